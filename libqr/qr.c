@@ -19,10 +19,60 @@
 #include "qr_private.h"
 #include "qr_dwtable.h"
 
-#define qrIsData(qr, i, j)  (((qr)->symbol[i][j] & QR_MM_DATA) != 0)
 #define qrIsFunc(qr, i, j)  (((qr)->symbol[i][j] & QR_MM_FUNC) != 0)
+#define qrIsDark(qr, i, j)  qrIsBlack((qr), (i), (j))
+#define qrPlaneSet(qr, p, i, j) \
+	(qrPlaneRow((qr), (p), (i))[(j) / QR_PLW_BITS] |= (qr_word_t)1 << ((j) % QR_PLW_BITS))
 
-QR_API const char *(*qrGetCurrentFunctionName)(void) = NULL;
+/*
+ * エラー情報に記録する関数名(qrSetCurrentFunctionName()で設定する)
+ * スレッドごとに持つので、他のスレッドの呼び出しと混ざらない
+ */
+static QR_TLS const char *qr_funcname = NULL;
+
+/*
+ * 型番ごとのコード語のビット→モジュール位置の対応表
+ * (初めて使うときに作成し、以後は変更しないのでスレッド間で共有できる。
+ *  以下の表はどのオブジェクトにも属さないので、アロケータを使わずに
+ *  標準ライブラリのmalloc()で確保し、qrCleanup()で開放する)
+ */
+static uint16_t *qr_placemaps[QR_VER_MAX+1];
+
+/*
+ * 型番ごとの機能パターンだけを配置したシンボル(同上)
+ */
+static qr_byte_t *qr_skeletons[QR_VER_MAX+1];
+
+/*
+ * 型番ごとのマスクパターンと機能パターンのビットプレーン(同上)
+ */
+static qr_word_t *qr_planeskels[QR_VER_MAX+1];
+
+#ifdef HAVE_PTHREAD
+/*
+ * マスクパターンを並列に評価するスレッドプール
+ * (qrSetMaskThreads()で有効にしたときだけ使う)
+ */
+static struct {
+	pthread_mutex_t lock;     /* 以下のメンバを保護する */
+	pthread_mutex_t config;   /* qrSetMaskThreads()の呼び出しを直列化する */
+	pthread_cond_t wake;      /* ワーカーに仕事か停止を知らせる */
+	pthread_cond_t done;      /* 呼び出し元に評価の完了を知らせる */
+	pthread_t threads[QR_MPT_THREADS_MAX];
+	int nthreads;             /* ワーカースレッド数 */
+	int minversion;           /* 並列評価する型番の下限 */
+	int busy;                 /* 評価中の仕事があるか */
+	int shutdown;             /* ワーカーを停止させるか */
+	unsigned long generation; /* 仕事の通し番号 */
+	qr_maskjob_t *job;        /* 評価中の仕事 */
+} qr_maskpool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.config = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.minversion = QR_MPT_THREADS_MINVER
+};
+#endif
 
 /*
  * ライブラリのバージョンを返す
@@ -38,31 +88,43 @@ qrVersion(void)
  */
 QR_API QRCode *
 qrInit(int version, int mode, int eclevel, int masktype, int *errcode)
+{
+	return qrInit2(version, mode, eclevel, masktype, NULL, errcode);
+}
+
+/*
+ * 指定したアロケータを使うQRCodeオブジェクトを生成する
+ * (allocatorがNULLなら既定のアロケータを使う)
+ */
+QR_API QRCode *
+qrInit2(int version, int mode, int eclevel, int masktype, const qr_allocator_t *allocator, int *errcode)
 {
 	QRCode *qr = NULL;
 
+	if (allocator == NULL) {
+		allocator = qrGetAllocator();
+	}
+
 	/*
 	 * メモリを確保する
 	 */
-	qr = (QRCode *)calloc(1, sizeof(QRCode));
+	qr = (QRCode *)qrAllocZero(allocator, sizeof(QRCode));
 	if (qr == NULL) {
 		*errcode = QR_ERR_MEMORY_EXHAUSTED;
 		return NULL;
 	}
-	qr->dataword = (qr_byte_t *)calloc(1, QR_DWD_MAX);
-	qr->ecword   = (qr_byte_t *)calloc(1, QR_ECW_MAX);
-	qr->codeword = (qr_byte_t *)calloc(1, QR_CWD_MAX);
-	if (qr->dataword == NULL || qr->ecword == NULL || qr->codeword == NULL) {
-		*errcode = QR_ERR_MEMORY_EXHAUSTED;
-		qrDestroy(qr);
-		return NULL;
-	}
+	qr->allocator = *allocator;
 
 	/*
 	 * 内部状態を初期化する
 	 */
+	qr->dataword = NULL;
+	qr->ecword = NULL;
+	qr->codeword = NULL;
+	qr->wordmax = 0;
 	qr->_symbol = NULL;
 	qr->symbol = NULL;
+	qr->_planes = NULL;
 	qr->source = NULL;
 	qr->srcmax = 0;
 	qr->srclen = 0;
@@ -70,71 +132,485 @@ qrInit(int version, int mode, int eclevel, int masktype, int *errcode)
 	qr->delta1 = 0;
 	qr->delta2 = 0;
 	qr->errcode = QR_ERR_NONE;
+	qr->errsys = 0;
+	qr->errctx = NULL;
+	qr->errinfo = NULL;
 	qr->state = QR_STATE_BEGIN;
+	qr->retain = 0;
+	qr->bufdim = 0;
+	qr->workspace = NULL;
+	qr->packed = NULL;
+	qr->symref = NULL;
 
 	/*
-	 * 型番を設定する
-	*/
-	if (version == -1 || (version >= 1 && version <= QR_VER_MAX)) {
-		qr->param.version = version;
-	} else {
-		*errcode = QR_ERR_INVALID_VERSION;
+	 * パラメータを設定する
+	 */
+	*errcode = qrCheckParam(version, mode, eclevel, masktype);
+	if (*errcode != QR_ERR_NONE) {
 		qrDestroy(qr);
 		return NULL;
 	}
+	qr->param.version = version;
+	qr->param.mode = mode;
+	qr->param.eclevel = eclevel;
+	qr->param.masktype = masktype;
 
 	/*
-	 * 符号化モードを設定する
-	*/
-	if (mode == QR_EM_AUTO || (mode >= QR_EM_NUMERIC && mode < QR_EM_COUNT)) {
-		qr->param.mode = mode;
-	} else {
-		*errcode = QR_ERR_INVALID_MODE;
+	 * 型番が指定されていれば、その大きさのコード語領域を確保する
+	 * (型番自動選択ならファイナライズで型番が決まってから確保する)
+	 */
+	if (version != -1 && !qrAllocWords(qr)) {
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
 		qrDestroy(qr);
 		return NULL;
 	}
 
+	return qr;
+}
+
+/*
+ * 呼び出し元が用意した作業領域にQRCodeオブジェクトを生成する
+ * 符号化、ファイナライズ、qrGetSymbol2()による変換はヒープを使わずに
+ * 作業領域の中だけで行う。最大の型番に必要な領域を最初にすべて
+ * 割り当てるので、符号化とファイナライズで領域が不足することはない
+ * 返されたオブジェクトはqrDestroy()で開放する必要はなく、
+ * 作業領域を再び初期化すればそれまでの内容は破棄される
+ * (qrReset()で再利用することもできる)
+ */
+QR_API QRCode *
+qrInitWorkspace(QRWorkspace *ws, int version, int mode, int eclevel, int masktype, int *errcode)
+{
+	QRCode *qr;
+
+	*errcode = qrCheckParam(version, mode, eclevel, masktype);
+	if (*errcode != QR_ERR_NONE) {
+		return NULL;
+	}
+
 	/*
-	 * 誤り訂正レベルを設定する
-	*/
-	if (eclevel >= QR_ECL_L && eclevel < QR_EM_COUNT) {
-		qr->param.eclevel = eclevel;
-	} else {
-		*errcode = QR_ERR_INVALID_ECL;
-		qrDestroy(qr);
+	 * 作業領域を初期化する
+	 */
+	ws->skelver = 0;
+	ws->pskelver = 0;
+	ws->mapver = 0;
+	ws->used = 0;
+	ws->peak = 0;
+	ws->out = NULL;
+	ws->outsize = 0;
+	ws->outused = 0;
+
+	qr = &(ws->qr);
+	memset(qr, 0, sizeof(QRCode));
+	qrWorkspaceGetAllocator(ws, &(qr->allocator));
+	qr->workspace = ws;
+
+	/*
+	 * 作業領域から各領域を割り当てる
+	 */
+	qr->dataword = (qr_byte_t *)qrAllocZero(&(qr->allocator), QR_CWD_MAX * 2);
+	qr->source   = (qr_byte_t *)qrMalloc(qr, QR_WSP_SRC_MAX);
+	qr->_symbol  = (qr_byte_t *)qrMalloc(qr, QR_DIM_MAX * QR_DIM_MAX);
+	qr->symbol   = (qr_byte_t **)qrMalloc(qr, sizeof(qr_byte_t *) * QR_DIM_MAX);
+	qr->_planes  = (qr_word_t *)qrMalloc(qr, sizeof(qr_word_t) * QR_PLANE_COUNT * QR_DIM_MAX * QR_PLW_MAX);
+	if (qr->dataword == NULL || qr->source == NULL || qr->_symbol == NULL
+		|| qr->symbol == NULL || qr->_planes == NULL)
+	{
+		*errcode = QR_ERR_WORKSPACE_EXHAUSTED;
 		return NULL;
 	}
 
 	/*
-	 * マスクパターンを設定する
-	*/
-	if (masktype == -1 || (masktype >= 0 && masktype < QR_MPT_MAX)) {
-		qr->param.masktype = masktype;
+	 * 内部状態を初期化する
+	 * (割り当てた領域はファイナライズ後も保持する)
+	 */
+	qr->wordmax = QR_CWD_MAX * 2;
+	qr->srcmax = QR_WSP_SRC_MAX;
+	qr->srclen = 0;
+	qr->bufdim = QR_DIM_MAX;
+	qr->retain = 1;
+	qr->errcode = QR_ERR_NONE;
+	qr->state = QR_STATE_BEGIN;
+
+	/*
+	 * パラメータを設定する
+	 */
+	qr->param.version = version;
+	qr->param.mode = mode;
+	qr->param.eclevel = eclevel;
+	qr->param.masktype = masktype;
+	if (version != -1) {
+		qrAllocWords(qr);
+	}
+
+	return qr;
+}
+
+/*
+ * 現在の型番と誤り訂正レベルの大きさのコード語領域を用意する
+ * データコード語、誤り訂正コード語、シンボル配置用コード語の各領域は
+ * ひとつの領域から切り出し、確保済みの領域に収まればそのまま使う
+ */
+static int
+qrAllocWords(QRCode *qr)
+{
+	size_t size;
+	int datawords, totalwords;
+
+	totalwords = qr_vertable[qr->param.version].totalwords;
+	datawords = qr_vertable[qr->param.version].ecl[qr->param.eclevel].datawords;
+	size = (size_t)totalwords * 2;
+	if (!qrGrowWords(qr, size)) {
+		return FALSE;
+	}
+	qr->ecword = qr->dataword + datawords;
+	qr->codeword = qr->dataword + totalwords;
+	return TRUE;
+}
+
+/*
+ * コード語領域を少なくともsizeバイトに広げる
+ * (型番自動選択で書き出し済みのデータコード語を保つため、内容は保存する)
+ */
+static int
+qrGrowWords(QRCode *qr, size_t size)
+{
+	qr_byte_t *buf;
+	size_t wordmax;
+
+	if (qr->dataword != NULL && qr->wordmax >= size) {
+		return TRUE;
+	}
+	wordmax = qr->wordmax * 2;
+	if (wordmax < size) {
+		wordmax = size;
+	}
+	buf = (qr_byte_t *)qrRealloc(qr, qr->dataword, wordmax);
+	if (buf == NULL) {
+		qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
+		return FALSE;
+	}
+	qr->dataword = buf;
+	qr->ecword = NULL;
+	qr->codeword = NULL;
+	qr->wordmax = wordmax;
+	return TRUE;
+}
+
+/*
+ * コード語領域を開放する
+ */
+static void
+qrFreeWords(QRCode *qr)
+{
+	qrFree(qr, qr->dataword);
+	qr->ecword = NULL;
+	qr->codeword = NULL;
+	qr->wordmax = 0;
+}
+
+/*
+ * ファイナライズ済みのシンボル領域を複製と共有する
+ * (ファイナライズ後のシンボルは書き換えられないので、参照数を増やすだけにする。
+ *  参照数は最初に複製したときに確保し、複製元にも設定する)
+ */
+static int
+qrShareSymbol(const QRCode *qr, QRCode *cp)
+{
+	QRCode *src = (QRCode *)qr;
+	long *ref;
+
+	ref = (long *)qrAtomicLoadPtr(&(src->symref));
+	if (ref == NULL) {
+		ref = (long *)qrMalloc(src, sizeof(long));
+		if (ref == NULL) {
+			return FALSE;
+		}
+		*ref = 1;
+		if (!qrAtomicCasPtr(&(src->symref), (long *)NULL, ref)) {
+			qrRelease(src, ref);
+			ref = (long *)qrAtomicLoadPtr(&(src->symref));
+		}
+	}
+	qrAtomicIncrement(ref);
+
+	cp->symref = ref;
+	cp->packed = qr->packed;
+	cp->_symbol = qr->_symbol;
+	cp->symbol = qr->symbol;
+	cp->_planes = qr->_planes;
+	memcpy(cp->planes, qr->planes, sizeof(cp->planes));
+	cp->bufdim = qr->bufdim;
+
+	return TRUE;
+}
+
+/*
+ * 複製と共有しているシンボル領域を手放す
+ * (最後の参照だったときは領域をそのままこのオブジェクトのものにする)
+ */
+static void
+qrUnshareSymbol(QRCode *qr)
+{
+	int i;
+
+	if (qr->symref == NULL) {
+		return;
+	}
+	if (qrAtomicDecrement(qr->symref) == 0) {
+		qrRelease(qr, qr->symref);
 	} else {
-		*errcode = QR_ERR_INVALID_MPT;
-		qrDestroy(qr);
+		qr->packed = NULL;
+		qr->_symbol = NULL;
+		qr->symbol = NULL;
+		qr->_planes = NULL;
+		for (i = 0; i < QR_PLANE_COUNT; i++) {
+			qr->planes[i] = NULL;
+		}
+		qr->bufdim = 0;
+	}
+	qr->symref = NULL;
+}
+
+/*
+ * 型番、符号化モード、誤り訂正レベル、マスクパターンを検査し、
+ * 不正なものがあればそのエラー番号を返す
+ */
+static int
+qrCheckParam(int version, int mode, int eclevel, int masktype)
+{
+	/*
+	 * 型番
+	 */
+	if (version != -1 && (version < 1 || version > QR_VER_MAX)) {
+		return QR_ERR_INVALID_VERSION;
+	}
+	/*
+	 * 符号化モード
+	 */
+	if (mode != QR_EM_AUTO && (mode < QR_EM_NUMERIC || mode >= QR_EM_COUNT)) {
+		return QR_ERR_INVALID_MODE;
+	}
+	/*
+	 * 誤り訂正レベル
+	 */
+	if (eclevel < QR_ECL_L || eclevel >= QR_EM_COUNT) {
+		return QR_ERR_INVALID_ECL;
+	}
+	/*
+	 * マスクパターン
+	 */
+	if (masktype != QR_MPT_AUTO && masktype != QR_MPT_FAST
+		&& (masktype < 0 || masktype >= QR_MPT_MAX))
+	{
+		return QR_ERR_INVALID_MPT;
+	}
+	return QR_ERR_NONE;
+}
+
+/*
+ * QRCodeオブジェクトを新しいパラメータで初期状態に戻す
+ * 確保済みの作業領域やシンボルの領域は解放せずに再利用し、
+ * 以後のファイナライズでも作業領域を解放しない
+ */
+QR_API int
+qrReset(QRCode *qr, int version, int mode, int eclevel, int masktype)
+{
+	int err;
+
+	err = qrCheckParam(version, mode, eclevel, masktype);
+	if (err != QR_ERR_NONE) {
+		qrSetErrorInfo(qr, err, NULL);
+		return FALSE;
+	}
+
+	/*
+	 * パラメータを設定する
+	 */
+	qr->param.version = version;
+	qr->param.mode = mode;
+	qr->param.eclevel = eclevel;
+	qr->param.masktype = masktype;
+
+	/*
+	 * 内部状態を初期化する
+	 */
+	if (qr->source == NULL) {
+		qr->srcmax = 0;
+	}
+	qr->srclen = 0;
+	qr->enclen = 0;
+	qr->delta1 = 0;
+	qr->delta2 = 0;
+	qr->errcode = QR_ERR_NONE;
+	qr->errsys = 0;
+	if (qr->workspace == NULL) {
+		qrFree(qr, qr->errctx);
+	} else {
+		qr->errctx = NULL;
+	}
+	qrUnshareSymbol(qr);
+	qrFree(qr, qr->packed);
+	qr->state = QR_STATE_BEGIN;
+	qr->retain = 1;
+	memset(&(qr->maskinfo), 0, sizeof(qr_maskinfo_t));
+
+	/*
+	 * 新しい型番に合わせてコード語領域を用意する
+	 * (確保済みの領域に収まればそのまま使う)
+	 */
+	if (version != -1) {
+		if (!qrAllocWords(qr)) {
+			return FALSE;
+		}
+		qrInitDataWord(qr);
+	}
+
+	return TRUE;
+}
+
+/*
+ * QRCodeオブジェクトのプールを生成する
+ * maxidleは再利用のために保持するオブジェクト数の上限
+ */
+QR_API QRPool *
+qrPoolCreate(int maxidle, int *errcode)
+{
+	QRPool *pool = NULL;
+
+	if (maxidle <= 0) {
+		*errcode = QR_ERR_INVALID_ARG;
+		return NULL;
+	}
+	pool = (QRPool *)qrAllocZero(qrGetAllocator(), sizeof(QRPool));
+	if (pool == NULL) {
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
+		return NULL;
+	}
+	pool->allocator = *qrGetAllocator();
+	pool->idle = (QRCode **)qrMalloc(pool, sizeof(QRCode *) * (size_t)maxidle);
+	if (pool->idle == NULL) {
+		qrRelease(pool, pool);
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
+		return NULL;
+	}
+	qrMutexInit(&(pool->lock));
+	pool->nidle = 0;
+	pool->maxidle = maxidle;
+
+	return pool;
+}
+
+/*
+ * QRCodeオブジェクトのプールを開放する
+ * (保持しているオブジェクトも開放する。貸し出し中のオブジェクトは
+ * 呼び出し元がqrDestroy()で開放する)
+ */
+QR_API void
+qrPoolDestroy(QRPool *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+	while (pool->nidle > 0) {
+		qrDestroy(pool->idle[--pool->nidle]);
+	}
+	qrMutexDestroy(&(pool->lock));
+	qrRelease(pool, pool->idle);
+	qrRelease(pool, pool);
+}
+
+/*
+ * プールからQRCodeオブジェクトを取り出し、指定したパラメータで初期化する
+ * (保持しているオブジェクトがなければ新たに生成する)
+ */
+QR_API QRCode *
+qrPoolAcquire(QRPool *pool, int version, int mode, int eclevel, int masktype, int *errcode)
+{
+	QRCode *qr = NULL;
+
+	*errcode = qrCheckParam(version, mode, eclevel, masktype);
+	if (*errcode != QR_ERR_NONE) {
 		return NULL;
 	}
 
+	/*
+	 * 最後に返却されたオブジェクトから使う
+	 * (キャッシュに残っている可能性が高い)
+	 */
+	qrMutexLock(&(pool->lock));
+	if (pool->nidle > 0) {
+		qr = pool->idle[--pool->nidle];
+	}
+	qrMutexUnlock(&(pool->lock));
+
+	if (qr == NULL) {
+		qr = qrInit2(version, mode, eclevel, masktype, &(pool->allocator), errcode);
+		if (qr != NULL) {
+			qr->retain = 1;
+		}
+		return qr;
+	}
+	if (!qrReset(qr, version, mode, eclevel, masktype)) {
+		*errcode = qr->errcode;
+		qrDestroy(qr);
+		return NULL;
+	}
 	return qr;
 }
 
+/*
+ * QRCodeオブジェクトをプールに返却する
+ * (保持数が上限に達していれば開放する)
+ */
+QR_API void
+qrPoolRelease(QRPool *pool, QRCode *qr)
+{
+	if (qr == NULL) {
+		return;
+	}
+	qrMutexLock(&(pool->lock));
+	if (pool->nidle < pool->maxidle) {
+		pool->idle[pool->nidle++] = qr;
+		qr = NULL;
+	}
+	qrMutexUnlock(&(pool->lock));
+	if (qr != NULL) {
+		qrDestroy(qr);
+	}
+}
+
 /*
  * QRStructuredオブジェクトを生成する
  */
 QR_API QRStructured *
 qrsInit(int version, int mode, int eclevel, int masktype, int maxnum, int *errcode)
+{
+	return qrsInit2(version, mode, eclevel, masktype, maxnum, NULL, errcode);
+}
+
+/*
+ * 指定したアロケータを使うQRStructuredオブジェクトを生成する
+ * (allocatorがNULLなら既定のアロケータを使う。
+ * 保持するQRCodeオブジェクトも同じアロケータを使う)
+ */
+QR_API QRStructured *
+qrsInit2(int version, int mode, int eclevel, int masktype, int maxnum, const qr_allocator_t *allocator, int *errcode)
 {
 	QRStructured *st = NULL;
 
+	if (allocator == NULL) {
+		allocator = qrGetAllocator();
+	}
+
 	/*
 	 * メモリを確保する
 	 */
-	st = (QRStructured *)calloc(1, sizeof(QRStructured));
+	st = (QRStructured *)qrAllocZero(allocator, sizeof(QRStructured));
 	if (st == NULL) {
 		*errcode = QR_ERR_MEMORY_EXHAUSTED;
 		return NULL;
 	}
+	st->allocator = *allocator;
 
 	/*
 	 * 内部状態を初期化する
@@ -189,7 +665,7 @@ qrsInit(int version, int mode, int eclevel, int masktype, int maxnum, int *errco
 	/*
 	 * マスクパターンを設定する
 	*/
-	if (masktype == -1 || (masktype >= 0 && masktype < QR_MPT_MAX)) {
+	if (masktype == QR_MPT_AUTO || masktype == QR_MPT_FAST || (masktype >= 0 && masktype < QR_MPT_MAX)) {
 		st->param.masktype = masktype;
 	} else {
 		*errcode = QR_ERR_INVALID_MPT;
@@ -200,8 +676,8 @@ qrsInit(int version, int mode, int eclevel, int masktype, int maxnum, int *errco
 	/*
 	 * 一つめのQRコードオブジェクトを初期化する
 	*/
-	st->qrs[0] = qrInit(st->param.version, st->param.mode,
-			st->param.eclevel, st->param.masktype, errcode);
+	st->qrs[0] = qrInit2(st->param.version, st->param.mode,
+			st->param.eclevel, st->param.masktype, &(st->allocator), errcode);
 	if (st->qrs[0] == NULL) {
 		qrsDestroy(st);
 		return NULL;
@@ -214,21 +690,34 @@ qrsInit(int version, int mode, int eclevel, int masktype, int maxnum, int *errco
 
 /*
  * QRCodeオブジェクトを複製する
+ * (ファイナライズ済みのシンボルは複製元と共有するので、型番によらず一定時間で済む。
+ *  共有の参照数は不可分に増減するので、複製を別のスレッドに渡して破棄してもよい)
  */
 QR_API QRCode *
 qrClone(const QRCode *qr, int *errcode)
 {
 	QRCode *cp = NULL;
+	const qr_allocator_t *allocator;
 
 	/*
 	 * QRCodeオブジェクト用のメモリを確保し、複製する
+	 * (作業領域を使うオブジェクトは既定のアロケータで複製する)
 	 */
-	cp = (QRCode *)malloc(sizeof(QRCode));
+	allocator = (qr->workspace != NULL) ? qrGetAllocator() : &(qr->allocator);
+	cp = (QRCode *)allocator->alloc(allocator->ctx, sizeof(QRCode));
 	if (cp == NULL) {
 		*errcode = QR_ERR_MEMORY_EXHAUSTED;
 		return NULL;
 	}
-	memcpy(cp, qr, sizeof(QRCode));
+	/*
+	 * 共有の参照数は他のスレッドの複製が同時に設定することがあるので、
+	 * その前後だけを複製する(参照数は後でNULLにする)
+	 */
+	memcpy(cp, qr, offsetof(QRCode, symref));
+	memcpy(&(cp->symref) + 1, &(qr->symref) + 1,
+			sizeof(QRCode) - offsetof(QRCode, symref) - sizeof(cp->symref));
+	cp->allocator = *allocator;
+	cp->workspace = NULL;
 
 	/*
 	 * 動的に確保されるメンバをいったんNULLにする
@@ -236,28 +725,54 @@ qrClone(const QRCode *qr, int *errcode)
 	cp->dataword = NULL;
 	cp->ecword = NULL;
 	cp->codeword = NULL;
+	cp->wordmax = 0;
+	cp->errctx = NULL;
+	cp->errinfo = NULL;
+	cp->packed = NULL;
 	cp->_symbol = NULL;
 	cp->symbol = NULL;
+	cp->_planes = NULL;
 	cp->source = NULL;
+	cp->bufdim = 0;
+	cp->symref = NULL;
 
 	/*
-	 * ファイナライズ後ならシンボル、ファイナライズ前なら計算用領域を複製
+	 * ファイナライズ後ならシンボルを共有し、ファイナライズ前なら計算用領域を複製
+	 * (作業領域のシンボルは作業領域とともに消えるので複製する)
 	 */
-	if (cp->state == QR_STATE_FINAL) {
-		int i, dim;
-
-		dim = qr_vertable[cp->param.version].dimension;
-
-		cp->_symbol = (qr_byte_t *)calloc((size_t)dim, (size_t)dim);
-		if (cp->_symbol == NULL) {
+	if (cp->state == QR_STATE_FINAL && qr->workspace == NULL) {
+		if (!qrShareSymbol(qr, cp)) {
 			*errcode = QR_ERR_MEMORY_EXHAUSTED;
 			qrDestroy(cp);
 			return NULL;
 		}
-		memcpy(cp->_symbol, qr->_symbol, (size_t)(dim * dim));
+	} else if (cp->state == QR_STATE_FINAL && qr->packed != NULL) {
+		size_t size;
 
-		cp->symbol = (qr_byte_t **)malloc(sizeof(qr_byte_t *) * (size_t)dim);
-		if (cp->symbol == NULL) {
+		size = qrPackedSize(qr);
+		cp->packed = (qr_byte_t *)qrMalloc(cp, size);
+		if (cp->packed == NULL) {
+			*errcode = QR_ERR_MEMORY_EXHAUSTED;
+			qrDestroy(cp);
+			return NULL;
+		}
+		memcpy(cp->packed, qr->packed, size);
+	} else if (cp->state == QR_STATE_FINAL) {
+		int i, dim;
+
+		dim = qr_vertable[cp->param.version].dimension;
+
+		cp->_symbol = (qr_byte_t *)qrMalloc(cp, (size_t)dim * (size_t)dim);
+		if (cp->_symbol == NULL) {
+			*errcode = QR_ERR_MEMORY_EXHAUSTED;
+			qrDestroy(cp);
+			return NULL;
+		}
+		cp->bufdim = dim;
+		memcpy(cp->_symbol, qr->_symbol, (size_t)(dim * dim));
+
+		cp->symbol = (qr_byte_t **)qrMalloc(cp, sizeof(qr_byte_t *) * (size_t)dim);
+		if (cp->symbol == NULL) {
 			*errcode = QR_ERR_MEMORY_EXHAUSTED;
 			qrDestroy(cp);
 			return NULL;
@@ -265,25 +780,44 @@ qrClone(const QRCode *qr, int *errcode)
 		for (i = 0; i < dim; i++) {
 			cp->symbol[i] = cp->_symbol + dim * i;
 		}
-	} else {
-		cp->dataword = (qr_byte_t *)malloc(QR_DWD_MAX);
-		cp->ecword   = (qr_byte_t *)malloc(QR_ECW_MAX);
-		cp->codeword = (qr_byte_t *)malloc(QR_CWD_MAX);
-		if (cp->dataword == NULL || cp->ecword == NULL || cp->codeword == NULL) {
+
+		cp->_planes = (qr_word_t *)qrMalloc(cp, sizeof(qr_word_t) * QR_PLANE_COUNT * (size_t)(dim * cp->pwords));
+		if (cp->_planes == NULL) {
+			*errcode = QR_ERR_MEMORY_EXHAUSTED;
+			qrDestroy(cp);
+			return NULL;
+		}
+		memcpy(cp->_planes, qr->_planes, sizeof(qr_word_t) * QR_PLANE_COUNT * (size_t)(dim * cp->pwords));
+		for (i = 0; i < QR_PLANE_COUNT; i++) {
+			cp->planes[i] = cp->_planes + dim * cp->pwords * i;
+		}
+	} else if (qr->dataword != NULL) {
+		cp->dataword = (qr_byte_t *)qrMalloc(cp, qr->wordmax);
+		if (cp->dataword == NULL) {
 			*errcode = QR_ERR_MEMORY_EXHAUSTED;
 			qrDestroy(cp);
 			return NULL;
 		}
-		memcpy(cp->dataword, qr->dataword, QR_DWD_MAX);
-		memcpy(cp->ecword  , qr->ecword  , QR_ECW_MAX);
-		memcpy(cp->codeword, qr->codeword, QR_CWD_MAX);
+		memcpy(cp->dataword, qr->dataword, qr->wordmax);
+		if (qr->ecword != NULL) {
+			cp->ecword = cp->dataword + (qr->ecword - qr->dataword);
+			cp->codeword = cp->dataword + (qr->codeword - qr->dataword);
+		}
+		cp->wordmax = qr->wordmax;
+	}
+
+	/*
+	 * エラーの付加情報を複製
+	 */
+	if (qr->errctx != NULL) {
+		qrSetErrorContext(cp, qr->errctx, qr->errsuffix);
 	}
 
 	/*
 	 * 入力データを複製
 	 */
 	if (cp->srcmax > 0 && qr->source != NULL) {
-		cp->source = (qr_byte_t *)malloc(cp->srcmax);
+		cp->source = (qr_byte_t *)qrMalloc(cp, cp->srcmax);
 		if (cp->source == NULL) {
 			*errcode = QR_ERR_MEMORY_EXHAUSTED;
 			qrDestroy(cp);
@@ -307,7 +841,7 @@ qrsClone(const QRStructured *st, int *errcode)
 	/*
 	 * QRStructuredオブジェクト用のメモリを確保し、複製する
 	 */
-	cps = (QRStructured *)malloc(sizeof(QRStructured));
+	cps = (QRStructured *)qrMalloc(st, sizeof(QRStructured));
 	if (cps == NULL) {
 		*errcode = QR_ERR_MEMORY_EXHAUSTED;
 		return NULL;
@@ -322,8 +856,8 @@ qrsClone(const QRStructured *st, int *errcode)
 		if (cp == NULL) {
 			while (i > 0) {
 				qrDestroy(cps->qrs[--i]);
-				free(cps);
 			}
+			qrRelease(st, cps);
 			return NULL;
 		}
 		cps->qrs[i++] = cp;
@@ -331,7 +865,13 @@ qrsClone(const QRStructured *st, int *errcode)
 	while (i < QR_STA_MAX) {
 		cps->qrs[i++] = NULL;
 	}
-	cps->cur = cps->qrs[0] + (st->cur - st->qrs[0]);
+	cps->cur = NULL;
+	for (i = 0; i < cps->num; i++) {
+		if (st->qrs[i] == st->cur) {
+			cps->cur = cps->qrs[i];
+			break;
+		}
+	}
 
 	return cps;
 }
@@ -342,16 +882,22 @@ qrsClone(const QRStructured *st, int *errcode)
 QR_API void
 qrDestroy(QRCode *qr)
 {
-	if (qr == NULL) {
+	/*
+	 * 作業領域のオブジェクトは作業領域とともに破棄される
+	 */
+	if (qr == NULL || qr->workspace != NULL) {
 		return;
 	}
-	qrFree(qr->source);
-	qrFree(qr->dataword);
-	qrFree(qr->ecword);
-	qrFree(qr->codeword);
-	qrFree(qr->symbol);
-	qrFree(qr->_symbol);
-	free(qr);
+	qrFree(qr, qr->source);
+	qrFreeWords(qr);
+	qrUnshareSymbol(qr);
+	qrFree(qr, qr->symbol);
+	qrFree(qr, qr->_symbol);
+	qrFree(qr, qr->_planes);
+	qrFree(qr, qr->packed);
+	qrFree(qr, qr->errctx);
+	qrFree(qr, qr->errinfo);
+	qrRelease(qr, qr);
 }
 
 /*
@@ -367,7 +913,7 @@ qrsDestroy(QRStructured *st)
 	for (i = 0; i < st->num; i++) {
 		qrDestroy(st->qrs[i]);
 	}
-	free(st);
+	qrRelease(st, st);
 }
 
 /*
@@ -423,7 +969,48 @@ qrGetErrorCode(QRCode *qr)
 QR_API char *
 qrGetErrorInfo(QRCode *qr)
 {
-	return &(qr->errinfo[0]);
+	char *info;
+	const char *ctx;
+	int size;
+
+	/*
+	 * エラー番号と付加情報からエラーの詳細を組み立てる
+	 * (領域はエラーの詳細が初めて求められたときに確保する)
+	 */
+	if (qr->workspace != NULL) {
+		info = qr->workspace->errinfo;
+	} else {
+		if (qr->errinfo == NULL) {
+			qr->errinfo = (char *)qrMalloc(qr, QR_ERR_MAX);
+			if (qr->errinfo == NULL) {
+				return (char *)qrStrError(qr->errcode);
+			}
+		}
+		info = qr->errinfo;
+	}
+	ctx = (qr->errctx != NULL) ? qr->errctx : "";
+
+	if (qr->errcode == QR_ERR_SEE_ERRNO) {
+		size = 0;
+		if (*ctx != '\0') {
+			size = snprintf(info, QR_ERR_MAX, "%s: ", ctx);
+			if (size < 0 || size >= QR_ERR_MAX) {
+				return info;
+			}
+		}
+#ifdef WIN32
+		snprintf(info + size, (size_t)(QR_ERR_MAX - size), "%s", strerror(qr->errsys));
+#else
+		strerror_r(qr->errsys, info + size, (size_t)(QR_ERR_MAX - size));
+#endif
+	} else if (*ctx == '\0') {
+		snprintf(info, QR_ERR_MAX, "%s", qrStrError(qr->errcode));
+	} else if (qr->errsuffix) {
+		snprintf(info, QR_ERR_MAX, "%s%s", qrStrError(qr->errcode), ctx);
+	} else {
+		snprintf(info, QR_ERR_MAX, "%s: %s", ctx, qrStrError(qr->errcode));
+	}
+	return info;
 }
 
 /*
@@ -441,7 +1028,7 @@ qrsGetErrorCode(QRStructured *st)
 QR_API char *
 qrsGetErrorInfo(QRStructured *st)
 {
-	return &(st->cur->errinfo[0]);
+	return qrGetErrorInfo(st->cur);
 }
 
 /*
@@ -556,6 +1143,20 @@ qrStrError(int errcode)
 	  case QR_ERR_DEFLATE:
 		return "Failed to deflate";
 
+	/* workspace related errors */
+	  case QR_ERR_WORKSPACE_EXHAUSTED:
+		return "Workspace exhausted";
+
+	  case QR_ERR_OUTPUT_TOO_SMALL:
+		return "Output buffer too small";
+
+	/* asynchronous task related errors */
+	  case QR_ERR_QUEUE_FULL:
+		return "Too many pending tasks";
+
+	  case QR_ERR_CANCELED:
+		return "Task canceled";
+
 	/* unknown error(s) */
 	  case QR_ERR_UNKNOWN:
 	  default:
@@ -563,6 +1164,29 @@ qrStrError(int errcode)
 	}
 }
 
+/*
+ * 呼び出し元のスレッドでエラー情報に記録する関数名を設定する
+ * (NULLなら元に戻す)
+ */
+QR_API void
+qrSetCurrentFunctionName(const char *name)
+{
+	qr_funcname = name;
+}
+
+/*
+ * エラー情報に記録する関数名を返す
+ * 呼び出し元のスレッドで設定されていなければdefnameを返す
+ */
+QR_API const char *
+qrCurrentFunctionName(const char *defname)
+{
+	if (qr_funcname != NULL) {
+		return qr_funcname;
+	}
+	return defname;
+}
+
 /*
  * libqrのエラー番号からエラー情報を設定する
  */
@@ -570,11 +1194,8 @@ QR_API void
 qrSetErrorInfo(QRCode *qr, int errnum, const char *param)
 {
 	qr->errcode = errnum;
-	if (param != NULL) {
-		snprintf(&(qr->errinfo[0]), QR_ERR_MAX, "%s: %s", param, qrStrError(errnum));
-	} else {
-		snprintf(&(qr->errinfo[0]), QR_ERR_MAX, "%s", qrStrError(errnum));
-	}
+	qr->errsys = 0;
+	qrSetErrorContext(qr, param, 0);
 }
 
 /*
@@ -583,22 +1204,18 @@ qrSetErrorInfo(QRCode *qr, int errnum, const char *param)
 QR_API void
 qrSetErrorInfo2(QRCode *qr, int errnum, const char *param)
 {
-	char *info;
-	int size = 0;
-	info = &(qr->errinfo[0]);
-	qr->errcode = QR_ERR_SEE_ERRNO;
-	if (param != NULL) {
-		size = snprintf(info, QR_ERR_MAX, "%s: ", param);
-		if (size < 0 || size >= QR_ERR_MAX) {
-			return;
-		}
-		info += size;
+	/*
+	 * 作業領域を使うオブジェクトでは、メモリ不足は作業領域か
+	 * (変換中なら)出力領域の不足を意味する
+	 */
+	if (errnum == QR_ERR_MEMORY_EXHAUSTED && qr->workspace != NULL) {
+		qrSetErrorInfo(qr, (qr->workspace->out != NULL)
+				? QR_ERR_OUTPUT_TOO_SMALL : QR_ERR_WORKSPACE_EXHAUSTED, param);
+		return;
 	}
-#ifdef WIN32
-	snprintf(info, (size_t)(QR_ERR_MAX - size), "%s", strerror(errnum));
-#else
-	strerror_r(errnum, info, (size_t)(QR_ERR_MAX - size));
-#endif
+	qr->errcode = QR_ERR_SEE_ERRNO;
+	qr->errsys = errnum;
+	qrSetErrorContext(qr, param, 0);
 }
 
 /*
@@ -611,45 +1228,150 @@ qrSetErrorInfo3(QRCode *qr, int errnum, const char *fmt, ...)
 	va_list ap;
 
 	qr->errcode = errnum;
+	qr->errsys = 0;
 	va_start(ap, fmt);
 	vsnprintf(&(info[0]), QR_ERR_MAX, fmt, ap);
 	va_end(ap);
-	snprintf(&(qr->errinfo[0]), QR_ERR_MAX, "%s%s", qrStrError(errnum), info);
+	qrSetErrorContext(qr, &(info[0]), 1);
 }
 
 /*
- * 最適な符号化方法を調べる
+ * エラーの付加情報を保存する
+ * エラーの詳細はqrGetErrorInfo()が呼ばれたときに組み立てるので、
+ * ここでは付加情報だけを必要な大きさの領域にコピーする
+ * suffixが真なら、付加情報はエラーの説明の後に付ける
+ */
+static void
+qrSetErrorContext(QRCode *qr, const char *ctx, int suffix)
+{
+	char *buf;
+	size_t len;
+
+	qr->errsuffix = suffix;
+	if (qr->workspace != NULL) {
+		if (ctx == NULL) {
+			qr->errctx = NULL;
+		} else {
+			snprintf(qr->workspace->errctx, QR_ERR_MAX, "%s", ctx);
+			qr->errctx = qr->workspace->errctx;
+		}
+		return;
+	}
+	if (ctx == NULL) {
+		qrFree(qr, qr->errctx);
+		return;
+	}
+	len = strlen(ctx);
+	if (len >= QR_ERR_MAX) {
+		len = QR_ERR_MAX - 1;
+	}
+	buf = (char *)qrRealloc(qr, qr->errctx, len + 1);
+	if (buf == NULL) {
+		qrFree(qr, qr->errctx);
+		return;
+	}
+	memcpy(buf, ctx, len);
+	buf[len] = '\0';
+	qr->errctx = buf;
+}
+
+/*
+ * 入力データの各バイトの文字種別と、各符号化モードで符号化できなくなる
+ * 最初の位置を1回の走査で調べ、最適な符号化方法を返す
+ * classesがNULLでなければ、各バイトの文字種別(QR_CC_*)を書き込む
+ * offsetsがNULLでなければ、符号化モードごとの位置(なければ-1)を書き込む
  */
 QR_API int
-qrDetectDataType(const qr_byte_t *source, int size)
+qrClassifyData(const qr_byte_t *source, int size, qr_byte_t *classes, int *offsets)
 {
-	if (qrStrPosNotNumeric(source, size) == -1) {
+	qr_byte_t buf[QR_CLS_CHUNK];
+	qr_byte_t *cls;
+	int notnum = -1, notalnum = -1, notkanji = -1;
+	int p, n, k, y, num, alnum;
+
+	k = 0;
+	for (p = 0; p < size; p += n) {
+		n = size - p;
+		if (classes != NULL) {
+			cls = &(classes[p]);
+		} else {
+			if (n > QR_CLS_CHUNK) {
+				n = QR_CLS_CHUNK;
+			}
+			cls = &(buf[0]);
+		}
+		qrClassifyBlock(&(source[p]), n, size - p, cls, &num, &alnum);
+		if (notnum == -1 && num != -1) {
+			notnum = p + num;
+		}
+		if (notalnum == -1 && alnum != -1) {
+			notalnum = p + alnum;
+		}
+		/*
+		 * 漢字は2バイト単位で調べる
+		 * (2バイトめが次の区間にあっても、1バイトめの種別で判定できる)
+		 */
+		while (notkanji == -1 && k < p + n) {
+			if (cls[k - p] & QR_CC_KANJI) {
+				k += 2;
+				continue;
+			}
+			if (k + 1 >= size || !(cls[k - p] & QR_CC_KANJI1)) {
+				notkanji = k;
+				break;
+			}
+			y = source[k + 1];
+			if (y < 0x40 || y > 0xfc) {
+				/* JIS X 0208漢字の2バイトめでない */
+				notkanji = k + 1;
+			} else {
+				/* JIS X 0208漢字の未定義領域 */
+				notkanji = k;
+			}
+		}
+		if (classes == NULL && notnum != -1 && notalnum != -1 && notkanji != -1) {
+			break;
+		}
+	}
+
+	if (offsets != NULL) {
+		offsets[QR_EM_NUMERIC] = notnum;
+		offsets[QR_EM_ALNUM] = notalnum;
+		offsets[QR_EM_8BIT] = -1;
+		offsets[QR_EM_KANJI] = notkanji;
+	}
+
+	if (notnum == -1) {
 		return QR_EM_NUMERIC;
 	}
-	if (qrStrPosNotAlnum(source, size) == -1) {
+	if (notalnum == -1) {
 		return QR_EM_ALNUM;
 	}
-	if (qrStrPosNotKanji(source, size) == -1) {
+	if (notkanji == -1) {
 		return QR_EM_KANJI;
 	}
 	return QR_EM_8BIT;
 }
 
+/*
+ * 最適な符号化方法を調べる
+ */
+QR_API int
+qrDetectDataType(const qr_byte_t *source, int size)
+{
+	return qrClassifyData(source, size, NULL, NULL);
+}
+
 /*
  * 数字以外のデータが現れる位置を調べる
  */
 QR_API int
 qrStrPosNotNumeric(const qr_byte_t *source, int size)
 {
-	int p = 0;
+	int offsets[QR_EM_COUNT];
 
-	while (p < size) {
-		if (source[p] < '0' || source[p] > '9') {
-			return p;
-		}
-		p++;
-	}
-	return -1;
+	qrClassifyData(source, size, NULL, offsets);
+	return offsets[QR_EM_NUMERIC];
 }
 
 /*
@@ -658,15 +1380,10 @@ qrStrPosNotNumeric(const qr_byte_t *source, int size)
 QR_API int
 qrStrPosNotAlnum(const qr_byte_t *source, int size)
 {
-	int p = 0;
+	int offsets[QR_EM_COUNT];
 
-	while (p < size) {
-		if (qr_alnumtable[source[p]] == -1) {
-			return p;
-		}
-		p++;
-	}
-	return -1;
+	qrClassifyData(source, size, NULL, offsets);
+	return offsets[QR_EM_ALNUM];
 }
 
 /*
@@ -675,35 +1392,175 @@ qrStrPosNotAlnum(const qr_byte_t *source, int size)
 QR_API int
 qrStrPosNotKanji(const qr_byte_t *source, int size)
 {
-	qr_byte_t x, y;
-	int p = 0;
+	int offsets[QR_EM_COUNT];
 
-	while (p < size - 1) {
-		x = source[p++];
-		if (x >= 0x81 && x <= 0x9f) {
-			x -= 0x81;
-		} else if (x >= 0xe0 && x <= 0xea) {
-			x -= 0xc1;
-		} else {
-			/* JIS X 0208漢字の1バイトめでない */
-			return p - 1;
+	qrClassifyData(source, size, NULL, offsets);
+	return offsets[QR_EM_KANJI];
+}
+
+/*
+ * 入力データのsizeバイトの文字種別を調べてclassesに書き込む
+ * 数字・英数字でない最初の位置をnotnum, notalnumに返す(なければ-1)
+ * 漢字の2バイトめはavailバイトの範囲で参照する
+ */
+static void
+qrClassifyBlock(const qr_byte_t *source, int size, int avail, qr_byte_t *classes, int *notnum, int *notalnum)
+{
+	int i, c;
+
+#define qrClassifyKanji(pos) { \
+	int _x, _y; \
+	if ((pos) + 1 < avail) { \
+		_x = source[(pos)]; \
+		_y = source[(pos) + 1]; \
+		_x -= (_x < 0xa0) ? 0x81 : 0xc1; \
+		if (_y >= 0x40 && _y <= 0xfc && qr_dwtable_kanji[_x][_y - 0x40] != -1) { \
+			classes[(pos)] |= QR_CC_KANJI; \
+		} \
+	} \
+}
+
+	*notnum = -1;
+	*notalnum = -1;
+	i = 0;
+
+#ifdef QR_VEC_SIZE
+	/*
+	 * QR_VEC_SIZEバイトずつ範囲判定する
+	 */
+	for (; i + QR_VEC_SIZE <= size; i += QR_VEC_SIZE) {
+		qr_vec_t v, num, alnum, k1, k2;
+		int mk1, j;
+		v = qrVecLoad(&(source[i]));
+		num = qrVecInRange(v, '0', '9');
+		alnum = qrVecOr(qrVecOr(qrVecEq(v, qrVecSet1(' ')), qrVecInRange(v, '$', '%')),
+				qrVecOr(qrVecOr(qrVecInRange(v, '*', '+'), qrVecInRange(v, '-', ':')),
+				qrVecInRange(v, 'A', 'Z')));
+		k1 = qrVecOr(qrVecInRange(v, 0x81, 0x9f), qrVecInRange(v, 0xe0, 0xea));
+		k2 = qrVecInRange(v, 0x40, 0xfc);
+		qrVecStore(&(classes[i]), qrVecOr(
+				qrVecOr(qrVecAnd(num, qrVecSet1(QR_CC_NUMERIC)), qrVecAnd(alnum, qrVecSet1(QR_CC_ALNUM))),
+				qrVecOr(qrVecAnd(k1, qrVecSet1(QR_CC_KANJI1)), qrVecAnd(k2, qrVecSet1(QR_CC_KANJI2)))));
+		if (*notnum == -1 && qrVecMask(num) != QR_VEC_FULL) {
+			for (j = i; classes[j] & QR_CC_NUMERIC; j++);
+			*notnum = j;
 		}
-		y = source[p++];
-		if (y >= 0x40 && y <= 0xfc) {
-			y -= 0x40;
-		} else {
-			/* JIS X 0208漢字の2バイトめでない */
-			return p - 1;
+		if (*notalnum == -1 && qrVecMask(alnum) != QR_VEC_FULL) {
+			for (j = i; classes[j] & QR_CC_ALNUM; j++);
+			*notalnum = j;
+		}
+		/*
+		 * 漢字の1バイトめになりうる位置だけ表を引く
+		 */
+		mk1 = qrVecMask(k1);
+		for (j = 0; mk1 != 0; j++, mk1 = (int)((unsigned int)mk1 >> 1)) {
+			if (mk1 & 1) {
+				qrClassifyKanji(i + j);
+			}
+		}
+	}
+#endif
+
+	/*
+	 * 残りは1バイトずつ判定する
+	 */
+	for (; i < size; i++) {
+		c = source[i];
+		classes[i] = 0;
+		if (c >= '0' && c <= '9') {
+			classes[i] |= QR_CC_NUMERIC;
+		} else if (*notnum == -1) {
+			*notnum = i;
+		}
+		if (qr_alnumtable[c] != -1) {
+			classes[i] |= QR_CC_ALNUM;
+		} else if (*notalnum == -1) {
+			*notalnum = i;
 		}
-		if (qr_dwtable_kanji[x][y] == -1) {
-			/* JIS X 0208漢字の未定義領域 */
-			return p - 2;
+		if (c >= 0x40 && c <= 0xfc) {
+			classes[i] |= QR_CC_KANJI2;
 		}
+		if ((c >= 0x81 && c <= 0x9f) || (c >= 0xe0 && c <= 0xea)) {
+			classes[i] |= QR_CC_KANJI1;
+			qrClassifyKanji(i);
+		}
+	}
+
+#undef qrClassifyKanji
+}
+
+/*
+ * 断片に分かれた合計sizeバイトの入力データについて、qrClassifyData()と同じように
+ * 各バイトの文字種別をclasses(必須)に書き込み、offsetsがNULLでなければ
+ * 符号化モードごとの位置を書き込む
+ * 断片ごとに調べ、境目にまたがる漢字は境目の2バイトだけ調べ直す
+ */
+static void
+qrClassifyDataV(const qr_iovec_t *iov, int iovcnt, int size, qr_byte_t *classes, int *offsets)
+{
+	int frag[QR_EM_COUNT];
+	qr_byte_t pair[2], cls[2];
+	const qr_byte_t *ptr;
+	int i, k, n, p, num, alnum;
+
+	if (offsets != NULL) {
+		offsets[QR_EM_NUMERIC] = -1;
+		offsets[QR_EM_ALNUM] = -1;
+		offsets[QR_EM_8BIT] = -1;
+		offsets[QR_EM_KANJI] = -1;
 	}
-	if (p < size) {
-		return p;
+
+	p = 0;
+	for (i = 0; i < iovcnt && p < size; i++) {
+		ptr = (const qr_byte_t *)iov[i].iov_base;
+		n = (int)iov[i].iov_len;
+		if (n == 0) {
+			continue;
+		}
+		qrClassifyData(ptr, n, &(classes[p]), frag);
+		if (offsets != NULL) {
+			if (offsets[QR_EM_NUMERIC] == -1 && frag[QR_EM_NUMERIC] != -1) {
+				offsets[QR_EM_NUMERIC] = p + frag[QR_EM_NUMERIC];
+			}
+			if (offsets[QR_EM_ALNUM] == -1 && frag[QR_EM_ALNUM] != -1) {
+				offsets[QR_EM_ALNUM] = p + frag[QR_EM_ALNUM];
+			}
+		}
+		/*
+		 * 前の断片の末尾のバイトとこの断片の先頭のバイトが漢字になるか調べる
+		 */
+		if (p > 0 && (classes[p - 1] & QR_CC_KANJI1)) {
+			pair[1] = ptr[0];
+			qrClassifyBlock(pair, 1, 2, cls, &num, &alnum);
+			classes[p - 1] |= cls[0] & QR_CC_KANJI;
+		}
+		pair[0] = ptr[n - 1];
+		p += n;
+	}
+
+	/*
+	 * 漢字は2バイト単位で調べる
+	 * (2バイトめの範囲はQR_CC_KANJI2で分かる)
+	 */
+	if (offsets != NULL) {
+		k = 0;
+		while (k < size) {
+			if (classes[k] & QR_CC_KANJI) {
+				k += 2;
+				continue;
+			}
+			if (k + 1 >= size || !(classes[k] & QR_CC_KANJI1)) {
+				offsets[QR_EM_KANJI] = k;
+			} else if (!(classes[k + 1] & QR_CC_KANJI2)) {
+				/* JIS X 0208漢字の2バイトめでない */
+				offsets[QR_EM_KANJI] = k + 1;
+			} else {
+				/* JIS X 0208漢字の未定義領域 */
+				offsets[QR_EM_KANJI] = k;
+			}
+			break;
+		}
 	}
-	return -1;
 }
 
 /*
@@ -900,9 +1757,94 @@ qrAddData(QRCode *qr, const qr_byte_t *source, int size)
 QR_API int
 qrAddData2(QRCode *qr, const qr_byte_t *source, int size, int mode)
 {
+	qr_iovec_t iov;
+
+	iov.iov_base = source;
+	iov.iov_len = (size > 0) ? (size_t)size : 0;
+	return qrAddDataIov(qr, &iov, 1, size, mode, FALSE);
+}
+
+/*
+ * 符号化モードを指定して、呼び出し元の領域を借用してデータを追加する
+ * 入力データを後で符号化するためにバッファに保存するときは、
+ * 内容を複写せずにアドレスだけを保存する
+ * (呼び出し元はqrFinalize()が終わるまでsourceの内容を保たなければならない。
+ *  その間にqrClone()で複製したオブジェクトも同じ領域を借用する)
+ */
+QR_API int
+qrAddDataRef(QRCode *qr, const qr_byte_t *source, int size, int mode)
+{
+	qr_iovec_t iov;
+
+	iov.iov_base = source;
+	iov.iov_len = (size > 0) ? (size_t)size : 0;
+	return qrAddDataIov(qr, &iov, 1, size, mode, TRUE);
+}
+
+/*
+ * 符号化モードを指定して、断片に分かれたデータを連結したものとして追加する
+ * 断片は連結せずにそのまま符号化する
+ * (自動選択でも断片ごとに文字種別を調べて分割する)
+ */
+QR_API int
+qrAddDataV(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int mode)
+{
+	return qrAddDataVec(qr, iov, iovcnt, mode, FALSE);
+}
+
+/*
+ * 符号化モードを指定して、呼び出し元の領域を借用して断片に分かれたデータを追加する
+ * 入力データをバッファに保存するときは、各断片のアドレスと長さだけを保存する
+ * (呼び出し元はqrFinalize()が終わるまで各断片の内容を保たなければならない。
+ *  iov配列そのものは呼び出しが終われば不要になる)
+ */
+QR_API int
+qrAddDataRefV(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int mode)
+{
+	return qrAddDataVec(qr, iov, iovcnt, mode, TRUE);
+}
+
+/*
+ * 断片の合計の長さを求めてqrAddDataIov()に渡す
+ */
+static int
+qrAddDataVec(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int mode, int borrow)
+{
+	int i, size;
+
+	if (qr->state == QR_STATE_FINAL) {
+		qrSetErrorInfo(qr, QR_ERR_STATE, _QR_FUNCTION);
+		return FALSE;
+	}
+
+	size = 0;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > (size_t)(INT_MAX - size)) {
+			qrSetErrorInfo3(qr, QR_ERR_LARGE_SRC, ", over %d bytes", INT_MAX);
+			return FALSE;
+		}
+		size += (int)iov[i].iov_len;
+	}
+
+	return qrAddDataIov(qr, iov, iovcnt, size, mode, borrow);
+}
+
+/*
+ * 断片に分かれた合計sizeバイトの入力データを追加する
+ * borrowが真なら、バッファに保存するときに入力データを借用する
+ * (断片が多く、アドレスと長さの一覧のほうが大きくなるときは複写する)
+ */
+static int
+qrAddDataIov(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int size, int mode, int borrow)
+{
+	const qr_byte_t *data;
+	size_t need, top;
 	int enclen, maxlen;
 	int version;
-	int pos, err;
+	int i, nfrag, pos, err;
+	int delta1, delta2, direct;
+	int offsets[QR_EM_COUNT];
+	qr_byte_t *classes = NULL, *modes = NULL;
 
 	if (qr->state == QR_STATE_FINAL) {
 		qrSetErrorInfo(qr, QR_ERR_STATE, _QR_FUNCTION);
@@ -915,101 +1857,258 @@ qrAddData2(QRCode *qr, const qr_byte_t *source, int size, int mode)
 	}
 
 	/*
-	 * 入力データに最適な符号化モードを選ぶ
+	 * 作業領域は最大長の入力データを分割できる大きさなので、
+	 * それを超えるものは作業用の領域を割り当てる前に拒否する
 	 */
-	if (mode == QR_EM_AUTO) {
-		mode = qrDetectDataType(source, size);
-	} else if (mode < QR_EM_NUMERIC || mode >= QR_EM_COUNT) {
-		qrSetErrorInfo(qr, QR_ERR_INVALID_MODE, NULL);
+	if (qr->workspace != NULL && size > QR_SRC_MAX) {
+		qrSetErrorInfo3(qr, QR_ERR_LARGE_SRC, ", %d bytes (max %d bytes)", size, QR_SRC_MAX);
 		return FALSE;
 	}
 
+	version = (qr->param.version == -1) ? QR_VER_MAX : qr->param.version;
 
 	/*
 	 * 符号化後のデータ長を計算する
+	 * 自動選択のときは入力データの文字種別を1回だけ調べ、
+	 * 最適な符号化モードのセグメントに分割する
+	 * (そのまま符号化するために分割結果も求める。型番自動選択では
+	 *  他の区間の型番での分割結果と比べるための領域も確保する)
 	 */
-	enclen = qrGetEncodedLength2(qr, size, mode);
-	if (enclen == -1) {
+	if (mode == QR_EM_AUTO) {
+		classes = (qr_byte_t *)qrMalloc(qr, (size_t)size * ((qr->param.version == -1) ? 3 : 2));
+		if (classes == NULL) {
+			qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
+			return FALSE;
+		}
+		qrClassifyDataV(iov, iovcnt, size, classes, NULL);
+		modes = &(classes[size]);
+		enclen = qrSegmentData(qr, classes, size, version, modes);
+	} else if (mode < QR_EM_NUMERIC || mode >= QR_EM_COUNT) {
+		qrSetErrorInfo(qr, QR_ERR_INVALID_MODE, NULL);
+		return FALSE;
+	} else {
+		enclen = qrGetEncodedLength2(qr, size, mode);
+	}
+	if (enclen == -1) {
+		qrFree(qr, classes);
 		return FALSE;
 	}
-	version = (qr->param.version == -1) ? QR_VER_MAX : qr->param.version;
 	maxlen = 8 * qr_vertable[version].ecl[qr->param.eclevel].datawords;
 	if (qr->enclen + enclen > maxlen) {
+		qrFree(qr, classes);
 		qrSetErrorInfo3(qr, QR_ERR_LARGE_SRC, ", %d total encoded bits"
 				" (max %d bits on version=%d, ecl=%s)",
 				qr->enclen + enclen, maxlen, version, qr_eclname[qr->param.eclevel]);
 		return FALSE;
 	}
-	if (qr->param.version == -1) {
-		qr->delta1 += qr_vertable[QR_VER_MAX].nlen[mode] - qr_vertable[VERPOINT1].nlen[mode];
-		qr->delta2 += qr_vertable[QR_VER_MAX].nlen[mode] - qr_vertable[VERPOINT2].nlen[mode];
-	}
 
 	/*
 	 * 型番が指定されていれば、入力データをバッファリングせず直接エンコードする
 	 */
 	if (qr->param.version != -1) {
+		int ret;
 		qr->enclen += enclen;
 		if (!qrHasData(qr)) {
 			qrInitDataWord(qr);
 		}
-		if (qrEncodeDataWord(qr, source, size, mode) == TRUE) {
+		if (modes != NULL) {
+			ret = qrEncodeSegments(qr, iov, iovcnt, size, modes);
+			qrRelease(qr, classes);
+		} else {
+			ret = qrEncodeDataWordV(qr, iov, iovcnt, 0, size, mode);
+		}
+		if (ret == TRUE) {
 			qr->state = QR_STATE_SET;
 			return TRUE;
 		}
+		qr->enclen -= enclen;
 		return FALSE;
 	}
 
 	/*
-	 * 入力データを検証する
+	 * 型番自動選択の補助に使うビット長差分を求める
+	 * 自動分割では文字数指示子のビット長によって分割結果が変わるので
+	 * 各区間の型番で分割し直す
 	 */
-	pos = -1;
-	err = QR_ERR_NONE;
-	switch (mode) {
-	  case QR_EM_NUMERIC:
-		pos = qrStrPosNotNumeric(source, size);
-		err = QR_ERR_NOT_NUMERIC;
-		break;
-	  case QR_EM_ALNUM:
-		pos = qrStrPosNotAlnum(source, size);
-		err = QR_ERR_NOT_ALNUM;
-		break;
-	  case QR_EM_KANJI:
-		pos = qrStrPosNotKanji(source, size);
-		err = QR_ERR_NOT_KANJI;
-		break;
+	if (mode == QR_EM_AUTO) {
+		int enclen1, enclen2;
+		qr_byte_t *modes2 = &(classes[size * 2]);
+		direct = TRUE;
+		enclen1 = qrSegmentData(qr, classes, size, VERPOINT1, modes2);
+		if (enclen1 != -1 && memcmp(modes, modes2, (size_t)size) != 0) {
+			direct = FALSE;
+		}
+		enclen2 = qrSegmentData(qr, classes, size, VERPOINT2, modes2);
+		if (enclen2 != -1 && memcmp(modes, modes2, (size_t)size) != 0) {
+			direct = FALSE;
+		}
+		if (enclen1 == -1 || enclen2 == -1) {
+			qrRelease(qr, classes);
+			return FALSE;
+		}
+		delta1 = enclen - enclen1;
+		delta2 = enclen - enclen2;
+	} else {
+		direct = TRUE;
+		delta1 = qr_vertable[QR_VER_MAX].nlen[mode] - qr_vertable[VERPOINT1].nlen[mode];
+		delta2 = qr_vertable[QR_VER_MAX].nlen[mode] - qr_vertable[VERPOINT2].nlen[mode];
 	}
-	if (pos != -1) {
-		qrSetErrorInfo3(qr, err, " at offset %d", pos);
-		return FALSE;
+
+	/*
+	 * 最大の型番の文字数指示子で直接エンコードし、
+	 * ファイナライズで決定した型番に合わせて詰め直す
+	 * 自動分割の結果が型番の区間によって異なるときは、
+	 * それ以後の入力データをバッファに保存して型番が決まってから符号化する
+	 */
+	if (!qrHasData(qr)) {
+		qr->dwpos = 0;
+		qr->dwbit = 7;
+	}
+	if (direct && qr->srclen == 0) {
+		int ret;
+		/*
+		 * 詰め直しで数バイト先まで読むので、余裕を持って確保する
+		 */
+		if (!qrGrowWords(qr, (size_t)((qr->enclen + enclen + 7) / 8 + 8))) {
+			qrFree(qr, classes);
+			return FALSE;
+		}
+		if (classes != NULL) {
+			ret = qrEncodeSegments(qr, iov, iovcnt, size, modes);
+			qrRelease(qr, classes);
+		} else {
+			ret = qrEncodeDataWordV(qr, iov, iovcnt, 0, size, mode);
+		}
+		if (ret != TRUE) {
+			return FALSE;
+		}
+		qr->enclen += enclen;
+		qr->delta1 += delta1;
+		qr->delta2 += delta2;
+		qr->state = QR_STATE_SET;
+		return TRUE;
+	}
+	qrFree(qr, classes);
+
+	/*
+	 * 借用するときは空でない断片のアドレスと長さを保存する
+	 */
+	nfrag = 0;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > 0) {
+			nfrag++;
+		}
+	}
+	if (nfrag > 1 && sizeof(qr_iovec_t) * (size_t)nfrag + 4 > (size_t)size) {
+		borrow = FALSE;
 	}
-	qr->enclen += enclen;
 
 	/*
 	 * バッファの容量が足りないときは追加で確保する
+	 * (最初は必要な大きさだけ確保し、以後は倍々に広げる)
 	 */
-	while (qr->srcmax < qr->srclen + size + 6) {
-		qr->srcmax += QR_SRC_MAX;
-		qr->source = (qr_byte_t *)realloc(qr->source, qr->srcmax);
-		if (qr->source == NULL) {
-			qr->srcmax = 0;
+	need = qr->srclen + 6 + (borrow ? 4 + sizeof(qr_iovec_t) * (size_t)nfrag : (size_t)size);
+	if (qr->srcmax < need) {
+		qr_byte_t *buf;
+		size_t srcmax;
+		srcmax = qr->srcmax * 2;
+		if (srcmax < need) {
+			srcmax = need;
+		}
+		buf = (qr_byte_t *)qrRealloc(qr, qr->source, srcmax);
+		if (buf == NULL) {
 			qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 			return FALSE;
 		}
+		qr->source = buf;
+		qr->srcmax = srcmax;
 	}
 
 	/*
 	 * バッファにデータを保存する
+	 * (dataは連続した入力データがあればその先頭、なければNULL)
 	 */
-	qr->source[qr->srclen++] = (qr_byte_t)(mode | 0x80);
+	top = qr->srclen;
+	if (mode == QR_EM_AUTO) {
+		qr->source[qr->srclen] = (qr_byte_t)(QR_EM_SEGMENTS | 0x80);
+	} else {
+		qr->source[qr->srclen] = (qr_byte_t)(mode | 0x80);
+	}
+	if (borrow) {
+		qr->source[qr->srclen] |= QR_SRC_BORROWED;
+	}
+	qr->srclen++;
 	qr->source[qr->srclen++] = (qr_byte_t)((size >> 24) & 0x7F);
 	qr->source[qr->srclen++] = (qr_byte_t)((size >> 16) & 0xFF);
 	qr->source[qr->srclen++] = (qr_byte_t)((size >> 8) & 0xFF);
 	qr->source[qr->srclen++] = (qr_byte_t)(size & 0xFF);
-	memcpy(&(qr->source[qr->srclen]), source, (size_t)size);
-	qr->srclen += size;
+	data = NULL;
+	if (borrow) {
+		qr->source[qr->srclen++] = (qr_byte_t)((nfrag >> 24) & 0x7F);
+		qr->source[qr->srclen++] = (qr_byte_t)((nfrag >> 16) & 0xFF);
+		qr->source[qr->srclen++] = (qr_byte_t)((nfrag >> 8) & 0xFF);
+		qr->source[qr->srclen++] = (qr_byte_t)(nfrag & 0xFF);
+		for (i = 0; i < iovcnt; i++) {
+			if (iov[i].iov_len > 0) {
+				memcpy(&(qr->source[qr->srclen]), &(iov[i]), sizeof(qr_iovec_t));
+				qr->srclen += sizeof(qr_iovec_t);
+				if (nfrag == 1) {
+					data = (const qr_byte_t *)iov[i].iov_base;
+				}
+			}
+		}
+	} else {
+		data = &(qr->source[qr->srclen]);
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(&(qr->source[qr->srclen]), iov[i].iov_base, iov[i].iov_len);
+			qr->srclen += iov[i].iov_len;
+		}
+	}
 	qr->source[qr->srclen] = '\0';
 
+	/*
+	 * 入力データを検証する
+	 * (連続していなければ断片ごとに調べる)
+	 */
+	pos = -1;
+	err = QR_ERR_NONE;
+	switch (mode) {
+	  case QR_EM_NUMERIC:
+		err = QR_ERR_NOT_NUMERIC;
+		break;
+	  case QR_EM_ALNUM:
+		err = QR_ERR_NOT_ALNUM;
+		break;
+	  case QR_EM_KANJI:
+		err = QR_ERR_NOT_KANJI;
+		break;
+	}
+	if (err != QR_ERR_NONE) {
+		if (data != NULL) {
+			qrClassifyData(data, size, NULL, offsets);
+		} else {
+			classes = (qr_byte_t *)qrMalloc(qr, (size_t)size);
+			if (classes == NULL) {
+				qr->srclen = top;
+				qr->source[top] = '\0';
+				qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
+				return FALSE;
+			}
+			qrClassifyDataV(iov, iovcnt, size, classes, offsets);
+			qrRelease(qr, classes);
+		}
+		pos = offsets[mode];
+	}
+	if (pos != -1) {
+		qr->srclen = top;
+		qr->source[top] = '\0';
+		qrSetErrorInfo3(qr, err, " at offset %d", pos);
+		return FALSE;
+	}
+	qr->enclen += enclen;
+	qr->delta1 += delta1;
+	qr->delta2 += delta2;
+
 	qr->state = QR_STATE_SET;
 	return TRUE;
 }
@@ -1144,8 +2243,8 @@ qrsAddData2(QRStructured *st, const qr_byte_t *source, int size, int mode)
 			 * 次のQRコードオブジェクトを初期化する
 			 */
 			int errcode;
-			st->qrs[st->num] = qrInit(st->param.version, st->param.mode,
-					st->param.eclevel, st->param.masktype, &errcode);
+			st->qrs[st->num] = qrInit2(st->param.version, st->param.mode,
+					st->param.eclevel, st->param.masktype, &(st->allocator), &errcode);
 			if (st->qrs[st->num] == NULL) {
 				qrSetErrorInfo(st->cur, errcode, NULL);
 				return FALSE;
@@ -1175,7 +2274,7 @@ qrInitDataWord(QRCode *qr)
 	/*
 	 * データコード語領域をゼロクリアする
 	 */
-	memset(qr->dataword, '\0', QR_DWD_MAX);
+	memset(qr->dataword, '\0', (size_t)qr_vertable[qr->param.version].ecl[qr->param.eclevel].datawords);
 
 	/*
 	 * 追加位置をバイト0の最上位ビットにする
@@ -1192,36 +2291,162 @@ qrInitDataWord(QRCode *qr)
 static int
 qrEncodeDataWord(QRCode *qr, const qr_byte_t *source, int size, int mode)
 {
+	qr_iovec_t iov;
+
+	iov.iov_base = source;
+	iov.iov_len = (size_t)size;
+	return qrEncodeDataWordV(qr, &iov, 1, 0, size, mode);
+}
+
+/*
+ * 断片に分かれた入力データの、先頭の断片のskipバイトめからsizeバイトを
+ * 1つのセグメントとしてエンコードする
+ * 数字、英数字、漢字モードで断片の境目にまたがる桁の組は、
+ * 小さな領域に集めてから符号化する
+ */
+static int
+qrEncodeDataWordV(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int skip, int size, int mode)
+{
+	qr_bitstream_t bs;
+	qr_byte_t carry[3];
+	const qr_byte_t *ptr;
+	int i, len, n, unit;
+	int rest = size;
+	int ncarry = 0;
+	int cpos = 0;
+	int offset = 0;
 	int p = 0;
 	int e = QR_ERR_NONE;
-	int n = 0;
-	int word = 0;
-	int dwpos = qr->dwbit;
-	int dwbit = qr->dwpos;
+	int dwpos = qr->dwpos;
+	int dwbit = qr->dwbit;
+	qr_byte_t dwhead = (qr->dwbit < 7) ? qr->dataword[qr->dwpos] : 0;
+	int version = (qr->param.version == -1) ? QR_VER_MAX : qr->param.version;
 
 	if (mode < QR_EM_NUMERIC || mode >= QR_EM_COUNT) {
 		e = QR_ERR_INVALID_MODE;
 		goto err;
 	}
 
+	qrBitsBegin(qr, &bs);
+
 	/*
 	 * モード指示子(4ビット)を追加する
 	 */
-	qrAddDataBits(qr, 4, qr_modeid[mode]);
+	qrBitsPut(&bs, 4, qr_modeid[mode]);
 
 	/*
 	 * 文字数指示子(8〜16ビット)を追加する
 	 * ビット数は型番とモードによって異なる
+	 * (型番自動選択では最大の型番のビット数で書き出し、
+	 *  ファイナライズで型番が決まってから詰め直す)
 	 */
 	if (mode == QR_EM_KANJI) {
-		qrAddDataBits(qr, qr_vertable[qr->param.version].nlen[mode], size / 2);
+		qrBitsPut(&bs, qr_vertable[version].nlen[mode], size / 2);
 	} else {
-		qrAddDataBits(qr, qr_vertable[qr->param.version].nlen[mode], size);
+		qrBitsPut(&bs, qr_vertable[version].nlen[mode], size);
 	}
 
 	/*
-	 * 入力データを符号化する
+	 * 入力データを断片ごとに符号化する
+	 * 桁の組(数字は3桁、英数字は2桁、漢字は2バイト)の単位で区切り、
+	 * 断片の末尾に残った端数は次の断片の先頭と合わせて符号化する
+	 */
+	if (mode == QR_EM_NUMERIC) {
+		unit = 3;
+	} else if (mode == QR_EM_8BIT) {
+		unit = 1;
+	} else {
+		unit = 2;
+	}
+	for (i = 0; i < iovcnt && rest > 0 && e == QR_ERR_NONE; i++) {
+		ptr = (const qr_byte_t *)iov[i].iov_base;
+		len = (int)iov[i].iov_len;
+		if (i == 0) {
+			ptr += skip;
+			len -= skip;
+		}
+		if (len > rest) {
+			len = rest;
+		}
+		rest -= len;
+		while (ncarry > 0 && ncarry < unit && len > 0) {
+			carry[ncarry++] = *ptr++;
+			len--;
+			offset++;
+			if (ncarry == unit) {
+				e = qrEncodeDataBody(&bs, carry, unit, mode, &p);
+				p += cpos;
+				ncarry = 0;
+			}
+		}
+		if (e != QR_ERR_NONE) {
+			break;
+		}
+		n = len - len % unit;
+		if (n > 0) {
+			e = qrEncodeDataBody(&bs, ptr, n, mode, &p);
+			p += offset;
+			ptr += n;
+			len -= n;
+			offset += n;
+		}
+		if (e == QR_ERR_NONE && len > 0) {
+			memcpy(carry, ptr, (size_t)len);
+			ncarry = len;
+			cpos = offset;
+			offset += len;
+		}
+	}
+	/*
+	 * 最後の端数を符号化する
 	 */
+	if (e == QR_ERR_NONE && ncarry > 0) {
+		e = qrEncodeDataBody(&bs, carry, ncarry, mode, &p);
+		p += cpos;
+	}
+	if (e != QR_ERR_NONE) {
+		goto err;
+	}
+
+	qrBitsEnd(qr, &bs);
+
+	return TRUE;
+
+  err:
+	if (e != QR_ERR_INVALID_MODE) {
+		/*
+		 * 書き出し途中のデータコード語を元に戻す
+		 */
+		qrBitsEnd(qr, &bs);
+		n = (qr->dwbit < 7) ? qr->dwpos + 1 : qr->dwpos;
+		if (n > dwpos) {
+			memset(&(qr->dataword[dwpos]), '\0', (size_t)(n - dwpos));
+			qr->dataword[dwpos] = dwhead;
+		}
+	}
+	qr->dwpos = dwpos;
+	qr->dwbit = dwbit;
+	if (e == QR_ERR_INVALID_MODE) {
+		qrSetErrorInfo(qr, e, NULL);
+	} else {
+		qrSetErrorInfo3(qr, e, " at offset %d", p);
+	}
+	return FALSE;
+}
+
+/*
+ * 入力データをモードに従って符号化し、ビットストリームに追加する
+ * 符号化できないバイトがあればエラー番号を返し、その位置をposに書き込む
+ * (入力データの末尾の端数は、数字と英数字では短いビット列として符号化する)
+ */
+static int
+qrEncodeDataBody(qr_bitstream_t *bs, const qr_byte_t *source, int size, int mode, int *pos)
+{
+	int p = 0;
+	int e = QR_ERR_NONE;
+	int n = 0;
+	int word = 0;
+
 	switch (mode) {
 	  case QR_EM_NUMERIC:
 		/*
@@ -1229,19 +2454,49 @@ qrEncodeDataWord(QRCode *qr, const qr_byte_t *source, int size, int mode)
 		 * 3桁ずつ10ビットの2進数に変換する
 		 * 余りは1桁なら4ビット、2桁なら7ビットにする
 		 */
+		/*
+		 * 6桁ずつ64ビット整数に読み込み、すべて数字であることを
+		 * まとめて検証してから2組の10ビット値を一度に追加する
+		 * (数字でないバイトを含む組は1桁ずつの処理に任せる)
+		 */
+		while (p + 6 <= size) {
+			uint64_t x, d;
+			x = (uint64_t)source[p]
+				| ((uint64_t)source[p+1] << 8)
+				| ((uint64_t)source[p+2] << 16)
+				| ((uint64_t)source[p+3] << 24)
+				| ((uint64_t)source[p+4] << 32)
+				| ((uint64_t)source[p+5] << 40);
+			if ((x & 0xf0f0f0f0f0f0ULL) != 0x303030303030ULL ||
+				((x + 0x060606060606ULL) & 0xf0f0f0f0f0f0ULL) != 0x303030303030ULL)
+			{
+				break;
+			}
+			d = x - 0x303030303030ULL;
+			word = (int)(d & 0xff) * 100
+				+ (int)((d >> 8) & 0xff) * 10
+				+ (int)((d >> 16) & 0xff);
+			word = (word << 10)
+				| ((int)((d >> 24) & 0xff) * 100
+				+ (int)((d >> 32) & 0xff) * 10
+				+ (int)((d >> 40) & 0xff));
+			qrBitsPut(bs, 20, word);
+			p += 6;
+		}
+		word = 0;
 		while (p < size) {
 			qr_byte_t q = source[p];
 			if (q < '0' || q > '9') {
 				/* 数字でない */
 				e = QR_ERR_NOT_NUMERIC;
-				goto err;
+				break;
 			}
 			word = word * 10 + (q - '0');
 			/*
 			 * 3桁たまったら10ビットで追加する
 			 */
 			if (++n >= 3) {
-				qrAddDataBits(qr, 10, word);
+				qrBitsPut(bs, 10, word);
 				n = 0;
 				word = 0;
 			}
@@ -1251,9 +2506,9 @@ qrEncodeDataWord(QRCode *qr, const qr_byte_t *source, int size, int mode)
 		 * 余りの桁を追加する
 		 */
 		if (n == 1) {
-			qrAddDataBits(qr, 4, word);
+			qrBitsPut(bs, 4, word);
 		} else if (n == 2) {
-			qrAddDataBits(qr, 7, word);
+			qrBitsPut(bs, 7, word);
 		}
 		break;
 
@@ -1263,40 +2518,39 @@ qrEncodeDataWord(QRCode *qr, const qr_byte_t *source, int size, int mode)
 		 * 2桁ずつ11ビットの2進数に変換する
 		 * 余りは6ビットとして変換する
 		 */
-		while (p < size) {
+		while (p + 1 < size) {
 			signed char q = qr_alnumtable[source[p]];
-			if (q == -1) {
+			signed char r = qr_alnumtable[source[p+1]];
+			if (q == -1 || r == -1) {
 				/* 符号化可能な英数字でない */
+				if (q != -1) {
+					p++;
+				}
 				e = QR_ERR_NOT_ALNUM;
-				goto err;
-			}
-			word = word * 45 + (int)q;
-			/*
-			 * 2桁たまったら11ビットで追加する
-			 */
-			if (++n >= 2) {
-				qrAddDataBits(qr, 11, word);
-				n = 0;
-				word = 0;
+				break;
 			}
-			p++;
+			qrBitsPut(bs, 11, (int)q * 45 + (int)r);
+			p += 2;
 		}
 		/*
 		 * 余りの桁を追加する
 		 */
-		if (n == 1) {
-			qrAddDataBits(qr, 6, word);
+		if (p < size) {
+			signed char q = qr_alnumtable[source[p]];
+			if (q == -1) {
+				e = QR_ERR_NOT_ALNUM;
+				break;
+			}
+			qrBitsPut(bs, 6, (int)q);
 		}
 		break;
 
 	  case QR_EM_8BIT:
 		/*
 		 * 8ビットバイトモード
-		 * 各バイトを直接8ビット値として追加する
+		 * 入力データをビット位置をずらしてそのまま複写する
 		 */
-		while (p < size) {
-			qrAddDataBits(qr, 8, (int)source[p++]);
-		}
+		qrBitsPutBytes(bs, source, size);
 		break;
 
 	  case QR_EM_KANJI:
@@ -1320,7 +2574,7 @@ qrEncodeDataWord(QRCode *qr, const qr_byte_t *source, int size, int mode)
 				/* JIS X 0208漢字の1バイトめでない */
 				p -= 1;
 				e = QR_ERR_NOT_KANJI;
-				goto err;
+				break;
 			}
 			/*
 			 * 第2バイトの処理
@@ -1333,7 +2587,7 @@ qrEncodeDataWord(QRCode *qr, const qr_byte_t *source, int size, int mode)
 				/* JIS X 0208漢字の2バイトめでない */
 				p -= 1;
 				e = QR_ERR_NOT_KANJI;
-				goto err;
+				break;
 			}
 			/*
 			 * 結果を13ビットの値として追加する
@@ -1343,107 +2597,487 @@ qrEncodeDataWord(QRCode *qr, const qr_byte_t *source, int size, int mode)
 				/* JIS X 0208漢字の未定義領域 */
 				p -= 2;
 				e = QR_ERR_NOT_KANJI;
-				goto err;
+				break;
 			}
-			qrAddDataBits(qr, 13, word);
+			qrBitsPut(bs, 13, word);
 		}
 		if (p < size) {
 			/*
 			 * 末尾に余分なバイトがある
 			 */
 			e = QR_ERR_NOT_KANJI;
-			goto err;
+			break;
 		}
 		break;
 
 	  default:
 		e = QR_ERR_INVALID_MODE;
-		goto err;
+		break;
 	}
 
-	return TRUE;
-
-  err:
-	qr->dwpos = dwpos;
-	qr->dwbit = dwbit;
-	if (e == QR_ERR_INVALID_MODE) {
-		qrSetErrorInfo(qr, e, NULL);
-	} else {
-		qrSetErrorInfo3(qr, e, " at offset %d", p);
-	}
-	return FALSE;
+	*pos = p;
+	return e;
 }
 
 /*
- * データコード語の余りを埋める
+ * qrClassifyData()で調べた文字種別をもとに
+ * 入力データを符号化モードの異なるセグメントに分割する
+ * 型番versionの文字数指示子のビット長を使い、動的計画法で
+ * 総ビット長が最小となる分割を求めてビット長を返す
+ * modesがNULLでなければ、各バイトの符号化モードを書き込む
+ * (同じモードが連続する範囲が1つのセグメントとなる)
  */
 static int
-qrFinalizeDataWord(QRCode *qr)
+qrSegmentData(QRCode *qr, const qr_byte_t *classes, int size, int version, qr_byte_t *modes)
 {
-	int n, m;
-	int word;
+	int cost[3][QR_SEG_STATES];
+	int hdr[QR_EM_COUNT];
+	qr_byte_t *prev = NULL;
+	int i, m, s, t, c, from, least, bits;
+	const int inf = 0x3fffffff;
+
+#define qrSegRelax(pos, row, state, value, prevstate) { \
+	if ((value) < cost[(row)][(state)]) { \
+		cost[(row)][(state)] = (value); \
+		if (prev != NULL) { \
+			prev[(pos) * QR_SEG_STATES + (state)] = (qr_byte_t)(prevstate); \
+		} \
+	} \
+}
 
 	/*
-	 * 終端パターンを追加する(最大4ビットの0)
+	 * モード指示子と文字数指示子のビット長
 	 */
-	n = qrRemainedDataBits(qr);
-	if (n < 4) {
-		qrAddDataBits(qr, n, 0);
-		n = 0;
-	} else {
-		qrAddDataBits(qr, 4, 0);
-		n -= 4;
+	for (m = 0; m < QR_EM_COUNT; m++) {
+		hdr[m] = 4 + qr_vertable[version].nlen[m];
 	}
+
 	/*
-	 * 末尾のデータコード語の全ビットが埋まっていなければ
-	 * 余りを埋め草ビット(0)で埋める
+	 * 分割結果を求めるときは、各位置・各状態の直前の状態を記録する
 	 */
-	m = n % 8;
-	if (m > 0) {
-		qrAddDataBits(qr, m, 0);
-		n -= m;
+	if (modes != NULL) {
+		prev = (qr_byte_t *)qrMalloc(qr, (size_t)(size + 1) * QR_SEG_STATES);
+		if (prev == NULL) {
+			qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
+			return -1;
+		}
 	}
 
 	/*
-	 * 残りのデータコード語に埋め草コード語1,2を交互に埋める
+	 * cost[i % 3][s]は先頭iバイトを符号化し、状態sで終わるときの最小ビット長
+	 * (漢字は2バイト先に進むので3行を循環して使う)
 	 */
-	word = PADWORD1;
-	while (n >= 8) {
-		qrAddDataBits(qr, 8, word);
-		if (word == PADWORD1) {
-			word = PADWORD2;
+	for (s = 0; s < QR_SEG_STATES; s++) {
+		cost[0][s] = inf;
+		cost[1][s] = inf;
+	}
+	for (i = 0; i < size; i++) {
+		int *cur = cost[i % 3];
+		int next = (i + 1) % 3;
+		int next2 = (i + 2) % 3;
+		for (s = 0; s < QR_SEG_STATES; s++) {
+			cost[next2][s] = inf;
+		}
+		/*
+		 * 直前までの最小ビット長(新しいセグメントを始める起点)
+		 */
+		if (i == 0) {
+			least = 0;
+			from = QR_SEG_START;
 		} else {
-			word = PADWORD1;
+			least = inf;
+			from = QR_SEG_START;
+			for (s = 0; s < QR_SEG_STATES; s++) {
+				if (cur[s] < least) {
+					least = cur[s];
+					from = s;
+				}
+			}
 		}
-		n -= 8;
-	}
 
-	return TRUE;
-}
+		c = classes[i];
+		for (m = 0; m < QR_EM_COUNT; m++) {
+			int len = 1;
+			/*
+			 * このバイトから始まる文字がモードmで符号化できるか調べる
+			 */
+			if (m == QR_EM_NUMERIC) {
+				if (!(c & QR_CC_NUMERIC)) {
+					continue;
+				}
+			} else if (m == QR_EM_ALNUM) {
+				if (!(c & QR_CC_ALNUM)) {
+					continue;
+				}
+			} else if (m == QR_EM_KANJI) {
+				if (!(c & QR_CC_KANJI)) {
+					continue;
+				}
+				len = 2;
+			}
+			/*
+			 * 同じモードのセグメントを続ける場合
+			 */
+			for (s = qr_segfirst[m]; s < QR_SEG_STATES && qr_segmode[s] == m; s++) {
+				if (cur[s] < inf) {
+					t = qr_segnext[s];
+					if (len == 2) {
+						qrSegRelax(i + 2, next2, t, cur[s] + qr_segbits[s], s);
+					} else {
+						qrSegRelax(i + 1, next, t, cur[s] + qr_segbits[s], s);
+					}
+				}
+			}
+			/*
+			 * 新しいセグメントを始める場合
+			 */
+			s = qr_segfirst[m];
+			t = qr_segnext[s];
+			if (len == 2) {
+				qrSegRelax(i + 2, next2, t, least + hdr[m] + qr_segbits[s], from);
+			} else {
+				qrSegRelax(i + 1, next, t, least + hdr[m] + qr_segbits[s], from);
+			}
+		}
+	}
 
-/*
- * データコード語にビット列を追加する
- */
-static void
-qrAddDataBits(QRCode *qr, int n, int word)
-{
 	/*
-	 * 上位ビットから順に処理(ビット単位で処理するので遅い)
+	 * 末尾で最小となる状態を選ぶ
 	 */
-	while (n-- > 0) {
-		/*
-		 * ビット追加位置にデータの下位からnビットめをORする
-		 */
-		qr->dataword[qr->dwpos] |= ((word >> n) & 1) << qr->dwbit;
-		/*
-		 * 次のビット追加位置に進む
-		 */
-		if (--qr->dwbit < 0) {
-			qr->dwpos++;
-			qr->dwbit = 7;
+	bits = inf;
+	from = QR_SEG_START;
+	for (s = 0; s < QR_SEG_STATES; s++) {
+		if (cost[size % 3][s] < bits) {
+			bits = cost[size % 3][s];
+			from = s;
 		}
 	}
-}
+
+	/*
+	 * 直前の状態をたどって各バイトの符号化モードを求める
+	 */
+	if (prev != NULL) {
+		i = size;
+		s = from;
+		while (i > 0 && s != QR_SEG_START) {
+			m = qr_segmode[s];
+			t = prev[i * QR_SEG_STATES + s];
+			i -= (m == QR_EM_KANJI) ? 2 : 1;
+			memset(&(modes[i]), m, (m == QR_EM_KANJI) ? 2 : 1);
+			s = t;
+		}
+		qrRelease(qr, prev);
+	}
+
+#undef qrSegRelax
+
+	return bits;
+}
+
+/*
+ * qrSegmentData()で求めたセグメントごとにデータコード語をエンコードする
+ * 入力データは断片のまま、断片の番号と断片内の位置をたどって読む
+ */
+static int
+qrEncodeSegments(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int size, const qr_byte_t *modes)
+{
+	int i, p, q, skip;
+
+	i = 0;
+	skip = 0;
+	p = 0;
+	while (p < size) {
+		q = p + 1;
+		while (q < size && modes[q] == modes[p]) {
+			q++;
+		}
+		/*
+		 * 読み終えた断片と空の断片を飛ばす
+		 */
+		while ((size_t)skip >= iov[i].iov_len) {
+			skip -= (int)iov[i].iov_len;
+			i++;
+		}
+		if (qrEncodeDataWordV(qr, &(iov[i]), iovcnt - i, skip, q - p, (int)modes[p]) == FALSE) {
+			return FALSE;
+		}
+		skip += q - p;
+		p = q;
+	}
+
+	return TRUE;
+}
+
+/*
+ * 型番自動選択で最大の型番の文字数指示子を使って書き出したデータコード語を、
+ * 決定した型番の文字数指示子のビット長に詰め直す
+ * 各セグメントのモード指示子と文字数指示子からデータ部のビット長が
+ * 分かるので、それをたどって文字数指示子だけを短くする
+ * (書き込み位置は常に読み出し位置より前にあるので、同じ領域で詰められる)
+ */
+static void
+qrRepackDataWord(QRCode *qr)
+{
+	qr_bitstream_t bs;
+	const qr_byte_t *buf = qr->dataword;
+	int version = qr->param.version;
+	int rbit, end, mode, count, bits, n;
+
+	end = qr->dwpos * 8 + (7 - qr->dwbit);
+
+	/*
+	 * 文字数指示子のビット長が最大の型番と同じなら詰め直す必要はない
+	 */
+	if (version <= VERPOINT2) {
+		rbit = 0;
+		qr->dwpos = 0;
+		qr->dwbit = 7;
+		qrBitsBegin(qr, &bs);
+		while (rbit < end) {
+			/*
+			 * モード指示子はそのまま複写する
+			 */
+			n = qrReadBits(buf, rbit, 4);
+			rbit += 4;
+			for (mode = 0; mode < QR_EM_COUNT; mode++) {
+				if (qr_modeid[mode] == n) {
+					break;
+				}
+			}
+			qrBitsPut(&bs, 4, n);
+			/*
+			 * 文字数指示子を決定した型番のビット長で書き直す
+			 */
+			count = qrReadBits(buf, rbit, qr_vertable[QR_VER_MAX].nlen[mode]);
+			rbit += qr_vertable[QR_VER_MAX].nlen[mode];
+			qrBitsPut(&bs, qr_vertable[version].nlen[mode], count);
+			/*
+			 * データ部を複写する
+			 */
+			bits = qrGetEncodedLength2(qr, (mode == QR_EM_KANJI) ? count * 2 : count, mode)
+				- 4 - qr_vertable[version].nlen[mode];
+			while (bits > 0) {
+				n = (bits < 24) ? bits : 24;
+				qrBitsPut(&bs, n, qrReadBits(buf, rbit, n));
+				rbit += n;
+				bits -= n;
+			}
+		}
+		qrBitsEnd(qr, &bs);
+	}
+
+	/*
+	 * 書き出したデータより後ろのデータコード語をゼロクリアする
+	 */
+	n = (qr->dwbit < 7) ? qr->dwpos + 1 : qr->dwpos;
+	if (n < qr_vertable[version].ecl[qr->param.eclevel].datawords) {
+		memset(&(qr->dataword[n]), '\0', (size_t)(qr_vertable[version].ecl[qr->param.eclevel].datawords - n));
+	}
+}
+
+/*
+ * ビット位置bitからnビット(最大24ビット)を読み出す
+ */
+static int
+qrReadBits(const qr_byte_t *buf, int bit, int n)
+{
+	const qr_byte_t *ptr = &(buf[bit >> 3]);
+	uint32_t w;
+
+	w = ((uint32_t)ptr[0] << 24)
+		| ((uint32_t)ptr[1] << 16)
+		| ((uint32_t)ptr[2] << 8)
+		| (uint32_t)ptr[3];
+	return (int)((w << (bit & 7)) >> (32 - n));
+}
+
+/*
+ * データコード語の余りを埋める
+ */
+static int
+qrFinalizeDataWord(QRCode *qr)
+{
+	int n, m;
+	qr_byte_t word;
+
+	/*
+	 * 終端パターンを追加する(最大4ビットの0)
+	 */
+	n = qrRemainedDataBits(qr);
+	if (n < 4) {
+		qrAddDataBits(qr, n, 0);
+		n = 0;
+	} else {
+		qrAddDataBits(qr, 4, 0);
+		n -= 4;
+	}
+	/*
+	 * 末尾のデータコード語の全ビットが埋まっていなければ
+	 * 余りを埋め草ビット(0)で埋める
+	 */
+	m = n % 8;
+	if (m > 0) {
+		qrAddDataBits(qr, m, 0);
+		n -= m;
+	}
+
+	/*
+	 * 残りのデータコード語に埋め草コード語1,2を交互に埋める
+	 * (ここではバイト境界に揃っているので直接書き込む)
+	 */
+	word = PADWORD1;
+	while (n >= 8) {
+		qr->dataword[qr->dwpos++] = word;
+		if (word == PADWORD1) {
+			word = PADWORD2;
+		} else {
+			word = PADWORD1;
+		}
+		n -= 8;
+	}
+
+	return TRUE;
+}
+
+/*
+ * データコード語にビット列を追加する
+ */
+static void
+qrAddDataBits(QRCode *qr, int n, int word)
+{
+	int k;
+
+	/*
+	 * 上位ビットから順に、現在のバイトに収まる分ずつ処理する
+	 * (既存のビットを壊さないようにORで書き込むので、
+	 * 構造的連接ヘッダの上書きにも使える)
+	 */
+	while (n > 0) {
+		k = (n < qr->dwbit + 1) ? n : qr->dwbit + 1;
+		n -= k;
+		/*
+		 * ビット追加位置にデータの上位kビットをORする
+		 */
+		qr->dataword[qr->dwpos] |= (qr_byte_t)(((word >> n) & ((1 << k) - 1)) << (qr->dwbit + 1 - k));
+		/*
+		 * 次のビット追加位置に進む
+		 */
+		qr->dwbit -= k;
+		if (qr->dwbit < 0) {
+			qr->dwpos++;
+			qr->dwbit = 7;
+		}
+	}
+}
+
+/*
+ * 現在のビット追加位置からビットストリームを開始する
+ * 書きかけのバイトの上位ビットはアキュムレータに読み込む
+ */
+static void
+qrBitsBegin(QRCode *qr, qr_bitstream_t *bs)
+{
+	bs->buf = qr->dataword;
+	bs->pos = qr->dwpos;
+	bs->nbits = 7 - qr->dwbit;
+	bs->acc = 0;
+	if (bs->nbits > 0) {
+		bs->acc = (uint64_t)(qr->dataword[qr->dwpos] >> (qr->dwbit + 1));
+	}
+}
+
+/*
+ * ビットストリームにnビット(最大24ビット)を追加する
+ * アキュムレータに32ビット以上溜まったら4バイトまとめて書き出す
+ */
+static void
+qrBitsPut(qr_bitstream_t *bs, int n, int word)
+{
+	bs->acc = (bs->acc << n) | (uint64_t)(word & ((1 << n) - 1));
+	bs->nbits += n;
+	if (bs->nbits >= 32) {
+		qr_byte_t *ptr = &(bs->buf[bs->pos]);
+		bs->nbits -= 32;
+		ptr[0] = (qr_byte_t)(bs->acc >> (bs->nbits + 24));
+		ptr[1] = (qr_byte_t)(bs->acc >> (bs->nbits + 16));
+		ptr[2] = (qr_byte_t)(bs->acc >> (bs->nbits + 8));
+		ptr[3] = (qr_byte_t)(bs->acc >> bs->nbits);
+		bs->pos += 4;
+	}
+}
+
+/*
+ * ビットストリームにバイト列を追加する
+ * アキュムレータを8ビット未満まで書き出した後、
+ * 8バイトずつビット位置をずらして複写する
+ */
+static void
+qrBitsPutBytes(qr_bitstream_t *bs, const qr_byte_t *source, int size)
+{
+	qr_byte_t *ptr;
+	int shift, p = 0;
+
+	while (bs->nbits >= 8) {
+		bs->nbits -= 8;
+		bs->buf[bs->pos++] = (qr_byte_t)(bs->acc >> bs->nbits);
+	}
+	shift = bs->nbits;
+	ptr = &(bs->buf[bs->pos]);
+
+	if (shift == 0) {
+		memcpy(ptr, source, (size_t)size);
+		bs->pos += size;
+		bs->acc = 0;
+		return;
+	}
+
+	while (p + 8 <= size) {
+		uint64_t w, v;
+		w = ((uint64_t)source[p] << 56)
+			| ((uint64_t)source[p+1] << 48)
+			| ((uint64_t)source[p+2] << 40)
+			| ((uint64_t)source[p+3] << 32)
+			| ((uint64_t)source[p+4] << 24)
+			| ((uint64_t)source[p+5] << 16)
+			| ((uint64_t)source[p+6] << 8)
+			| (uint64_t)source[p+7];
+		v = (bs->acc << (64 - shift)) | (w >> shift);
+		ptr[0] = (qr_byte_t)(v >> 56);
+		ptr[1] = (qr_byte_t)(v >> 48);
+		ptr[2] = (qr_byte_t)(v >> 40);
+		ptr[3] = (qr_byte_t)(v >> 32);
+		ptr[4] = (qr_byte_t)(v >> 24);
+		ptr[5] = (qr_byte_t)(v >> 16);
+		ptr[6] = (qr_byte_t)(v >> 8);
+		ptr[7] = (qr_byte_t)v;
+		ptr += 8;
+		bs->acc = w;
+		p += 8;
+	}
+	while (p < size) {
+		*ptr++ = (qr_byte_t)((bs->acc << (8 - shift)) | (source[p] >> shift));
+		bs->acc = source[p++];
+	}
+	bs->acc &= (1U << shift) - 1;
+	bs->pos = (int)(ptr - bs->buf);
+}
+
+/*
+ * ビットストリームの残りを書き出し、ビット追加位置を更新する
+ */
+static void
+qrBitsEnd(QRCode *qr, qr_bitstream_t *bs)
+{
+	while (bs->nbits >= 8) {
+		bs->nbits -= 8;
+		bs->buf[bs->pos++] = (qr_byte_t)(bs->acc >> bs->nbits);
+	}
+	if (bs->nbits > 0) {
+		bs->buf[bs->pos] = (qr_byte_t)((bs->acc << (8 - bs->nbits)) & 0xff);
+	}
+	qr->dwpos = bs->pos;
+	qr->dwbit = 7 - bs->nbits;
+}
 
 /*
  * データコード語の残りビット数を返す
@@ -1462,9 +3096,11 @@ qrRemainedDataBits(QRCode *qr)
 static int
 qrComputeECWord(QRCode *qr)
 {
-	int i, j, k, m;
+	int i, j;
 	int ecwtop, dwtop, nrsb, rsbnum;
-	qr_byte_t rswork[QR_RSD_MAX];
+#ifdef QR_RS_SIMD
+	int width = qrRSBlocksWidth();
+#endif
 
 	/*
 	 * データコード語をRSブロックごとに読み出し、
@@ -1476,87 +3112,35 @@ qrComputeECWord(QRCode *qr)
 	ecwtop = 0;
 	nrsb = qr_vertable[qr->param.version].ecl[qr->param.eclevel].nrsb;
 #define rsb qr_vertable[qr->param.version].ecl[qr->param.eclevel].rsb
-#define gfvector qr_gftable[ecwlen]
 	for (i = 0; i < nrsb; i++) {
 		int dwlen, ecwlen;
-		/*unsigned char *gfvector;*/
-		/*qr_rsblock_t *rsbp;*/
 		/*
 		 * この長さのRSブロックの個数(rsbnum)と
 		 * RSブロック内のデータコード語の長さ(dwlen)、
 		 * 誤り訂正コード語の長さ(ecwlen)を求める
-		 * また誤り訂正コード語の長さから、使われる
-		 * 誤り訂正生成多項式(gfvector)を選ぶ
 		 */
-		/*rsbp = &(qr_vertable[qr->param.version].ecl[qr->param.eclevel].rsb[i]);
-		rsbnum = rsbp->rsbnum;
-		dwlen = rsbp->datawords;
-		ecwlen = rsbp->totalwords - rsbp->datawords;*/
 		rsbnum = rsb[i].rsbnum;
 		dwlen = rsb[i].datawords;
 		ecwlen = rsb[i].totalwords - rsb[i].datawords;
-		/*gfvector = qr_gftable[ecwlen];*/
+		j = 0;
+#ifdef QR_RS_SIMD
 		/*
-		 * それぞれのRSブロックについてデータコード語を
-		 * 誤り訂正生成多項式で除算し、結果を誤り訂正
-		 * コード語とする
+		 * 同じ長さのRSブロックが十分にあれば、
+		 * ベクトルの要素数(width)個ずつまとめて計算する
 		 */
-		for (j = 0; j < rsbnum; j++) {
-			/*
-			 * RS符号計算用作業領域をクリアし、
-			 * 当該RSブロックのデータコード語を
-			 * 多項式係数とみなして作業領域に入れる
-			 * (作業領域の大きさはRSブロックの
-			 * データコード語と誤り訂正コード語の
-			 * いずれか長いほうと同じだけ必要)
-			 */
-			memset(&(rswork[0]), '\0', QR_RSD_MAX);
-			memcpy(&(rswork[0]), &(qr->dataword[dwtop]), (size_t)dwlen);
-			/*
-			 * 多項式の除算を行う
-			 * (各次数についてデータコード語の初項係数から
-			 * 誤り訂正生成多項式への乗数を求め、多項式
-			 * どうしの減算により剰余を求めることをくり返す)
-			 */
-			for (k = 0; k < dwlen; k++) {
-				int e;
-				if (rswork[0] == 0) {
-					/*
-					 * 初項係数がゼロなので、各項係数を
-					 * 左にシフトして次の次数に進む
-					 */
-					for (m = 0; m < QR_RSD_MAX-1; m++) {
-						rswork[m] = rswork[m+1];
-					}
-					rswork[QR_RSD_MAX-1] = 0;
-					continue;
-				}
-				/*
-				 * データコード語の初項係数(整数表現)から
-				 * 誤り訂正生成多項式への乗数(べき表現)を求め、
-				 * 残りの各項について剰余を求めるために
-				 * データコード語の各項係数を左にシフトする
-				 */
-				e = qr_fac2exp[rswork[0]];
-				for (m = 0; m < QR_RSD_MAX-1; m++) {
-					rswork[m] = rswork[m+1];
-				}
-				rswork[QR_RSD_MAX-1] = 0;
-				/*
-				 * 誤り訂正生成多項式の各項係数に上で求めた
-				 * 乗数を掛け(べき表現の加算により求める)、
-				 * データコード語の各項から引いて(整数表現の
-				 * 排他的論理和により求める)、剰余を求める
-				 */
-				for (m = 0; m < ecwlen; m++) {
-					rswork[m] ^= qr_exp2fac[(gfvector[m] + e) % 255];
-				}
-			}
-			/*
-			 * 多項式除算の剰余を当該RSブロックの
-			 * 誤り訂正コードとする
-			 */
-			memcpy(&(qr->ecword[ecwtop]), &(rswork[0]), (size_t)ecwlen);
+		while (width > 0 && rsbnum - j >= width / 4) {
+			int num = (rsbnum - j < width) ? rsbnum - j : width;
+			qrComputeRSBlocks(&(qr->dataword[dwtop]), dwlen, &(qr->ecword[ecwtop]), ecwlen, num, width);
+			dwtop += dwlen * num;
+			ecwtop += ecwlen * num;
+			j += num;
+		}
+#endif
+		/*
+		 * 残りのRSブロックを1つずつ計算する
+		 */
+		for (; j < rsbnum; j++) {
+			qrComputeRSBlock(&(qr->dataword[dwtop]), dwlen, &(qr->ecword[ecwtop]), ecwlen);
 			/*
 			 * データコード語の読み出し位置と
 			 * 誤り訂正コード語の書き込み位置を
@@ -1567,10 +3151,209 @@ qrComputeECWord(QRCode *qr)
 		}
 	}
 #undef rsb
-#undef gfvector
 	return TRUE;
 }
 
+/*
+ * 1つのRSブロックのデータコード語を誤り訂正生成多項式で除算し、
+ * 剰余を誤り訂正コード語としてremに書き込む
+ */
+static void
+qrComputeRSBlock(const qr_byte_t *dw, int dwlen, qr_byte_t *rem, int ecwlen)
+{
+	const unsigned char *gfvector;
+	int k, m;
+
+	/*
+	 * 誤り訂正コード語の長さから、使われる
+	 * 誤り訂正生成多項式(gfvector)を選ぶ
+	 */
+	gfvector = qr_gftable[ecwlen];
+	/*
+	 * 誤り訂正コード語の領域を長さecwlenの
+	 * 剰余レジスタとして使い、ゼロで初期化する
+	 */
+	memset(rem, '\0', (size_t)ecwlen);
+	/*
+	 * データコード語を1つずつ入力して多項式の除算を行う
+	 * (入力と剰余の初項係数の和から誤り訂正生成多項式
+	 * への乗数を求め、レジスタを左にずらしながら
+	 * 各項係数に乗数を掛けた値を加える)
+	 */
+	for (k = 0; k < dwlen; k++) {
+		int e, fb;
+		fb = dw[k] ^ rem[0];
+		if (fb == 0) {
+			/*
+			 * 乗数がゼロなので、左にずらすだけ
+			 */
+			for (m = 0; m < ecwlen - 1; m++) {
+				rem[m] = rem[m+1];
+			}
+			rem[ecwlen-1] = 0;
+			continue;
+		}
+		/*
+		 * 乗数の整数表現をべき表現にし、
+		 * 誤り訂正生成多項式の各項係数との積を
+		 * べき表現の加算により求める
+		 * (qr_exp2facは2周期分あるので255で割らなくてよい)
+		 */
+		e = qr_fac2exp[fb];
+		for (m = 0; m < ecwlen - 1; m++) {
+			rem[m] = rem[m+1] ^ qr_exp2fac[gfvector[m] + e];
+		}
+		rem[ecwlen-1] = qr_exp2fac[gfvector[ecwlen-1] + e];
+	}
+}
+
+#ifdef QR_RS_SIMD
+/*
+ * RSブロックをまとめて計算するベクトルの要素数を返す
+ * (CPUが対応していなければ0を返し、1ブロックずつ計算する)
+ * CPUの機能はlibgcc等が起動時に一度だけ調べたものを参照するだけなので、
+ * シンボルごとに呼んでもかまわない
+ */
+static int
+qrRSBlocksWidth(void)
+{
+	if (qrCpuHasAvx2()) {
+		return 32;
+	}
+	if (qrCpuHasSsse3()) {
+		return 16;
+	}
+	return 0;
+}
+
+/*
+ * 同じ長さのnum個(width以下)のRSブロックの誤り訂正コード語を
+ * ベクトルの各要素に1ブロックずつ割り当てて同時に計算する
+ * GF(256)の定数倍は乗数の上位・下位4ビットごとの積の表を
+ * シャッフル命令で引いて求める
+ */
+static void
+qrComputeRSBlocks(const qr_byte_t *dw, int dwlen, qr_byte_t *ecw, int ecwlen, int num, int width)
+{
+	qr_byte_t lanes[QR_RSD_MAX * QR_RSB_LANES_MAX];
+	qr_byte_t mtable[QR_RSW_MAX][2][16];
+	const unsigned char *gfvector;
+	int b, k, m, n, g;
+
+	/*
+	 * 誤り訂正生成多項式の各項係数について、
+	 * 4ビットの値0～15および16～240の倍数との積の表を作る
+	 */
+	gfvector = qr_gftable[ecwlen];
+	for (m = 0; m < ecwlen; m++) {
+		g = gfvector[m];
+		mtable[m][0][0] = 0;
+		mtable[m][1][0] = 0;
+		for (n = 1; n < 16; n++) {
+			mtable[m][0][n] = qr_exp2fac[qr_fac2exp[n] + g];
+			mtable[m][1][n] = qr_exp2fac[qr_fac2exp[n << 4] + g];
+		}
+	}
+
+	/*
+	 * データコード語をk番めのコード語ごとに並べ替える
+	 * (使わない要素はゼロで埋める)
+	 */
+	if (num < width) {
+		memset(&(lanes[0]), '\0', (size_t)(dwlen * width));
+	}
+	for (b = 0; b < num; b++) {
+		for (k = 0; k < dwlen; k++) {
+			lanes[k * width + b] = dw[b * dwlen + k];
+		}
+	}
+
+	/*
+	 * 剰余はlanesの先頭から同じ並びで書き戻される
+	 */
+	if (width == 32) {
+		qrRSBlocksAvx2(lanes, mtable, dwlen, ecwlen);
+	} else {
+		qrRSBlocksSsse3(lanes, mtable, dwlen, ecwlen);
+	}
+
+	/*
+	 * 剰余をブロックごとの並びに戻す
+	 */
+	for (b = 0; b < num; b++) {
+		for (m = 0; m < ecwlen; m++) {
+			ecw[b * ecwlen + m] = lanes[m * width + b];
+		}
+	}
+}
+
+/*
+ * qrComputeRSBlock()と同じ除算を16要素ずつ行う(SSSE3)
+ */
+static QR_TARGET_SSSE3 void
+qrRSBlocksSsse3(qr_byte_t *lanes, qr_byte_t mtable[][2][16], int dwlen, int ecwlen)
+{
+	__m128i rem[QR_RSW_MAX];
+	__m128i fb, lo, hi, low4;
+	int k, m;
+
+	low4 = _mm_set1_epi8(0x0f);
+	for (m = 0; m < ecwlen; m++) {
+		rem[m] = _mm_setzero_si128();
+	}
+	for (k = 0; k < dwlen; k++) {
+		fb = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&(lanes[k * 16])), rem[0]);
+		lo = _mm_and_si128(fb, low4);
+		hi = _mm_and_si128(_mm_srli_epi16(fb, 4), low4);
+		for (m = 0; m < ecwlen - 1; m++) {
+			rem[m] = _mm_xor_si128(rem[m+1], _mm_xor_si128(
+					_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)mtable[m][0]), lo),
+					_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)mtable[m][1]), hi)));
+		}
+		rem[m] = _mm_xor_si128(
+				_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)mtable[m][0]), lo),
+				_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)mtable[m][1]), hi));
+	}
+	for (m = 0; m < ecwlen; m++) {
+		_mm_storeu_si128((__m128i *)&(lanes[m * 16]), rem[m]);
+	}
+}
+
+/*
+ * qrComputeRSBlock()と同じ除算を32要素ずつ行う(AVX2)
+ */
+static QR_TARGET_AVX2 void
+qrRSBlocksAvx2(qr_byte_t *lanes, qr_byte_t mtable[][2][16], int dwlen, int ecwlen)
+{
+	__m256i rem[QR_RSW_MAX];
+	__m256i fb, lo, hi, low4;
+	int k, m;
+
+#define qrRSTable(p) _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(p)))
+	low4 = _mm256_set1_epi8(0x0f);
+	for (m = 0; m < ecwlen; m++) {
+		rem[m] = _mm256_setzero_si256();
+	}
+	for (k = 0; k < dwlen; k++) {
+		fb = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&(lanes[k * 32])), rem[0]);
+		lo = _mm256_and_si256(fb, low4);
+		hi = _mm256_and_si256(_mm256_srli_epi16(fb, 4), low4);
+		for (m = 0; m < ecwlen - 1; m++) {
+			rem[m] = _mm256_xor_si256(rem[m+1], _mm256_xor_si256(
+					_mm256_shuffle_epi8(qrRSTable(mtable[m][0]), lo),
+					_mm256_shuffle_epi8(qrRSTable(mtable[m][1]), hi)));
+		}
+		rem[m] = _mm256_xor_si256(
+				_mm256_shuffle_epi8(qrRSTable(mtable[m][0]), lo),
+				_mm256_shuffle_epi8(qrRSTable(mtable[m][1]), hi));
+	}
+	for (m = 0; m < ecwlen; m++) {
+		_mm256_storeu_si256((__m256i *)&(lanes[m * 32]), rem[m]);
+	}
+#undef qrRSTable
+}
+#endif
+
 /*
  * データコード語と誤り訂正コード語から最終的なコード語を作る
  */
@@ -1620,111 +3403,320 @@ qrMakeCodeWord(QRCode *qr)
 				/*
 				 * 次のRSブロックのiバイトめに進む
 				 */
-				pos += dwlen;
+				pos += dwlen;
+			}
+		}
+	}
+	/*
+	 * 各RSブロックから順に誤り訂正コード語を取り出し
+	 * コード語領域(qr->codeword)に追加する
+	 */
+	for (i = 0; i < ecwlenmax; i++) {
+		pos = i;
+		/*
+		 * RSブロックのサイズごとに処理を行う
+		 */
+		for (j = 0; j < nrsb; j++) {
+			ecwlen = rsb[j].totalwords - rsb[j].datawords;
+			/*
+			 * 同じサイズのRSブロックは順に処理する
+			 */
+			for (k = 0; k < rsb[j].rsbnum; k++) {
+				/*
+				 * 各RSブロックのiバイトめの誤り訂正
+				 * コード語をコード語領域に追加する
+				 * (すでにすべての誤り訂正コード語を
+				 * 取り出したRSブロックは飛ばす)
+				 */
+				if (i < ecwlen) {
+					qr->codeword[cwtop++] = qr->ecword[pos];
+				}
+				/*
+				 * 次のRSブロックのiバイトめに進む
+				 */
+				pos += ecwlen;
+			}
+		}
+	}
+#undef rsb
+#undef nrsb
+	return TRUE;
+}
+
+/*
+ * シンボルを初期化し、機能パターンを配置する
+ */
+static int
+qrFillFunctionPattern(QRCode *qr)
+{
+	const qr_byte_t *skel;
+	const qr_word_t *pskel;
+	int i, dim, pwords;
+	size_t psize;
+
+	/*
+	 * 型番ごとの機能パターンを得る
+	 */
+	skel = qrGetSkeleton(qr);
+	if (skel == NULL) {
+		return FALSE;
+	}
+	/*
+	 * シンボルの1辺の長さを求める
+	 */
+	dim = qr_vertable[qr->param.version].dimension;
+	pwords = (dim + QR_PLW_BITS - 1) / QR_PLW_BITS;
+	psize = (size_t)(dim * pwords);
+	/*
+	 * シンボルとビットプレーンの領域を確保する
+	 * (qrReset()で再利用する場合、確保済みの領域に収まればそのまま使う)
+	 */
+	if (qr->_symbol == NULL || qr->symbol == NULL || qr->_planes == NULL || qr->bufdim < dim) {
+		qrFree(qr, qr->symbol);
+		qrFree(qr, qr->_symbol);
+		qrFree(qr, qr->_planes);
+		qr->bufdim = 0;
+		qr->_symbol = (qr_byte_t *)qrMalloc(qr, (size_t)dim * (size_t)dim);
+		qr->symbol = (qr_byte_t **)qrMalloc(qr, sizeof(qr_byte_t *) * (size_t)dim);
+		qr->_planes = (qr_word_t *)qrMalloc(qr, sizeof(qr_word_t) * QR_PLANE_COUNT * psize);
+		if (qr->_symbol == NULL || qr->symbol == NULL || qr->_planes == NULL) {
+			qrFree(qr, qr->symbol);
+			qrFree(qr, qr->_symbol);
+			qrFree(qr, qr->_planes);
+			qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
+			return FALSE;
+		}
+		qr->bufdim = dim;
+	}
+	/*
+	 * シンボル全体を機能パターンで初期化する
+	 */
+	memcpy(qr->_symbol, skel, (size_t)dim * (size_t)dim);
+	for (i = 0; i < dim; i++) {
+		qr->symbol[i] = qr->_symbol + dim * i;
+	}
+	/*
+	 * ビットプレーンに機能パターンの領域と
+	 * 黒モジュールをビットプレーンの雛形からコピーする
+	 */
+	pskel = qrGetPlaneSkeleton(qr);
+	if (pskel == NULL) {
+		return FALSE;
+	}
+	qr->pwords = pwords;
+	for (i = 0; i < QR_PLANE_COUNT; i++) {
+		qr->planes[i] = qr->_planes + psize * (size_t)i;
+	}
+	memcpy(qr->planes[QR_PLANE_DARK], pskel + psize * QR_PSK_DARK, sizeof(qr_word_t) * psize);
+	memset(qr->planes[QR_PLANE_DATA], 0, sizeof(qr_word_t) * psize);
+	memcpy(qr->planes[QR_PLANE_FUNC], pskel + psize * QR_PSK_FUNC, sizeof(qr_word_t) * psize);
+
+	return TRUE;
+}
+
+/*
+ * 機能パターンだけを配置したシンボルを返す
+ * 型番ごとに初めて呼ばれたときに作成する
+ */
+static const qr_byte_t *
+qrGetSkeleton(QRCode *qr)
+{
+	qr_byte_t *skel;
+	int dim, version;
+
+	version = qr->param.version;
+	dim = qr_vertable[version].dimension;
+	/*
+	 * 作業領域を使うオブジェクトは、キャッシュを使わずに作業領域に作成する
+	 */
+	if (qr->workspace != NULL) {
+		QRWorkspace *ws = qr->workspace;
+		if (ws->skelver != version) {
+			memset(ws->skeleton, 0, (size_t)dim * (size_t)dim);
+			qrDrawSkeleton(ws->skeleton, version);
+			ws->skelver = version;
+		}
+		return ws->skeleton;
+	}
+
+	skel = qrAtomicLoadPtr(&(qr_skeletons[version]));
+	if (skel != NULL) {
+		return skel;
+	}
+
+	skel = (qr_byte_t *)calloc((size_t)dim, (size_t)dim);
+	if (skel == NULL) {
+		qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
+		return NULL;
+	}
+	qrDrawSkeleton(skel, version);
+	/*
+	 * 他のスレッドが先に作成していれば、そちらを使う
+	 */
+	if (!qrAtomicCasPtr(&(qr_skeletons[version]), (qr_byte_t *)NULL, skel)) {
+		free(skel);
+		skel = qrAtomicLoadPtr(&(qr_skeletons[version]));
+	}
+	return skel;
+}
+
+/*
+ * 型番ごとのビットプレーンの雛形を返す
+ * 雛形はQR_PSK_COUNT枚のビットプレーンからなり、
+ * 0〜7番めはマスクパターン(機能パターン領域を除く)、
+ * QR_PSK_FUNC番めは機能パターン領域、
+ * QR_PSK_DARK番めは機能パターンの黒モジュールを表す
+ * 型番ごとに初めて呼ばれたときに作成する
+ */
+static const qr_word_t *
+qrGetPlaneSkeleton(QRCode *qr)
+{
+	const qr_byte_t *skel;
+	qr_word_t *pskel;
+	int dim, pwords, version;
+	size_t psize;
+
+	version = qr->param.version;
+	dim = qr_vertable[version].dimension;
+	pwords = (dim + QR_PLW_BITS - 1) / QR_PLW_BITS;
+	psize = (size_t)(dim * pwords);
+	/*
+	 * 作業領域を使うオブジェクトは、キャッシュを使わずに作業領域に作成する
+	 */
+	if (qr->workspace != NULL) {
+		QRWorkspace *ws = qr->workspace;
+		if (ws->pskelver != version) {
+			skel = qrGetSkeleton(qr);
+			memset(ws->planeskel, 0, sizeof(qr_word_t) * psize * QR_PSK_COUNT);
+			qrMakePlaneSkeleton(ws->planeskel, skel, version);
+			ws->pskelver = version;
+		}
+		return ws->planeskel;
+	}
+
+	pskel = qrAtomicLoadPtr(&(qr_planeskels[version]));
+	if (pskel != NULL) {
+		return pskel;
+	}
+
+	skel = qrGetSkeleton(qr);
+	if (skel == NULL) {
+		return NULL;
+	}
+	pskel = (qr_word_t *)calloc(psize * QR_PSK_COUNT, sizeof(qr_word_t));
+	if (pskel == NULL) {
+		qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
+		return NULL;
+	}
+	qrMakePlaneSkeleton(pskel, skel, version);
+	/*
+	 * 他のスレッドが先に作成していれば、そちらを使う
+	 */
+	if (!qrAtomicCasPtr(&(qr_planeskels[version]), (qr_word_t *)NULL, pskel)) {
+		free(pskel);
+		pskel = qrAtomicLoadPtr(&(qr_planeskels[version]));
+	}
+	return pskel;
+}
+
+/*
+ * 機能パターンの雛形からビットプレーンの雛形を作る
+ * (pskelはゼロクリアされていること)
+ */
+static void
+qrMakePlaneSkeleton(qr_word_t *pskel, const qr_byte_t *skel, int version)
+{
+	qr_word_t bit;
+	int i, j, k, type, dim, pwords;
+	size_t psize;
+
+	dim = qr_vertable[version].dimension;
+	pwords = (dim + QR_PLW_BITS - 1) / QR_PLW_BITS;
+	psize = (size_t)(dim * pwords);
+	for (i = 0; i < dim; i++) {
+		for (j = 0; j < dim; j++) {
+			k = i * pwords + j / QR_PLW_BITS;
+			bit = (qr_word_t)1 << (j % QR_PLW_BITS);
+			if (skel[i * dim + j] & QR_MM_FUNC) {
+				/*
+				 * 機能パターン領域(および形式情報、
+				 * 型番情報)はマスク対象から除外する
+				 */
+				pskel[psize * QR_PSK_FUNC + k] |= bit;
+				if (skel[i * dim + j] & QR_MM_BLACK) {
+					pskel[psize * QR_PSK_DARK + k] |= bit;
+				}
+				continue;
 			}
-		}
-	}
-	/*
-	 * 各RSブロックから順に誤り訂正コード語を取り出し
-	 * コード語領域(qr->codeword)に追加する
-	 */
-	for (i = 0; i < ecwlenmax; i++) {
-		pos = i;
-		/*
-		 * RSブロックのサイズごとに処理を行う
-		 */
-		for (j = 0; j < nrsb; j++) {
-			ecwlen = rsb[j].totalwords - rsb[j].datawords;
 			/*
-			 * 同じサイズのRSブロックは順に処理する
+			 * 条件を満たすモジュールを反転するマスクパターンを作る
 			 */
-			for (k = 0; k < rsb[j].rsbnum; k++) {
-				/*
-				 * 各RSブロックのiバイトめの誤り訂正
-				 * コード語をコード語領域に追加する
-				 * (すでにすべての誤り訂正コード語を
-				 * 取り出したRSブロックは飛ばす)
-				 */
-				if (i < ecwlen) {
-					qr->codeword[cwtop++] = qr->ecword[pos];
+			for (type = 0; type < QR_MPT_MAX; type++) {
+				if ((type == 0 && (i + j) % 2 == 0) ||
+					(type == 1 && i % 2 == 0) ||
+					(type == 2 && j % 3 == 0) ||
+					(type == 3 && (i + j) % 3 == 0) ||
+					(type == 4 && ((i / 2) + (j / 3)) % 2 == 0) ||
+					(type == 5 && (i * j) % 2 + (i * j) % 3 == 0) ||
+					(type == 6 && ((i * j) % 2 + (i * j) % 3) % 2 == 0) ||
+					(type == 7 && ((i * j) % 3 + (i + j) % 2) % 2 == 0))
+				{
+					pskel[psize * (size_t)type + k] |= bit;
 				}
-				/*
-				 * 次のRSブロックのiバイトめに進む
-				 */
-				pos += ecwlen;
 			}
 		}
 	}
-#undef rsb
-#undef nrsb
-	return TRUE;
 }
 
 /*
- * シンボルを初期化し、機能パターンを配置する
+ * ゼロで初期化された型番versionのシンボルに機能パターンを配置する
  */
-static int
-qrFillFunctionPattern(QRCode *qr)
+static void
+qrDrawSkeleton(qr_byte_t *skel, int version)
 {
 	int i, j, n, dim, xpos, ypos;
 
+#define symbol(y, x) skel[(y) * dim + (x)]
 	/*
 	 * シンボルの1辺の長さを求める
 	 */
-	dim = qr_vertable[qr->param.version].dimension;
-	/*
-	 * シンボル全体をクリアする
-	 */
-	qrFree(qr->symbol);
-	qrFree(qr->_symbol);
-	qr->_symbol = (qr_byte_t *)calloc((size_t)dim, (size_t)dim);
-	if (qr->_symbol == NULL) {
-		return FALSE;
-	}
-	qr->symbol = (qr_byte_t **)malloc(sizeof(qr_byte_t *) * (size_t)dim);
-	if (qr->symbol == NULL) {
-		free(qr->_symbol);
-		return FALSE;
-	}
-	for (i = 0; i < dim; i++) {
-		qr->symbol[i] = qr->_symbol + dim * i;
-	}
+	dim = qr_vertable[version].dimension;
 	/*
 	 * 左上、右上、左下の隅に位置検出パターンを配置する
 	 */
 	for (i = 0; i < QR_DIM_FINDER; i++) {
 		for (j = 0; j < QR_DIM_FINDER; j++) {
-			qr->symbol[i][j] = qr_finderpattern[i][j];
-			qr->symbol[i][dim-1-j] = qr_finderpattern[i][j];
-			qr->symbol[dim-1-i][j] = qr_finderpattern[i][j];
+			symbol(i, j) = qr_finderpattern[i][j];
+			symbol(i, dim-1-j) = qr_finderpattern[i][j];
+			symbol(dim-1-i, j) = qr_finderpattern[i][j];
 		}
 	}
 	/*
 	 * 位置検出パターンの分離パターンを配置する
 	 */
 	for (i = 0; i < QR_DIM_FINDER+1; i++) {
-		qr->symbol[i][QR_DIM_FINDER] = QR_MM_FUNC;
-		qr->symbol[QR_DIM_FINDER][i] = QR_MM_FUNC;
-		qr->symbol[i][dim-1-QR_DIM_FINDER] = QR_MM_FUNC;
-		qr->symbol[dim-1-QR_DIM_FINDER][i] = QR_MM_FUNC;
-		qr->symbol[dim-1-i][QR_DIM_FINDER] = QR_MM_FUNC;
-		qr->symbol[QR_DIM_FINDER][dim-1-i] = QR_MM_FUNC;
+		symbol(i, QR_DIM_FINDER) = QR_MM_FUNC;
+		symbol(QR_DIM_FINDER, i) = QR_MM_FUNC;
+		symbol(i, dim-1-QR_DIM_FINDER) = QR_MM_FUNC;
+		symbol(dim-1-QR_DIM_FINDER, i) = QR_MM_FUNC;
+		symbol(dim-1-i, QR_DIM_FINDER) = QR_MM_FUNC;
+		symbol(QR_DIM_FINDER, dim-1-i) = QR_MM_FUNC;
 	}
 	/*
 	 * 位置合わせパターンを配置する
 	 */
-	n = qr_vertable[qr->param.version].aplnum;
+	n = qr_vertable[version].aplnum;
 	for (i = 0; i < n; i++) {
 		for (j = 0; j < n; j++) {
 			int x, y, x0, y0, xcenter, ycenter;
 			/*
 			 * 位置合わせパターンの中心と左上の座標を求める
 			 */
-			ycenter = qr_vertable[qr->param.version].aploc[i];
-			xcenter = qr_vertable[qr->param.version].aploc[j];
+			ycenter = qr_vertable[version].aploc[i];
+			xcenter = qr_vertable[version].aploc[j];
 			y0 = ycenter - QR_DIM_ALIGN / 2;
 			x0 = xcenter - QR_DIM_ALIGN / 2;
-			if (qrIsFunc(qr, ycenter, xcenter)) {
+			if ((symbol(ycenter, xcenter) & QR_MM_FUNC) != 0) {
 				/*
 				 * 位置検出パターンと重なるときは配置しない
 				 */
@@ -1732,7 +3724,7 @@ qrFillFunctionPattern(QRCode *qr)
 			}
 			for (y = 0; y < QR_DIM_ALIGN; y++) {
 				for (x = 0; x < QR_DIM_ALIGN; x++) {
-					qr->symbol[y0+y][x0+x] = qr_alignpattern[y][x];
+					symbol(y0+y, x0+x) = qr_alignpattern[y][x];
 				}
 			}
 		}
@@ -1741,11 +3733,11 @@ qrFillFunctionPattern(QRCode *qr)
 	 * タイミングパターンを配置する
 	 */
 	for (i = QR_DIM_FINDER; i < dim-1-QR_DIM_FINDER; i++) {
-		qr->symbol[i][QR_DIM_TIMING] = QR_MM_FUNC;
-		qr->symbol[QR_DIM_TIMING][i] = QR_MM_FUNC;
+		symbol(i, QR_DIM_TIMING) = QR_MM_FUNC;
+		symbol(QR_DIM_TIMING, i) = QR_MM_FUNC;
 		if ((i & 1) == 0) {
-			qr->symbol[i][QR_DIM_TIMING] |= QR_MM_BLACK;
-			qr->symbol[QR_DIM_TIMING][i] |= QR_MM_BLACK;
+			symbol(i, QR_DIM_TIMING) |= QR_MM_BLACK;
+			symbol(QR_DIM_TIMING, i) |= QR_MM_BLACK;
 		}
 	}
 	/*
@@ -1755,27 +3747,26 @@ qrFillFunctionPattern(QRCode *qr)
 		for (j = 0; j < QR_FIN_MAX; j++) {
 			xpos = (qr_fmtinfopos[i][j].xpos + dim) % dim;
 			ypos = (qr_fmtinfopos[i][j].ypos + dim) % dim;
-			qr->symbol[ypos][xpos] |= QR_MM_FUNC;
+			symbol(ypos, xpos) |= QR_MM_FUNC;
 		}
 	}
 	xpos = (qr_fmtblackpos.xpos + dim) % dim;
 	ypos = (qr_fmtblackpos.ypos + dim) % dim;
-	qr->symbol[ypos][xpos] |= QR_MM_FUNC;
+	symbol(ypos, xpos) |= QR_MM_FUNC;
 	/*
 	 * 型番情報が有効(型番7以上)なら
 	 * 型番情報の領域を予約する
 	 */
-	if (qr_verinfo[qr->param.version] != -1L) {
+	if (qr_verinfo[version] != -1L) {
 		for (i = 0; i < 2; i++) {
 			for (j = 0; j < QR_VIN_MAX; j++) {
 				xpos = (qr_verinfopos[i][j].xpos + dim) % dim;
 				ypos = (qr_verinfopos[i][j].ypos + dim) % dim;
-				qr->symbol[ypos][xpos] |= QR_MM_FUNC;
+				symbol(ypos, xpos) |= QR_MM_FUNC;
 			}
 		}
 	}
-
-	return TRUE;
+#undef symbol
 }
 
 /*
@@ -1784,36 +3775,108 @@ qrFillFunctionPattern(QRCode *qr)
 static int
 qrFillCodeWord(QRCode *qr)
 {
-	int i, j;
+	const uint16_t *map;
+	int i, j, n, dim;
 
 	/*
-	 * シンボル右下隅から開始する
+	 * コード語のビットを配置するモジュール位置の対応表を得る
 	 */
-	qrInitPosition(qr);
+	map = qrGetPlacementMap(qr);
+	if (map == NULL) {
+		return FALSE;
+	}
+	dim = qr_vertable[qr->param.version].dimension;
 	/*
-	 * コード語領域のすべてのバイトについて...
+	 * コード語領域のすべてのバイトについて、最上位ビットから
+	 * 順に各ビットを調べ、1なら符号化データのビットプレーンに
+	 * 黒モジュールを置く
 	 */
-	for (i = 0; i < qr_vertable[qr->param.version].totalwords; i++) {
-		/*
-		 * 最上位ビットから順に各ビットを調べ...
-		 */
+	n = qr_vertable[qr->param.version].totalwords;
+	for (i = 0; i < n; i++) {
+		int word = qr->codeword[i];
+		if (word == 0) {
+			map += 8;
+			continue;
+		}
 		for (j = 7; j >= 0; j--) {
-			/*
-			 * そのビットが1なら黒モジュールを置く
-			 */
-			if ((qr->codeword[i] & (1 << j)) != 0) {
-				qr->symbol[qr->ypos][qr->xpos] |= QR_MM_DATA;
+			if ((word & (1 << j)) != 0) {
+				qrPlaneSet(qr, QR_PLANE_DATA, *map / dim, *map % dim);
 			}
-			/*
-			 * 次のモジュール配置位置に移動する
-			 */
-			qrNextPosition(qr);
+			map++;
 		}
 	}
 
 	return TRUE;
 }
 
+/*
+ * コード語のビット番号からモジュール位置(行 * 1辺の長さ + 列)への
+ * 対応表を返す
+ * 型番ごとに初めて呼ばれたときに、機能パターンを配置済みの
+ * シンボル上で配置順をたどって作成する
+ */
+static const uint16_t *
+qrGetPlacementMap(QRCode *qr)
+{
+	uint16_t *map;
+	int n, version;
+
+	version = qr->param.version;
+	/*
+	 * 作業領域を使うオブジェクトは、キャッシュを使わずに作業領域に作成する
+	 */
+	if (qr->workspace != NULL) {
+		QRWorkspace *ws = qr->workspace;
+		if (ws->mapver != version) {
+			qrMakePlacementMap(qr, ws->placemap);
+			ws->mapver = version;
+		}
+		return ws->placemap;
+	}
+
+	map = qrAtomicLoadPtr(&(qr_placemaps[version]));
+	if (map != NULL) {
+		return map;
+	}
+
+	n = qr_vertable[version].totalwords * 8;
+	map = (uint16_t *)malloc(sizeof(uint16_t) * (size_t)n);
+	if (map == NULL) {
+		qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
+		return NULL;
+	}
+	qrMakePlacementMap(qr, map);
+	/*
+	 * 他のスレッドが先に作成していれば、そちらを使う
+	 */
+	if (!qrAtomicCasPtr(&(qr_placemaps[version]), (uint16_t *)NULL, map)) {
+		free(map);
+		map = qrAtomicLoadPtr(&(qr_placemaps[version]));
+	}
+	return map;
+}
+
+/*
+ * シンボル右下隅から開始し、機能パターンをよけながら
+ * 各ビットの配置位置を記録する
+ * (機能パターンを配置したシンボルを使う)
+ */
+static void
+qrMakePlacementMap(QRCode *qr, uint16_t *map)
+{
+	int i, n, dim;
+
+	dim = qr_vertable[qr->param.version].dimension;
+	n = qr_vertable[qr->param.version].totalwords * 8;
+	qrInitPosition(qr);
+	for (i = 0; i < n; i++) {
+		map[i] = (uint16_t)(qr->ypos * dim + qr->xpos);
+		if (i + 1 < n) {
+			qrNextPosition(qr);
+		}
+	}
+}
+
 /*
  * モジュール配置の初期位置と配置方向を決める
  */
@@ -1877,39 +3940,227 @@ qrNextPosition(QRCode *qr)
 static int
 qrSelectMaskPattern(QRCode *qr)
 {
+	qr_maskinfo_t *info = &(qr->maskinfo);
 	int type;
-	long penalty, xpenalty;
+	long estimated, xestimated;
+
+	info->policy = qr->param.masktype;
+	info->fallback = 0;
+	info->estimated = -1L;
+	info->penalty = -1L;
 
 	if (qr->param.masktype >= 0) {
 		/*
 		 * マスクパターンが引数で指定されていたので
 		 * そのパターンでマスクして終了
 		 */
+		info->masktype = qr->param.masktype;
+		return qrApplyMaskPattern(qr);
+	}
+	if (qr->param.masktype != QR_MPT_FAST) {
+		/*
+		 * すべてのマスクパターンを評価する
+		 */
+		info->penalty = qrSelectMaskPatternFull(qr);
+		info->masktype = qr->param.masktype;
 		return qrApplyMaskPattern(qr);
 	}
 	/*
-	 * すべてのマスクパターンを評価する
+	 * 一部の行/列だけを評価した推定失点が
+	 * 最も低いマスクパターンを選ぶ
+	 */
+	xestimated = -1L;
+	for (type = 0; type < QR_MPT_MAX; type++) {
+		qrApplyMaskPattern2(qr, type);
+		estimated = qrEstimateMaskPattern(qr);
+		if (xestimated == -1L || estimated < xestimated) {
+			qr->param.masktype = type;
+			xestimated = estimated;
+		}
+	}
+	/*
+	 * 選んだパターンでマスクして失点を求め、
+	 * 推定より大幅に悪ければすべてのパターンを評価し直す
+	 */
+	qrApplyMaskPattern(qr);
+	info->estimated = xestimated;
+	info->penalty = qrEvaluateMaskPattern(qr, -1L);
+	if (info->penalty * 100 > xestimated * (100 + QR_MPT_FAST_SLACK)) {
+		info->fallback = 1;
+		info->penalty = qrSelectMaskPatternFull(qr);
+		qrApplyMaskPattern(qr);
+	}
+	info->masktype = qr->param.masktype;
+	return TRUE;
+}
+
+/*
+ * すべてのマスクパターンを評価し、失点が最低のパターンの
+ * 参照子をqr->param.masktypeに設定して、その失点を返す
+ */
+static long
+qrSelectMaskPatternFull(QRCode *qr)
+{
+	int type;
+	long penalty, xpenalty;
+
+#ifdef HAVE_PTHREAD
+	/*
+	 * 大きな型番ではスレッドプールで並列に評価する
+	 * (作業領域を使うオブジェクトは実行時間を一定にするため逐次に評価する)
 	 */
+	if (qr->workspace == NULL && qrSelectMaskPatternParallel(qr, &xpenalty)) {
+		return xpenalty;
+	}
+#endif
+
 	xpenalty = -1L;
 	for (type = 0; type < QR_MPT_MAX; type++) {
 		/*
 		 * 当該マスクパターンでマスクして評価する
 		 */
 		qrApplyMaskPattern2(qr, type);
-		penalty = qrEvaluateMaskPattern(qr);
+		penalty = qrEvaluateMaskPattern(qr, xpenalty);
 		/*
 		 * 失点がこれまでより低かったら記録する
+		 * (これまでの最低点以上になった時点で評価は打ち切られる)
 		 */
 		if (xpenalty == -1L || penalty < xpenalty) {
 			qr->param.masktype = type;
 			xpenalty = penalty;
 		}
 	}
+	return xpenalty;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * スレッドプールですべてのマスクパターンを並列に評価する
+ * 各スレッドは自分のビットプレーンにマスクして評価し、
+ * 失点が最低のパターンの参照子をqr->param.masktypeに設定して、
+ * その失点をpenaltyに格納する
+ * (結果は逐次に評価した場合と同じになる)
+ * プールが無効か、型番が閾値未満か、プールが他の評価に
+ * 使われていればFALSEを返し、呼び出し元が逐次に評価する
+ */
+static int
+qrSelectMaskPatternParallel(QRCode *qr, long *penalty)
+{
+	qr_maskjob_t job;
+	const qr_word_t *pskel;
+
+	pskel = qrGetPlaneSkeleton(qr);
+	if (pskel == NULL) {
+		return FALSE;
+	}
+	job.pskel = pskel;
+	job.data = qr->planes[QR_PLANE_DATA];
+	job.dim = qr_vertable[qr->param.version].dimension;
+	job.pwords = qr->pwords;
+	job.next = 0;
+	job.running = 0;
+	job.besttype = -1;
+	job.bestpenalty = -1L;
+
+	pthread_mutex_lock(&qr_maskpool.lock);
+	if (qr_maskpool.nthreads == 0 || qr_maskpool.busy
+		|| qr->param.version < qr_maskpool.minversion)
+	{
+		pthread_mutex_unlock(&qr_maskpool.lock);
+		return FALSE;
+	}
+	/*
+	 * 仕事を公開してワーカーを起こし、呼び出し元も評価に加わる
+	 */
+	qr_maskpool.busy = 1;
+	qr_maskpool.job = &job;
+	qr_maskpool.generation++;
+	pthread_cond_broadcast(&qr_maskpool.wake);
+	qrRunMaskJob(&job);
 	/*
-	 * 失点が最低のパターンでマスクする
+	 * 評価中のワーカーが残っていれば終わるのを待つ
 	 */
-	return qrApplyMaskPattern(qr);
+	while (job.running > 0) {
+		pthread_cond_wait(&qr_maskpool.done, &qr_maskpool.lock);
+	}
+	qr_maskpool.job = NULL;
+	qr_maskpool.busy = 0;
+	pthread_mutex_unlock(&qr_maskpool.lock);
+
+	qr->param.masktype = job.besttype;
+	*penalty = job.bestpenalty;
+	return TRUE;
+}
+
+/*
+ * 未評価のマスクパターンがなくなるまで取り出して評価する
+ * (スレッドプールのロックを取得した状態で呼び、評価中だけ解放する)
+ * 失点と参照子の組が最小のものを残すので、
+ * 評価の順序によらず逐次評価と同じパターンが選ばれる
+ */
+static void
+qrRunMaskJob(qr_maskjob_t *job)
+{
+	qr_word_t dark[QR_DIM_MAX * QR_PLW_MAX];
+	long bound, penalty;
+	int type;
+
+	while (job->next < QR_MPT_MAX) {
+		type = job->next++;
+		/*
+		 * これまでの最低点に届いたら評価を打ち切る
+		 * (参照子が小さいパターンは同点でも勝つので1点余裕をみる)
+		 */
+		if (job->besttype == -1) {
+			bound = -1L;
+		} else if (type < job->besttype) {
+			bound = job->bestpenalty + 1;
+		} else {
+			bound = job->bestpenalty;
+		}
+		job->running++;
+		pthread_mutex_unlock(&qr_maskpool.lock);
+
+		qrMaskPlane(dark, job->data, job->pskel, job->dim * job->pwords, type);
+		penalty = qrEvaluatePlane(dark, job->dim, job->pwords, bound);
+
+		pthread_mutex_lock(&qr_maskpool.lock);
+		job->running--;
+		if (job->besttype == -1 || penalty < job->bestpenalty
+			|| (penalty == job->bestpenalty && type < job->besttype))
+		{
+			job->besttype = type;
+			job->bestpenalty = penalty;
+		}
+	}
+	if (job->running == 0) {
+		pthread_cond_broadcast(&qr_maskpool.done);
+	}
+}
+
+/*
+ * スレッドプールのワーカー
+ * 新しい仕事が公開されるたびに評価に加わる
+ */
+static void *
+qrMaskWorker(void *arg)
+{
+	unsigned long seen = 0;
+
+	(void)arg;
+	pthread_mutex_lock(&qr_maskpool.lock);
+	while (!qr_maskpool.shutdown) {
+		if (qr_maskpool.job != NULL && qr_maskpool.generation != seen) {
+			seen = qr_maskpool.generation;
+			qrRunMaskJob(qr_maskpool.job);
+		} else {
+			pthread_cond_wait(&qr_maskpool.wake, &qr_maskpool.lock);
+		}
+	}
+	pthread_mutex_unlock(&qr_maskpool.lock);
+	return NULL;
 }
+#endif
 
 /*
  * 設定済みの参照子のマスクパターンでシンボルをマスクする
@@ -1926,280 +4177,370 @@ qrApplyMaskPattern(QRCode *qr)
 static int
 qrApplyMaskPattern2(QRCode *qr, int type)
 {
-
-	int i, j, dim;
+	const qr_word_t *pskel;
 
 	if (type < 0 || type >= QR_MPT_MAX) {
 		qrSetErrorInfo3(qr, QR_ERR_INVALID_MPT, "%d", type);
 		return FALSE;
 	}
 
-	dim = qr_vertable[qr->param.version].dimension;
-	/*
-	 * 以前のマスクパターンをクリアし、
-	 * 符号化済みデータを初期パターンとする
-	 */
-	for (i = 0; i < dim; i++) {
-		for (j = 0; j < dim; j++) {
-			/*
-			 * 機能パターン領域の印字黒モジュールは残す
-			 */
-			if (qrIsFunc(qr, i, j)) {
-				continue;
-			}
-			/*
-			 * 符号化データ領域は符号化データの
-			 * 黒モジュールを印字黒モジュールにする
-			 */
-			if (qrIsData(qr, i, j)) {
-				qr->symbol[i][j] |= QR_MM_BLACK;
-			} else {
-				qr->symbol[i][j] &= ~QR_MM_BLACK;
-			}
-		}
+	pskel = qrGetPlaneSkeleton(qr);
+	if (pskel == NULL) {
+		return FALSE;
 	}
 	/*
-	 * i行j列のモジュールについて...
+	 * 符号化データをマスクパターンで反転し、
+	 * 機能パターンの黒モジュールを重ねる
+	 * (マスクパターンは機能パターン領域を除いてあり、
+	 * 符号化データは機能パターン領域にはない)
 	 */
-	for (i = 0; i < dim; i++) {
-		for (j = 0; j < dim; j++) {
-			if (qrIsFunc(qr, i, j)) {
-				/*
-				 * 機能パターン領域(および形式情報、
-				 * 型番情報)はマスク対象から除外する
-				 */
-				continue;
-			}
-			/*
-			 * 指定された条件を満たすモジュールを反転する
-			 */
-			if ((type == 0 && (i + j) % 2 == 0) ||
-				(type == 1 && i % 2 == 0) ||
-				(type == 2 && j % 3 == 0) ||
-				(type == 3 && (i + j) % 3 == 0) ||
-				(type == 4 && ((i / 2) + (j / 3)) % 2 == 0) ||
-				(type == 5 && (i * j) % 2 + (i * j) % 3 == 0) ||
-				(type == 6 && ((i * j) % 2 + (i * j) % 3) % 2 == 0) ||
-				(type == 7 && ((i * j) % 3 + (i + j) % 2) % 2 == 0))
-			{
-				qr->symbol[i][j] ^= QR_MM_BLACK;
-			}
-		}
-	}
+	qrMaskPlane(qr->planes[QR_PLANE_DARK], qr->planes[QR_PLANE_DATA], pskel,
+		qr_vertable[qr->param.version].dimension * qr->pwords, type);
 
 	return TRUE;
 }
 
+/*
+ * n語の符号化データのビットプレーンdataを参照子typeの
+ * マスクパターンでマスクし、印字されるビットプレーンをdarkに書き込む
+ */
+static void
+qrMaskPlane(qr_word_t *dark, const qr_word_t *data, const qr_word_t *pskel, int n, int type)
+{
+	const qr_word_t *mask, *fdark;
+	int k;
+
+	mask = pskel + (size_t)n * (size_t)type;
+	fdark = pskel + (size_t)n * QR_PSK_DARK;
+	for (k = 0; k < n; k++) {
+		dark[k] = (data[k] ^ mask[k]) | fdark[k];
+	}
+}
+
 /*
  * マスクパターンを評価し評価値を返す
+ * ビットプレーンの行と、それを転置した列について
+ * 語単位のビット演算で評価する
+ * boundが-1でなければ、計算の軽い特徴から順に評価し、
+ * 評価値がbound以上になった時点で打ち切ってその値を返す
+ * (失点は加算されるだけなので、それ以上の評価は不要)
+ */
+static long
+qrEvaluateMaskPattern(QRCode *qr, long bound)
+{
+	return qrEvaluatePlane(qr->planes[QR_PLANE_DARK],
+		qr_vertable[qr->param.version].dimension, qr->pwords, bound);
+}
+
+/*
+ * dim×dimのビットプレーンrowsについてマスクパターンの評価値を求める
+ * (引数boundの意味はqrEvaluateMaskPattern()と同じ)
  */
 static long
-qrEvaluateMaskPattern(QRCode *qr)
+qrEvaluatePlane(const qr_word_t *rows, int dim, int pwords, long bound)
 {
-	int i, j, m, n, dim;
+	qr_word_t cols[QR_PLW_MAX * QR_PLW_BITS * QR_PLW_MAX];
+	qr_word_t valid[QR_PLW_MAX], edge[QR_PLW_MAX];
+	int i, k, n;
 	long penalty;
 
+#define qrPenaltyExceeds() (bound != -1L && penalty >= bound)
+
 	/*
 	 * 評価値をpenaltyに積算する
 	 * マスクは符号化領域に対してのみ行うが
 	 * 評価はシンボル全体について行われる
 	 */
 	penalty = 0L;
-	dim = qr_vertable[qr->param.version].dimension;
 	/*
-	 * 特徴: 同色の行/列の隣接モジュール
-	 * 評価条件: モジュール数 = (5＋i)
-	 * 失点: 3＋i
+	 * 各語のうちシンボル内にあるビット(valid)と、
+	 * 右隣のモジュールもシンボル内にあるビット(edge)
 	 */
-	for (i = 0; i < dim; i++) {
-		n = 0;
-		for (j = 0; j < dim; j++) {
-			if (j > 0 && qrIsBlack(qr, i, j) == qrIsBlack(qr, i, j-1)) {
-				/*
-				 * すぐ左と同色のモジュール
-				 * 同色列の長さを1増やす
-				 */
-				n++;
-			} else {
-				/*
-				 * 色が変わった
-				 * 直前で終わった同色列の長さを評価する
-				 */
-				if (n >= 5) {
-					penalty += (long)(3 + (n - 5));
-				}
-				n = 1;
-			}
-		}
-		/*
-		 * 列が尽きた
-		 * 直前で終わった同色列の長さを評価する
-		 */
-		if (n >= 5) {
-			penalty += (long)(3 + (n - 5));
-		}
+	for (k = 0; k < pwords; k++) {
+		valid[k] = qrPlaneMask(dim - k * QR_PLW_BITS);
+		edge[k] = qrPlaneMask(dim - 1 - k * QR_PLW_BITS);
 	}
-	for (i = 0; i < dim; i++) {
-		n = 0;
-		for (j = 0; j < dim; j++) {
-			if (j > 0 && qrIsBlack(qr, j, i) == qrIsBlack(qr, j-1, i)) {
-				/*
-				 * すぐ上と同色のモジュール
-				 * 同色列の長さを1増やす
-				 */
-				n++;
-			} else {
-				/*
-				 * 色が変わった
-				 * 直前で終わった同色列の長さを評価する
-				 */
-				if (n >= 5) {
-					penalty += (long)(3 + (n - 5));
-				}
-				n = 1;
-			}
-		}
-		/*
-		 * 列が尽きた
-		 * 直前で終わった同色列の長さを評価する
-		 */
-		if (n >= 5) {
-			penalty += (long)(3 + (n - 5));
-		}
+	/*
+	 * 特徴: 全体に対する暗モジュールの占める割合
+	 * 評価条件: 50±(5×k)%〜50±(5×(k＋1))%
+	 * 失点: 10×k
+	 */
+	n = 0;
+	for (k = 0; k < dim * pwords; k++) {
+		n += qrPopCount(rows[k]);
+	}
+	penalty += (long)(abs((n * 100 / (dim * dim)) - 50) / 5 * 10);
+	if (qrPenaltyExceeds()) {
+		return penalty;
 	}
 	/*
 	 * 特徴: 同色のモジュールブロック
 	 * 評価条件: ブロックサイズ = 2×2
 	 * 失点: 3
+	 * (上下の行が同色の位置(same)のうち、右隣も上下同色で、
+	 * かつ上の行で右隣と同色の位置を数える)
 	 */
-	for (i = 0; i < dim - 1; i++) {
-		for (j = 0; j < dim - 1; j++) {
-			if (qrIsBlack(qr, i, j) == qrIsBlack(qr, i, j+1) &&
-				qrIsBlack(qr, i, j) == qrIsBlack(qr, i+1, j) &&
-				qrIsBlack(qr, i, j) == qrIsBlack(qr, i+1, j+1))
-			{
-				/*
-				 * 2×2の同色のブロックがあった
-				 */
-				penalty += 3L;
-			}
+	for (i = 0; i < dim - 1; i++) {
+		const qr_word_t *r0 = &(rows[i * pwords]);
+		const qr_word_t *r1 = &(rows[(i + 1) * pwords]);
+		for (k = 0; k < pwords; k++) {
+			qr_word_t same, same1, horiz;
+			same = ~(r0[k] ^ r1[k]);
+			same1 = ~(qrShiftDown(r0, k, 1, pwords, 0) ^ qrShiftDown(r1, k, 1, pwords, 0));
+			horiz = ~(r0[k] ^ qrShiftDown(r0, k, 1, pwords, 0));
+			penalty += 3L * qrPopCount(same & same1 & horiz & edge[k]);
 		}
 	}
+	if (qrPenaltyExceeds()) {
+		return penalty;
+	}
 	/*
+	 * 特徴: 同色の行/列の隣接モジュール
+	 * 評価条件: モジュール数 = (5＋i)
+	 * 失点: 3＋i
 	 * 特徴: 行/列における1:1:3:1:1比率(暗:明:暗:明:暗)のパターン
 	 * に続いて比率4の幅以上の明パターン
 	 * 失点: 40
-	 * 前後はシンボル境界外か明モジュールである必要がある
-	 * 2:2:6:2:2のようなパターンにも失点を与えるべきかは
-	 * JIS規格からは読み取れない。ここでは与えていない
+	 * まず行について評価する
 	 */
 	for (i = 0; i < dim; i++) {
-		for (j = 0; j < dim - 6; j++) {
-			if ((j == 0 || !qrIsBlack(qr, i, j-1)) &&
-				qrIsBlack(qr, i, j+0) &&
-				!qrIsBlack(qr, i, j+1) &&
-				qrIsBlack(qr, i, j+2) &&
-				qrIsBlack(qr, i, j+3) &&
-				qrIsBlack(qr, i, j+4) &&
-				!qrIsBlack(qr, i, j+5) &&
-				qrIsBlack(qr, i, j+6))
-			{
-				int k, l;
-				l = 1;
-				for (k = 0; k < dim - j - 7 && k < 4; k++) {
-					if (qrIsBlack(qr, i, j + k + 7)) {
-						l = 0;
-						break;
-					}
-				}
-				/*
-				 * パターンがあった
-				 */
-				if (l) {
-					penalty += 40L;
-				}
-			}
+		penalty += qrEvaluateLine(&(rows[i * pwords]), valid, edge, dim, pwords);
+		if (qrPenaltyExceeds()) {
+			return penalty;
 		}
 	}
+	/*
+	 * 列を行として扱えるように転置し、列について評価する
+	 */
+	qrTransposePlane(rows, cols, dim, pwords);
 	for (i = 0; i < dim; i++) {
-		for (j = 0; j < dim - 6; j++) {
-			if ((j == 0 || !qrIsBlack(qr, j-1, i)) &&
-				qrIsBlack(qr, j+0, i) &&
-				!qrIsBlack(qr, j+1, i) &&
-				qrIsBlack(qr, j+2, i) &&
-				qrIsBlack(qr, j+3, i) &&
-				qrIsBlack(qr, j+4, i) &&
-				!qrIsBlack(qr, j+5, i) &&
-				qrIsBlack(qr, j+6, i) &&
-				(j == dim-7 || !qrIsBlack(qr, j+7, i)))
-			{
-				int k, l;
-				l = 1;
-				for (k = 0; k < dim - j - 7 && k < 4; k++) {
-					if (qrIsBlack(qr, j + k + 7, i)) {
-						l = 0;
-						break;
-					}
-				}
-				/*
-				 * パターンがあった
-				 */
-				if (l) {
-					penalty += 40L;
-				}
-			}
+		penalty += qrEvaluateLine(&(cols[i * pwords]), valid, edge, dim, pwords);
+		if (qrPenaltyExceeds()) {
+			return penalty;
 		}
 	}
+
+#undef qrPenaltyExceeds
+
+	return penalty;
+}
+
+/*
+ * QR_MPT_FAST_STEPごとの行/列だけを評価して
+ * マスクパターンの失点を推定する
+ * (暗モジュールの割合はシンボル全体について求める)
+ */
+static long
+qrEstimateMaskPattern(QRCode *qr)
+{
+	qr_word_t cols[QR_PLW_MAX * QR_PLW_BITS * QR_PLW_MAX];
+	qr_word_t valid[QR_PLW_MAX], edge[QR_PLW_MAX];
+	const qr_word_t *rows;
+	int i, k, n, dim, pwords, sampled;
+	long penalty, lines;
+
+	dim = qr_vertable[qr->param.version].dimension;
+	pwords = qr->pwords;
+	rows = qr->planes[QR_PLANE_DARK];
+	for (k = 0; k < pwords; k++) {
+		valid[k] = qrPlaneMask(dim - k * QR_PLW_BITS);
+		edge[k] = qrPlaneMask(dim - 1 - k * QR_PLW_BITS);
+	}
 	/*
-	 * 特徴: 全体に対する暗モジュールの占める割合
-	 * 評価条件: 50±(5×k)%〜50±(5×(k＋1))%
-	 * 失点: 10×k
+	 * 暗モジュールの割合
 	 */
-	m = 0;
 	n = 0;
-	for (i = 0; i < dim; i++) {
-		for (j = 0; j < dim; j++) {
-			m++;
-			if (qrIsBlack(qr, i, j)) {
-				n++;
+	for (k = 0; k < dim * pwords; k++) {
+		n += qrPopCount(rows[k]);
+	}
+	penalty = (long)(abs((n * 100 / (dim * dim)) - 50) / 5 * 10);
+	/*
+	 * 同色のモジュールブロック、同色の隣接モジュール、
+	 * 1:1:3:1:1比率のパターンを間引いた行/列について評価する
+	 */
+	qrTransposePlane(rows, cols, dim, pwords);
+	lines = 0L;
+	sampled = 0;
+	for (i = 0; i < dim; i += QR_MPT_FAST_STEP) {
+		lines += qrEvaluateLine(&(rows[i * pwords]), valid, edge, dim, pwords);
+		lines += qrEvaluateLine(&(cols[i * pwords]), valid, edge, dim, pwords);
+		if (i < dim - 1) {
+			const qr_word_t *r0 = &(rows[i * pwords]);
+			const qr_word_t *r1 = &(rows[(i + 1) * pwords]);
+			for (k = 0; k < pwords; k++) {
+				qr_word_t same, same1, horiz;
+				same = ~(r0[k] ^ r1[k]);
+				same1 = ~(qrShiftDown(r0, k, 1, pwords, 0) ^ qrShiftDown(r1, k, 1, pwords, 0));
+				horiz = ~(r0[k] ^ qrShiftDown(r0, k, 1, pwords, 0));
+				lines += 3L * qrPopCount(same & same1 & horiz & edge[k]);
+			}
+		}
+		sampled++;
+	}
+	/*
+	 * 評価した行/列の数からシンボル全体の失点に換算する
+	 */
+	return penalty + lines * dim / sampled;
+}
+
+/*
+ * 1行(または転置した1列)について、同色の隣接モジュールと
+ * 1:1:3:1:1比率のパターンを評価し評価値を返す
+ */
+static long
+qrEvaluateLine(const qr_word_t *line, const qr_word_t *valid, const qr_word_t *edge, int dim, int pwords)
+{
+	qr_word_t light[QR_PLW_MAX];
+	qr_word_t t, found;
+	int k, pos, start;
+	long penalty = 0L;
+
+	/*
+	 * 右隣と色が変わる位置を調べ、
+	 * そこで終わる同色列の長さを評価する
+	 */
+	start = 0;
+	for (k = 0; k < pwords; k++) {
+		t = (line[k] ^ qrShiftDown(line, k, 1, pwords, 0)) & edge[k];
+		while (t != 0) {
+			pos = k * QR_PLW_BITS + qrCountTrailingZeros(t);
+			if (pos - start + 1 >= 5) {
+				penalty += (long)(3 + (pos - start + 1 - 5));
 			}
+			start = pos + 1;
+			t &= t - 1;
 		}
 	}
-	penalty += (long)(abs((n * 100 / m) - 50) / 5 * 10);
+	/*
+	 * 列が尽きた
+	 * 直前で終わった同色列の長さを評価する
+	 */
+	if (dim - start >= 5) {
+		penalty += (long)(3 + (dim - start - 5));
+	}
+
+	/*
+	 * 暗:明:暗:暗:暗:明:暗のパターンの開始位置のうち、
+	 * 直前が明モジュールかシンボル境界で、
+	 * 直後の4モジュールがシンボル境界まで明モジュールのものを数える
+	 * (シンボル外は明モジュールとみなす)
+	 */
+	for (k = 0; k < pwords; k++) {
+		light[k] = ~line[k];
+	}
+	for (k = 0; k < pwords; k++) {
+		found = line[k]
+			& qrShiftDown(light, k, 1, pwords, ~(qr_word_t)0)
+			& qrShiftDown(line, k, 2, pwords, 0)
+			& qrShiftDown(line, k, 3, pwords, 0)
+			& qrShiftDown(line, k, 4, pwords, 0)
+			& qrShiftDown(light, k, 5, pwords, ~(qr_word_t)0)
+			& qrShiftDown(line, k, 6, pwords, 0)
+			& qrShiftDown(light, k, 7, pwords, ~(qr_word_t)0)
+			& qrShiftDown(light, k, 8, pwords, ~(qr_word_t)0)
+			& qrShiftDown(light, k, 9, pwords, ~(qr_word_t)0)
+			& qrShiftDown(light, k, 10, pwords, ~(qr_word_t)0)
+			& ((light[k] << 1) | (k > 0 ? light[k-1] >> (QR_PLW_BITS - 1) : 1))
+			& valid[k];
+		penalty += 40L * qrPopCount(found);
+	}
+
 	return penalty;
 }
 
+/*
+ * dim×dimのビットプレーンsrcを転置してdstに書き込む
+ * (64×64ビットのブロックごとに転置する)
+ */
+static void
+qrTransposePlane(const qr_word_t *src, qr_word_t *dst, int dim, int pwords)
+{
+	qr_word_t block[QR_PLW_BITS], t, m;
+	int bi, bj, i, j, k;
+
+	for (bi = 0; bi < pwords; bi++) {
+		for (bj = 0; bj < pwords; bj++) {
+			/*
+			 * bi番めの64行のbj語めを取り出す
+			 */
+			for (i = 0; i < QR_PLW_BITS; i++) {
+				k = bi * QR_PLW_BITS + i;
+				block[i] = (k < dim) ? src[k * pwords + bj] : 0;
+			}
+			/*
+			 * 32×32, 16×16, ... 1×1の対角外ブロックを順に入れ換える
+			 */
+			m = 0x00000000ffffffffULL;
+			for (j = 32; j != 0; j >>= 1, m ^= m << j) {
+				for (k = 0; k < QR_PLW_BITS; k = ((k | j) + 1) & ~j) {
+					t = ((block[k] >> j) ^ block[k | j]) & m;
+					block[k] ^= t << j;
+					block[k | j] ^= t;
+				}
+			}
+			/*
+			 * bj番めの64列のbi語めとして書き込む
+			 */
+			for (i = 0; i < QR_PLW_BITS; i++) {
+				k = bj * QR_PLW_BITS + i;
+				if (k < dim) {
+					dst[k * pwords + bi] = block[i];
+				}
+			}
+		}
+	}
+}
+
+/*
+ * 64ビット語の1のビットを数える
+ */
+static int
+qrPopCount(qr_word_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	return (int)__popcnt64(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/*
+ * 64ビット語の最下位の1のビットの位置を返す(xはゼロでないこと)
+ */
+static int
+qrCountTrailingZeros(qr_word_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	unsigned long n;
+	_BitScanForward64(&n, x);
+	return (int)n;
+#else
+	return qrPopCount((x & (~x + 1)) - 1);
+#endif
+}
+
 /*
  * シンボルに形式情報と型番情報を配置する
  */
 static int
 qrFillFormatInfo(QRCode *qr)
 {
-	int i, j, dim, fmt, modulo, xpos, ypos;
+	int i, j, dim, fmt, xpos, ypos;
 	long v;
 
 	dim = qr_vertable[qr->param.version].dimension;
 	/*
-	 * 形式情報を計算する
-	 * 誤り訂正レベル2ビット(L:01, M:00, Q:11, H:10)と
-	 * マスクパターン参照子3ビットからなる計5ビットに
-	 * Bose-Chaudhuri-Hocquenghem(15,5)符号による
-	 * 誤り訂正ビット10ビットを付加して15ビットとする
-	 * (5ビットをxの次数14〜10の多項式係数とみなして
-	 * 多項式x^10+x^8+x^5+x^4+x^2+x+1(係数10100110111)
-	 * で除算した剰余10ビットを誤り訂正ビットとする)
-	 * さらにすべてのビットがゼロにならないように
-	 * 101010000010010(0x5412)とXORをとる
-	 */
-	fmt = ((qr->param.eclevel ^ 1) << 3) | qr->param.masktype;
-	modulo = fmt << 10;
-	for (i = 14; i >= 10; i--) {
-		if ((modulo & (1 << i)) == 0) {
-			continue;
-		}
-		modulo ^= 0x537 << (i - 10);
-	}
-	fmt = ((fmt << 10) + modulo) ^ 0x5412;
+	 * 形式情報を求める
+	 * (BCH符号による誤り訂正ビットを付加したものを表で持つ)
+	 */
+	fmt = qr_fmtinfo[qr->param.eclevel][qr->param.masktype];
 	/*
 	 * 形式情報をシンボルに配置する
 	 */
@@ -2210,12 +4551,12 @@ qrFillFormatInfo(QRCode *qr)
 			}
 			xpos = (qr_fmtinfopos[i][j].xpos + dim) % dim;
 			ypos = (qr_fmtinfopos[i][j].ypos + dim) % dim;
-			qr->symbol[ypos][xpos] |= QR_MM_BLACK;
+			qrPlaneSet(qr, QR_PLANE_DARK, ypos, xpos);
 		}
 	}
 	xpos = (qr_fmtblackpos.xpos + dim) % dim;
 	ypos = (qr_fmtblackpos.ypos + dim) % dim;
-	qr->symbol[ypos][xpos] |= QR_MM_BLACK;
+	qrPlaneSet(qr, QR_PLANE_DARK, ypos, xpos);
 	/*
 	 * 型番情報が有効(型番7以上)なら
 	 * 型番情報をシンボルに配置する
@@ -2229,7 +4570,32 @@ qrFillFormatInfo(QRCode *qr)
 				}
 				xpos = (qr_verinfopos[i][j].xpos + dim) % dim;
 				ypos = (qr_verinfopos[i][j].ypos + dim) % dim;
-				qr->symbol[ypos][xpos] |= QR_MM_BLACK;
+				qrPlaneSet(qr, QR_PLANE_DARK, ypos, xpos);
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * ビットプレーンの値をシンボルの各モジュールに書き戻す
+ */
+static int
+qrUnpackSymbol(QRCode *qr)
+{
+	int i, j, dim;
+
+	dim = qr_vertable[qr->param.version].dimension;
+	for (i = 0; i < dim; i++) {
+		for (j = 0; j < dim; j++) {
+			if (qrPlaneBit(qr, QR_PLANE_DATA, i, j)) {
+				qr->symbol[i][j] |= QR_MM_DATA;
+			}
+			if (qrPlaneBit(qr, QR_PLANE_DARK, i, j)) {
+				qr->symbol[i][j] |= QR_MM_BLACK;
+			} else {
+				qr->symbol[i][j] &= ~QR_MM_BLACK;
 			}
 		}
 	}
@@ -2245,7 +4611,7 @@ qrFillFormatInfo(QRCode *qr)
 QR_API int
 qrFinalize(QRCode *qr)
 {
-	static qr_funcs funcs[] = {
+	static const qr_funcs funcs[] = {
 		qrFinalizeDataWord,
 		qrComputeECWord,
 		qrMakeCodeWord,
@@ -2253,10 +4619,12 @@ qrFinalize(QRCode *qr)
 		qrFillCodeWord,
 		qrSelectMaskPattern,
 		qrFillFormatInfo,
+		qrUnpackSymbol,
 		NULL
 	};
 	int i = 0;
 	int ret = TRUE;
+	int autover;
 
 	if (qrIsFinalized(qr)) {
 		return TRUE;
@@ -2265,7 +4633,8 @@ qrFinalize(QRCode *qr)
 	/*
 	 * 型番自動選択
 	 */
-	if (qr->param.version == -1) {
+	autover = (qr->param.version == -1);
+	if (autover) {
 		int maxlen, delta;
 		int version = 0;
 		while (++version <= QR_VER_MAX) {
@@ -2292,27 +4661,94 @@ qrFinalize(QRCode *qr)
 	}
 
 	/*
-	 * データコード語に入力データを登録する
+	 * 決定した型番の大きさのコード語領域を用意する
+	 */
+	if (!qrAllocWords(qr)) {
+		return FALSE;
+	}
+
+	/*
+	 * 最大の型番の文字数指示子で直接エンコードしたデータコード語を
+	 * 決定した型番に合わせて詰め直す
+	 */
+	if (autover && qrHasData(qr)) {
+		qrRepackDataWord(qr);
+	}
+
+	/*
+	 * バッファに保存した入力データを続けてデータコード語に登録する
 	 */
-	if (qr->source != NULL) {
+	if (qr->source != NULL && qr->srclen > 0) {
 		qr_byte_t *source;
 		int mode, size;
 
-		qrInitDataWord(qr);
 		source = qr->source;
 		while ((mode = (int)(*source++)) != '\0') {
+			qr_iovec_t one, *iov;
+			int nfrag, done;
 			mode ^= 0x80;
 			size = ((int)*source++) << 24;
 			size |= ((int)*source++) << 16;
 			size |= ((int)*source++) << 8;
 			size |= (int)*source++;
-			if (qrEncodeDataWord(qr, source, size, mode) == FALSE) {
+			/*
+			 * 借用したデータはバッファに保存した断片の一覧から読む
+			 */
+			iov = &one;
+			nfrag = 1;
+			if (mode & QR_SRC_BORROWED) {
+				mode ^= QR_SRC_BORROWED;
+				nfrag = ((int)*source++) << 24;
+				nfrag |= ((int)*source++) << 16;
+				nfrag |= ((int)*source++) << 8;
+				nfrag |= (int)*source++;
+				if (nfrag > 1) {
+					iov = (qr_iovec_t *)qrMalloc(qr, sizeof(qr_iovec_t) * (size_t)nfrag);
+					if (iov == NULL) {
+						qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
+						return FALSE;
+					}
+				}
+				memcpy(iov, source, sizeof(qr_iovec_t) * (size_t)nfrag);
+				source += sizeof(qr_iovec_t) * (size_t)nfrag;
+			} else {
+				one.iov_base = source;
+				one.iov_len = (size_t)size;
+				source += size;
+			}
+			if (mode == QR_EM_SEGMENTS) {
+				/*
+				 * 決定した型番の文字数指示子で分割し直して符号化する
+				 */
+				qr_byte_t *classes;
+				classes = (qr_byte_t *)qrMalloc(qr, (size_t)size * 2);
+				if (classes == NULL) {
+					qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
+					done = FALSE;
+				} else {
+					qrClassifyDataV(iov, nfrag, size, classes, NULL);
+					done = qrSegmentData(qr, classes, size, qr->param.version, &(classes[size]));
+					if (done != -1) {
+						done = qrEncodeSegments(qr, iov, nfrag, size, &(classes[size]));
+					}
+					qrRelease(qr, classes);
+				}
+			} else {
+				done = qrEncodeDataWordV(qr, iov, nfrag, 0, size, mode);
+			}
+			if (iov != &one) {
+				qrRelease(qr, iov);
+			}
+			if (done != TRUE) {
 				return FALSE;
 			}
-			source += size;
 		}
 
-		qrFree(qr->source);
+		if (qr->retain) {
+			qr->srclen = 0;
+		} else {
+			qrFree(qr, qr->source);
+		}
 	}
 
 	/*
@@ -2323,14 +4759,112 @@ qrFinalize(QRCode *qr)
 	}
 
 	if (ret == TRUE) {
-		qrFree(qr->dataword);
-		qrFree(qr->ecword);
-		qrFree(qr->codeword);
+		if (!qr->retain) {
+			qrFreeWords(qr);
+		}
 		qr->state = QR_STATE_FINAL;
 	}
 	return ret;
 }
 
+/*
+ * マスクパターン選択の結果を返す
+ * (ファイナライズ前はNULL)
+ */
+QR_API const qr_maskinfo_t *
+qrGetMaskInfo(const QRCode *qr)
+{
+	if (qr->state != QR_STATE_FINAL) {
+		return NULL;
+	}
+	return &(qr->maskinfo);
+}
+
+/*
+ * マスクパターンを並列に評価するスレッドプールを設定する
+ * threadsはワーカースレッド数(0〜QR_MPT_MAX-1, 0で無効)、
+ * minversionは並列評価する型番の下限(0で既定値)
+ * QR_MPT_AUTOなどで全パターンを評価するとき、型番がminversion以上なら
+ * 呼び出し元とワーカーで分担して評価する(プロセス全体で共有される)
+ * スレッドが使えないか、スレッドを起動できなければFALSEを返す
+ */
+QR_API int
+qrSetMaskThreads(int threads, int minversion)
+{
+#ifdef HAVE_PTHREAD
+	pthread_t stopped[QR_MPT_THREADS_MAX];
+	int i, n, ok;
+
+	if (threads < 0 || threads > QR_MPT_THREADS_MAX
+		|| minversion < 0 || minversion > QR_VER_MAX)
+	{
+		return FALSE;
+	}
+	if (minversion == 0) {
+		minversion = QR_MPT_THREADS_MINVER;
+	}
+
+	pthread_mutex_lock(&qr_maskpool.config);
+	/*
+	 * 既存のワーカーを停止させる
+	 * (評価中のワーカーは担当中のパターンを評価し終えてから終了する)
+	 */
+	pthread_mutex_lock(&qr_maskpool.lock);
+	n = qr_maskpool.nthreads;
+	memcpy(stopped, qr_maskpool.threads, sizeof(pthread_t) * (size_t)n);
+	qr_maskpool.nthreads = 0;
+	qr_maskpool.shutdown = 1;
+	pthread_cond_broadcast(&qr_maskpool.wake);
+	pthread_mutex_unlock(&qr_maskpool.lock);
+	for (i = 0; i < n; i++) {
+		pthread_join(stopped[i], NULL);
+	}
+	/*
+	 * 新しいワーカーを起動する
+	 */
+	pthread_mutex_lock(&qr_maskpool.lock);
+	qr_maskpool.shutdown = 0;
+	qr_maskpool.minversion = minversion;
+	ok = TRUE;
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&(qr_maskpool.threads[i]), NULL, qrMaskWorker, NULL) != 0) {
+			ok = FALSE;
+			break;
+		}
+	}
+	qr_maskpool.nthreads = i;
+	pthread_mutex_unlock(&qr_maskpool.lock);
+	pthread_mutex_unlock(&qr_maskpool.config);
+
+	return ok;
+#else
+	(void)minversion;
+	return (threads == 0) ? TRUE : FALSE;
+#endif
+}
+
+/*
+ * プロセス全体で共有している領域を開放する
+ * マスク評価のスレッドを停止し、型番ごとの表を開放する
+ * 他のスレッドがライブラリを使っておらず、QRコードオブジェクトが
+ * ひとつも残っていないときに呼ぶ(以後に使えば表は作り直される)
+ */
+QR_API void
+qrCleanup(void)
+{
+	int i;
+
+	(void)qrSetMaskThreads(0, 0);
+	for (i = 0; i <= QR_VER_MAX; i++) {
+		free(qr_placemaps[i]);
+		qr_placemaps[i] = NULL;
+		free(qr_skeletons[i]);
+		qr_skeletons[i] = NULL;
+		free(qr_planeskels[i]);
+		qr_planeskels[i] = NULL;
+	}
+}
+
 /*
  * Finalze済か判定する
  */
@@ -2343,6 +4877,65 @@ qrIsFinalized(const QRCode *qr)
 	return FALSE;
 }
 
+/*
+ * ファイナライズ済みのシンボルを1モジュール1ビットに詰めて保持し、
+ * シンボルの生成に使った他の領域をすべて開放する
+ * (以後も出力はできるが、シンボルの各行やビットプレーンは参照できない。
+ *  多数のシンボルを長時間保持するときに使う)
+ */
+QR_API int
+qrCompact(QRCode *qr)
+{
+	qr_byte_t *packed;
+	const qr_word_t *row;
+	size_t n;
+	int i, j, dim;
+
+	if (qr->state != QR_STATE_FINAL) {
+		qrSetErrorInfo(qr, QR_ERR_STATE, _QR_FUNCTION);
+		return FALSE;
+	}
+	/*
+	 * 作業領域のオブジェクトは開放しても作業領域の大きさは変わらない
+	 */
+	if (qr->packed != NULL || qr->workspace != NULL) {
+		return TRUE;
+	}
+
+	packed = (qr_byte_t *)qrAllocZero(&(qr->allocator), qrPackedSize(qr));
+	if (packed == NULL) {
+		qrSetErrorInfo2(qr, QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
+		return FALSE;
+	}
+	dim = qr_vertable[qr->param.version].dimension;
+	n = 0;
+	for (i = 0; i < dim; i++) {
+		row = qrPlaneRow(qr, QR_PLANE_DARK, i);
+		for (j = 0; j < dim; j++, n++) {
+			if ((row[j / QR_PLW_BITS] >> (j % QR_PLW_BITS)) & 1) {
+				packed[n >> 3] |= (qr_byte_t)(1 << (n & 7));
+			}
+		}
+	}
+
+	qrFree(qr, qr->source);
+	qr->srcmax = 0;
+	qr->srclen = 0;
+	qrFreeWords(qr);
+	qrUnshareSymbol(qr);
+	qrFree(qr, qr->symbol);
+	qrFree(qr, qr->_symbol);
+	qrFree(qr, qr->_planes);
+	for (i = 0; i < QR_PLANE_COUNT; i++) {
+		qr->planes[i] = NULL;
+	}
+	qr->bufdim = 0;
+	qrFree(qr, qr->errinfo);
+	qr->packed = packed;
+
+	return TRUE;
+}
+
 /*
  * データをセット済か判定する
  */
@@ -2459,6 +5052,72 @@ qrGetSymbol(QRCode *qr, int fmt, int sep, int mag, int *size)
 	return buf;
 }
 
+/*
+ * 生成されたQRコードシンボルを呼び出し元の領域 buf に書き込む
+ * 作業領域を使うオブジェクトでは、変換に使う領域を作業領域の空きと
+ * bufから割り当て、ヒープを使わない(作業用の領域は変換後に巻き戻す)
+ * bufが足りなければQR_ERR_OUTPUT_TOO_SMALLとなり、変換後の大きさが
+ * わかっていればそれをsizeに格納する
+ */
+QR_API int
+qrGetSymbol2(QRCode *qr, int fmt, int sep, int mag, qr_byte_t *buf, int bufsize, int *size)
+{
+	QRWorkspace *ws = qr->workspace;
+	qr_byte_t *sbuf;
+	size_t used = 0;
+	int _size = -1;
+	int ret = TRUE;
+
+	if (buf == NULL || bufsize <= 0) {
+		qrSetErrorInfo(qr, QR_ERR_INVALID_ARG, _QR_FUNCTION);
+		return FALSE;
+	}
+
+	if (ws != NULL) {
+		used = ws->used;
+		ws->out = buf;
+		ws->outsize = (size_t)bufsize;
+		ws->outused = 0;
+	}
+
+	sbuf = qrGetSymbol(qr, fmt, sep, mag, &_size);
+	if (sbuf == NULL) {
+		ret = FALSE;
+	} else if (_size > bufsize) {
+		qrSetErrorInfo3(qr, QR_ERR_OUTPUT_TOO_SMALL, ", %d bytes required (%d bytes given)",
+				_size, bufsize);
+		ret = FALSE;
+	} else if (sbuf != buf) {
+		memcpy(buf, sbuf, (size_t)_size);
+	}
+
+	if (ws != NULL) {
+		ws->used = used;
+		ws->out = NULL;
+		ws->outsize = 0;
+		ws->outused = 0;
+	} else {
+		qrFreeSymbol(qr, sbuf);
+	}
+
+	if (size) {
+		*size = _size;
+	}
+	return ret;
+}
+
+/*
+ * qrGetSymbol()などが返した領域を開放する
+ * (QRCodeオブジェクトのアロケータで確保されている)
+ */
+QR_API void
+qrFreeSymbol(QRCode *qr, qr_byte_t *symbol)
+{
+	if (symbol != NULL) {
+		qrRelease(qr, symbol);
+	}
+}
+
 /*
  * 生成されたQRコードシンボルをストリーム fp に書き込む
  */
@@ -2479,16 +5138,16 @@ qrOutputSymbol(QRCode *qr, FILE *fp, int fmt, int sep, int mag)
 
 	if (!fwrite(buf, (size_t)size, 1, fp)) {
 		qrSetErrorInfo2(qr, QR_ERR_FWRITE, NULL);
-		free(buf);
+		qrRelease(qr, buf);
 		return -1;
 	}
 	if (ferror(fp)) {
 		qrSetErrorInfo(qr, QR_ERR_FWRITE, NULL);
-		free(buf);
+		qrRelease(qr, buf);
 		return -1;
 	}
 
-	free(buf);
+	qrRelease(qr, buf);
 
 	return size;
 }
@@ -2528,7 +5187,7 @@ qrsGetSymbols(QRStructured *st, int fmt, int sep, int mag, int order, int *size)
 	qr_byte_t *buf;
 	int _size;
 
-	static QRsConverter cnv[QR_FMT_COUNT] = {
+	static const QRsConverter cnv[QR_FMT_COUNT] = {
 		qrsSymbolsToPNG,
 		qrsSymbolsToBMP,
 		qrsSymbolsToTIFF,
@@ -2556,6 +5215,18 @@ qrsGetSymbols(QRStructured *st, int fmt, int sep, int mag, int order, int *size)
 	return buf;
 }
 
+/*
+ * qrsGetSymbols()などが返した領域を開放する
+ * (QRStructuredオブジェクトのアロケータで確保されている)
+ */
+QR_API void
+qrsFreeSymbols(QRStructured *st, qr_byte_t *symbols)
+{
+	if (symbols != NULL) {
+		qrRelease(st, symbols);
+	}
+}
+
 /*
  * 生成されたQRコードシンボルすべてをストリーム fp に書き込む
  */
@@ -2577,16 +5248,16 @@ qrsOutputSymbols(QRStructured *st, FILE *fp, int fmt, int sep, int mag, int orde
 
 	if (!fwrite(buf, (size_t)size, 1, fp)) {
 		qrSetErrorInfo2(st->cur, QR_ERR_FWRITE, NULL);
-		free(buf);
+		qrRelease(st, buf);
 		return -1;
 	}
 	if (ferror(fp)) {
 		qrSetErrorInfo(st->cur, QR_ERR_FWRITE, NULL);
-		free(buf);
+		qrRelease(st, buf);
 		return -1;
 	}
 
-	free(buf);
+	qrRelease(st, buf);
 
 	return size;
 }
@@ -18,6 +18,7 @@ extern "C" {
 #endif
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #if defined(WIN32) && !defined(QR_STATIC_BUILD)
@@ -33,7 +34,7 @@ extern "C" {
 /*
  * ライブラリのバージョン
  */
-#define LIBQR_VERSION "0.3.1"
+#define LIBQR_VERSION "0.4.0"
 
 /*
  * エラーコード
@@ -82,7 +83,15 @@ typedef enum {
 	QR_ERR_IMAGEFRAME       = 0x35,
 
 	/* zlib用エラーコード */
-	QR_ERR_DEFLATE = 0x40
+	QR_ERR_DEFLATE = 0x40,
+
+	/* 作業領域用エラーコード */
+	QR_ERR_WORKSPACE_EXHAUSTED = 0x50,
+	QR_ERR_OUTPUT_TOO_SMALL    = 0x51,
+
+	/* 非同期処理用エラーコード */
+	QR_ERR_QUEUE_FULL = 0x60,
+	QR_ERR_CANCELED   = 0x61
 } qr_err_t;
 
 /*
@@ -119,6 +128,12 @@ typedef enum {
 /* レベル総数 */
 #define QR_ECL_COUNT 4
 
+/*
+ * マスクパターンの選択方針(参照子0〜7のかわりに指定する)
+ */
+#define QR_MPT_AUTO  -1  /* すべてのパターンを評価して最適なものを選ぶ */
+#define QR_MPT_FAST  -2  /* 一部の行/列の評価から推定して選ぶ(最適とは限らない) */
+
 /*
  * 出力形式
  */
@@ -144,6 +159,17 @@ typedef enum {
 #define QR_MM_BLACK     0x02  /* 印字される黒モジュール */
 #define QR_MM_FUNC      0x04  /* 機能パターン領域(形式/型番情報を含む) */
 
+/*
+ * ビットプレーンの種類
+ * (各行をQR_PLW_BITSモジュールずつの語に詰め、左端のモジュールを最下位ビットとする)
+ */
+#define QR_PLANE_DARK   0  /* 印字される黒モジュール */
+#define QR_PLANE_DATA   1  /* 符号化データの黒モジュール */
+#define QR_PLANE_FUNC   2  /* 機能パターン領域(形式/型番情報を含む) */
+
+/* ビットプレーン総数 */
+#define QR_PLANE_COUNT  3
+
 /*
  * 機能パターンの定数
  */
@@ -173,6 +199,8 @@ typedef enum {
 #define QR_ERR_MAX  1024  /* エラー情報の最大長 */
 #define QR_STA_MAX    16  /* 構造的連接(分割/連結)の最大数 */
 #define QR_STA_LEN    20  /* 構造的連接ヘッダのビット数 */
+#define QR_PLW_BITS   64  /* ビットプレーンの1語のビット数 */
+#define QR_PLW_MAX     3  /* ビットプレーン1行あたりの語数の最大値(型番40) */
 
 /*
  * その他の定数
@@ -188,6 +216,11 @@ typedef enum {
  */
 typedef unsigned char qr_byte_t;
 
+/*
+ * ビットプレーンの語の型
+ */
+typedef uint64_t qr_word_t;
+
 /*
  * RSブロックごとの情報
  */
@@ -237,15 +270,72 @@ typedef struct qr_param_t {
   int masktype;             /* マスクパターン種別 */
 } qr_param_t;
 
+/*
+ * メモリアロケータ
+ * ctxは各関数の第1引数として渡される
+ */
+typedef struct qr_allocator_t {
+  void *(*alloc)(void *ctx, size_t size);              /* 確保(malloc相当) */
+  void *(*resize)(void *ctx, void *ptr, size_t size);  /* 再確保(realloc相当) */
+  void (*release)(void *ctx, void *ptr);               /* 開放(free相当) */
+  void *ctx;                                           /* 任意のコンテキスト */
+} qr_allocator_t;
+
+/*
+ * 断片に分かれた入力データの1つ(qrAddDataV(), qrAddDataRefV()で使う)
+ * POSIXのstruct iovecと同じ並びなので、そのままキャストして渡せる
+ */
+typedef struct qr_iovec_t {
+  const void *iov_base;     /* 断片の先頭アドレス */
+  size_t iov_len;           /* 断片のバイト数 */
+} qr_iovec_t;
+
+/*
+ * 一括生成の項目(qrEncodeBatch()で使う)
+ * source、size、paramを設定して渡すと、symbol、symsize、errcodeが格納される
+ */
+typedef struct qr_batch_t {
+  const qr_byte_t *source;  /* 入力データ */
+  int size;                 /* 入力データのサイズ */
+  qr_param_t param;         /* 型番、符号化モード、誤り訂正レベル、マスクパターン種別 */
+  qr_byte_t *symbol;        /* 生成したシンボル(qrFreeBatch()で開放する) */
+  int symsize;              /* シンボルのサイズ */
+  int errcode;              /* エラー番号(成功すればQR_ERR_NONE) */
+} qr_batch_t;
+
+/*
+ * 一括生成のオプション
+ */
+typedef struct qr_batchopt_t {
+  int threads;              /* スレッド数(0: オンラインのCPU数) */
+  const int *cpus;          /* スレッドを固定するCPU番号の配列(NULL: 固定しない) */
+  int ncpus;                /* cpusの要素数 */
+} qr_batchopt_t;
+
+/*
+ * マスクパターン選択の結果
+ */
+typedef struct qr_maskinfo_t {
+  int policy;               /* 選択方針(QR_MPT_AUTO, QR_MPT_FAST, 0〜7) */
+  int masktype;             /* 選ばれたマスクパターン参照子 */
+  int fallback;             /* 推定が外れて全パターンを評価し直したか */
+  long estimated;           /* 選ばれたパターンの推定失点(-1: 推定していない) */
+  long penalty;             /* 選ばれたパターンの失点(-1: 評価していない) */
+} qr_maskinfo_t;
+
 /*
  * QRコードオブジェクト
  */
 typedef struct qrcode_t {
   qr_byte_t *dataword;      /* データコード語領域のアドレス */
-  qr_byte_t *ecword;        /* 誤り訂正コード語領域のアドレス */
-  qr_byte_t *codeword;      /* シンボル配置用コード語領域のアドレス */
+  qr_byte_t *ecword;        /* 誤り訂正コード語領域のアドレス(datawordの領域内) */
+  qr_byte_t *codeword;      /* シンボル配置用コード語領域のアドレス(同上) */
+  size_t wordmax;           /* コード語領域を確保した大きさ */
   qr_byte_t *_symbol;       /* シンボルデータ領域のアドレス */
   qr_byte_t **symbol;       /* シンボルデータの各行頭のアドレスのポインタ */
+  qr_word_t *_planes;       /* ビットプレーン領域のアドレス */
+  qr_word_t *planes[QR_PLANE_COUNT]; /* 各ビットプレーンの先頭アドレス */
+  int pwords;               /* ビットプレーン1行あたりの語数 */
   qr_byte_t *source;        /* 入力データ領域のアドレス */
   size_t srcmax;            /* 入力データ領域の最大容量 */
   size_t srclen;            /* 入力データ領域の使用容量 */
@@ -257,10 +347,112 @@ typedef struct qrcode_t {
   int xdir, ydir;           /* モジュール配置の移動方向 */
   int state;                /* 処理の進行状況 */
   int errcode;              /* 最後に起こったエラーの番号 */
-  char errinfo[QR_ERR_MAX]; /* 最後に起こったエラーの詳細 */
+  int errsys;               /* システム標準のエラー番号(errcodeがQR_ERR_SEE_ERRNOのとき) */
+  int errsuffix;            /* 付加情報をエラーの説明の後に付けるか */
+  char *errctx;             /* 最後に起こったエラーの付加情報(パラメータなど) */
+  char *errinfo;            /* qrGetErrorInfo()が組み立てたエラーの詳細 */
   qr_param_t param;         /* 出力パラメータ */
+  qr_maskinfo_t maskinfo;   /* マスクパターン選択の結果 */
+  int retain;               /* ファイナライズ後も作業領域を保持するか */
+  int bufdim;               /* シンボル/ビットプレーン領域を確保した1辺の長さ */
+  qr_allocator_t allocator; /* このオブジェクトが使うアロケータ */
+  struct qrcode_workspace_t *workspace; /* 生成に使う作業領域(NULL: ヒープを使う) */
+  qr_byte_t *packed;        /* qrCompact()で1モジュール1ビットに詰めたシンボル */
+  long *symref;             /* 複製と共有しているシンボル領域の参照数(NULL: 共有していない) */
 } QRCode;
 
+/*
+ * QRCodeオブジェクトのプール(内部構造は非公開)
+ */
+typedef struct qrcode_pool_t QRPool;
+
+/*
+ * シンボルのキャッシュ(内部構造は非公開)
+ */
+typedef struct qrcode_cache_t QRCache;
+
+/*
+ * キャッシュの統計(qrCacheGetStats()で得る)
+ */
+typedef struct qr_cachestat_t {
+  unsigned long hits;       /* 出力が見つかった回数 */
+  unsigned long symhits;    /* シンボルだけが見つかり、変換した回数 */
+  unsigned long misses;     /* どちらも見つからず、生成した回数 */
+  unsigned long evictions;  /* 容量を超えて追い出したエントリ数 */
+  size_t entries;           /* エントリ数 */
+  size_t bytes;             /* エントリが使うバイト数 */
+} qr_cachestat_t;
+
+/*
+ * 共有メモリのキャッシュ(内部構造は非公開)
+ */
+typedef struct qrcode_shmcache_t QRShmCache;
+
+/*
+ * 非同期処理の実行器と、投入した処理(内部構造は非公開)
+ */
+typedef struct qrcode_executor_t QRExecutor;
+typedef struct qrcode_task_t QRTask;
+
+/*
+ * 非同期処理の完了時に呼ばれる関数
+ * (実行器のワーカースレッドか、取り消したときは取り消したスレッドから呼ばれる)
+ */
+typedef void (*qr_task_cb)(QRTask *task, void *arg);
+
+/*
+ * 一括して開放できるアリーナ(内部構造は非公開)
+ */
+typedef struct qrcode_arena_t QRArena;
+
+/*
+ * 作業領域の割り当て単位と、ひとつの作業領域に割り当てる各領域の大きさ
+ * (入力データは型番自動選択のときに保存するもので、
+ *  符号化後のビット長の制限から最大長の2倍を超えることはない。
+ *  借用した断片の一覧を読み出すときは最大長までの領域も使う)
+ */
+#define QR_WSP_ALIGN    16
+#define QR_WSP_BLOCK(n) ((((n) + QR_WSP_ALIGN - 1) / QR_WSP_ALIGN + 1) * QR_WSP_ALIGN)
+#define QR_WSP_SRC_MAX  (QR_SRC_MAX * 2)
+#define QR_WSP_CLS_MAX  (QR_SRC_MAX * 3)        /* 文字種別と2つの型番での分割結果 */
+#define QR_WSP_SEG_MAX  ((QR_SRC_MAX + 1) * 7)  /* 自動分割の経路(7は分割の状態数) */
+#define QR_WSP_SIZE ( \
+	QR_WSP_BLOCK(QR_CWD_MAX * 2) + \
+	QR_WSP_BLOCK(QR_WSP_SRC_MAX) + \
+	QR_WSP_BLOCK(QR_DIM_MAX * QR_DIM_MAX) + \
+	QR_WSP_BLOCK(sizeof(qr_byte_t *) * QR_DIM_MAX) + \
+	QR_WSP_BLOCK(sizeof(qr_word_t) * QR_PLANE_COUNT * QR_DIM_MAX * QR_PLW_MAX) + \
+	QR_WSP_BLOCK(QR_SRC_MAX) + \
+	QR_WSP_BLOCK(QR_WSP_CLS_MAX) + \
+	QR_WSP_BLOCK(QR_WSP_SEG_MAX))
+
+/*
+ * ヒープを使わずにシンボルを生成・変換するための作業領域
+ * 静的に確保してqrInitWorkspace()に渡す(メンバは直接操作しないこと)
+ * 符号化と変換に使う領域はすべてこの中から割り当てられ、
+ * 型番ごとの雛形や対応表もライブラリ全体のキャッシュを使わずにここに作成する
+ */
+typedef struct qrcode_workspace_t {
+  QRCode qr;                /* QRコードオブジェクト */
+  qr_byte_t skeleton[QR_DIM_MAX * QR_DIM_MAX];  /* 機能パターンの雛形 */
+  qr_word_t planeskel[(QR_MPT_MAX + 2) * QR_DIM_MAX * QR_PLW_MAX]; /* ビットプレーンの雛形 */
+  uint16_t placemap[QR_CWD_MAX * 8]; /* コード語のビット→モジュール位置の対応表 */
+  int skelver;              /* 機能パターンの雛形を作成した型番(0: 未作成) */
+  int pskelver;             /* ビットプレーンの雛形を作成した型番 */
+  int mapver;               /* 対応表を作成した型番 */
+  size_t used;              /* 作業領域の使用済みバイト数 */
+  size_t peak;              /* 作業領域の使用量の最大値 */
+  qr_byte_t *out;           /* 変換中の出力領域(変換結果の割り当てに使う) */
+  size_t outsize;           /* 出力領域の大きさ */
+  int outused;              /* 出力領域を割り当て済みか */
+  char errctx[QR_ERR_MAX];  /* エラーの付加情報 */
+  char errinfo[QR_ERR_MAX]; /* エラーの詳細 */
+  union {
+    qr_word_t align;
+    qr_byte_t data[QR_WSP_SIZE];
+  } area;                   /* 割り当てに使う領域 */
+} QRWorkspace;
+
 /*
  * 構造的連接QRコードオブジェクト
  */
@@ -272,6 +464,7 @@ typedef struct qrcode_sa_t {
   int parity;               /* パリティ */
   int state;                /* 処理の進行状況 */
   qr_param_t param;         /* 出力パラメータ */
+  qr_allocator_t allocator; /* このオブジェクトが使うアロケータ */
 } QRStructured;
 
 /*
@@ -284,20 +477,94 @@ typedef qr_byte_t *(*QRsConverter)(QRStructured *, int, int, int, int *);
  * 基本関数のプロトタイプ
  */
 QR_API QRCode *qrInit(int version, int mode, int eclevel, int masktype, int *errcode);
+QR_API QRCode *qrInit2(int version, int mode, int eclevel, int masktype, const qr_allocator_t *allocator, int *errcode);
+QR_API QRCode *qrInitWorkspace(QRWorkspace *ws, int version, int mode, int eclevel, int masktype, int *errcode);
 QR_API void qrDestroy(QRCode *qr);
 QR_API int qrGetErrorCode(QRCode *qr);
 QR_API char *qrGetErrorInfo(QRCode *qr);
 QR_API int qrAddData(QRCode *qr, const qr_byte_t *source, int size);
 QR_API int qrAddData2(QRCode *qr, const qr_byte_t *source, int size, int mode);
+QR_API int qrAddDataRef(QRCode *qr, const qr_byte_t *source, int size, int mode);
+QR_API int qrAddDataV(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int mode);
+QR_API int qrAddDataRefV(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int mode);
 QR_API int qrFinalize(QRCode *qr);
 QR_API int qrIsFinalized(const QRCode *qr);
+QR_API int qrCompact(QRCode *qr);
+QR_API const qr_maskinfo_t *qrGetMaskInfo(const QRCode *qr);
+QR_API int qrSetMaskThreads(int threads, int minversion);
+QR_API void qrCleanup(void);
 QR_API int qrHasData(const QRCode *qr);
 QR_API QRCode *qrClone(const QRCode *qr, int *errcode);
+QR_API int qrReset(QRCode *qr, int version, int mode, int eclevel, int masktype);
+
+/*
+ * オブジェクトプール操作用関数のプロトタイプ
+ */
+QR_API QRPool *qrPoolCreate(int maxidle, int *errcode);
+QR_API void qrPoolDestroy(QRPool *pool);
+QR_API QRCode *qrPoolAcquire(QRPool *pool, int version, int mode, int eclevel, int masktype, int *errcode);
+QR_API void qrPoolRelease(QRPool *pool, QRCode *qr);
+
+/*
+ * 一括生成用関数のプロトタイプ
+ */
+QR_API int qrEncodeBatch(qr_batch_t *items, int count, int fmt, int sep, int mag, const qr_batchopt_t *opt);
+QR_API void qrFreeBatch(qr_batch_t *items, int count);
+
+/*
+ * キャッシュ用関数のプロトタイプ
+ */
+QR_API QRCache *qrCacheCreate(size_t maxbytes, int shards, int *errcode);
+QR_API void qrCacheDestroy(QRCache *cache);
+QR_API void qrCacheClear(QRCache *cache);
+QR_API void qrCacheGetStats(QRCache *cache, qr_cachestat_t *stat);
+QR_API qr_byte_t *qrCacheGetSymbol(QRCache *cache, const qr_byte_t *source, int size, const qr_param_t *param, int fmt, int sep, int mag, int *outsize, int *errcode);
+QR_API qr_byte_t *qrCacheGetSymbolV(QRCache *cache, const qr_iovec_t *iov, int iovcnt, const qr_param_t *param, int fmt, int sep, int mag, int *outsize, int *errcode);
+
+/*
+ * 共有メモリのキャッシュ用関数のプロトタイプ
+ */
+QR_API QRShmCache *qrShmCacheOpen(const char *name, size_t size, int *errcode);
+QR_API void qrShmCacheClose(QRShmCache *sc);
+QR_API int qrShmCacheUnlink(const char *name);
+QR_API void qrShmCacheGetStats(QRShmCache *sc, qr_cachestat_t *stat);
+QR_API qr_byte_t *qrShmCacheGetSymbol(QRShmCache *sc, const qr_byte_t *source, int size, const qr_param_t *param, int fmt, int sep, int mag, int *outsize, int *errcode);
+
+/*
+ * 非同期処理用関数のプロトタイプ
+ */
+QR_API QRExecutor *qrExecutorCreate(int threads, int maxpending, int *errcode);
+QR_API void qrExecutorDestroy(QRExecutor *ex);
+QR_API int qrExecutorGetFd(const QRExecutor *ex);
+QR_API int qrExecutorPending(QRExecutor *ex);
+QR_API QRTask *qrExecutorReap(QRExecutor *ex);
+QR_API QRTask *qrFinalizeAsync(QRExecutor *ex, QRCode *qr, qr_task_cb callback, void *arg, int *errcode);
+QR_API QRTask *qrGetSymbolAsync(QRExecutor *ex, QRCode *qr, int fmt, int sep, int mag, qr_task_cb callback, void *arg, int *errcode);
+QR_API int qrTaskCancel(QRTask *task);
+QR_API int qrTaskGetError(const QRTask *task);
+QR_API QRCode *qrTaskGetQRCode(const QRTask *task);
+QR_API void *qrTaskGetArg(const QRTask *task);
+QR_API qr_byte_t *qrTaskGetSymbol(QRTask *task, int *size);
+QR_API void qrTaskFree(QRTask *task);
+
+/*
+ * メモリアロケータ用関数のプロトタイプ
+ */
+QR_API void qrSetAllocator(const qr_allocator_t *allocator);
+QR_API const qr_allocator_t *qrGetAllocator(void);
+QR_API void qrFreeBuffer(qr_byte_t *buf);
+QR_API void *qrAllocZero(const qr_allocator_t *allocator, size_t size);
+QR_API QRArena *qrArenaCreate(size_t chunksize, int *errcode);
+QR_API void qrArenaReset(QRArena *arena);
+QR_API void qrArenaDestroy(QRArena *arena);
+QR_API void qrArenaGetAllocator(QRArena *arena, qr_allocator_t *allocator);
+QR_API void qrWorkspaceGetAllocator(QRWorkspace *ws, qr_allocator_t *allocator);
 
 /*
  * 構造的連接操作用関数のプロトタイプ
  */
 QR_API QRStructured *qrsInit(int version, int mode, int eclevel, int masktype, int maxnum, int *errcode);
+QR_API QRStructured *qrsInit2(int version, int mode, int eclevel, int masktype, int maxnum, const qr_allocator_t *allocator, int *errcode);
 QR_API void qrsDestroy(QRStructured *st);
 QR_API int qrsGetErrorCode(QRStructured *st);
 QR_API char *qrsGetErrorInfo(QRStructured *st);
@@ -314,6 +581,7 @@ QR_API QRStructured *qrsClone(const QRStructured *st, int *errcode);
 QR_API int qrOutputSymbol(QRCode *qr, FILE *fp, int fmt, int sep, int mag);
 QR_API int qrOutputSymbol2(QRCode *qr, const char *pathname, int fmt, int sep, int mag);
 QR_API qr_byte_t *qrGetSymbol(QRCode *qr, int fmt, int sep, int mag, int *size);
+QR_API int qrGetSymbol2(QRCode *qr, int fmt, int sep, int mag, qr_byte_t *buf, int bufsize, int *size);
 QR_API qr_byte_t *qrSymbolToDigit(QRCode *qr, int sep, int mag, int *size);
 QR_API qr_byte_t *qrSymbolToASCII(QRCode *qr, int sep, int mag, int *size);
 QR_API qr_byte_t *qrSymbolToJSON(QRCode *qr, int sep, int mag, int *size);
@@ -322,6 +590,7 @@ QR_API qr_byte_t *qrSymbolToBMP(QRCode *qr, int sep, int mag, int *size);
 QR_API qr_byte_t *qrSymbolToSVG(QRCode *qr, int sep, int mag, int *size);
 QR_API qr_byte_t *qrSymbolToTIFF(QRCode *qr, int sep, int mag, int *size);
 QR_API qr_byte_t *qrSymbolToPNG(QRCode *qr, int sep, int mag, int *size);
+QR_API void qrFreeSymbol(QRCode *qr, qr_byte_t *symbol);
 
 /*
  * 構造的連接出力用関数のプロトタイプ
@@ -337,6 +606,7 @@ QR_API qr_byte_t *qrsSymbolsToBMP(QRStructured *st, int sep, int mag, int order,
 QR_API qr_byte_t *qrsSymbolsToSVG(QRStructured *st, int sep, int mag, int order, int *size);
 QR_API qr_byte_t *qrsSymbolsToTIFF(QRStructured *st, int sep, int mag, int order, int *size);
 QR_API qr_byte_t *qrsSymbolsToPNG(QRStructured *st, int sep, int mag, int order, int *size);
+QR_API void qrsFreeSymbols(QRStructured *st, qr_byte_t *symbols);
 
 #ifdef __cplusplus
 } // extern "C"
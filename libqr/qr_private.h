@@ -14,8 +14,119 @@
 #define _QR_PRIVATE_H_
 
 #include "qr.h"
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * SIMD命令セット(コンパイル時に利用可能なものを選ぶ)
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define QR_SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QR_SIMD_SSE2
+#endif
+
+/*
+ * RSブロックをまとめて計算するSIMD命令
+ * GCC互換のコンパイラでは命令セットを関数ごとに指定してコンパイルし、
+ * 実行時にCPUが対応しているものを選ぶ(コンパイラのオプションは要らない)
+ */
+#if ((defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) || defined(__clang__)) \
+	&& (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define QR_RS_SIMD
+#define QR_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define QR_TARGET_AVX2  __attribute__((target("avx2")))
+#define qrCpuHasSsse3() __builtin_cpu_supports("ssse3")
+#define qrCpuHasAvx2()  __builtin_cpu_supports("avx2")
+#elif defined(QR_SIMD_AVX2)
+#define QR_RS_SIMD
+#define QR_TARGET_SSSE3
+#define QR_TARGET_AVX2
+#define qrCpuHasSsse3() 1
+#define qrCpuHasAvx2()  1
+#endif
+#ifdef QR_RS_SIMD
+/* 同時に計算するRSブロック数の上限 */
+#define QR_RSB_LANES_MAX 32
+#endif
+
+/*
+ * 型番ごとのキャッシュの公開と、共有シンボルの参照数のための不可分操作
+ */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define qrAtomicLoadPtr(pp) \
+	_InterlockedCompareExchangePointer((void *volatile *)(pp), NULL, NULL)
+#define qrAtomicCasPtr(pp, oldp, newp) \
+	(_InterlockedCompareExchangePointer((void *volatile *)(pp), (void *)(newp), (void *)(oldp)) == (void *)(oldp))
+#define qrAtomicIncrement(p) _InterlockedIncrement((volatile long *)(p))
+#define qrAtomicDecrement(p) _InterlockedDecrement((volatile long *)(p))
+#else
+#define qrAtomicLoadPtr(pp) __atomic_load_n((pp), __ATOMIC_ACQUIRE)
+#define qrAtomicCasPtr(pp, oldp, newp) __sync_bool_compare_and_swap((pp), (oldp), (newp))
+#define qrAtomicIncrement(p) __sync_add_and_fetch((p), 1L)
+#define qrAtomicDecrement(p) __sync_sub_and_fetch((p), 1L)
+#endif
+
+/*
+ * オブジェクトプールの排他制御
+ * (スレッドが使えない環境では何もしない)
+ */
+#if defined(HAVE_PTHREAD)
+typedef pthread_mutex_t qr_mutex_t;
+#define qrMutexInit(m)    pthread_mutex_init((m), NULL)
+#define qrMutexDestroy(m) pthread_mutex_destroy(m)
+#define qrMutexLock(m)    pthread_mutex_lock(m)
+#define qrMutexUnlock(m)  pthread_mutex_unlock(m)
+#elif defined(WIN32)
+#include <windows.h>
+typedef CRITICAL_SECTION qr_mutex_t;
+#define qrMutexInit(m)    InitializeCriticalSection(m)
+#define qrMutexDestroy(m) DeleteCriticalSection(m)
+#define qrMutexLock(m)    EnterCriticalSection(m)
+#define qrMutexUnlock(m)  LeaveCriticalSection(m)
+#else
+typedef int qr_mutex_t;
+#define qrMutexInit(m)    ((void)(m))
+#define qrMutexDestroy(m) ((void)(m))
+#define qrMutexLock(m)    ((void)(m))
+#define qrMutexUnlock(m)  ((void)(m))
+#endif
+
+/*
+ * スレッドごとの変数の記憶域クラス
+ * (使えない環境ではプロセスで共有される)
+ */
+#if defined(_MSC_VER)
+#define QR_TLS __declspec(thread)
+#elif defined(__GNUC__)
+#define QR_TLS __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define QR_TLS _Thread_local
+#else
+#define QR_TLS
+#endif
+
+/*
+ * QRCodeオブジェクトのプール
+ * 返却されたオブジェクトを後入れ先出しで貸し出す
+ */
+struct qrcode_pool_t {
+	qr_mutex_t lock;          /* 以下のメンバを保護する */
+	QRCode **idle;            /* 再利用を待つオブジェクト */
+	int nidle;                /* 再利用を待つオブジェクト数 */
+	int maxidle;              /* 再利用を待つオブジェクト数の上限 */
+	qr_allocator_t allocator; /* プールと生成するオブジェクトが使うアロケータ */
+};
 
 /*
  * Booblean
@@ -283,8 +394,9 @@ const qr_vertable_t qr_vertable[QR_VER_MAX+1] = {
 
 /*
  * αのべき表現→多項式係数の整数表現
+ * (べき表現どうしの和を255で割らずに引けるように2周期分を持つ)
  */
-static const unsigned char qr_exp2fac[256] = {
+static const unsigned char qr_exp2fac[512] = {
 	  1,  2,  4,  8, 16, 32, 64,128, 29, 58,116,232,205,135, 19, 38,
 	 76,152, 45, 90,180,117,234,201,143,  3,  6, 12, 24, 48, 96,192,
 	157, 39, 78,156, 37, 74,148, 53,106,212,181,119,238,193,159, 35,
@@ -300,7 +412,23 @@ static const unsigned char qr_exp2fac[256] = {
 	130, 25, 50,100,200,141,  7, 14, 28, 56,112,224,221,167, 83,166,
 	 81,162, 89,178,121,242,249,239,195,155, 43, 86,172, 69,138,  9,
 	 18, 36, 72,144, 61,122,244,245,247,243,251,235,203,139, 11, 22,
-	 44, 88,176,125,250,233,207,131, 27, 54,108,216,173, 71,142,  1
+	 44, 88,176,125,250,233,207,131, 27, 54,108,216,173, 71,142,  1,
+	  2,  4,  8, 16, 32, 64,128, 29, 58,116,232,205,135, 19, 38, 76,
+	152, 45, 90,180,117,234,201,143,  3,  6, 12, 24, 48, 96,192,157,
+	 39, 78,156, 37, 74,148, 53,106,212,181,119,238,193,159, 35, 70,
+	140,  5, 10, 20, 40, 80,160, 93,186,105,210,185,111,222,161, 95,
+	190, 97,194,153, 47, 94,188,101,202,137, 15, 30, 60,120,240,253,
+	231,211,187,107,214,177,127,254,225,223,163, 91,182,113,226,217,
+	175, 67,134, 17, 34, 68,136, 13, 26, 52,104,208,189,103,206,129,
+	 31, 62,124,248,237,199,147, 59,118,236,197,151, 51,102,204,133,
+	 23, 46, 92,184,109,218,169, 79,158, 33, 66,132, 21, 42, 84,168,
+	 77,154, 41, 82,164, 85,170, 73,146, 57,114,228,213,183,115,230,
+	209,191, 99,198,145, 63,126,252,229,215,179,123,246,241,255,227,
+	219,171, 75,150, 49, 98,196,149, 55,110,220,165, 87,174, 65,130,
+	 25, 50,100,200,141,  7, 14, 28, 56,112,224,221,167, 83,166, 81,
+	162, 89,178,121,242,249,239,195,155, 43, 86,172, 69,138,  9, 18,
+	 36, 72,144, 61,122,244,245,247,243,251,235,203,139, 11, 22, 44,
+	 88,176,125,250,233,207,131, 27, 54,108,216,173, 71,142,  1,  2
 };
 
 /*
@@ -366,6 +494,99 @@ static const unsigned char qr_gftable[QR_RSW_MAX+1][QR_RSW_MAX] = {
 #define F0 QR_MM_FUNC
 #define F1 (QR_MM_FUNC | QR_MM_BLACK)
 
+/*
+ * 型番ごとのビットプレーンの雛形の構成
+ * (0〜QR_MPT_MAX-1番めはマスクパターン)
+ */
+#define QR_PSK_FUNC   QR_MPT_MAX        /* 機能パターン領域 */
+#define QR_PSK_DARK   (QR_MPT_MAX + 1)  /* 機能パターンの黒モジュール */
+#define QR_PSK_COUNT  (QR_MPT_MAX + 2)  /* ビットプレーン数 */
+
+/*
+ * ビットプレーンの1語のうち下位nビット(0～QR_PLW_BITS)が1の値
+ */
+#define qrPlaneMask(n) \
+	(((n) <= 0) ? (qr_word_t)0 : ((n) >= QR_PLW_BITS) ? ~(qr_word_t)0 \
+	: (((qr_word_t)1 << (n)) - 1))
+
+/*
+ * pwords語からなる行lineのk語めをsビット(1～QR_PLW_BITS-1)下位にずらした値
+ * (行末より先はfillの値で埋める)
+ */
+#define qrShiftDown(line, k, s, pwords, fill) \
+	(((line)[(k)] >> (s)) | ((((k) + 1 < (pwords)) ? (line)[(k) + 1] : (fill)) << (QR_PLW_BITS - (s))))
+
+/*
+ * 高速なマスクパターン選択(QR_MPT_FAST)の設定
+ */
+#define QR_MPT_FAST_STEP   4  /* 評価する行/列の間隔 */
+#define QR_MPT_FAST_SLACK 25  /* 推定失点に対する失点の超過の許容範囲(%) */
+
+/*
+ * マスクパターンの並列評価(qrSetMaskThreads)の設定
+ */
+#define QR_MPT_THREADS_MAX    (QR_MPT_MAX - 1)  /* ワーカースレッド数の最大値(呼び出し元も評価する) */
+#define QR_MPT_THREADS_MINVER 25                /* 並列評価する型番の下限の既定値 */
+
+#ifdef HAVE_PTHREAD
+/*
+ * マスクパターンの並列評価1回分の状態
+ * (呼び出し元のスタックに置き、スレッドプールのロックで保護する)
+ */
+typedef struct qr_maskjob_t {
+	const qr_word_t *pskel;  /* ビットプレーンの雛形 */
+	const qr_word_t *data;   /* 符号化データのビットプレーン */
+	int dim;                 /* 1辺のモジュール数 */
+	int pwords;              /* ビットプレーン1行あたりの語数 */
+	int next;                /* 次に評価するマスクパターン参照子 */
+	int running;             /* 評価中のスレッド数 */
+	int besttype;            /* 失点が最低のマスクパターン参照子(-1: 未評価) */
+	long bestpenalty;        /* その失点 */
+} qr_maskjob_t;
+#endif
+
+/*
+ * 入力データの文字種別を調べる単位(バイト数)
+ */
+#define QR_CLS_CHUNK 256
+
+/*
+ * 文字種別を調べるベクトル演算
+ * 範囲判定は符号なしの差の飽和比較で行う
+ */
+#if defined(QR_SIMD_AVX2)
+typedef __m256i qr_vec_t;
+#define QR_VEC_SIZE 32
+#define QR_VEC_FULL ((int)0xffffffff)
+#define qrVecLoad(p)     _mm256_loadu_si256((const __m256i *)(p))
+#define qrVecStore(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+#define qrVecSet1(c)     _mm256_set1_epi8((char)(c))
+#define qrVecAnd(a, b)   _mm256_and_si256((a), (b))
+#define qrVecOr(a, b)    _mm256_or_si256((a), (b))
+#define qrVecSub(a, b)   _mm256_sub_epi8((a), (b))
+#define qrVecMin(a, b)   _mm256_min_epu8((a), (b))
+#define qrVecEq(a, b)    _mm256_cmpeq_epi8((a), (b))
+#define qrVecMask(v)     _mm256_movemask_epi8(v)
+#elif defined(QR_SIMD_SSE2)
+typedef __m128i qr_vec_t;
+#define QR_VEC_SIZE 16
+#define QR_VEC_FULL 0xffff
+#define qrVecLoad(p)     _mm_loadu_si128((const __m128i *)(p))
+#define qrVecStore(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+#define qrVecSet1(c)     _mm_set1_epi8((char)(c))
+#define qrVecAnd(a, b)   _mm_and_si128((a), (b))
+#define qrVecOr(a, b)    _mm_or_si128((a), (b))
+#define qrVecSub(a, b)   _mm_sub_epi8((a), (b))
+#define qrVecMin(a, b)   _mm_min_epu8((a), (b))
+#define qrVecEq(a, b)    _mm_cmpeq_epi8((a), (b))
+#define qrVecMask(v)     _mm_movemask_epi8(v)
+#endif
+#ifdef QR_VEC_SIZE
+#define qrVecInRange(v, lo, hi) \
+	qrVecEq(qrVecMin(qrVecSub((v), qrVecSet1(lo)), qrVecSet1((hi) - (lo))), \
+			qrVecSub((v), qrVecSet1(lo)))
+#endif
+
 /*
  * 位置検出パターンのデータ
  */
@@ -398,6 +619,39 @@ static const qr_byte_t qr_alignpattern[QR_DIM_ALIGN][QR_DIM_ALIGN] = {
  */
 static const int qr_modeid[QR_EM_COUNT] = { 0x01, 0x02, 0x04, 0x08 };
 
+/*
+ * 入力データバッファ上で自動分割(QR_EM_AUTO)を表すモード値
+ */
+#define QR_EM_SEGMENTS 0x3f
+
+/*
+ * 入力データバッファ上で借用したデータ(qrAddDataRef(), qrAddDataRefV())を表すフラグ
+ * (モード値にORし、データの代わりに断片の数と各断片のqr_iovec_tを保存する)
+ */
+#define QR_SRC_BORROWED 0x40
+
+/*
+ * 自動分割の状態(符号化モードと、数字/英数字モードでの文字数の剰余)
+ * 数字モードは3桁、英数字モードは2桁ごとにビット長の増分が変わる
+ */
+#define QR_SEG_STATES 7
+/* 作業領域の大きさ(QR_WSP_SEG_MAX)は状態数に合わせて見積もっている */
+typedef char qr_wsp_seg_check[(QR_WSP_SEG_MAX >= (QR_SRC_MAX + 1) * QR_SEG_STATES) ? 1 : -1];
+#define QR_SEG_START  QR_SEG_STATES
+
+/* 状態ごとの符号化モード */
+static const int qr_segmode[QR_SEG_STATES] = {
+	QR_EM_NUMERIC, QR_EM_NUMERIC, QR_EM_NUMERIC,
+	QR_EM_ALNUM, QR_EM_ALNUM, QR_EM_8BIT, QR_EM_KANJI
+};
+
+/* 状態ごとの1文字追加したときのビット長の増分と遷移先の状態 */
+static const int qr_segbits[QR_SEG_STATES] = { 4, 3, 3, 6, 5, 8, 13 };
+static const int qr_segnext[QR_SEG_STATES] = { 1, 2, 0, 4, 3, 5, 6 };
+
+/* 符号化モードごとの新しいセグメントの開始状態 */
+static const int qr_segfirst[QR_EM_COUNT] = { 0, 3, 5, 6 };
+
 /*
  * 符号化モード名 (不使用)
  */
@@ -471,6 +725,23 @@ static const qr_coord_t qr_verinfopos[2][QR_VIN_MAX] = {
 	 { 5, -11 }, { 5, -10 }, { 5, -9 }}
 };
 
+/*
+ * 形式情報(誤り訂正レベル・マスクパターン参照子ごと)
+ * 誤り訂正レベル2ビット(L:01, M:00, Q:11, H:10)と
+ * マスクパターン参照子3ビットからなる計5ビットに
+ * Bose-Chaudhuri-Hocquenghem(15,5)符号による
+ * 誤り訂正ビット10ビットを付加して15ビットとし、
+ * 101010000010010(0x5412)とXORをとったもの
+ * (誤り訂正ビットは5ビットをxの次数14〜10の多項式係数とみなして
+ * 多項式x^10+x^8+x^5+x^4+x^2+x+1(係数10100110111)で除算した剰余)
+ */
+static const int qr_fmtinfo[QR_ECL_COUNT][QR_MPT_MAX] = {
+	{ 0x77c4, 0x72f3, 0x7daa, 0x789d, 0x662f, 0x6318, 0x6c41, 0x6976 },
+	{ 0x5412, 0x5125, 0x5e7c, 0x5b4b, 0x45f9, 0x40ce, 0x4f97, 0x4aa0 },
+	{ 0x355f, 0x3068, 0x3f31, 0x3a06, 0x24b4, 0x2183, 0x2eda, 0x2bed },
+	{ 0x1689, 0x13be, 0x1ce7, 0x19d0, 0x0762, 0x0255, 0x0d0c, 0x083b }
+};
+
 /*
  * 型番情報(型番7〜40について有効)
  */
@@ -484,29 +755,95 @@ static const long qr_verinfo[QR_VER_MAX+1] = {
 	0x24b0bL, 0x2542eL, 0x26a64L, 0x27541L, 0x28c69L
 };
 
+/*
+ * データコード語書き込み用のビットストリーム
+ * 64ビットのアキュムレータにビット列を溜め、バイト単位でまとめて書き出す
+ */
+typedef struct qr_bitstream_t {
+	qr_byte_t *buf;   /* 書き込み先(データコード語領域) */
+	int pos;          /* 次に書き出すバイト位置 */
+	int nbits;        /* アキュムレータに溜まっているビット数 */
+	uint64_t acc;     /* アキュムレータ(下位nbitsビットが有効) */
+} qr_bitstream_t;
+
 /*
  * 一連の処理をする関数ポインタ型
  */
 typedef int (*qr_funcs)(QRCode *);
 
+/*
+ * qrCompact()で詰めたシンボルのバイト数
+ */
+#define qrPackedSize(qr) \
+	(((size_t)qr_vertable[(qr)->param.version].dimension \
+		* (size_t)qr_vertable[(qr)->param.version].dimension + 7) / 8)
+
 /*
  * 内部処理用関数のプロトタイプ
  */
+static int qrCheckParam(int version, int mode, int eclevel, int masktype);
+static int qrAllocWords(QRCode *qr);
+static int qrGrowWords(QRCode *qr, size_t size);
+static void qrFreeWords(QRCode *qr);
+static int qrShareSymbol(const QRCode *qr, QRCode *cp);
+static void qrUnshareSymbol(QRCode *qr);
+static void qrSetErrorContext(QRCode *qr, const char *ctx, int suffix);
 static void qrAddDataBits(QRCode *qr, int n, int word);
+static void qrBitsBegin(QRCode *qr, qr_bitstream_t *bs);
+static void qrBitsPut(qr_bitstream_t *bs, int n, int word);
+static void qrBitsPutBytes(qr_bitstream_t *bs, const qr_byte_t *source, int size);
+static void qrBitsEnd(QRCode *qr, qr_bitstream_t *bs);
 static int qrInitDataWord(QRCode *qr);
+static int qrAddDataVec(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int mode, int borrow);
+static int qrAddDataIov(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int size, int mode, int borrow);
 static int qrEncodeDataWord(QRCode *qr, const qr_byte_t *source, int size, int mode);
+static int qrEncodeDataWordV(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int skip, int size, int mode);
+static int qrEncodeDataBody(qr_bitstream_t *bs, const qr_byte_t *source, int size, int mode, int *pos);
+static void qrClassifyBlock(const qr_byte_t *source, int size, int avail, qr_byte_t *classes, int *notnum, int *notalnum);
+static void qrClassifyDataV(const qr_iovec_t *iov, int iovcnt, int size, qr_byte_t *classes, int *offsets);
+static int qrSegmentData(QRCode *qr, const qr_byte_t *classes, int size, int version, qr_byte_t *modes);
+static int qrEncodeSegments(QRCode *qr, const qr_iovec_t *iov, int iovcnt, int size, const qr_byte_t *modes);
+static void qrRepackDataWord(QRCode *qr);
+static int qrReadBits(const qr_byte_t *buf, int bit, int n);
 static int qrFinalizeDataWord(QRCode *qr);
 static int qrComputeECWord(QRCode *qr);
+static void qrComputeRSBlock(const qr_byte_t *dw, int dwlen, qr_byte_t *rem, int ecwlen);
+#ifdef QR_RS_SIMD
+static int qrRSBlocksWidth(void);
+static void qrComputeRSBlocks(const qr_byte_t *dw, int dwlen, qr_byte_t *ecw, int ecwlen, int num, int width);
+static QR_TARGET_SSSE3 void qrRSBlocksSsse3(qr_byte_t *lanes, qr_byte_t mtable[][2][16], int dwlen, int ecwlen);
+static QR_TARGET_AVX2 void qrRSBlocksAvx2(qr_byte_t *lanes, qr_byte_t mtable[][2][16], int dwlen, int ecwlen);
+#endif
 static int qrMakeCodeWord(QRCode *qr);
 static int qrFillFunctionPattern(QRCode *qr);
 static int qrFillCodeWord(QRCode *qr);
+static const qr_byte_t *qrGetSkeleton(QRCode *qr);
+static void qrDrawSkeleton(qr_byte_t *skel, int version);
+static const qr_word_t *qrGetPlaneSkeleton(QRCode *qr);
+static void qrMakePlaneSkeleton(qr_word_t *pskel, const qr_byte_t *skel, int version);
+static const uint16_t *qrGetPlacementMap(QRCode *qr);
+static void qrMakePlacementMap(QRCode *qr, uint16_t *map);
 static void qrInitPosition(QRCode *qr);
 static void qrNextPosition(QRCode *qr);
 static int qrSelectMaskPattern(QRCode *qr);
 static int qrApplyMaskPattern(QRCode *qr);
 static int qrApplyMaskPattern2(QRCode *qr, int type);
-static long qrEvaluateMaskPattern(QRCode *qr);
+static long qrSelectMaskPatternFull(QRCode *qr);
+#ifdef HAVE_PTHREAD
+static int qrSelectMaskPatternParallel(QRCode *qr, long *penalty);
+static void qrRunMaskJob(qr_maskjob_t *job);
+static void *qrMaskWorker(void *arg);
+#endif
+static void qrMaskPlane(qr_word_t *dark, const qr_word_t *data, const qr_word_t *pskel, int n, int type);
+static long qrEvaluateMaskPattern(QRCode *qr, long bound);
+static long qrEvaluatePlane(const qr_word_t *rows, int dim, int pwords, long bound);
+static long qrEstimateMaskPattern(QRCode *qr);
+static long qrEvaluateLine(const qr_word_t *line, const qr_word_t *valid, const qr_word_t *edge, int dim, int pwords);
+static void qrTransposePlane(const qr_word_t *src, qr_word_t *dst, int dim, int pwords);
+static int qrPopCount(qr_word_t x);
+static int qrCountTrailingZeros(qr_word_t x);
 static int qrFillFormatInfo(QRCode *qr);
+static int qrUnpackSymbol(QRCode *qr);
 
 
 #endif /* _QR_PRIVATE_H_ */
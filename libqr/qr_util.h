@@ -21,26 +21,64 @@ extern "C" {
 
 #include <stdarg.h>
 
+/*
+ * Get the address of the i-th row of the bitplane p (QR_PLANE_*).
+ */
+#define qrPlaneRow(qr, p, i) ((qr)->planes[(p)] + (size_t)(i) * (size_t)(qr)->pwords)
+
+/*
+ * Get the module at (i, j) of the bitplane p as 0 or 1.
+ */
+#define qrPlaneBit(qr, p, i, j) \
+	((int)((qrPlaneRow((qr), (p), (i))[(j) / QR_PLW_BITS] >> ((j) % QR_PLW_BITS)) & 1))
+
+/*
+ * Get the module at (i, j) of the symbol packed by qrCompact() as 0 or 1.
+ * (modules are stored row by row, 8 modules per byte, LSB first)
+ */
+#define qrPackedBit(qr, i, j) \
+	qrPackedBitAt((qr)->packed, \
+		(size_t)(i) * (size_t)qr_vertable[(qr)->param.version].dimension + (size_t)(j))
+#define qrPackedBitAt(bits, n) ((int)(((bits)[(n) >> 3] >> ((n) & 7)) & 1))
+
 /*
  * Determine the module is a dark module or not.
+ * (available after qrFinalize())
+ */
+#define qrIsBlack(qr, i, j) \
+	((((qr)->packed != NULL) ? qrPackedBit((qr), (i), (j)) \
+		: qrPlaneBit((qr), QR_PLANE_DARK, (i), (j))) != 0)
+
+/*
+ * Allocate, reallocate and deallocate memory with the allocator
+ * of the object (QRCode or QRStructured).
  */
-#define qrIsBlack(qr, i, j) (((qr)->symbol[(i)][(j)] & QR_MM_BLACK) != 0)
+#define qrMalloc(obj, size) \
+	((obj)->allocator.alloc((obj)->allocator.ctx, (size_t)(size)))
+#define qrRealloc(obj, ptr, size) \
+	((obj)->allocator.resize((obj)->allocator.ctx, (ptr), (size_t)(size)))
+#define qrRelease(obj, ptr) \
+	((obj)->allocator.release((obj)->allocator.ctx, (ptr)))
 
 /*
- * Deallocate and set to NULL.
+ * Deallocate with the allocator of the object and set to NULL.
  */
-#define qrFree(ptr) { if ((ptr) != NULL) { free(ptr); (ptr) = NULL; } }
+#define qrFree(obj, ptr) { if ((ptr) != NULL) { qrRelease((obj), (ptr)); (ptr) = NULL; } }
 
 /*
  * Current function name macro.
+ * Bindings report errors under their own function names by calling
+ * qrSetCurrentFunctionName() before each call into libqr. The name is
+ * kept per thread, so concurrent callers never see each other's names.
  */
-QR_API extern const char *(*qrGetCurrentFunctionName)(void);
+QR_API void qrSetCurrentFunctionName(const char *name);
+QR_API const char *qrCurrentFunctionName(const char *defname);
 #if defined(__FUNCTION__)
-#define _QR_FUNCTION ((qrGetCurrentFunctionName) ? qrGetCurrentFunctionName() : __FUNCTION__)
+#define _QR_FUNCTION qrCurrentFunctionName(__FUNCTION__)
 #elif defined(__func__)
-#define _QR_FUNCTION ((qrGetCurrentFunctionName) ? qrGetCurrentFunctionName() : __func__)
+#define _QR_FUNCTION qrCurrentFunctionName(__func__)
 #else
-#define _QR_FUNCTION ((qrGetCurrentFunctionName) ? qrGetCurrentFunctionName() : "?")
+#define _QR_FUNCTION qrCurrentFunctionName("?")
 #endif
 
 /*
@@ -71,9 +109,19 @@ QR_API int qrGetEncodableLength(QRCode *qr, int size);
 QR_API int qrGetEncodableLength2(QRCode *qr, int size, int mode);
 QR_API int qrRemainedDataBits(QRCode *qr);
 
+/*
+ * Character class bits written by qrClassifyData().
+ */
+#define QR_CC_NUMERIC  0x01  /* 0-9 */
+#define QR_CC_ALNUM    0x02  /* 0-9 A-Z SP $%*+-./: */
+#define QR_CC_KANJI1   0x04  /* in the range of the first byte of Shift_JIS kanji */
+#define QR_CC_KANJI2   0x08  /* in the range of the second byte of Shift_JIS kanji */
+#define QR_CC_KANJI    0x10  /* starts a JIS X 0208 kanji (2 bytes) */
+
 /*
  * Functions for checking datatype.
  */
+QR_API int qrClassifyData(const qr_byte_t *source, int size, qr_byte_t *classes, int *offsets);
 QR_API int qrDetectDataType(const qr_byte_t *source, int size);
 QR_API int qrStrPosNotNumeric(const qr_byte_t *source, int size);
 QR_API int qrStrPosNotAlnum(const qr_byte_t *source, int size);
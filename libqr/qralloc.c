@@ -0,0 +1,471 @@
+/*
+ * QR Code Generator Library: Memory Allocators
+ *
+ * Core routines were originally written by Junn Ohta.
+ * Based on qr.c Version 0.1: 2004/4/3 (Public Domain)
+ *
+ * @package     libqr
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2013 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "qr.h"
+#include "qr_util.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * アリーナから割り当てるブロックの境界
+ * (ブロックの直前にはブロックの大きさを格納する)
+ */
+#define QR_ARENA_ALIGN  16
+#define QR_ARENA_HEADER QR_ARENA_ALIGN
+#define qrArenaRound(n) (((n) + (QR_ARENA_ALIGN - 1)) & ~(size_t)(QR_ARENA_ALIGN - 1))
+
+/*
+ * アリーナの既定のチャンクサイズ
+ * (型番40のシンボルの生成とPNGへの変換が収まる大きさ)
+ */
+#define QR_ARENA_CHUNK_DEFAULT (512 * 1024)
+
+/*
+ * アリーナのチャンク
+ * (この構造体の直後からブロックを割り当てる)
+ */
+typedef struct qr_arena_chunk_t {
+	struct qr_arena_chunk_t *next; /* 前に割り当てたチャンク */
+	size_t size;                   /* 割り当て可能なバイト数 */
+	size_t used;                   /* 割り当て済みのバイト数 */
+} qr_arena_chunk_t;
+
+#define QR_ARENA_CHUNK_HEADER qrArenaRound(sizeof(qr_arena_chunk_t))
+#define qrArenaData(chunk) ((qr_byte_t *)(chunk) + QR_ARENA_CHUNK_HEADER)
+
+/*
+ * バンプポインタ方式のアリーナ
+ */
+struct qrcode_arena_t {
+	qr_arena_chunk_t *head; /* 割り当て中のチャンク */
+	size_t chunksize;       /* チャンクの最小サイズ */
+	void *last;             /* 最後に割り当てたブロック(その場で伸縮できる) */
+};
+
+/*
+ * 標準ライブラリのmalloc()などを使うアロケータ
+ */
+static void *qrStdAlloc(void *ctx, size_t size);
+static void *qrStdResize(void *ctx, void *ptr, size_t size);
+static void qrStdRelease(void *ctx, void *ptr);
+
+/*
+ * アリーナから割り当てるアロケータ
+ */
+static void *qrArenaAlloc(void *ctx, size_t size);
+static void *qrArenaResize(void *ctx, void *ptr, size_t size);
+static void qrArenaRelease(void *ctx, void *ptr);
+static qr_arena_chunk_t *qrArenaNewChunk(size_t size);
+
+/*
+ * 作業領域から割り当てるアロケータ
+ */
+static void *qrWorkspaceAlloc(void *ctx, size_t size);
+static void *qrWorkspaceResize(void *ctx, void *ptr, size_t size);
+static void qrWorkspaceRelease(void *ctx, void *ptr);
+
+/*
+ * 既定のアロケータ(qrSetAllocator()で変更する)
+ */
+static qr_allocator_t qr_allocator = { qrStdAlloc, qrStdResize, qrStdRelease, NULL };
+
+/*
+ * 以後に生成するオブジェクトの既定のアロケータを設定する
+ * (NULLなら標準ライブラリのものに戻す)
+ * オブジェクトは生成時のアロケータを保持するので、
+ * 他のスレッドがオブジェクトを生成していないときに呼ぶこと
+ */
+QR_API void
+qrSetAllocator(const qr_allocator_t *allocator)
+{
+	if (allocator == NULL) {
+		qr_allocator.alloc = qrStdAlloc;
+		qr_allocator.resize = qrStdResize;
+		qr_allocator.release = qrStdRelease;
+		qr_allocator.ctx = NULL;
+	} else {
+		qr_allocator = *allocator;
+	}
+}
+
+/*
+ * 既定のアロケータを返す
+ */
+QR_API const qr_allocator_t *
+qrGetAllocator(void)
+{
+	return &qr_allocator;
+}
+
+/*
+ * 既定のアロケータで確保された出力を開放する
+ * (生成したオブジェクトを既に破棄したqrGetSymbol()などの出力や、
+ *  キャッシュ・非同期処理の出力のように、開放に使うオブジェクトがないもの)
+ */
+QR_API void
+qrFreeBuffer(qr_byte_t *buf)
+{
+	if (buf != NULL) {
+		qr_allocator.release(qr_allocator.ctx, buf);
+	}
+}
+
+/*
+ * アロケータでゼロクリアされた領域を確保する
+ */
+QR_API void *
+qrAllocZero(const qr_allocator_t *allocator, size_t size)
+{
+	void *ptr;
+
+	ptr = allocator->alloc(allocator->ctx, size);
+	if (ptr != NULL) {
+		memset(ptr, 0, size);
+	}
+	return ptr;
+}
+
+/*
+ * 標準ライブラリのアロケータ
+ */
+static void *
+qrStdAlloc(void *ctx, size_t size)
+{
+	(void)ctx;
+	return malloc(size);
+}
+
+static void *
+qrStdResize(void *ctx, void *ptr, size_t size)
+{
+	(void)ctx;
+	return realloc(ptr, size);
+}
+
+static void
+qrStdRelease(void *ctx, void *ptr)
+{
+	(void)ctx;
+	free(ptr);
+}
+
+/*
+ * アリーナを生成する
+ * chunksizeは一度に確保するチャンクの大きさ(0で既定値)
+ * アリーナはスレッド間で共有できない
+ */
+QR_API QRArena *
+qrArenaCreate(size_t chunksize, int *errcode)
+{
+	QRArena *arena;
+
+	arena = (QRArena *)malloc(sizeof(QRArena));
+	if (arena == NULL) {
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
+		return NULL;
+	}
+	arena->chunksize = (chunksize == 0) ? QR_ARENA_CHUNK_DEFAULT : qrArenaRound(chunksize);
+	arena->head = qrArenaNewChunk(arena->chunksize);
+	arena->last = NULL;
+	if (arena->head == NULL) {
+		free(arena);
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
+		return NULL;
+	}
+	return arena;
+}
+
+/*
+ * アリーナから割り当てたすべての領域を一度に開放する
+ * 複数のチャンクを使っていたら、次回はひとつに収まるように
+ * それらの合計の大きさのチャンクを確保し直す
+ * (確保できなければ既存のチャンクのうち最も大きいものを残して使う)
+ */
+QR_API void
+qrArenaReset(QRArena *arena)
+{
+	qr_arena_chunk_t *chunk, *next, *keep;
+	size_t total;
+
+	arena->last = NULL;
+	if (arena->head->next == NULL) {
+		arena->head->used = 0;
+		return;
+	}
+	total = 0;
+	keep = arena->head;
+	for (chunk = arena->head; chunk != NULL; chunk = chunk->next) {
+		total += chunk->size;
+		if (chunk->size > keep->size) {
+			keep = chunk;
+		}
+	}
+	chunk = qrArenaNewChunk(total);
+	if (chunk != NULL) {
+		keep = chunk;
+	}
+	for (chunk = arena->head; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		if (chunk != keep) {
+			free(chunk);
+		}
+	}
+	keep->next = NULL;
+	keep->used = 0;
+	arena->head = keep;
+}
+
+/*
+ * アリーナを開放する
+ */
+QR_API void
+qrArenaDestroy(QRArena *arena)
+{
+	qr_arena_chunk_t *chunk, *next;
+
+	if (arena == NULL) {
+		return;
+	}
+	for (chunk = arena->head; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+/*
+ * アリーナから割り当てるアロケータを返す
+ * (qrInit2()などに渡す。個々の領域の開放はqrArenaReset()まで遅延される)
+ */
+QR_API void
+qrArenaGetAllocator(QRArena *arena, qr_allocator_t *allocator)
+{
+	allocator->alloc = qrArenaAlloc;
+	allocator->resize = qrArenaResize;
+	allocator->release = qrArenaRelease;
+	allocator->ctx = arena;
+}
+
+/*
+ * チャンクを確保する
+ */
+static qr_arena_chunk_t *
+qrArenaNewChunk(size_t size)
+{
+	qr_arena_chunk_t *chunk;
+
+	chunk = (qr_arena_chunk_t *)malloc(QR_ARENA_CHUNK_HEADER + size);
+	if (chunk == NULL) {
+		return NULL;
+	}
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+/*
+ * アリーナからブロックを割り当てる
+ * 現在のチャンクに収まらなければ新しいチャンクを追加する
+ */
+static void *
+qrArenaAlloc(void *ctx, size_t size)
+{
+	QRArena *arena = (QRArena *)ctx;
+	qr_arena_chunk_t *chunk;
+	qr_byte_t *block;
+	size_t need;
+
+	need = QR_ARENA_HEADER + qrArenaRound(size);
+	chunk = arena->head;
+	if (chunk->size - chunk->used < need) {
+		chunk = qrArenaNewChunk((need > arena->chunksize) ? need : arena->chunksize);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->next = arena->head;
+		arena->head = chunk;
+	}
+	block = qrArenaData(chunk) + chunk->used + QR_ARENA_HEADER;
+	*(size_t *)(block - QR_ARENA_HEADER) = size;
+	chunk->used += need;
+	arena->last = block;
+	return block;
+}
+
+/*
+ * ブロックの大きさを変更する
+ * 最後に割り当てたブロックはその場で伸縮し、
+ * それ以外は新しいブロックを割り当てて内容をコピーする
+ */
+static void *
+qrArenaResize(void *ctx, void *ptr, size_t size)
+{
+	QRArena *arena = (QRArena *)ctx;
+	qr_arena_chunk_t *chunk = arena->head;
+	qr_byte_t *block;
+	size_t oldsize, start;
+
+	if (ptr == NULL) {
+		return qrArenaAlloc(ctx, size);
+	}
+	oldsize = *(size_t *)((qr_byte_t *)ptr - QR_ARENA_HEADER);
+	if (ptr == arena->last) {
+		start = (size_t)((qr_byte_t *)ptr - qrArenaData(chunk)) - QR_ARENA_HEADER;
+		if (chunk->size - start >= QR_ARENA_HEADER + qrArenaRound(size)) {
+			*(size_t *)((qr_byte_t *)ptr - QR_ARENA_HEADER) = size;
+			chunk->used = start + QR_ARENA_HEADER + qrArenaRound(size);
+			return ptr;
+		}
+	}
+	block = (qr_byte_t *)qrArenaAlloc(ctx, size);
+	if (block == NULL) {
+		return NULL;
+	}
+	memcpy(block, ptr, (oldsize < size) ? oldsize : size);
+	return block;
+}
+
+/*
+ * ブロックを開放する
+ * 最後に割り当てたブロックなら巻き戻し、それ以外は何もしない
+ */
+static void
+qrArenaRelease(void *ctx, void *ptr)
+{
+	QRArena *arena = (QRArena *)ctx;
+
+	if (ptr != NULL && ptr == arena->last) {
+		arena->head->used = (size_t)((qr_byte_t *)ptr - qrArenaData(arena->head)) - QR_ARENA_HEADER;
+		arena->last = NULL;
+	}
+}
+
+/*
+ * 作業領域から割り当てるアロケータを返す
+ * 作業領域のブロックはスタックのように割り当て、最後のブロックから
+ * 順に開放すれば巻き戻す。それ以外の開放は作業領域を初期化するまで遅延される
+ * 変換中は、作業領域に収まらない領域を出力領域に1つだけ割り当てる
+ * いずれにも収まらなければ、ヒープは使わずにNULLを返す
+ */
+QR_API void
+qrWorkspaceGetAllocator(QRWorkspace *ws, qr_allocator_t *allocator)
+{
+	allocator->alloc = qrWorkspaceAlloc;
+	allocator->resize = qrWorkspaceResize;
+	allocator->release = qrWorkspaceRelease;
+	allocator->ctx = ws;
+}
+
+/*
+ * 作業領域または出力領域からブロックを割り当てる
+ * (出力領域のブロックはその先頭に置き、管理用の領域を持たない)
+ */
+static void *
+qrWorkspaceAlloc(void *ctx, size_t size)
+{
+	QRWorkspace *ws = (QRWorkspace *)ctx;
+	qr_byte_t *block;
+	size_t need;
+
+	need = QR_ARENA_HEADER + qrArenaRound(size);
+	if (need >= size && sizeof(ws->area.data) - ws->used >= need) {
+		block = ws->area.data + ws->used + QR_ARENA_HEADER;
+		*(size_t *)(block - QR_ARENA_HEADER) = size;
+		ws->used += need;
+		if (ws->peak < ws->used) {
+			ws->peak = ws->used;
+		}
+		return block;
+	}
+	if (ws->out != NULL && !ws->outused && size <= ws->outsize) {
+		ws->outused = 1;
+		return ws->out;
+	}
+	return NULL;
+}
+
+/*
+ * ブロックの大きさを変更する
+ * 最後のブロックと出力領域のブロックはその場で伸縮し、
+ * それ以外は新しいブロックを割り当てて内容をコピーする
+ */
+static void *
+qrWorkspaceResize(void *ctx, void *ptr, size_t size)
+{
+	QRWorkspace *ws = (QRWorkspace *)ctx;
+	qr_byte_t *block;
+	size_t oldsize, start;
+
+	if (ptr == NULL) {
+		return qrWorkspaceAlloc(ctx, size);
+	}
+	if (ptr == ws->out) {
+		if (size <= ws->outsize) {
+			return ptr;
+		}
+		oldsize = ws->outsize;
+	} else {
+		oldsize = *(size_t *)((qr_byte_t *)ptr - QR_ARENA_HEADER);
+		start = (size_t)((qr_byte_t *)ptr - ws->area.data) - QR_ARENA_HEADER;
+		if (start + QR_ARENA_HEADER + qrArenaRound(oldsize) == ws->used) {
+			if (sizeof(ws->area.data) - start >= QR_ARENA_HEADER + qrArenaRound(size)) {
+				*(size_t *)((qr_byte_t *)ptr - QR_ARENA_HEADER) = size;
+				ws->used = start + QR_ARENA_HEADER + qrArenaRound(size);
+				if (ws->peak < ws->used) {
+					ws->peak = ws->used;
+				}
+				return ptr;
+			}
+		}
+	}
+	block = (qr_byte_t *)qrWorkspaceAlloc(ctx, size);
+	if (block == NULL) {
+		return NULL;
+	}
+	memcpy(block, ptr, (oldsize < size) ? oldsize : size);
+	qrWorkspaceRelease(ctx, ptr);
+	return block;
+}
+
+/*
+ * ブロックを開放する
+ * 作業領域の最後のブロックなら巻き戻し、出力領域のブロックなら空きに戻す
+ */
+static void
+qrWorkspaceRelease(void *ctx, void *ptr)
+{
+	QRWorkspace *ws = (QRWorkspace *)ctx;
+	size_t size, start;
+
+	if (ptr == NULL) {
+		return;
+	}
+	if (ptr == ws->out) {
+		ws->outused = 0;
+		return;
+	}
+	if ((qr_byte_t *)ptr < ws->area.data + QR_ARENA_HEADER
+		|| (qr_byte_t *)ptr >= ws->area.data + ws->used)
+	{
+		return;
+	}
+	size = *(size_t *)((qr_byte_t *)ptr - QR_ARENA_HEADER);
+	start = (size_t)((qr_byte_t *)ptr - ws->area.data) - QR_ARENA_HEADER;
+	if (start + QR_ARENA_HEADER + qrArenaRound(size) == ws->used) {
+		ws->used = start;
+	}
+}
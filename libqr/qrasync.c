@@ -0,0 +1,732 @@
+/*
+ * QR Code Generator Library: Asynchronous Finalize/Render
+ *
+ * Core routines were originally written by Junn Ohta.
+ * Based on qr.c Version 0.1: 2004/4/3 (Public Domain)
+ *
+ * @package     libqr
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2013 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "qr.h"
+#include "qr_util.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <unistd.h>
+#define QR_HAVE_EVENTFD
+#endif
+
+#ifdef TRUE
+#undef TRUE
+#endif
+#ifdef FALSE
+#undef FALSE
+#endif
+#define TRUE 1
+#define FALSE 0
+
+/*
+ * 処理の種類と状態
+ */
+#define QR_TASK_FINALIZE 0
+#define QR_TASK_SYMBOL   1
+
+#define QR_TASK_QUEUED  0
+#define QR_TASK_RUNNING 1
+#define QR_TASK_DONE    2
+
+/*
+ * 実行器の排他制御
+ * (スレッドが使えない環境では投入時にその場で処理するので何もしない)
+ */
+#ifdef HAVE_PTHREAD
+#define qrExecutorLock(ex)   pthread_mutex_lock(&((ex)->lock))
+#define qrExecutorUnlock(ex) pthread_mutex_unlock(&((ex)->lock))
+#else
+#define qrExecutorLock(ex)   ((void)(ex))
+#define qrExecutorUnlock(ex) ((void)(ex))
+#endif
+
+/*
+ * 投入した処理
+ */
+struct qrcode_task_t {
+	struct qrcode_executor_t *ex; /* 投入先の実行器 */
+	struct qrcode_task_t *next;   /* 待ち行列・完了リストの次の処理 */
+	QRCode *qr;               /* 処理するオブジェクト */
+	int kind;                 /* 処理の種類 */
+	int fmt;                  /* 出力形式 */
+	int sep;                  /* 分離パターンの幅 */
+	int mag;                  /* ピクセル表示倍率 */
+	qr_task_cb callback;      /* 完了時に呼ぶ関数(NULL: 完了リストに入れる) */
+	void *arg;                /* callbackに渡す引数 */
+	int state;                /* 処理の状態 */
+	int refs;                 /* 参照数(投入した側と実行器で2から始まる) */
+	int errcode;              /* エラー番号 */
+	qr_byte_t *symbol;        /* 変換したシンボル */
+	int symsize;              /* シンボルのサイズ */
+	qr_allocator_t symalloc;  /* シンボルを確保したアロケータ */
+};
+
+/*
+ * 非同期処理の実行器
+ */
+struct qrcode_executor_t {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;     /* 以下のメンバを保護する */
+	pthread_cond_t wake;      /* ワーカーに処理か停止を知らせる */
+	pthread_t *threads;       /* ワーカースレッド */
+#endif
+	int nthreads;             /* ワーカースレッド数 */
+	int maxpending;           /* 完了していない処理の上限 */
+	int pending;              /* 完了していない処理の数 */
+	int shutdown;             /* ワーカーを停止させるか */
+	int destroyed;            /* qrExecutorDestroy()を終えたか */
+	int ntasks;               /* 開放されていない処理の数 */
+	QRTask *head, *tail;      /* 待ち行列 */
+	QRTask *donehead, *donetail; /* 完了して回収されていない処理 */
+	int rfd, wfd;             /* 完了を知らせるファイル記述子(-1: なし) */
+	qr_allocator_t allocator; /* 実行器と処理の領域を確保するアロケータ */
+};
+
+static QRTask *qrTaskSubmit(QRExecutor *ex, QRCode *qr, int kind, int fmt, int sep, int mag,
+		qr_task_cb callback, void *arg, int *errcode);
+static void qrTaskRun(QRTask *task);
+static void qrTaskComplete(QRTask *task);
+static int qrTaskUnref(QRTask *task);
+static void qrExecutorFree(QRExecutor *ex);
+static void qrExecutorNotify(QRExecutor *ex);
+static void qrExecutorDrain(QRExecutor *ex);
+#ifdef HAVE_PTHREAD
+static void *qrExecutorWorker(void *arg);
+#endif
+
+/*
+ * 非同期処理の実行器を生成する
+ * threadsはワーカースレッド数(0: オンラインのCPU数)
+ * maxpendingは投入して完了していない処理の上限で、
+ * 超えて投入しようとするとQR_ERR_QUEUE_FULLで失敗する(0: 上限なし)
+ * コールバックを指定した処理は、コールバックが戻るまで完了していないものとして数える
+ * スレッドが使えない環境では投入時に呼び出し元のスレッドで処理する
+ */
+QR_API QRExecutor *
+qrExecutorCreate(int threads, int maxpending, int *errcode)
+{
+	const qr_allocator_t *allocator = qrGetAllocator();
+	QRExecutor *ex;
+
+	if (threads < 0 || maxpending < 0) {
+		*errcode = QR_ERR_INVALID_ARG;
+		return NULL;
+	}
+	ex = (QRExecutor *)qrAllocZero(allocator, sizeof(QRExecutor));
+	if (ex == NULL) {
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
+		return NULL;
+	}
+	ex->allocator = *allocator;
+	ex->maxpending = (maxpending == 0) ? INT_MAX : maxpending;
+	ex->rfd = ex->wfd = -1;
+
+	/*
+	 * 完了を知らせるファイル記述子を作る
+	 */
+#if defined(QR_HAVE_EVENTFD)
+	ex->rfd = ex->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ex->rfd == -1) {
+		*errcode = QR_ERR_SEE_ERRNO;
+		allocator->release(allocator->ctx, ex);
+		return NULL;
+	}
+#elif defined(HAVE_PTHREAD)
+	{
+		int fds[2], i;
+
+		if (pipe(fds) == -1) {
+			*errcode = QR_ERR_SEE_ERRNO;
+			allocator->release(allocator->ctx, ex);
+			return NULL;
+		}
+		for (i = 0; i < 2; i++) {
+			fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+			fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+		}
+		ex->rfd = fds[0];
+		ex->wfd = fds[1];
+	}
+#endif
+
+#ifdef HAVE_PTHREAD
+	if (threads == 0) {
+		long n = -1;
+#if defined(_SC_NPROCESSORS_ONLN)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		threads = (n > 0) ? (int)n : 1;
+	}
+	pthread_mutex_init(&(ex->lock), NULL);
+	pthread_cond_init(&(ex->wake), NULL);
+	ex->threads = (pthread_t *)allocator->alloc(allocator->ctx, sizeof(pthread_t) * (size_t)threads);
+	if (ex->threads == NULL) {
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
+		qrExecutorDestroy(ex);
+		return NULL;
+	}
+	for (ex->nthreads = 0; ex->nthreads < threads; ex->nthreads++) {
+		if (pthread_create(&(ex->threads[ex->nthreads]), NULL, qrExecutorWorker, ex) != 0) {
+			break;
+		}
+	}
+	if (ex->nthreads == 0) {
+		*errcode = QR_ERR_SEE_ERRNO;
+		qrExecutorDestroy(ex);
+		return NULL;
+	}
+#endif
+
+	return ex;
+}
+
+/*
+ * 実行器を破棄する
+ * 待っている処理は取り消し(QR_ERR_CANCELEDで完了させ)、
+ * 実行中の処理の完了を待ってからワーカーを停止する
+ * 回収されていない処理は実行器の参照を外すだけなので、
+ * 投入した側はこの後もqrTaskFree()で開放する
+ * (実行器の領域は最後の処理が開放されたときに開放される)
+ */
+QR_API void
+qrExecutorDestroy(QRExecutor *ex)
+{
+	QRTask *task, *next;
+	int last;
+
+	if (ex == NULL) {
+		return;
+	}
+
+	qrExecutorLock(ex);
+	ex->shutdown = 1;
+	task = ex->head;
+	ex->head = ex->tail = NULL;
+#ifdef HAVE_PTHREAD
+	pthread_cond_broadcast(&(ex->wake));
+#endif
+	qrExecutorUnlock(ex);
+
+	for (; task != NULL; task = next) {
+		next = task->next;
+		task->errcode = QR_ERR_CANCELED;
+		qrTaskComplete(task);
+	}
+
+#ifdef HAVE_PTHREAD
+	{
+		int i;
+		for (i = 0; i < ex->nthreads; i++) {
+			pthread_join(ex->threads[i], NULL);
+		}
+	}
+#endif
+
+	/*
+	 * 回収されていない処理から実行器の参照を外す
+	 */
+	qrExecutorLock(ex);
+	task = ex->donehead;
+	ex->donehead = ex->donetail = NULL;
+	qrExecutorUnlock(ex);
+	for (; task != NULL; task = next) {
+		next = task->next;
+		qrTaskFree(task);
+	}
+
+	qrExecutorLock(ex);
+	ex->destroyed = 1;
+	last = (ex->ntasks == 0);
+	qrExecutorUnlock(ex);
+	if (last) {
+		qrExecutorFree(ex);
+	}
+}
+
+/*
+ * 完了を知らせるファイル記述子を返す(-1: なし)
+ * コールバックを指定せずに投入した処理が完了すると読み込み可能になるので、
+ * イベントループで監視し、qrExecutorReap()で完了した処理を回収する
+ * (読み込みはqrExecutorReap()が行うので、呼び出し元では読まないこと)
+ */
+QR_API int
+qrExecutorGetFd(const QRExecutor *ex)
+{
+	return ex->rfd;
+}
+
+/*
+ * 投入して完了していない処理の数を返す
+ * (コールバックを実行中の処理も含む)
+ */
+QR_API int
+qrExecutorPending(QRExecutor *ex)
+{
+	int pending;
+
+	qrExecutorLock(ex);
+	pending = ex->pending;
+	qrExecutorUnlock(ex);
+
+	return pending;
+}
+
+/*
+ * コールバックを指定せずに投入して完了した処理を1つ取り出す(なければNULL)
+ * 取り出した処理は投入時の戻り値と同じもので、qrTaskFree()で開放する
+ */
+QR_API QRTask *
+qrExecutorReap(QRExecutor *ex)
+{
+	QRTask *task;
+
+	qrExecutorLock(ex);
+	while ((task = ex->donehead) != NULL) {
+		ex->donehead = task->next;
+		if (ex->donehead == NULL) {
+			ex->donetail = NULL;
+		}
+		task->next = NULL;
+		/*
+		 * 実行器の参照を外し、投入した側が既に開放していれば捨てる
+		 */
+		if (!qrTaskUnref(task)) {
+			break;
+		}
+		ex->allocator.release(ex->allocator.ctx, task);
+	}
+	/*
+	 * 完了リストが空になったら通知を消す
+	 * (ロック中に行うので、この後に完了した処理の通知は失われない)
+	 */
+	if (ex->donehead == NULL) {
+		qrExecutorDrain(ex);
+	}
+	qrExecutorUnlock(ex);
+
+	return task;
+}
+
+/*
+ * qrFinalize()を実行器で行う
+ * 完了するとcallbackを呼ぶか、callbackがNULLなら完了リストに入れて
+ * qrExecutorGetFd()のファイル記述子に知らせる
+ * 完了するまでqrを操作してはならない
+ */
+QR_API QRTask *
+qrFinalizeAsync(QRExecutor *ex, QRCode *qr, qr_task_cb callback, void *arg, int *errcode)
+{
+	return qrTaskSubmit(ex, qr, QR_TASK_FINALIZE, 0, 0, 0, callback, arg, errcode);
+}
+
+/*
+ * qrGetSymbol()を実行器で行う(ファイナライズしていなければ先に行う)
+ * 変換したシンボルは完了後にqrTaskGetSymbol()で受け取る
+ * 完了の知らせ方と、完了までqrを操作してはならないことは
+ * qrFinalizeAsync()と同じ
+ */
+QR_API QRTask *
+qrGetSymbolAsync(QRExecutor *ex, QRCode *qr, int fmt, int sep, int mag,
+		qr_task_cb callback, void *arg, int *errcode)
+{
+	if (fmt < 0 || fmt >= QR_FMT_COUNT) {
+		*errcode = QR_ERR_INVALID_FMT;
+		return NULL;
+	}
+	return qrTaskSubmit(ex, qr, QR_TASK_SYMBOL, fmt, sep, mag, callback, arg, errcode);
+}
+
+/*
+ * まだ実行されていない処理を取り消す
+ * 取り消した処理はQR_ERR_CANCELEDで完了する(コールバックはこの関数から呼ばれる)
+ * 取り消せればTRUE、実行中か完了済みならFALSEを返す
+ */
+QR_API int
+qrTaskCancel(QRTask *task)
+{
+	QRExecutor *ex = task->ex;
+	QRTask *prev, *cur;
+
+	qrExecutorLock(ex);
+	if (task->state != QR_TASK_QUEUED) {
+		qrExecutorUnlock(ex);
+		return FALSE;
+	}
+	prev = NULL;
+	for (cur = ex->head; cur != task; cur = cur->next) {
+		prev = cur;
+	}
+	if (prev == NULL) {
+		ex->head = task->next;
+	} else {
+		prev->next = task->next;
+	}
+	if (ex->tail == task) {
+		ex->tail = prev;
+	}
+	task->next = NULL;
+	qrExecutorUnlock(ex);
+
+	task->errcode = QR_ERR_CANCELED;
+	qrTaskComplete(task);
+
+	return TRUE;
+}
+
+/*
+ * 完了した処理のエラー番号を返す(成功すればQR_ERR_NONE)
+ * 詳しいエラー情報はqrTaskGetQRCode()のオブジェクトから得られる
+ */
+QR_API int
+qrTaskGetError(const QRTask *task)
+{
+	return task->errcode;
+}
+
+/*
+ * 処理したオブジェクトを返す
+ */
+QR_API QRCode *
+qrTaskGetQRCode(const QRTask *task)
+{
+	return task->qr;
+}
+
+/*
+ * 投入時に指定した引数を返す
+ */
+QR_API void *
+qrTaskGetArg(const QRTask *task)
+{
+	return task->arg;
+}
+
+/*
+ * qrGetSymbolAsync()で変換したシンボルを受け取る(なければNULL)
+ * 受け取ったシンボルは処理のQRコードオブジェクトのアロケータで確保されているので、
+ * qrFreeSymbol(qrTaskGetQRCode(task), symbol)で開放する
+ */
+QR_API qr_byte_t *
+qrTaskGetSymbol(QRTask *task, int *size)
+{
+	qr_byte_t *symbol = task->symbol;
+
+	if (size != NULL) {
+		*size = task->symsize;
+	}
+	task->symbol = NULL;
+	task->symsize = 0;
+
+	return symbol;
+}
+
+/*
+ * 処理を開放する
+ * 投入した処理ごとに1回呼ぶ(完了前に呼ぶと、結果は完了時に捨てられる)
+ * 受け取っていないシンボルも開放する
+ */
+QR_API void
+qrTaskFree(QRTask *task)
+{
+	QRExecutor *ex;
+	int last, destroyed;
+
+	if (task == NULL) {
+		return;
+	}
+	ex = task->ex;
+
+	qrExecutorLock(ex);
+	last = qrTaskUnref(task);
+	destroyed = (ex->destroyed && ex->ntasks == 0);
+	qrExecutorUnlock(ex);
+
+	if (last) {
+		ex->allocator.release(ex->allocator.ctx, task);
+		if (destroyed) {
+			qrExecutorFree(ex);
+		}
+	}
+}
+
+/*
+ * 処理を待ち行列に入れる
+ */
+static QRTask *
+qrTaskSubmit(QRExecutor *ex, QRCode *qr, int kind, int fmt, int sep, int mag,
+		qr_task_cb callback, void *arg, int *errcode)
+{
+	QRTask *task;
+
+	task = (QRTask *)qrAllocZero(&(ex->allocator), sizeof(QRTask));
+	if (task == NULL) {
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
+		return NULL;
+	}
+	task->ex = ex;
+	task->qr = qr;
+	task->kind = kind;
+	task->fmt = fmt;
+	task->sep = sep;
+	task->mag = mag;
+	task->callback = callback;
+	task->arg = arg;
+	task->state = QR_TASK_QUEUED;
+	task->refs = 2;
+	task->errcode = QR_ERR_NONE;
+
+	qrExecutorLock(ex);
+	if (ex->shutdown) {
+		qrExecutorUnlock(ex);
+		ex->allocator.release(ex->allocator.ctx, task);
+		*errcode = QR_ERR_STATE;
+		return NULL;
+	}
+	if (ex->pending >= ex->maxpending) {
+		qrExecutorUnlock(ex);
+		ex->allocator.release(ex->allocator.ctx, task);
+		*errcode = QR_ERR_QUEUE_FULL;
+		return NULL;
+	}
+	ex->pending++;
+	ex->ntasks++;
+#ifdef HAVE_PTHREAD
+	if (ex->tail == NULL) {
+		ex->head = task;
+	} else {
+		ex->tail->next = task;
+	}
+	ex->tail = task;
+	pthread_cond_signal(&(ex->wake));
+	qrExecutorUnlock(ex);
+#else
+	/*
+	 * ワーカーがいないのでその場で処理する
+	 */
+	task->state = QR_TASK_RUNNING;
+	qrExecutorUnlock(ex);
+	qrTaskRun(task);
+	qrTaskComplete(task);
+#endif
+
+	return task;
+}
+
+/*
+ * 処理を実行する
+ */
+static void
+qrTaskRun(QRTask *task)
+{
+	QRCode *qr = task->qr;
+
+	if (!qrIsFinalized(qr) && !qrFinalize(qr)) {
+		task->errcode = qrGetErrorCode(qr);
+		return;
+	}
+	if (task->kind == QR_TASK_SYMBOL) {
+		task->symbol = qrGetSymbol(qr, task->fmt, task->sep, task->mag, &(task->symsize));
+		if (task->symbol == NULL) {
+			task->errcode = qrGetErrorCode(qr);
+			return;
+		}
+		task->symalloc = qr->allocator;
+	}
+}
+
+/*
+ * 処理を完了させ、コールバックを呼ぶか完了リストに入れて知らせる
+ * 投入した側が既に開放していれば、結果を捨てて処理を開放する
+ */
+static void
+qrTaskComplete(QRTask *task)
+{
+	QRExecutor *ex = task->ex;
+
+	qrExecutorLock(ex);
+	task->state = QR_TASK_DONE;
+	if (task->refs == 1) {
+		ex->pending--;
+		(void)qrTaskUnref(task);
+		qrExecutorUnlock(ex);
+		ex->allocator.release(ex->allocator.ctx, task);
+		return;
+	}
+	if (task->callback == NULL) {
+		ex->pending--;
+		task->next = NULL;
+		if (ex->donetail == NULL) {
+			ex->donehead = task;
+		} else {
+			ex->donetail->next = task;
+		}
+		ex->donetail = task;
+		qrExecutorNotify(ex);
+		qrExecutorUnlock(ex);
+		return;
+	}
+	qrExecutorUnlock(ex);
+
+	/*
+	 * コールバックの中でqrTaskFree()が呼ばれても、
+	 * 実行器の参照が残っているので処理は開放されない
+	 */
+	task->callback(task, task->arg);
+
+	/*
+	 * コールバックが戻るまでは完了していない処理として数える
+	 */
+	qrExecutorLock(ex);
+	ex->pending--;
+	qrExecutorUnlock(ex);
+	qrTaskFree(task);
+}
+
+/*
+ * 処理の参照数を減らす(ロック中に呼ぶ)
+ * 参照がなくなれば受け取られていないシンボルを開放してTRUEを返す
+ * (処理の領域の開放はロックを外してから呼び出し元が行う)
+ */
+static int
+qrTaskUnref(QRTask *task)
+{
+	if (--task->refs > 0) {
+		return FALSE;
+	}
+	if (task->symbol != NULL) {
+		task->symalloc.release(task->symalloc.ctx, task->symbol);
+		task->symbol = NULL;
+	}
+	task->ex->ntasks--;
+	return TRUE;
+}
+
+/*
+ * 実行器の領域を開放する
+ * (ワーカーを停止し、すべての処理が開放されてから呼ぶ)
+ */
+static void
+qrExecutorFree(QRExecutor *ex)
+{
+#ifdef HAVE_PTHREAD
+	if (ex->threads != NULL) {
+		ex->allocator.release(ex->allocator.ctx, ex->threads);
+	}
+	pthread_cond_destroy(&(ex->wake));
+	pthread_mutex_destroy(&(ex->lock));
+#endif
+#if defined(QR_HAVE_EVENTFD) || defined(HAVE_PTHREAD)
+	if (ex->wfd != ex->rfd) {
+		close(ex->wfd);
+	}
+	if (ex->rfd != -1) {
+		close(ex->rfd);
+	}
+#endif
+	ex->allocator.release(ex->allocator.ctx, ex);
+}
+
+/*
+ * 完了リストに処理が入ったことをファイル記述子に知らせる
+ * (ロック中に呼ぶ。書き込めないのは既に読み込み可能なときなので無視する)
+ */
+static void
+qrExecutorNotify(QRExecutor *ex)
+{
+#if defined(QR_HAVE_EVENTFD)
+	uint64_t one = 1;
+	ssize_t n;
+
+	n = write(ex->wfd, &one, sizeof(one));
+	(void)n;
+#elif defined(HAVE_PTHREAD)
+	char one = 1;
+	ssize_t n;
+
+	n = write(ex->wfd, &one, sizeof(one));
+	(void)n;
+#else
+	(void)ex;
+#endif
+}
+
+/*
+ * ファイル記述子への通知を読み捨てる(ロック中に呼ぶ)
+ */
+static void
+qrExecutorDrain(QRExecutor *ex)
+{
+#if defined(QR_HAVE_EVENTFD)
+	uint64_t count;
+	ssize_t n;
+
+	n = read(ex->rfd, &count, sizeof(count));
+	(void)n;
+#elif defined(HAVE_PTHREAD)
+	char buf[64];
+
+	while (read(ex->rfd, buf, sizeof(buf)) > 0) {
+		;
+	}
+#else
+	(void)ex;
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * ワーカースレッド
+ * 待ち行列から処理を取り出して実行し、停止を知らされたら終了する
+ */
+static void *
+qrExecutorWorker(void *arg)
+{
+	QRExecutor *ex = (QRExecutor *)arg;
+	QRTask *task;
+
+	for (;;) {
+		pthread_mutex_lock(&(ex->lock));
+		while (ex->head == NULL && !ex->shutdown) {
+			pthread_cond_wait(&(ex->wake), &(ex->lock));
+		}
+		task = ex->head;
+		if (task == NULL) {
+			pthread_mutex_unlock(&(ex->lock));
+			break;
+		}
+		ex->head = task->next;
+		if (ex->head == NULL) {
+			ex->tail = NULL;
+		}
+		task->next = NULL;
+		task->state = QR_TASK_RUNNING;
+		pthread_mutex_unlock(&(ex->lock));
+
+		qrTaskRun(task);
+		qrTaskComplete(task);
+	}
+
+	return NULL;
+}
+#endif
@@ -0,0 +1,452 @@
+/*
+ * QR Code Generator Library: Batch Encoding
+ *
+ * Core routines were originally written by Junn Ohta.
+ * Based on qr.c Version 0.1: 2004/4/3 (Public Domain)
+ *
+ * @package     libqr
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2013 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * スレッドをCPUに固定するpthread_attr_setaffinity_np()を使う
+ */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "qr.h"
+#include "qr_util.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#ifdef TRUE
+#undef TRUE
+#endif
+#ifdef FALSE
+#undef FALSE
+#endif
+#define TRUE 1
+#define FALSE 0
+
+/*
+ * スレッドごとの未処理の項目の範囲
+ * 自分の範囲は先頭から取り出し、他のスレッドは後ろ半分を盗む
+ */
+typedef struct qr_batchq_t {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;     /* 以下のメンバを保護する */
+#endif
+	int next;                 /* 次に処理する項目 */
+	int end;                  /* 範囲の終わり(この項目は含まない) */
+} qr_batchq_t;
+
+/*
+ * 一括生成の仕事
+ */
+typedef struct qr_batchjob_t {
+	qr_batch_t *items;        /* 生成する項目 */
+	int fmt;                  /* 出力形式 */
+	int sep;                  /* 分離パターンの幅 */
+	int mag;                  /* ピクセル表示倍率 */
+	int nthreads;             /* スレッド数 */
+	qr_batchq_t *queues;      /* スレッドごとの未処理の項目 */
+} qr_batchjob_t;
+
+/*
+ * ワーカースレッドの引数
+ */
+typedef struct qr_batchworker_t {
+	qr_batchjob_t *job;       /* 一括生成の仕事 */
+	int self;                 /* このスレッドの番号 */
+} qr_batchworker_t;
+
+static void qrBatchRun(qr_batchjob_t *job, int self);
+static int qrBatchNext(qr_batchjob_t *job, int self);
+static void qrBatchEncode(qr_batchjob_t *job, QRCode **qrp, qr_batch_t *item);
+#ifdef HAVE_PTHREAD
+static void *qrBatchWorker(void *arg);
+static int qrBatchDefaultThreads(void);
+#endif
+static int qrBatchCheckCpus(const qr_batchopt_t *opt);
+
+/*
+ * 複数のシンボルを一括して生成し、形式fmtに変換する
+ * 各項目の入力データとパラメータから生成したシンボルを項目のsymbol、
+ * symsizeに、エラー番号をerrcodeに格納する(結果は入力と同じ順に並ぶ)
+ * 項目はスレッドごとに均等に割り振り、手の空いたスレッドは
+ * 他のスレッドに残っている項目の後ろ半分を盗んで処理するので、
+ * 型番によって生成にかかる時間が大きく異なっても負荷が偏らない
+ * optがNULLならオンラインのCPU数のスレッドを使い、CPUには固定しない
+ * (スレッドが使えない環境では呼び出し元のスレッドで順に処理する)
+ * 生成したシンボルはqrFreeBatch()で開放する
+ * 固定するCPU番号が範囲外か使えないCPUなら、または固定に失敗すれば、
+ * 何も生成せずにすべての項目のエラー番号をQR_ERR_INVALID_ARGにする
+ * すべての項目が成功すればTRUE、ひとつでも失敗すればFALSEを返す
+ */
+QR_API int
+qrEncodeBatch(qr_batch_t *items, int count, int fmt, int sep, int mag, const qr_batchopt_t *opt)
+{
+	const qr_allocator_t *allocator = qrGetAllocator();
+	qr_batchjob_t job;
+	int i, nthreads, pinned = TRUE;
+
+	if (count <= 0) {
+		return TRUE;
+	}
+	for (i = 0; i < count; i++) {
+		items[i].symbol = NULL;
+		items[i].symsize = 0;
+		items[i].errcode = QR_ERR_UNKNOWN;
+	}
+	if (!qrBatchCheckCpus(opt)) {
+		for (i = 0; i < count; i++) {
+			items[i].errcode = QR_ERR_INVALID_ARG;
+		}
+		return FALSE;
+	}
+
+	/*
+	 * スレッド数を決める
+	 */
+	nthreads = (opt != NULL) ? opt->threads : 0;
+#ifdef HAVE_PTHREAD
+	if (nthreads <= 0) {
+		nthreads = qrBatchDefaultThreads();
+	}
+#else
+	nthreads = 1;
+#endif
+	if (nthreads > count) {
+		nthreads = count;
+	}
+
+	job.items = items;
+	job.fmt = fmt;
+	job.sep = sep;
+	job.mag = mag;
+	job.nthreads = nthreads;
+	job.queues = (qr_batchq_t *)allocator->alloc(allocator->ctx, sizeof(qr_batchq_t) * (size_t)nthreads);
+	if (job.queues == NULL) {
+		for (i = 0; i < count; i++) {
+			items[i].errcode = QR_ERR_MEMORY_EXHAUSTED;
+		}
+		return FALSE;
+	}
+
+	/*
+	 * 項目を連続した範囲に分けて各スレッドに割り振る
+	 */
+	for (i = 0; i < nthreads; i++) {
+#ifdef HAVE_PTHREAD
+		pthread_mutex_init(&(job.queues[i].lock), NULL);
+#endif
+		job.queues[i].next = (int)((long long)count * i / nthreads);
+		job.queues[i].end = (int)((long long)count * (i + 1) / nthreads);
+	}
+
+#ifdef HAVE_PTHREAD
+	if (nthreads > 1) {
+		pthread_t *threads;
+		qr_batchworker_t *workers;
+		pthread_attr_t *attrs;
+		int started = 0, ninit = 0;
+
+		threads = (pthread_t *)allocator->alloc(allocator->ctx, sizeof(pthread_t) * (size_t)nthreads);
+		workers = (qr_batchworker_t *)allocator->alloc(allocator->ctx, sizeof(qr_batchworker_t) * (size_t)nthreads);
+		attrs = (pthread_attr_t *)allocator->alloc(allocator->ctx, sizeof(pthread_attr_t) * (size_t)nthreads);
+		if (threads != NULL && workers != NULL && attrs != NULL) {
+			/*
+			 * すべてのスレッドの属性を用意してから起動する
+			 * (CPUに固定できなければひとつも起動しない)
+			 */
+			for (ninit = 0; ninit < nthreads && pinned; ninit++) {
+				pthread_attr_init(&(attrs[ninit]));
+#if defined(__linux__)
+				if (opt != NULL && opt->cpus != NULL && opt->ncpus > 0) {
+					cpu_set_t cpuset;
+					CPU_ZERO(&cpuset);
+					CPU_SET(opt->cpus[ninit % opt->ncpus], &cpuset);
+					if (pthread_attr_setaffinity_np(&(attrs[ninit]), sizeof(cpu_set_t), &cpuset) != 0) {
+						pinned = FALSE;
+					}
+				}
+#endif
+			}
+			/*
+			 * ワーカースレッドを起動する
+			 * (起動できなかった分は他のスレッドが盗んで処理する)
+			 */
+			for (i = 0; i < nthreads && pinned; i++) {
+				workers[i].job = &job;
+				workers[i].self = i;
+				if (pthread_create(&(threads[started]), &(attrs[i]), qrBatchWorker, &(workers[i])) == 0) {
+					started++;
+				}
+			}
+			for (i = 0; i < ninit; i++) {
+				pthread_attr_destroy(&(attrs[i]));
+			}
+		}
+		/*
+		 * ひとつも起動できなければ呼び出し元が処理する
+		 */
+		if (started == 0 && pinned) {
+			qrBatchRun(&job, 0);
+		}
+		for (i = 0; i < started; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		if (threads != NULL) {
+			allocator->release(allocator->ctx, threads);
+		}
+		if (workers != NULL) {
+			allocator->release(allocator->ctx, workers);
+		}
+		if (attrs != NULL) {
+			allocator->release(allocator->ctx, attrs);
+		}
+	} else {
+		qrBatchRun(&job, 0);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_destroy(&(job.queues[i].lock));
+	}
+#else
+	qrBatchRun(&job, 0);
+#endif
+	allocator->release(allocator->ctx, job.queues);
+
+	if (!pinned) {
+		for (i = 0; i < count; i++) {
+			items[i].errcode = QR_ERR_INVALID_ARG;
+		}
+		return FALSE;
+	}
+	for (i = 0; i < count; i++) {
+		if (items[i].errcode != QR_ERR_NONE) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * qrEncodeBatch()で生成したシンボルを開放する
+ */
+QR_API void
+qrFreeBatch(qr_batch_t *items, int count)
+{
+	const qr_allocator_t *allocator = qrGetAllocator();
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (items[i].symbol != NULL) {
+			allocator->release(allocator->ctx, items[i].symbol);
+			items[i].symbol = NULL;
+		}
+		items[i].symsize = 0;
+	}
+}
+
+/*
+ * 未処理の項目がなくなるまで取り出して生成する
+ * QRCodeオブジェクトはスレッドごとにひとつ作り、項目ごとにqrReset()で再利用する
+ */
+static void
+qrBatchRun(qr_batchjob_t *job, int self)
+{
+	QRCode *qr = NULL;
+	int i;
+
+	while ((i = qrBatchNext(job, self)) != -1) {
+		qrBatchEncode(job, &qr, &(job->items[i]));
+	}
+	qrDestroy(qr);
+}
+
+/*
+ * 次に処理する項目の番号を返す(なければ-1)
+ * 自分の範囲が空なら、残りの最も多いスレッドから後ろ半分を盗む
+ * (項目は増えないので、すべての範囲が空なら仕事は終わっている)
+ */
+static int
+qrBatchNext(qr_batchjob_t *job, int self)
+{
+	qr_batchq_t *q = &(job->queues[self]);
+	int i, n, victim, most;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&(q->lock));
+#endif
+	i = (q->next < q->end) ? q->next++ : -1;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&(q->lock));
+#endif
+	if (i != -1 || job->nthreads == 1) {
+		return i;
+	}
+
+#ifdef HAVE_PTHREAD
+	for (;;) {
+		/*
+		 * 残りの最も多いスレッドを探す
+		 * (盗むまでに減っているかもしれないので、盗むときに確かめる)
+		 */
+		victim = -1;
+		most = 0;
+		for (n = 0; n < job->nthreads; n++) {
+			int remain;
+			if (n == self) {
+				continue;
+			}
+			pthread_mutex_lock(&(job->queues[n].lock));
+			remain = job->queues[n].end - job->queues[n].next;
+			pthread_mutex_unlock(&(job->queues[n].lock));
+			if (remain > most) {
+				victim = n;
+				most = remain;
+			}
+		}
+		if (victim == -1) {
+			return -1;
+		}
+
+		/*
+		 * 後ろ半分を自分の範囲にする
+		 * (1項目だけ残っていればそれを盗む)
+		 */
+		pthread_mutex_lock(&(job->queues[victim].lock));
+		n = job->queues[victim].end - job->queues[victim].next;
+		if (n <= 0) {
+			pthread_mutex_unlock(&(job->queues[victim].lock));
+			continue;
+		}
+		n = (n + 1) / 2;
+		job->queues[victim].end -= n;
+		i = job->queues[victim].end;
+		pthread_mutex_unlock(&(job->queues[victim].lock));
+
+		pthread_mutex_lock(&(q->lock));
+		q->next = i + 1;
+		q->end = i + n;
+		pthread_mutex_unlock(&(q->lock));
+		return i;
+	}
+#else
+	(void)n;
+	(void)victim;
+	(void)most;
+	return -1;
+#endif
+}
+
+/*
+ * 項目をひとつ生成する
+ */
+static void
+qrBatchEncode(qr_batchjob_t *job, QRCode **qrp, qr_batch_t *item)
+{
+	const qr_param_t *param = &(item->param);
+	QRCode *qr = *qrp;
+	int errcode = QR_ERR_NONE;
+
+	if (qr == NULL) {
+		qr = qrInit(param->version, param->mode, param->eclevel, param->masktype, &errcode);
+		if (qr == NULL) {
+			item->errcode = errcode;
+			return;
+		}
+		*qrp = qr;
+	} else if (!qrReset(qr, param->version, param->mode, param->eclevel, param->masktype)) {
+		item->errcode = qrGetErrorCode(qr);
+		return;
+	}
+
+	if (!qrAddData2(qr, item->source, item->size, param->mode) || !qrFinalize(qr)) {
+		item->errcode = qrGetErrorCode(qr);
+		return;
+	}
+	item->symbol = qrGetSymbol(qr, job->fmt, job->sep, job->mag, &(item->symsize));
+	if (item->symbol == NULL) {
+		item->errcode = qrGetErrorCode(qr);
+		return;
+	}
+	item->errcode = QR_ERR_NONE;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * ワーカースレッド
+ */
+static void *
+qrBatchWorker(void *arg)
+{
+	qr_batchworker_t *worker = (qr_batchworker_t *)arg;
+
+	qrBatchRun(worker->job, worker->self);
+	return NULL;
+}
+
+/*
+ * 既定のスレッド数(オンラインのCPU数)を返す
+ */
+static int
+qrBatchDefaultThreads(void)
+{
+	long n = -1;
+
+#if defined(_SC_NPROCESSORS_ONLN)
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return (n > 0) ? (int)n : 1;
+}
+#endif
+
+/*
+ * スレッドを固定するCPU番号を確かめる
+ * (負の番号や、このプロセスが使えないCPUの番号があればFALSEを返す)
+ */
+static int
+qrBatchCheckCpus(const qr_batchopt_t *opt)
+{
+	int i;
+
+	if (opt == NULL || opt->cpus == NULL) {
+		return TRUE;
+	}
+	if (opt->ncpus < 0) {
+		return FALSE;
+	}
+	for (i = 0; i < opt->ncpus; i++) {
+		if (opt->cpus[i] < 0) {
+			return FALSE;
+		}
+	}
+#if defined(HAVE_PTHREAD) && defined(__linux__)
+	if (opt->ncpus > 0) {
+		cpu_set_t allowed;
+
+		if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+			return FALSE;
+		}
+		for (i = 0; i < opt->ncpus; i++) {
+			if (opt->cpus[i] >= CPU_SETSIZE || !CPU_ISSET(opt->cpus[i], &allowed)) {
+				return FALSE;
+			}
+		}
+	}
+#endif
+	return TRUE;
+}
@@ -0,0 +1,671 @@
+/*
+ * QR Code Generator Library: Symbol Cache
+ *
+ * Core routines were originally written by Junn Ohta.
+ * Based on qr.c Version 0.1: 2004/4/3 (Public Domain)
+ *
+ * @package     libqr
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2013 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "qr.h"
+#include "qr_util.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef TRUE
+#undef TRUE
+#endif
+#ifdef FALSE
+#undef FALSE
+#endif
+#define TRUE 1
+#define FALSE 0
+
+/*
+ * 既定のシャード数と、シャードごとのハッシュ表の初期の大きさ
+ */
+#define QR_CACHE_SHARDS  16
+#define QR_CACHE_BUCKETS 64
+
+/*
+ * エントリの種類
+ */
+#define QR_CACHE_SYMBOL 0  /* ファイナライズ済みのシンボル */
+#define QR_CACHE_OUTPUT 1  /* qrGetSymbol()で変換した出力 */
+
+/*
+ * シャードの排他制御
+ * (スレッドが使えない環境では何もしない)
+ */
+#ifdef HAVE_PTHREAD
+#define qrShardLock(sh)   pthread_mutex_lock(&((sh)->lock))
+#define qrShardUnlock(sh) pthread_mutex_unlock(&((sh)->lock))
+#else
+#define qrShardLock(sh)   ((void)(sh))
+#define qrShardUnlock(sh) ((void)(sh))
+#endif
+
+/*
+ * キャッシュのエントリ
+ * 入力データの複製はエントリの直後に置く
+ */
+typedef struct qr_cacheent_t {
+	struct qr_cacheent_t *chain;  /* ハッシュ表の同じバケットの次のエントリ */
+	struct qr_cacheent_t *prev;   /* LRUリストの前(より最近使われた)のエントリ */
+	struct qr_cacheent_t *next;   /* LRUリストの次(より古い)のエントリ */
+	uint64_t hash;            /* キーのハッシュ値 */
+	int kind;                 /* エントリの種類 */
+	qr_param_t param;         /* 型番、符号化モード、誤り訂正レベル、マスクパターン種別 */
+	int fmt;                  /* 出力形式(QR_CACHE_OUTPUTのみ) */
+	int sep;                  /* 分離パターンの幅(同上) */
+	int mag;                  /* ピクセル表示倍率(同上) */
+	size_t srclen;            /* 入力データのサイズ */
+	QRCode *qr;               /* 詰めたシンボル(QR_CACHE_SYMBOLのみ) */
+	qr_byte_t *output;        /* 出力(QR_CACHE_OUTPUTのみ) */
+	int outsize;              /* 出力のサイズ */
+	size_t bytes;             /* このエントリが使うバイト数 */
+} qr_cacheent_t;
+
+/*
+ * キャッシュのシャード
+ * キーのハッシュ値で選び、シャードごとにロックと容量を持つ
+ */
+typedef struct qr_cacheshard_t {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;     /* 以下のメンバを保護する */
+#endif
+	qr_cacheent_t **buckets;  /* ハッシュ表 */
+	size_t nbuckets;          /* ハッシュ表の大きさ(2の累乗) */
+	size_t entries;           /* エントリ数 */
+	size_t bytes;             /* エントリが使うバイト数の合計 */
+	qr_cacheent_t *head;      /* LRUリストの先頭(最も最近使われた) */
+	qr_cacheent_t *tail;      /* LRUリストの末尾(最も古い) */
+	unsigned long hits;       /* 出力が見つかった回数 */
+	unsigned long symhits;    /* シンボルだけが見つかった回数 */
+	unsigned long misses;     /* どちらも見つからなかった回数 */
+	unsigned long evictions;  /* 容量を超えて追い出した回数 */
+} qr_cacheshard_t;
+
+/*
+ * シンボルのキャッシュ
+ */
+struct qrcode_cache_t {
+	qr_cacheshard_t *shards;  /* シャード */
+	int nshards;              /* シャード数(2の累乗) */
+	size_t maxbytes;          /* シャードごとの容量 */
+	qr_allocator_t allocator; /* キャッシュとエントリの領域を確保するアロケータ */
+};
+
+static uint64_t qrCacheHash(const qr_iovec_t *iov, int iovcnt, const qr_param_t *param, size_t *srclen);
+static uint64_t qrCacheHashOutput(uint64_t hash, int fmt, int sep, int mag);
+static qr_cacheent_t *qrCacheFind(qr_cacheshard_t *sh, uint64_t hash, int kind,
+		const qr_iovec_t *iov, int iovcnt, size_t srclen, const qr_param_t *param,
+		int fmt, int sep, int mag);
+static int qrCacheInsert(QRCache *cache, qr_cacheshard_t *sh, qr_cacheent_t *ent);
+static qr_cacheent_t *qrCacheNewEntry(QRCache *cache, uint64_t hash, int kind,
+		const qr_iovec_t *iov, int iovcnt, size_t srclen, const qr_param_t *param);
+static void qrCacheUnlink(qr_cacheshard_t *sh, qr_cacheent_t *ent);
+static void qrCacheFreeEntry(QRCache *cache, qr_cacheent_t *ent);
+static qr_byte_t *qrCacheCopyOutput(const qr_cacheent_t *ent, int *size, int *errcode);
+
+/*
+ * シンボルのキャッシュを生成する
+ * maxbytesはエントリが使うバイト数の上限で、シャードごとに等分し、
+ * 超えたシャードでは最も長く使われていないエントリから追い出す
+ * shardsはシャード数(0: 既定値)で、2の累乗に切り上げる
+ */
+QR_API QRCache *
+qrCacheCreate(size_t maxbytes, int shards, int *errcode)
+{
+	const qr_allocator_t *allocator = qrGetAllocator();
+	QRCache *cache;
+	int i, n;
+
+	if (maxbytes == 0 || shards < 0) {
+		*errcode = QR_ERR_INVALID_ARG;
+		return NULL;
+	}
+	if (shards == 0) {
+		shards = QR_CACHE_SHARDS;
+	}
+	for (n = 1; n < shards && n < (1 << 16); n <<= 1) {
+		;
+	}
+
+	cache = (QRCache *)qrAllocZero(allocator, sizeof(QRCache));
+	if (cache == NULL) {
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
+		return NULL;
+	}
+	cache->allocator = *allocator;
+	cache->nshards = n;
+	cache->maxbytes = maxbytes / (size_t)n;
+	cache->shards = (qr_cacheshard_t *)qrAllocZero(allocator, sizeof(qr_cacheshard_t) * (size_t)n);
+	if (cache->shards == NULL) {
+		allocator->release(allocator->ctx, cache);
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		qr_cacheshard_t *sh = &(cache->shards[i]);
+#ifdef HAVE_PTHREAD
+		pthread_mutex_init(&(sh->lock), NULL);
+#endif
+		sh->buckets = (qr_cacheent_t **)qrAllocZero(allocator, sizeof(qr_cacheent_t *) * QR_CACHE_BUCKETS);
+		if (sh->buckets == NULL) {
+			cache->nshards = i + 1;
+			qrCacheDestroy(cache);
+			*errcode = QR_ERR_MEMORY_EXHAUSTED;
+			return NULL;
+		}
+		sh->nbuckets = QR_CACHE_BUCKETS;
+	}
+
+	return cache;
+}
+
+/*
+ * キャッシュを破棄する
+ * (返したシンボルや出力はキャッシュとは独立しているので影響を受けない)
+ */
+QR_API void
+qrCacheDestroy(QRCache *cache)
+{
+	int i;
+
+	if (cache == NULL) {
+		return;
+	}
+	qrCacheClear(cache);
+	for (i = 0; i < cache->nshards; i++) {
+		qr_cacheshard_t *sh = &(cache->shards[i]);
+		if (sh->buckets != NULL) {
+			cache->allocator.release(cache->allocator.ctx, sh->buckets);
+		}
+#ifdef HAVE_PTHREAD
+		pthread_mutex_destroy(&(sh->lock));
+#endif
+	}
+	cache->allocator.release(cache->allocator.ctx, cache->shards);
+	cache->allocator.release(cache->allocator.ctx, cache);
+}
+
+/*
+ * すべてのエントリを捨てる(カウンタはそのまま)
+ */
+QR_API void
+qrCacheClear(QRCache *cache)
+{
+	qr_cacheent_t *ent, *next;
+	int i;
+
+	for (i = 0; i < cache->nshards; i++) {
+		qr_cacheshard_t *sh = &(cache->shards[i]);
+
+		qrShardLock(sh);
+		ent = sh->head;
+		sh->head = sh->tail = NULL;
+		if (sh->buckets != NULL) {
+			memset(sh->buckets, 0, sizeof(qr_cacheent_t *) * sh->nbuckets);
+		}
+		sh->entries = 0;
+		sh->bytes = 0;
+		qrShardUnlock(sh);
+
+		for (; ent != NULL; ent = next) {
+			next = ent->next;
+			qrCacheFreeEntry(cache, ent);
+		}
+	}
+}
+
+/*
+ * キャッシュの統計を得る(全シャードの合計)
+ */
+QR_API void
+qrCacheGetStats(QRCache *cache, qr_cachestat_t *stat)
+{
+	int i;
+
+	memset(stat, 0, sizeof(qr_cachestat_t));
+	for (i = 0; i < cache->nshards; i++) {
+		qr_cacheshard_t *sh = &(cache->shards[i]);
+
+		qrShardLock(sh);
+		stat->hits += sh->hits;
+		stat->symhits += sh->symhits;
+		stat->misses += sh->misses;
+		stat->evictions += sh->evictions;
+		stat->entries += sh->entries;
+		stat->bytes += sh->bytes;
+		qrShardUnlock(sh);
+	}
+}
+
+/*
+ * 入力データからシンボルを生成して形式fmtに変換する
+ * 同じ入力データ・パラメータ・出力形式の出力がキャッシュにあればその複製を返し、
+ * ファイナライズ済みのシンボルだけがあれば変換だけを行う
+ * どちらもなければ生成・変換して両方をキャッシュに入れる
+ * 返した出力はqrFreeBuffer()で開放する
+ */
+QR_API qr_byte_t *
+qrCacheGetSymbol(QRCache *cache, const qr_byte_t *source, int size, const qr_param_t *param,
+		int fmt, int sep, int mag, int *outsize, int *errcode)
+{
+	qr_iovec_t iov;
+
+	if (source == NULL || size <= 0) {
+		*errcode = QR_ERR_EMPTY_SRC;
+		return NULL;
+	}
+	iov.iov_base = source;
+	iov.iov_len = (size_t)size;
+
+	return qrCacheGetSymbolV(cache, &iov, 1, param, fmt, sep, mag, outsize, errcode);
+}
+
+/*
+ * 断片に分かれた入力データからシンボルを生成して形式fmtに変換する
+ * (断片の区切り方はキーに含めず、連結したデータが同じなら同じエントリを使う)
+ */
+QR_API qr_byte_t *
+qrCacheGetSymbolV(QRCache *cache, const qr_iovec_t *iov, int iovcnt, const qr_param_t *param,
+		int fmt, int sep, int mag, int *outsize, int *errcode)
+{
+	qr_cacheshard_t *sh;
+	qr_cacheent_t *ent, *sym, *out;
+	QRCode *qr, *cp = NULL;
+	qr_byte_t *buf;
+	uint64_t hash, ohash;
+	size_t srclen;
+	int bufsize, size;
+
+	if (fmt < 0 || fmt >= QR_FMT_COUNT) {
+		*errcode = QR_ERR_INVALID_FMT;
+		return NULL;
+	}
+	hash = qrCacheHash(iov, iovcnt, param, &srclen);
+	ohash = qrCacheHashOutput(hash, fmt, sep, mag);
+	sh = &(cache->shards[hash & (uint64_t)(cache->nshards - 1)]);
+
+	/*
+	 * 出力を探し、なければシンボルを探す
+	 * (シンボルはロック中に複製し、追い出されても使えるようにする)
+	 */
+	qrShardLock(sh);
+	ent = qrCacheFind(sh, ohash, QR_CACHE_OUTPUT, iov, iovcnt, srclen, param, fmt, sep, mag);
+	if (ent != NULL) {
+		sh->hits++;
+		buf = qrCacheCopyOutput(ent, outsize, errcode);
+		qrShardUnlock(sh);
+		return buf;
+	}
+	ent = qrCacheFind(sh, hash, QR_CACHE_SYMBOL, iov, iovcnt, srclen, param, 0, 0, 0);
+	if (ent != NULL) {
+		cp = qrClone(ent->qr, errcode);
+		if (cp == NULL) {
+			qrShardUnlock(sh);
+			return NULL;
+		}
+		sh->symhits++;
+	} else {
+		sh->misses++;
+	}
+	qrShardUnlock(sh);
+
+	/*
+	 * シンボルがなければ生成する
+	 */
+	qr = cp;
+	if (qr == NULL) {
+		qr = qrInit(param->version, param->mode, param->eclevel, param->masktype, errcode);
+		if (qr == NULL) {
+			return NULL;
+		}
+		if (!qrAddDataV(qr, iov, iovcnt, param->mode) || !qrFinalize(qr)) {
+			*errcode = qrGetErrorCode(qr);
+			qrDestroy(qr);
+			return NULL;
+		}
+	}
+
+	buf = qrGetSymbol(qr, fmt, sep, mag, &bufsize);
+	if (buf == NULL) {
+		*errcode = qrGetErrorCode(qr);
+		qrDestroy(qr);
+		return NULL;
+	}
+
+	/*
+	 * キャッシュに入れる
+	 * (エントリを作れなくても生成した出力は返す)
+	 */
+	sym = NULL;
+	if (cp == NULL && qrCompact(qr)) {
+		sym = qrCacheNewEntry(cache, hash, QR_CACHE_SYMBOL, iov, iovcnt, srclen, param);
+		if (sym != NULL) {
+			sym->qr = qr;
+			size = qr_vertable[qr->param.version].dimension;
+			sym->bytes += sizeof(QRCode) + ((size_t)size * (size_t)size + 7) / 8;
+			qr = NULL;
+		}
+	}
+	if (qr != NULL) {
+		qrDestroy(qr);
+	}
+	out = qrCacheNewEntry(cache, ohash, QR_CACHE_OUTPUT, iov, iovcnt, srclen, param);
+	if (out != NULL) {
+		out->output = (qr_byte_t *)cache->allocator.alloc(cache->allocator.ctx, (size_t)bufsize);
+		if (out->output == NULL) {
+			qrCacheFreeEntry(cache, out);
+			out = NULL;
+		} else {
+			memcpy(out->output, buf, (size_t)bufsize);
+			out->outsize = bufsize;
+			out->fmt = fmt;
+			out->sep = sep;
+			out->mag = mag;
+			out->bytes += (size_t)bufsize;
+		}
+	}
+
+	/*
+	 * 入れられなかったエントリと、容量を超えて古い順に追い出したエントリは
+	 * ロックを外してから開放する
+	 */
+	ent = NULL;
+	qrShardLock(sh);
+	if (sym != NULL && !qrCacheInsert(cache, sh, sym)) {
+		sym->next = ent;
+		ent = sym;
+	}
+	if (out != NULL && !qrCacheInsert(cache, sh, out)) {
+		out->next = ent;
+		ent = out;
+	}
+	while (sh->bytes > cache->maxbytes && sh->tail != NULL) {
+		qr_cacheent_t *victim = sh->tail;
+		qrCacheUnlink(sh, victim);
+		victim->next = ent;
+		ent = victim;
+		sh->evictions++;
+	}
+	qrShardUnlock(sh);
+	while (ent != NULL) {
+		qr_cacheent_t *next = ent->next;
+		qrCacheFreeEntry(cache, ent);
+		ent = next;
+	}
+
+	if (outsize != NULL) {
+		*outsize = bufsize;
+	}
+	return buf;
+}
+
+/*
+ * キーのハッシュ値を計算する(64ビットFNV-1a)
+ * 入力データの合計サイズをsrclenに格納する
+ */
+static uint64_t
+qrCacheHash(const qr_iovec_t *iov, int iovcnt, const qr_param_t *param, size_t *srclen)
+{
+	const uint64_t prime = 0x100000001b3ULL;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const qr_byte_t *p;
+	size_t len = 0, n;
+	int i;
+
+	hash = (hash ^ (uint64_t)(param->version & 0xff)) * prime;
+	hash = (hash ^ (uint64_t)(param->mode & 0xff)) * prime;
+	hash = (hash ^ (uint64_t)(param->eclevel & 0xff)) * prime;
+	hash = (hash ^ (uint64_t)(param->masktype & 0xff)) * prime;
+	for (i = 0; i < iovcnt; i++) {
+		p = (const qr_byte_t *)iov[i].iov_base;
+		for (n = 0; n < iov[i].iov_len; n++) {
+			hash = (hash ^ p[n]) * prime;
+		}
+		len += iov[i].iov_len;
+	}
+	*srclen = len;
+
+	return hash;
+}
+
+/*
+ * 出力のキーのハッシュ値を計算する
+ * (シンボルと同じシャードに入るよう、下位ビットは変えない)
+ */
+static uint64_t
+qrCacheHashOutput(uint64_t hash, int fmt, int sep, int mag)
+{
+	uint64_t h;
+
+	h = ((uint64_t)(fmt & 0xff) << 56) | ((uint64_t)(sep & 0xff) << 48) | ((uint64_t)(mag & 0xffff) << 32);
+	h = (h | 1) * 0x9e3779b97f4a7c15ULL;
+
+	return hash ^ (h & ~(uint64_t)0xffff);
+}
+
+/*
+ * エントリを探す(シャードのロック中に呼ぶ)
+ * 見つかればLRUリストの先頭に移す
+ * ハッシュ値が一致しても入力データとパラメータを比べ、衝突で別の出力を返さない
+ */
+static qr_cacheent_t *
+qrCacheFind(qr_cacheshard_t *sh, uint64_t hash, int kind,
+		const qr_iovec_t *iov, int iovcnt, size_t srclen, const qr_param_t *param,
+		int fmt, int sep, int mag)
+{
+	qr_cacheent_t *ent;
+	const qr_byte_t *key;
+	size_t off;
+	int i;
+
+	for (ent = sh->buckets[(hash >> 16) & (sh->nbuckets - 1)]; ent != NULL; ent = ent->chain) {
+		if (ent->hash != hash || ent->kind != kind || ent->srclen != srclen
+			|| memcmp(&(ent->param), param, sizeof(qr_param_t)) != 0)
+		{
+			continue;
+		}
+		if (kind == QR_CACHE_OUTPUT && (ent->fmt != fmt || ent->sep != sep || ent->mag != mag)) {
+			continue;
+		}
+		key = (const qr_byte_t *)(ent + 1);
+		off = 0;
+		for (i = 0; i < iovcnt; i++) {
+			if (memcmp(key + off, iov[i].iov_base, iov[i].iov_len) != 0) {
+				break;
+			}
+			off += iov[i].iov_len;
+		}
+		if (i < iovcnt) {
+			continue;
+		}
+
+		if (sh->head != ent) {
+			ent->prev->next = ent->next;
+			if (ent->next != NULL) {
+				ent->next->prev = ent->prev;
+			} else {
+				sh->tail = ent->prev;
+			}
+			ent->prev = NULL;
+			ent->next = sh->head;
+			sh->head->prev = ent;
+			sh->head = ent;
+		}
+		return ent;
+	}
+
+	return NULL;
+}
+
+/*
+ * エントリをシャードに入れる(シャードのロック中に呼ぶ)
+ * 同じキーのエントリが既にあるか、シャードの容量より大きければFALSEを返す
+ * (ロックを外している間に他のスレッドが入れたものを優先する)
+ */
+static int
+qrCacheInsert(QRCache *cache, qr_cacheshard_t *sh, qr_cacheent_t *ent)
+{
+	qr_iovec_t key;
+	size_t b;
+
+	if (ent->bytes > cache->maxbytes) {
+		return FALSE;
+	}
+	key.iov_base = (const void *)(ent + 1);
+	key.iov_len = ent->srclen;
+	if (qrCacheFind(sh, ent->hash, ent->kind, &key, 1, ent->srclen, &(ent->param),
+			ent->fmt, ent->sep, ent->mag) != NULL)
+	{
+		return FALSE;
+	}
+
+	/*
+	 * エントリ数がバケット数を超えたらハッシュ表を倍にする
+	 * (確保できなければそのままの大きさで使い続ける)
+	 */
+	if (sh->entries >= sh->nbuckets) {
+		qr_cacheent_t **buckets, *e, *next;
+		size_t n = sh->nbuckets * 2;
+
+		buckets = (qr_cacheent_t **)qrAllocZero(&(cache->allocator), sizeof(qr_cacheent_t *) * n);
+		if (buckets != NULL) {
+			for (b = 0; b < sh->nbuckets; b++) {
+				for (e = sh->buckets[b]; e != NULL; e = next) {
+					next = e->chain;
+					e->chain = buckets[(e->hash >> 16) & (n - 1)];
+					buckets[(e->hash >> 16) & (n - 1)] = e;
+				}
+			}
+			cache->allocator.release(cache->allocator.ctx, sh->buckets);
+			sh->buckets = buckets;
+			sh->nbuckets = n;
+		}
+	}
+
+	b = (size_t)(ent->hash >> 16) & (sh->nbuckets - 1);
+	ent->chain = sh->buckets[b];
+	sh->buckets[b] = ent;
+	ent->prev = NULL;
+	ent->next = sh->head;
+	if (sh->head != NULL) {
+		sh->head->prev = ent;
+	} else {
+		sh->tail = ent;
+	}
+	sh->head = ent;
+	sh->entries++;
+	sh->bytes += ent->bytes;
+
+	return TRUE;
+}
+
+/*
+ * エントリを作り、キーの入力データを複製する
+ */
+static qr_cacheent_t *
+qrCacheNewEntry(QRCache *cache, uint64_t hash, int kind,
+		const qr_iovec_t *iov, int iovcnt, size_t srclen, const qr_param_t *param)
+{
+	qr_cacheent_t *ent;
+	qr_byte_t *key;
+	int i;
+
+	ent = (qr_cacheent_t *)qrAllocZero(&(cache->allocator), sizeof(qr_cacheent_t) + srclen);
+	if (ent == NULL) {
+		return NULL;
+	}
+	ent->hash = hash;
+	ent->kind = kind;
+	ent->param = *param;
+	ent->srclen = srclen;
+	ent->bytes = sizeof(qr_cacheent_t) + srclen;
+	key = (qr_byte_t *)(ent + 1);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(key, iov[i].iov_base, iov[i].iov_len);
+		key += iov[i].iov_len;
+	}
+
+	return ent;
+}
+
+/*
+ * エントリをハッシュ表とLRUリストから外す(シャードのロック中に呼ぶ)
+ */
+static void
+qrCacheUnlink(qr_cacheshard_t *sh, qr_cacheent_t *ent)
+{
+	qr_cacheent_t **pp;
+
+	pp = &(sh->buckets[(ent->hash >> 16) & (sh->nbuckets - 1)]);
+	while (*pp != ent) {
+		pp = &((*pp)->chain);
+	}
+	*pp = ent->chain;
+
+	if (ent->prev != NULL) {
+		ent->prev->next = ent->next;
+	} else {
+		sh->head = ent->next;
+	}
+	if (ent->next != NULL) {
+		ent->next->prev = ent->prev;
+	} else {
+		sh->tail = ent->prev;
+	}
+	ent->prev = ent->next = NULL;
+	sh->entries--;
+	sh->bytes -= ent->bytes;
+}
+
+/*
+ * エントリを開放する
+ * (シンボルを複製したオブジェクトとは共有を解くだけなので、ロックは要らない)
+ */
+static void
+qrCacheFreeEntry(QRCache *cache, qr_cacheent_t *ent)
+{
+	if (ent->qr != NULL) {
+		qrDestroy(ent->qr);
+	}
+	if (ent->output != NULL) {
+		cache->allocator.release(cache->allocator.ctx, ent->output);
+	}
+	cache->allocator.release(cache->allocator.ctx, ent);
+}
+
+/*
+ * 出力の複製を返す(シャードのロック中に呼ぶ)
+ */
+static qr_byte_t *
+qrCacheCopyOutput(const qr_cacheent_t *ent, int *size, int *errcode)
+{
+	const qr_allocator_t *allocator = qrGetAllocator();
+	qr_byte_t *buf;
+
+	buf = (qr_byte_t *)allocator->alloc(allocator->ctx, (size_t)ent->outsize);
+	if (buf == NULL) {
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
+		return NULL;
+	}
+	memcpy(buf, ent->output, (size_t)ent->outsize);
+	if (size != NULL) {
+		*size = ent->outsize;
+	}
+
+	return buf;
+}
@@ -170,7 +170,8 @@ qrShowHelp(void)
 	writeln("                        8: 8-bit byte, K: JIS X 0208 Kanji, S: auto");
 	writeln("  -e, --eclevel=LEVEL   error correction level (L,M,Q,H, default: M)");
 	writeln("                        L: 7%%, M: 15%%, Q: 25%%, H: 30%%");
-	writeln("  -p, --pattern=NUM     mask pattern (0-7, default: auto)");
+	writeln("  -p, --pattern=NUM     mask pattern (0-7, F, default: auto)");
+	writeln("                        F: fast selection (not always optimal)");
 	writeln("  -x, --magnify=NUM     magnifying ratio (1-16, default: 1)");
 	writeln("  -s, --separator=NUM   separator pattan width (0-16, default: 4)");
 	writeln("                        '4' is the lower limit of the QR Code specification.");
@@ -338,12 +339,16 @@ qrGetParameter(int argc, char **argv,
 			 * マスクパターン種別
 			 */
 			QR_GETOPT_NEXT();
-			if (*ptr < '0' || *ptr > '9') {
-				errx(1, "%s: %s", ptr, qrStrError(QR_ERR_INVALID_MPT));
-			}
-			masktype = atoi(ptr);
-			if (masktype < 0 || masktype >= QR_MPT_MAX) {
-				errx(1, "%d: %s", masktype, qrStrError(QR_ERR_INVALID_MPT));
+			if ((*ptr == 'F' || *ptr == 'f') && *(ptr + 1) == '\0') {
+				masktype = QR_MPT_FAST;
+			} else {
+				if (*ptr < '0' || *ptr > '9') {
+					errx(1, "%s: %s", ptr, qrStrError(QR_ERR_INVALID_MPT));
+				}
+				masktype = atoi(ptr);
+				if (masktype < 0 || masktype >= QR_MPT_MAX) {
+					errx(1, "%d: %s", masktype, qrStrError(QR_ERR_INVALID_MPT));
+				}
 			}
 
 		} else if (QR_SHORT_OPT("-x") || QR_LONG_OPT("--magnify")) {
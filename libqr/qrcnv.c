@@ -16,6 +16,27 @@
 
 #define repeat(m, n) for ((m) = 0; (m) < (n); (m)++)
 
+/* }}} */
+/* {{{ zlib memory allocators */
+
+/*
+ * zlibの作業領域をオブジェクトのアロケータで確保/開放する
+ * (opaqueはqr_allocator_tへのポインタ)
+ */
+void *
+qrcnvZAlloc(void *opaque, unsigned int items, unsigned int size)
+{
+	const qr_allocator_t *allocator = (const qr_allocator_t *)opaque;
+	return allocator->alloc(allocator->ctx, (size_t)items * (size_t)size);
+}
+
+void
+qrcnvZFree(void *opaque, void *ptr)
+{
+	const qr_allocator_t *allocator = (const qr_allocator_t *)opaque;
+	allocator->release(allocator->ctx, ptr);
+}
+
 /* }}} */
 /* {{{ symbol writing macro */
 
@@ -239,7 +260,7 @@ qrSymbolToDigit(QRCode *qr, int sep, int mag, int *size)
 #undef qrWriteBLM
 #undef qrWriteDKM
 
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	return sbuf;
 }
@@ -290,7 +311,7 @@ qrSymbolToASCII(QRCode *qr, int sep, int mag, int *size)
 #undef qrWriteBLM
 #undef qrWriteDKM
 
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	return sbuf;
 }
@@ -349,7 +370,7 @@ qrSymbolToJSON(QRCode *qr, int sep, int mag, int *size)
 #undef qrWriteBLM
 #undef qrWriteDKM
 
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	return sbuf;
 }
@@ -413,7 +434,7 @@ qrSymbolToPBM(QRCode *qr, int sep, int mag, int *size)
 #undef qrWriteBLM
 #undef qrWriteDKM
 
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	return sbuf;
 }
@@ -473,7 +494,7 @@ qrsSymbolsToDigit(QRStructured *st, int sep, int mag, int order, int *size)
 #undef qrWriteBLM
 #undef qrWriteDKM
 
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	return sbuf;
 }
@@ -528,7 +549,7 @@ qrsSymbolsToASCII(QRStructured *st, int sep, int mag, int order, int *size)
 #undef qrWriteBLM
 #undef qrWriteDKM
 
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	return sbuf;
 }
@@ -597,7 +618,7 @@ qrsSymbolsToJSON(QRStructured *st, int sep, int mag, int order, int *size)
 #undef qrWriteBLM
 #undef qrWriteDKM
 
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	return sbuf;
 }
@@ -664,7 +685,7 @@ qrsSymbolsToPBM(QRStructured *st, int sep, int mag, int order, int *size)
 #undef qrWriteBLM
 #undef qrWriteDKM
 
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	return sbuf;
 }
@@ -65,17 +65,43 @@
 /* {{{ allocate memory for the working rowl and the symbo */
 
 #define QRCNV_MALLOC(rsize, ssize) { \
-	rbuf = (qr_byte_t *)malloc((size_t)(rsize)); \
+	rbuf = (qr_byte_t *)qrMalloc(qr, (size_t)(rsize)); \
 	if (rbuf == NULL) { \
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION); \
 	} \
-	sbuf = (qr_byte_t *)malloc((size_t)(ssize)); \
+	sbuf = (qr_byte_t *)qrMalloc(qr, (size_t)(ssize)); \
 	if (sbuf == NULL) { \
-		free(rbuf); \
+		qrRelease(qr, rbuf); \
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION); \
 	} \
 }
 
+/* }}} */
+/* {{{ let zlib allocate memory with the allocator of the object */
+
+void *qrcnvZAlloc(void *opaque, unsigned int items, unsigned int size);
+void qrcnvZFree(void *opaque, void *ptr);
+
+#define QRCNV_ZSTREAM_INIT(zst) { \
+	(zst).zalloc = qrcnvZAlloc; \
+	(zst).zfree  = qrcnvZFree; \
+	(zst).opaque = (void *)&(qr->allocator); \
+}
+
+/*
+ * objects living in a workspace have no heap to fall back on,
+ * so deflate with a small window that fits in the spare workspace
+ * (the output is still a valid stream, only slightly larger)
+ */
+#define QRCNV_WSP_WINDOW_BITS 12
+#define QRCNV_WSP_MEM_LEVEL   4
+
+#define QRCNV_DEFLATE_INIT(zst, level) \
+	((qr->workspace != NULL) \
+		? deflateInit2(&(zst), (level), Z_DEFLATED, \
+				QRCNV_WSP_WINDOW_BITS, QRCNV_WSP_MEM_LEVEL, Z_DEFAULT_STRATEGY) \
+		: deflateInit(&(zst), (level)))
+
 /* }}} */
 /* {{{ check the state and the parameters */
 
@@ -165,7 +165,7 @@ qrSymbolToBMP(QRCode *qr, int sep, int mag, int *size)
 		sptr += sepskips;
 	}
 
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	return sbuf;
 }
@@ -262,7 +262,7 @@ qrsSymbolsToBMP(QRStructured *st, int sep, int mag, int order, int *size)
 		sptr += sepskips;
 	}
 
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	return sbuf;
 }
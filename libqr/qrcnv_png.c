@@ -45,9 +45,9 @@
 #define QRCNV_PNG_REALLOC(reqsize) { \
 	while (*size + (reqsize) > wsize) { \
 		wsize += QRCNV_PNG_BUFFER_UNIT; \
-		wbuf = realloc(wbuf, (size_t)wsize); \
+		wbuf = qrRealloc(qr, wbuf, (size_t)wsize); \
 		if (wbuf == NULL) { \
-			free(rbuf); \
+			qrRelease(qr, rbuf); \
 			deflateEnd(&zst); \
 			QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION); \
 		} \
@@ -65,8 +65,8 @@
 	} else { \
 		snprintf(&(_info[0]), 128, "%s", (errinfo)); \
 	} \
-	free(rbuf); \
-	free(wbuf); \
+	qrRelease(qr, rbuf); \
+	qrRelease(qr, wbuf); \
 	deflateEnd(&zst); \
 	QRCNV_RETURN_FAILURE(QR_ERR_DEFLATE, _info); \
 }
@@ -185,13 +185,13 @@ qrSymbolToPNG(QRCode *qr, int sep, int mag, int *size)
 	/*
 	 * メモリを確保し、画像を初期化する
 	 */
-	rbuf = (qr_byte_t *)malloc((size_t)rsize);
+	rbuf = (qr_byte_t *)qrMalloc(qr, (size_t)rsize);
 	if (rbuf == NULL) {
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
-	wbuf = (qr_byte_t *)malloc((size_t)wsize);
+	wbuf = (qr_byte_t *)qrMalloc(qr, (size_t)wsize);
 	if (wbuf == NULL) {
-		free(rbuf);
+		qrRelease(qr, rbuf);
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
 	wptr = qrPngWriteHeader(wbuf, imgdim, imgdim);
@@ -201,12 +201,10 @@ qrSymbolToPNG(QRCode *qr, int sep, int mag, int *size)
 	/*
 	 * deflate圧縮ストリームを初期化する
 	 */
-	zst.zalloc = Z_NULL;
-	zst.zfree  = Z_NULL;
-	zst.opaque = Z_NULL;
-	if (deflateInit(&zst, QRCNV_PNG_DEFLATE_LEVEL) != Z_OK) {
-		free(rbuf);
-		free(wbuf);
+	QRCNV_ZSTREAM_INIT(zst);
+	if (QRCNV_DEFLATE_INIT(zst, QRCNV_PNG_DEFLATE_LEVEL) != Z_OK) {
+		qrRelease(qr, rbuf);
+		qrRelease(qr, wbuf);
 		QRCNV_RETURN_FAILURE(QR_ERR_DEFLATE, "deflateInit()");
 	}
 	zst.next_out = &(zbuf[0]);
@@ -279,13 +277,13 @@ qrSymbolToPNG(QRCode *qr, int sep, int mag, int *size)
 	memcpy(wptr, zbuf, (size_t)zsize);
 	wptr += zsize;
 	*size += zsize;
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	/*
 	 * deflate圧縮ストリームを開放する
 	 */
 	if (deflateEnd(&zst) != Z_OK) {
-		free(wbuf);
+		qrRelease(qr, wbuf);
 		QRCNV_RETURN_FAILURE(QR_ERR_DEFLATE, "deflateEnd()");
 	}
 
@@ -301,7 +299,7 @@ qrSymbolToPNG(QRCode *qr, int sep, int mag, int *size)
 	/*
 	 * 余分に確保したメモリ領域を切り詰める
 	 */
-	wbuf = (qr_byte_t *)realloc(wbuf, (size_t)*size);
+	wbuf = (qr_byte_t *)qrRealloc(qr, wbuf, (size_t)*size);
 	if (wbuf == NULL) {
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
@@ -348,13 +346,13 @@ qrsSymbolsToPNG(QRStructured *st, int sep, int mag, int order, int *size)
 	/*
 	 * メモリを確保し、画像を初期化する
 	 */
-	rbuf = (qr_byte_t *)malloc((size_t)rsize);
+	rbuf = (qr_byte_t *)qrMalloc(qr, (size_t)rsize);
 	if (rbuf == NULL) {
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
-	wbuf = (qr_byte_t *)malloc((size_t)wsize);
+	wbuf = (qr_byte_t *)qrMalloc(qr, (size_t)wsize);
 	if (wbuf == NULL) {
-		free(rbuf);
+		qrRelease(qr, rbuf);
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
 	wptr = qrPngWriteHeader(wbuf, xdim, ydim);
@@ -364,12 +362,10 @@ qrsSymbolsToPNG(QRStructured *st, int sep, int mag, int order, int *size)
 	/*
 	 * deflate圧縮ストリームを初期化する
 	 */
-	zst.zalloc = Z_NULL;
-	zst.zfree  = Z_NULL;
-	zst.opaque = Z_NULL;
-	if (deflateInit(&zst, QRCNV_PNG_DEFLATE_LEVEL) != Z_OK) {
-		free(rbuf);
-		free(wbuf);
+	QRCNV_ZSTREAM_INIT(zst);
+	if (QRCNV_DEFLATE_INIT(zst, QRCNV_PNG_DEFLATE_LEVEL) != Z_OK) {
+		qrRelease(qr, rbuf);
+		qrRelease(qr, wbuf);
 		QRCNV_RETURN_FAILURE(QR_ERR_DEFLATE, "deflateInit()");
 	}
 	zst.next_out = &(zbuf[0]);
@@ -457,13 +453,13 @@ qrsSymbolsToPNG(QRStructured *st, int sep, int mag, int order, int *size)
 	memcpy(wptr, zbuf, (size_t)zsize);
 	wptr += zsize;
 	*size += zsize;
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	/*
 	 * deflate圧縮ストリームを開放する
 	 */
 	if (deflateEnd(&zst) != Z_OK) {
-		free(wbuf);
+		qrRelease(qr, wbuf);
 		QRCNV_RETURN_FAILURE(QR_ERR_DEFLATE, "deflateEnd()");
 	}
 
@@ -479,7 +475,7 @@ qrsSymbolsToPNG(QRStructured *st, int sep, int mag, int order, int *size)
 	/*
 	 * 余分に確保したメモリ領域を切り詰める
 	 */
-	wbuf = (qr_byte_t *)realloc(wbuf, (size_t)*size);
+	wbuf = (qr_byte_t *)qrRealloc(qr, wbuf, (size_t)*size);
 	if (wbuf == NULL) {
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
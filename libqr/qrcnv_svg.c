@@ -46,7 +46,7 @@
 #define QRCNV_SVG_REALLOC(reqsize) { \
 	while (*size + (reqsize) > bufsize) { \
 		bufsize += QRCNV_SVG_BUFFER_UNIT; \
-		wbuf = realloc(wbuf, (size_t)bufsize); \
+		wbuf = qrRealloc(qr, wbuf, (size_t)bufsize); \
 		if (wbuf == NULL) { \
 			QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION); \
 		} \
@@ -87,7 +87,7 @@ qrSymbolToSVG(QRCode *qr, int sep, int mag, int *size)
 	 * SVGを初期化する
 	 */
 	bufsize = QRCNV_SVG_BUFFER_UNIT;
-	wbuf = (char *)malloc((size_t)bufsize);
+	wbuf = (char *)qrMalloc(qr, (size_t)bufsize);
 	if (wbuf == NULL) {
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
@@ -125,16 +125,15 @@ qrSymbolToSVG(QRCode *qr, int sep, int mag, int *size)
 	*size += snprintf(wptr, 16, " </g>\n</svg>\n");
 
 	/*
-	 * SVGをコピーする
+	 * 余分に確保したメモリ領域を切り詰める
+	 * (コピーしないので、作業領域では出力領域にそのまま収まる)
 	 */
-	sbuf = (qr_byte_t *)malloc((size_t)(*size + 1));
+	sbuf = (qr_byte_t *)qrRealloc(qr, wbuf, (size_t)(*size + 1));
 	if (sbuf == NULL) {
-		free(wbuf);
+		qrRelease(qr, wbuf);
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
-	memcpy(sbuf, wbuf, (size_t)*size);
 	sbuf[*size] = '\0';
-	free(wbuf);
 
 	return sbuf;
 }
@@ -165,7 +164,7 @@ qrsSymbolsToSVG(QRStructured *st, int sep, int mag, int order, int *size)
 	 * SVGを初期化する
 	 */
 	bufsize = QRCNV_SVG_BUFFER_UNIT;
-	wbuf = (char *)malloc((size_t)bufsize);
+	wbuf = (char *)qrMalloc(qr, (size_t)bufsize);
 	if (wbuf == NULL) {
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
@@ -234,16 +233,15 @@ qrsSymbolsToSVG(QRStructured *st, int sep, int mag, int order, int *size)
 	*size += snprintf(wptr, 16, "</svg>\n");
 
 	/*
-	 * SVGをコピーする
+	 * 余分に確保したメモリ領域を切り詰める
+	 * (コピーしないので、作業領域では出力領域にそのまま収まる)
 	 */
-	sbuf = (qr_byte_t *)malloc((size_t)(*size + 1));
+	sbuf = (qr_byte_t *)qrRealloc(qr, wbuf, (size_t)(*size + 1));
 	if (sbuf == NULL) {
-		free(wbuf);
+		qrRelease(qr, wbuf);
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
-	memcpy(sbuf, wbuf, (size_t)*size);
 	sbuf[*size] = '\0';
-	free(wbuf);
 
 	return sbuf;
 }
@@ -62,9 +62,9 @@
 #define QRCNV_TIFF_REALLOC(reqsize) { \
 	while (*size + (reqsize) > wsize) { \
 		wsize += QRCNV_TIFF_BUFFER_UNIT; \
-		wbuf = realloc(wbuf, (size_t)wsize); \
+		wbuf = qrRealloc(qr, wbuf, (size_t)wsize); \
 		if (wbuf == NULL) { \
-			free(rbuf); \
+			qrRelease(qr, rbuf); \
 			if (compression == QRCNV_TIFF_COMPRESSION_ZIP) { \
 				deflateEnd(&zst); \
 			} \
@@ -84,8 +84,8 @@
 	} else { \
 		snprintf(&(_info[0]), 128, "%s", (errinfo)); \
 	} \
-	free(rbuf); \
-	free(wbuf); \
+	qrRelease(qr, rbuf); \
+	qrRelease(qr, wbuf); \
 	deflateEnd(&zst); \
 	QRCNV_RETURN_FAILURE(QR_ERR_DEFLATE, _info); \
 }
@@ -277,13 +277,13 @@ qrSymbolToTIFF(QRCode *qr, int sep, int mag, int *size)
 	/*
 	 * メモリを確保し、画像を初期化する
 	 */
-	rbuf = (qr_byte_t *)malloc((size_t)rsize);
+	rbuf = (qr_byte_t *)qrMalloc(qr, (size_t)rsize);
 	if (rbuf == NULL) {
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
-	wbuf = (qr_byte_t *)malloc((size_t)wsize);
+	wbuf = (qr_byte_t *)qrMalloc(qr, (size_t)wsize);
 	if (wbuf == NULL) {
-		free(rbuf);
+		qrRelease(qr, rbuf);
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
 	wptr = qrTiffWriteHeader(wbuf, imgdim, imgdim, rowsperstrip, totalstrips, compression);
@@ -293,12 +293,10 @@ qrSymbolToTIFF(QRCode *qr, int sep, int mag, int *size)
 	 * deflate圧縮ストリームを初期化する
 	 */
 	if (compression == QRCNV_TIFF_COMPRESSION_ZIP) {
-		zst.zalloc = Z_NULL;
-		zst.zfree  = Z_NULL;
-		zst.opaque = Z_NULL;
-		if (deflateInit(&zst, QRCNV_TIFF_DEFLATE_LEVEL) != Z_OK) {
-			free(rbuf);
-			free(wbuf);
+		QRCNV_ZSTREAM_INIT(zst);
+		if (QRCNV_DEFLATE_INIT(zst, QRCNV_TIFF_DEFLATE_LEVEL) != Z_OK) {
+			qrRelease(qr, rbuf);
+			qrRelease(qr, wbuf);
 			QRCNV_RETURN_FAILURE(QR_ERR_DEFLATE, "deflateInit()");
 		}
 	}
@@ -356,14 +354,14 @@ qrSymbolToTIFF(QRCode *qr, int sep, int mag, int *size)
 	if (ssize > 0) {
 		qrTiffWriteStrip();
 	}
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	/*
 	 * deflate圧縮ストリームを開放する
 	 */
 	if (compression == QRCNV_TIFF_COMPRESSION_ZIP) {
 		if (deflateEnd(&zst) != Z_OK) {
-			free(wbuf);
+			qrRelease(qr, wbuf);
 			QRCNV_RETURN_FAILURE(QR_ERR_DEFLATE, "deflateEnd()");
 		}
 	}
@@ -371,7 +369,7 @@ qrSymbolToTIFF(QRCode *qr, int sep, int mag, int *size)
 	/*
 	 * 余分に確保したメモリ領域を切り詰める
 	 */
-	wbuf = (qr_byte_t *)realloc(wbuf, (size_t)*size);
+	wbuf = (qr_byte_t *)qrRealloc(qr, wbuf, (size_t)*size);
 	if (wbuf == NULL) {
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
@@ -429,13 +427,13 @@ qrsSymbolsToTIFF(QRStructured *st, int sep, int mag, int order, int *size)
 	/*
 	 * メモリを確保し、画像を初期化する
 	 */
-	rbuf = (qr_byte_t *)malloc((size_t)rsize);
+	rbuf = (qr_byte_t *)qrMalloc(qr, (size_t)rsize);
 	if (rbuf == NULL) {
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
-	wbuf = (qr_byte_t *)malloc((size_t)wsize);
+	wbuf = (qr_byte_t *)qrMalloc(qr, (size_t)wsize);
 	if (wbuf == NULL) {
-		free(rbuf);
+		qrRelease(qr, rbuf);
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
 	wptr = qrTiffWriteHeader(wbuf, xdim, ydim, rowsperstrip, totalstrips, compression);
@@ -445,12 +443,10 @@ qrsSymbolsToTIFF(QRStructured *st, int sep, int mag, int order, int *size)
 	 * deflate圧縮ストリームを初期化する
 	 */
 	if (compression == QRCNV_TIFF_COMPRESSION_ZIP) {
-		zst.zalloc = Z_NULL;
-		zst.zfree  = Z_NULL;
-		zst.opaque = Z_NULL;
-		if (deflateInit(&zst, QRCNV_TIFF_DEFLATE_LEVEL) != Z_OK) {
-			free(rbuf);
-			free(wbuf);
+		QRCNV_ZSTREAM_INIT(zst);
+		if (QRCNV_DEFLATE_INIT(zst, QRCNV_TIFF_DEFLATE_LEVEL) != Z_OK) {
+			qrRelease(qr, rbuf);
+			qrRelease(qr, wbuf);
 			QRCNV_RETURN_FAILURE(QR_ERR_DEFLATE, "deflateInit()");
 		}
 	}
@@ -520,14 +516,14 @@ qrsSymbolsToTIFF(QRStructured *st, int sep, int mag, int order, int *size)
 	if (ssize > 0) {
 		qrTiffWriteStrip();
 	}
-	free(rbuf);
+	qrRelease(qr, rbuf);
 
 	/*
 	 * deflate圧縮ストリームを開放する
 	 */
 	if (compression == QRCNV_TIFF_COMPRESSION_ZIP) {
 		if (deflateEnd(&zst) != Z_OK) {
-			free(wbuf);
+			qrRelease(qr, wbuf);
 			QRCNV_RETURN_FAILURE(QR_ERR_DEFLATE, "deflateEnd()");
 		}
 	}
@@ -535,7 +531,7 @@ qrsSymbolsToTIFF(QRStructured *st, int sep, int mag, int order, int *size)
 	/*
 	 * 余分に確保したメモリ領域を切り詰める
 	 */
-	wbuf = (qr_byte_t *)realloc(wbuf, (size_t)*size);
+	wbuf = (qr_byte_t *)qrRealloc(qr, wbuf, (size_t)*size);
 	if (wbuf == NULL) {
 		QRCNV_RETURN_FAILURE2(QR_ERR_MEMORY_EXHAUSTED, _QR_FUNCTION);
 	}
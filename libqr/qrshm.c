@@ -0,0 +1,662 @@
+/*
+ * QR Code Generator Library: Shared-Memory Symbol Cache
+ *
+ * Core routines were originally written by Junn Ohta.
+ * Based on qr.c Version 0.1: 2004/4/3 (Public Domain)
+ *
+ * @package     libqr
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2013 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "qr.h"
+#include "qr_util.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * POSIXの共有メモリとGCC互換の不可分操作が使える環境でだけ有効にする
+ */
+#if !defined(WIN32) && (defined(__GNUC__) || defined(__clang__))
+#define QR_HAVE_SHM
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef TRUE
+#undef TRUE
+#endif
+#ifdef FALSE
+#undef FALSE
+#endif
+#define TRUE 1
+#define FALSE 0
+
+#ifdef QR_HAVE_SHM
+
+/*
+ * 共有メモリの識別子と配置の版
+ * (配置を変えたら版を上げ、古い配置の共有メモリには接続しない)
+ */
+#define QR_SHM_MAGIC  0x48535251UL  /* "QRSH" */
+#define QR_SHM_LAYOUT 3
+
+/*
+ * スラブの大きさの種類と、1つのキーが入りうるスロット数
+ * 領域を種類ごとに等分し、出力が収まる最小のスラブに入れる
+ */
+#define QR_SHM_CLASSES 4
+#define QR_SHM_WAYS    4
+static const size_t qr_shm_slabsize[QR_SHM_CLASSES] = { 1024, 4096, 16384, 65536 };
+
+/*
+ * 初期化の状態
+ */
+#define QR_SHM_INIT_NONE  0
+#define QR_SHM_INIT_BUSY  1
+#define QR_SHM_INIT_READY 2
+
+/*
+ * 作成や初期化を待つ回数(1ミリ秒ごと)
+ * (超えたら壊れた共有メモリとみなしてQR_ERR_STATEで失敗する)
+ */
+#define QR_SHM_WAIT 5000
+
+/*
+ * 不可分操作
+ */
+#define qrShmLoad(p)         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define qrShmSet(p, v)       __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define qrShmCas(p, o, n)    __sync_bool_compare_and_swap((p), (o), (n))
+#define qrShmIncrement(p)    __sync_add_and_fetch((p), 1)
+#define qrShmFence()         __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+/*
+ * スロットのロック語(上位32ビット: 書き込んでいるプロセス、下位32ビット: 版)
+ */
+#define qrShmLockWord(pid, ver) (((uint64_t)(pid) << 32) | (uint64_t)(uint32_t)(ver))
+#define qrShmLockOwner(lock)    ((uint32_t)((lock) >> 32))
+#define qrShmLockVersion(lock)  ((uint32_t)(lock))
+
+/*
+ * 共有メモリの先頭に置く管理情報
+ */
+typedef struct qr_shmhdr_t {
+	uint32_t magic;           /* 識別子(初期化が終わってから書く) */
+	uint32_t layout;          /* 配置の版 */
+	uint64_t init;            /* 初期化の状態と初期化しているプロセス(スロットのロック語と同じ形) */
+	uint64_t size;            /* 共有メモリの大きさ */
+	uint64_t offset[QR_SHM_CLASSES]; /* スラブの種類ごとの領域の位置 */
+	uint32_t nslots[QR_SHM_CLASSES]; /* スラブの種類ごとのスロット数(QR_SHM_WAYSの倍数) */
+	uint64_t clock;           /* 参照の通し番号(LRUの近似に使う) */
+	uint64_t hits;            /* 見つかった回数 */
+	uint64_t misses;          /* 見つからなかった回数 */
+	uint64_t evictions;       /* 有効なエントリを上書きした回数 */
+} qr_shmhdr_t;
+
+#define QR_SHM_HDRSIZE 4096
+
+/*
+ * スロットの先頭に置くエントリの情報
+ * 書き込み中はロック語の版を奇数にし(シーケンスロック)、読み込み前後で
+ * ロック語が同じ偶数の版なら途中で書き換えられていないと判断する
+ * 書き込むプロセスは版と同時に自分のプロセスIDをロック語に入れるので、
+ * 書き込み中のスロットを誰が持っているかは常にロック語だけで分かる
+ * キーの入力データと出力はこの直後に続く
+ */
+typedef struct qr_shmslot_t {
+	uint64_t lock;            /* ロック語(版 0: 空、奇数: 書き込み中) */
+	uint64_t tick;            /* 最後に参照された通し番号 */
+	uint64_t hash;            /* キーのハッシュ値 */
+	int32_t param[4];         /* 型番、符号化モード、誤り訂正レベル、マスクパターン種別 */
+	int32_t fmt;              /* 出力形式 */
+	int32_t sep;              /* 分離パターンの幅 */
+	int32_t mag;              /* ピクセル表示倍率 */
+	uint32_t srclen;          /* 入力データのサイズ */
+	uint32_t outsize;         /* 出力のサイズ */
+	uint32_t reserved;
+} qr_shmslot_t;
+
+#endif /* QR_HAVE_SHM */
+
+/*
+ * 共有メモリのキャッシュに接続したもの
+ */
+struct qrcode_shmcache_t {
+	void *base;               /* 割り当てたアドレス */
+	size_t size;              /* 割り当てた大きさ */
+};
+
+#ifdef QR_HAVE_SHM
+static int qrShmFormat(qr_shmhdr_t *hdr, size_t size);
+static uint64_t qrShmHash(const qr_byte_t *source, size_t size, const qr_param_t *param,
+		int fmt, int sep, int mag);
+static qr_shmslot_t *qrShmSlot(QRShmCache *sc, int cls, uint32_t i);
+static qr_byte_t *qrShmLookup(QRShmCache *sc, uint64_t hash, const qr_byte_t *source, size_t size,
+		const qr_param_t *param, int fmt, int sep, int mag, int *outsize);
+static void qrShmStore(QRShmCache *sc, uint64_t hash, const qr_byte_t *source, size_t size,
+		const qr_param_t *param, int fmt, int sep, int mag, const qr_byte_t *output, int outsize);
+static int qrShmIsStale(uint64_t lock);
+#endif
+
+/*
+ * 名前nameの共有メモリのキャッシュに接続する
+ * なければ大きさsizeで作り、あれば既存の大きさのまま接続する
+ * 同じ名前で接続したプロセス(フォークした子プロセスを含む)は同じ出力を共有する
+ */
+QR_API QRShmCache *
+qrShmCacheOpen(const char *name, size_t size, int *errcode)
+{
+#ifdef QR_HAVE_SHM
+	const qr_allocator_t *allocator = qrGetAllocator();
+	QRShmCache *sc;
+	qr_shmhdr_t *hdr;
+	struct stat st;
+	void *base;
+	int fd, i;
+
+	if (name == NULL || size < QR_SHM_HDRSIZE * 2) {
+		*errcode = QR_ERR_INVALID_ARG;
+		return NULL;
+	}
+
+	/*
+	 * 共有メモリを作ったプロセスだけが大きさを決める
+	 * 既にあれば開き、作ったプロセスが大きさを決めるまで待つ(大きさは変えない)
+	 */
+	for (i = 0; ; i++) {
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd != -1) {
+			if (ftruncate(fd, (off_t)size) == -1) {
+				*errcode = QR_ERR_SEE_ERRNO;
+				close(fd);
+				(void)shm_unlink(name);
+				return NULL;
+			}
+			break;
+		}
+		if (errno != EEXIST) {
+			*errcode = QR_ERR_SEE_ERRNO;
+			return NULL;
+		}
+		fd = shm_open(name, O_RDWR, 0600);
+		if (fd != -1) {
+			break;
+		}
+		if (errno != ENOENT || i >= QR_SHM_WAIT) {
+			*errcode = QR_ERR_SEE_ERRNO;
+			return NULL;
+		}
+	}
+	for (i = 0; ; i++) {
+		if (fstat(fd, &st) == -1) {
+			*errcode = QR_ERR_SEE_ERRNO;
+			close(fd);
+			return NULL;
+		}
+		if (st.st_size != 0) {
+			break;
+		}
+		if (i >= QR_SHM_WAIT) {
+			*errcode = QR_ERR_STATE;
+			close(fd);
+			return NULL;
+		}
+		usleep(1000);
+	}
+	if ((size_t)st.st_size < QR_SHM_HDRSIZE * 2) {
+		*errcode = QR_ERR_STATE;
+		close(fd);
+		return NULL;
+	}
+	size = (size_t)st.st_size;
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		*errcode = QR_ERR_SEE_ERRNO;
+		return NULL;
+	}
+
+	/*
+	 * 最初に接続したプロセスが管理情報を書き、他のプロセスはそれを待つ
+	 * 状態とプロセスIDは1回の不可分操作で設定するので、初期化中の
+	 * プロセスが異常終了していれば必ず分かり、引き継げる
+	 */
+	hdr = (qr_shmhdr_t *)base;
+	for (i = 0; ; i++) {
+		uint64_t init = qrShmLoad(&(hdr->init));
+		uint64_t mine = qrShmLockWord(getpid(), QR_SHM_INIT_BUSY);
+		uint32_t state = qrShmLockVersion(init);
+
+		if (state == QR_SHM_INIT_READY) {
+			break;
+		}
+		if ((state == QR_SHM_INIT_NONE || qrShmIsStale(init))
+			&& qrShmCas(&(hdr->init), init, mine))
+		{
+			/*
+			 * 書けなければ準備完了にだけして、待っている他のプロセスも失敗させる
+			 */
+			if (!qrShmFormat(hdr, size)) {
+				qrShmSet(&(hdr->init), qrShmLockWord(0, QR_SHM_INIT_READY));
+				munmap(base, size);
+				*errcode = QR_ERR_INVALID_SIZE;
+				return NULL;
+			}
+			qrShmSet(&(hdr->init), qrShmLockWord(0, QR_SHM_INIT_READY));
+			break;
+		}
+		if (i >= QR_SHM_WAIT) {
+			munmap(base, size);
+			*errcode = QR_ERR_STATE;
+			return NULL;
+		}
+		usleep(1000);
+	}
+	if (hdr->magic != QR_SHM_MAGIC || hdr->layout != QR_SHM_LAYOUT || hdr->size != size) {
+		munmap(base, size);
+		*errcode = QR_ERR_STATE;
+		return NULL;
+	}
+
+	sc = (QRShmCache *)allocator->alloc(allocator->ctx, sizeof(QRShmCache));
+	if (sc == NULL) {
+		munmap(base, size);
+		*errcode = QR_ERR_MEMORY_EXHAUSTED;
+		return NULL;
+	}
+	sc->base = base;
+	sc->size = size;
+
+	return sc;
+#else
+	(void)name;
+	(void)size;
+	*errcode = QR_ERR_NOT_IMPL;
+	return NULL;
+#endif
+}
+
+/*
+ * 共有メモリのキャッシュから切り離す
+ * (共有メモリそのものは残るので、消すときはqrShmCacheUnlink()を呼ぶ)
+ */
+QR_API void
+qrShmCacheClose(QRShmCache *sc)
+{
+	const qr_allocator_t *allocator = qrGetAllocator();
+
+	if (sc == NULL) {
+		return;
+	}
+#ifdef QR_HAVE_SHM
+	munmap(sc->base, sc->size);
+#endif
+	allocator->release(allocator->ctx, sc);
+}
+
+/*
+ * 名前nameの共有メモリを消す
+ * (接続中のプロセスはそのまま使い続けられる)
+ */
+QR_API int
+qrShmCacheUnlink(const char *name)
+{
+#ifdef QR_HAVE_SHM
+	return (shm_unlink(name) == 0) ? TRUE : FALSE;
+#else
+	(void)name;
+	return FALSE;
+#endif
+}
+
+/*
+ * キャッシュの統計を得る
+ * hits、misses、evictionsは接続しているすべてのプロセスの合計で、
+ * symhitsは常に0(共有メモリには出力だけを置く)
+ */
+QR_API void
+qrShmCacheGetStats(QRShmCache *sc, qr_cachestat_t *stat)
+{
+	memset(stat, 0, sizeof(qr_cachestat_t));
+#ifdef QR_HAVE_SHM
+	{
+		qr_shmhdr_t *hdr = (qr_shmhdr_t *)sc->base;
+		qr_shmslot_t *slot;
+		uint32_t i, ver;
+		int c;
+
+		stat->hits = (unsigned long)qrShmLoad(&(hdr->hits));
+		stat->misses = (unsigned long)qrShmLoad(&(hdr->misses));
+		stat->evictions = (unsigned long)qrShmLoad(&(hdr->evictions));
+		for (c = 0; c < QR_SHM_CLASSES; c++) {
+			for (i = 0; i < hdr->nslots[c]; i++) {
+				slot = qrShmSlot(sc, c, i);
+				ver = qrShmLockVersion(qrShmLoad(&(slot->lock)));
+				if (ver != 0 && (ver & 1) == 0) {
+					stat->entries++;
+					stat->bytes += qr_shm_slabsize[c];
+				}
+			}
+		}
+	}
+#else
+	(void)sc;
+#endif
+}
+
+/*
+ * 入力データからシンボルを生成して形式fmtに変換する
+ * 同じ入力データ・パラメータ・出力形式の出力が共有メモリにあればその複製を返し、
+ * なければ生成・変換して共有メモリに入れる
+ * 返した出力はqrFreeBuffer()で開放する
+ */
+QR_API qr_byte_t *
+qrShmCacheGetSymbol(QRShmCache *sc, const qr_byte_t *source, int size, const qr_param_t *param,
+		int fmt, int sep, int mag, int *outsize, int *errcode)
+{
+	QRCode *qr;
+	qr_byte_t *buf;
+	int bufsize;
+#ifdef QR_HAVE_SHM
+	uint64_t hash;
+#endif
+
+	if (source == NULL || size <= 0) {
+		*errcode = QR_ERR_EMPTY_SRC;
+		return NULL;
+	}
+	if (fmt < 0 || fmt >= QR_FMT_COUNT) {
+		*errcode = QR_ERR_INVALID_FMT;
+		return NULL;
+	}
+
+#ifdef QR_HAVE_SHM
+	hash = qrShmHash(source, (size_t)size, param, fmt, sep, mag);
+	buf = qrShmLookup(sc, hash, source, (size_t)size, param, fmt, sep, mag, &bufsize);
+	if (buf != NULL) {
+		if (outsize != NULL) {
+			*outsize = bufsize;
+		}
+		return buf;
+	}
+#else
+	(void)sc;
+#endif
+
+	qr = qrInit(param->version, param->mode, param->eclevel, param->masktype, errcode);
+	if (qr == NULL) {
+		return NULL;
+	}
+	if (!qrAddDataRef(qr, source, size, param->mode) || !qrFinalize(qr)) {
+		*errcode = qrGetErrorCode(qr);
+		qrDestroy(qr);
+		return NULL;
+	}
+	buf = qrGetSymbol(qr, fmt, sep, mag, &bufsize);
+	if (buf == NULL) {
+		*errcode = qrGetErrorCode(qr);
+		qrDestroy(qr);
+		return NULL;
+	}
+	qrDestroy(qr);
+
+#ifdef QR_HAVE_SHM
+	qrShmStore(sc, hash, source, (size_t)size, param, fmt, sep, mag, buf, bufsize);
+#endif
+	if (outsize != NULL) {
+		*outsize = bufsize;
+	}
+	return buf;
+}
+
+#ifdef QR_HAVE_SHM
+/*
+ * 管理情報を書き、管理情報の後ろをスラブの種類ごとに等分する
+ * (スロットは作成時にゼロで埋められているので空になっている)
+ */
+static int
+qrShmFormat(qr_shmhdr_t *hdr, size_t size)
+{
+	uint64_t offset, share;
+	uint32_t n;
+	int c, usable = 0;
+
+	hdr->size = size;
+	hdr->layout = QR_SHM_LAYOUT;
+	offset = QR_SHM_HDRSIZE;
+	share = (size - QR_SHM_HDRSIZE) / QR_SHM_CLASSES;
+	for (c = 0; c < QR_SHM_CLASSES; c++) {
+		n = (uint32_t)(share / qr_shm_slabsize[c]);
+		n -= n % QR_SHM_WAYS;
+		hdr->offset[c] = offset;
+		hdr->nslots[c] = n;
+		offset += share;
+		if (n > 0) {
+			usable = 1;
+		}
+	}
+	if (!usable) {
+		return FALSE;
+	}
+	qrShmSet(&(hdr->magic), (uint32_t)QR_SHM_MAGIC);
+
+	return TRUE;
+}
+
+/*
+ * キーのハッシュ値を計算する(64ビットFNV-1a)
+ * (プロセス間で同じ値になるよう、アドレスや乱数は混ぜない)
+ */
+static uint64_t
+qrShmHash(const qr_byte_t *source, size_t size, const qr_param_t *param, int fmt, int sep, int mag)
+{
+	const uint64_t prime = 0x100000001b3ULL;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int32_t fields[7];
+	const qr_byte_t *p;
+	size_t n;
+
+	fields[0] = param->version;
+	fields[1] = param->mode;
+	fields[2] = param->eclevel;
+	fields[3] = param->masktype;
+	fields[4] = fmt;
+	fields[5] = sep;
+	fields[6] = mag;
+	p = (const qr_byte_t *)fields;
+	for (n = 0; n < sizeof(fields); n++) {
+		hash = (hash ^ p[n]) * prime;
+	}
+	for (n = 0; n < size; n++) {
+		hash = (hash ^ source[n]) * prime;
+	}
+
+	return hash;
+}
+
+/*
+ * スラブの種類clsのi番目のスロットを返す
+ */
+static qr_shmslot_t *
+qrShmSlot(QRShmCache *sc, int cls, uint32_t i)
+{
+	const qr_shmhdr_t *hdr = (const qr_shmhdr_t *)sc->base;
+
+	return (qr_shmslot_t *)((qr_byte_t *)sc->base + hdr->offset[cls] + qr_shm_slabsize[cls] * i);
+}
+
+/*
+ * 出力を探し、見つかればその複製を返す
+ * 各種類のスラブでハッシュ値から決まるQR_SHM_WAYS個のスロットを調べ、
+ * 読む前後でロック語が変わっていなければ一致とみなす(ロックは取らない)
+ */
+static qr_byte_t *
+qrShmLookup(QRShmCache *sc, uint64_t hash, const qr_byte_t *source, size_t size,
+		const qr_param_t *param, int fmt, int sep, int mag, int *outsize)
+{
+	const qr_allocator_t *allocator = qrGetAllocator();
+	qr_shmhdr_t *hdr = (qr_shmhdr_t *)sc->base;
+	qr_shmslot_t *slot;
+	const qr_byte_t *data;
+	qr_byte_t *buf;
+	uint64_t lock;
+	uint32_t ver, set, w, len;
+	int c;
+
+	for (c = 0; c < QR_SHM_CLASSES; c++) {
+		if (hdr->nslots[c] == 0 || sizeof(qr_shmslot_t) + size > qr_shm_slabsize[c]) {
+			continue;
+		}
+		set = (uint32_t)((hash >> 8) % (hdr->nslots[c] / QR_SHM_WAYS));
+		for (w = 0; w < QR_SHM_WAYS; w++) {
+			slot = qrShmSlot(sc, c, set * QR_SHM_WAYS + w);
+			lock = qrShmLoad(&(slot->lock));
+			ver = qrShmLockVersion(lock);
+			if (ver == 0 || (ver & 1) != 0 || slot->hash != hash || slot->srclen != size
+				|| slot->param[0] != param->version || slot->param[1] != param->mode
+				|| slot->param[2] != param->eclevel || slot->param[3] != param->masktype
+				|| slot->fmt != fmt || slot->sep != sep || slot->mag != mag)
+			{
+				continue;
+			}
+			len = slot->outsize;
+			if (len == 0 || sizeof(qr_shmslot_t) + size + len > qr_shm_slabsize[c]) {
+				continue;
+			}
+			data = (const qr_byte_t *)(slot + 1);
+			if (memcmp(data, source, size) != 0) {
+				continue;
+			}
+			buf = (qr_byte_t *)allocator->alloc(allocator->ctx, len);
+			if (buf == NULL) {
+				return NULL;
+			}
+			memcpy(buf, data + size, len);
+			qrShmFence();
+			if (qrShmLoad(&(slot->lock)) != lock) {
+				allocator->release(allocator->ctx, buf);
+				continue;
+			}
+			__atomic_store_n(&(slot->tick), qrShmIncrement(&(hdr->clock)), __ATOMIC_RELAXED);
+			qrShmIncrement(&(hdr->hits));
+			*outsize = (int)len;
+			return buf;
+		}
+	}
+	qrShmIncrement(&(hdr->misses));
+
+	return NULL;
+}
+
+/*
+ * 出力を共有メモリに入れる
+ * 出力が収まる最小のスラブの種類で、空のスロットか最も古いスロットを選び、
+ * ロック語を自分のプロセスIDと奇数の版にしてから書き込み、
+ * 書き込んだときのロック語のままなら偶数の版に進めて公開する
+ * 生きているプロセスが書き込み中なら入れずに戻る(次に生成したときに入る)
+ */
+static void
+qrShmStore(QRShmCache *sc, uint64_t hash, const qr_byte_t *source, size_t size,
+		const qr_param_t *param, int fmt, int sep, int mag, const qr_byte_t *output, int outsize)
+{
+	qr_shmhdr_t *hdr = (qr_shmhdr_t *)sc->base;
+	qr_shmslot_t *slot, *victim = NULL;
+	qr_byte_t *data;
+	uint64_t lock, vlock = 0, claimed, oldest = 0, tick;
+	uint32_t ver, set, w, next;
+	int c;
+
+	for (c = 0; c < QR_SHM_CLASSES; c++) {
+		if (hdr->nslots[c] > 0 && sizeof(qr_shmslot_t) + size + (size_t)outsize <= qr_shm_slabsize[c]) {
+			break;
+		}
+	}
+	if (c == QR_SHM_CLASSES) {
+		return;
+	}
+
+	set = (uint32_t)((hash >> 8) % (hdr->nslots[c] / QR_SHM_WAYS));
+	for (w = 0; w < QR_SHM_WAYS; w++) {
+		slot = qrShmSlot(sc, c, set * QR_SHM_WAYS + w);
+		lock = qrShmLoad(&(slot->lock));
+		ver = qrShmLockVersion(lock);
+		if ((ver & 1) != 0 && !qrShmIsStale(lock)) {
+			continue;
+		}
+		tick = (ver == 0) ? 0 : __atomic_load_n(&(slot->tick), __ATOMIC_RELAXED);
+		if (victim == NULL || tick < oldest) {
+			victim = slot;
+			vlock = lock;
+			oldest = tick;
+		}
+		if (ver == 0) {
+			break;
+		}
+	}
+	if (victim == NULL) {
+		return;
+	}
+
+	/*
+	 * スロットを書き込み中にする
+	 * (放置されたスロットは奇数のまま版を進めて奪う)
+	 */
+	ver = qrShmLockVersion(vlock);
+	next = ((ver & 1) != 0) ? ver + 2 : ver + 1;
+	claimed = qrShmLockWord(getpid(), next);
+	if (!qrShmCas(&(victim->lock), vlock, claimed)) {
+		return;
+	}
+	if (ver != 0 && (ver & 1) == 0) {
+		qrShmIncrement(&(hdr->evictions));
+	}
+
+	victim->hash = hash;
+	victim->param[0] = param->version;
+	victim->param[1] = param->mode;
+	victim->param[2] = param->eclevel;
+	victim->param[3] = param->masktype;
+	victim->fmt = fmt;
+	victim->sep = sep;
+	victim->mag = mag;
+	victim->srclen = (uint32_t)size;
+	victim->outsize = (uint32_t)outsize;
+	data = (qr_byte_t *)(victim + 1);
+	memcpy(data, source, size);
+	memcpy(data + size, output, (size_t)outsize);
+	__atomic_store_n(&(victim->tick), qrShmIncrement(&(hdr->clock)), __ATOMIC_RELAXED);
+
+	/*
+	 * 書き込みを終えてから公開する
+	 * (その間にスロットを奪われていたら、書いた内容は捨てる)
+	 */
+	next++;
+	if (next == 0) {
+		next = 2;
+	}
+	(void)qrShmCas(&(victim->lock), claimed, qrShmLockWord(0, next));
+}
+
+/*
+ * 書き込み中のスロットが放置されているか判定する
+ * (ロック語に入っている書き込み中のプロセスがもういないとき)
+ * 生きているプロセスからは、どれだけ時間がかかっていても奪わない
+ */
+static int
+qrShmIsStale(uint64_t lock)
+{
+	uint32_t owner = qrShmLockOwner(lock);
+
+	return (owner != 0 && kill((pid_t)owner, 0) == -1 && errno == ESRCH) ? TRUE : FALSE;
+}
+#endif /* QR_HAVE_SHM */
@@ -0,0 +1,229 @@
+/*
+ * QR Code Generator Library: Mask Penalty Test
+ *
+ * すべての型番の大きさの乱数のビットプレーンについて、
+ * qrEvaluatePlane()の評価値が1モジュールずつ数える
+ * 以前の評価方法と一致することを確かめる
+ * 打ち切り値を与えたときの戻り値も確かめる
+ * (静的関数を呼ぶためにqr.cを取り込む)
+ *
+ * @package     libqr
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2013 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+#include "../qr.c"
+#include <stdio.h>
+
+#define MP_PLANES 24
+
+static unsigned int mp_state = 1U;
+
+static unsigned int
+mpRand(void)
+{
+	mp_state = mp_state * 1103515245U + 12345U;
+	return (mp_state >> 16) & 0x7fff;
+}
+
+static int
+mpIsDark(const qr_word_t *rows, int pwords, int i, int j)
+{
+	return (int)((rows[i * pwords + j / QR_PLW_BITS] >> (j % QR_PLW_BITS)) & 1);
+}
+
+/*
+ * 同色の連続の評価値
+ */
+static long
+mpRunPenalty(int n)
+{
+	return (n >= 5) ? (long)(3 + (n - 5)) : 0L;
+}
+
+/*
+ * 1:1:3:1:1のパターンの評価値
+ * (transposeが真なら列について調べる)
+ */
+static long
+mpFinderPenalty(const qr_word_t *rows, int dim, int pwords, int i, int j, int transpose)
+{
+	static const int pattern[7] = { 1, 0, 1, 1, 1, 0, 1 };
+	int k;
+
+#define mpDark(x) (transpose ? mpIsDark(rows, pwords, (x), i) : mpIsDark(rows, pwords, i, (x)))
+	if (j > 0 && mpDark(j - 1)) {
+		return 0L;
+	}
+	for (k = 0; k < 7; k++) {
+		if (mpDark(j + k) != pattern[k]) {
+			return 0L;
+		}
+	}
+	for (k = 0; k < dim - j - 7 && k < 4; k++) {
+		if (mpDark(j + k + 7)) {
+			return 0L;
+		}
+	}
+#undef mpDark
+	return 40L;
+}
+
+/*
+ * 1モジュールずつ数える評価方法
+ */
+static long
+mpReference(const qr_word_t *rows, int dim, int pwords)
+{
+	int i, j, n, t, dark;
+	long penalty = 0L;
+
+	/*
+	 * 行/列の同色の連続
+	 */
+	for (t = 0; t < 2; t++) {
+		for (i = 0; i < dim; i++) {
+			n = 0;
+			for (j = 0; j < dim; j++) {
+				if (j > 0 && (t ? mpIsDark(rows, pwords, j, i) == mpIsDark(rows, pwords, j - 1, i)
+						: mpIsDark(rows, pwords, i, j) == mpIsDark(rows, pwords, i, j - 1)))
+				{
+					n++;
+				} else {
+					penalty += mpRunPenalty(n);
+					n = 1;
+				}
+			}
+			penalty += mpRunPenalty(n);
+		}
+	}
+	/*
+	 * 2×2の同色のブロック
+	 */
+	for (i = 0; i < dim - 1; i++) {
+		for (j = 0; j < dim - 1; j++) {
+			dark = mpIsDark(rows, pwords, i, j);
+			if (mpIsDark(rows, pwords, i, j + 1) == dark
+				&& mpIsDark(rows, pwords, i + 1, j) == dark
+				&& mpIsDark(rows, pwords, i + 1, j + 1) == dark)
+			{
+				penalty += 3L;
+			}
+		}
+	}
+	/*
+	 * 行/列の1:1:3:1:1のパターン
+	 */
+	for (t = 0; t < 2; t++) {
+		for (i = 0; i < dim; i++) {
+			for (j = 0; j < dim - 6; j++) {
+				penalty += mpFinderPenalty(rows, dim, pwords, i, j, t);
+			}
+		}
+	}
+	/*
+	 * 暗モジュールの割合
+	 */
+	n = 0;
+	for (i = 0; i < dim; i++) {
+		for (j = 0; j < dim; j++) {
+			n += mpIsDark(rows, pwords, i, j);
+		}
+	}
+	penalty += (long)(abs((n * 100 / (dim * dim)) - 50) / 5 * 10);
+
+	return penalty;
+}
+
+/*
+ * 乱数のビットプレーンを作る
+ * kindが0なら暗モジュールの割合をdensity%にし、
+ * 1なら短い同色の連続を並べ、2なら1:1:3:1:1のパターンを散りばめる
+ */
+static void
+mpMakePlane(qr_word_t *rows, int dim, int pwords, int kind, int density)
+{
+	static const int pattern[11] = { 0, 1, 0, 1, 1, 1, 0, 1, 0, 0, 0 };
+	int i, j, k, run = 0, color = 0;
+
+	memset(rows, 0, sizeof(qr_word_t) * (size_t)(dim * pwords));
+	for (i = 0; i < dim; i++) {
+		for (j = 0; j < dim; j++) {
+			if (kind == 0) {
+				color = ((int)(mpRand() % 100) < density);
+			} else {
+				if (run == 0) {
+					color = !color;
+					run = (int)(mpRand() % 7) + 1;
+				}
+				run--;
+			}
+			if (color) {
+				rows[i * pwords + j / QR_PLW_BITS] |= (qr_word_t)1 << (j % QR_PLW_BITS);
+			}
+		}
+	}
+	if (kind == 2) {
+		for (k = 0; k < dim / 2; k++) {
+			int t = (int)(mpRand() % 2), a = (int)(mpRand() % dim);
+			int b = (int)(mpRand() % (dim - 10));
+			for (j = 0; j < 11; j++) {
+				int y = t ? b + j : a, x = t ? a : b + j;
+				qr_word_t bit = (qr_word_t)1 << (x % QR_PLW_BITS);
+				if (pattern[j]) {
+					rows[y * pwords + x / QR_PLW_BITS] |= bit;
+				} else {
+					rows[y * pwords + x / QR_PLW_BITS] &= ~bit;
+				}
+			}
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	qr_word_t rows[QR_DIM_MAX * QR_PLW_MAX];
+	int version, p, dim, pwords, checked = 0, failures = 0;
+
+	(void)argc;
+
+	for (version = 1; version <= QR_VER_MAX; version++) {
+		dim = qr_vertable[version].dimension;
+		pwords = (dim + QR_PLW_BITS - 1) / QR_PLW_BITS;
+		for (p = 0; p < MP_PLANES; p++) {
+			long expect, penalty, bound;
+
+			mpMakePlane(rows, dim, pwords, p % 3, (p * 100) / (MP_PLANES - 1));
+			expect = mpReference(rows, dim, pwords);
+			penalty = qrEvaluatePlane(rows, dim, pwords, -1L);
+			if (penalty != expect) {
+				fprintf(stderr, "%s: version %d, plane %d: %ld, expected %ld\n",
+						argv[0], version, p, penalty, expect);
+				failures++;
+			}
+			/*
+			 * 打ち切り値より小さければ評価値そのもの、
+			 * そうでなければ打ち切り値以上の値を返す
+			 */
+			for (bound = expect - 1L; bound <= expect + 1L; bound++) {
+				penalty = qrEvaluatePlane(rows, dim, pwords, bound);
+				if ((expect < bound) ? (penalty != expect) : (penalty < bound)) {
+					fprintf(stderr, "%s: version %d, plane %d: %ld with bound %ld, expected %ld\n",
+							argv[0], version, p, penalty, bound, expect);
+					failures++;
+				}
+			}
+			checked++;
+		}
+	}
+
+	if (failures > 0) {
+		fprintf(stderr, "%s: %d failures\n", argv[0], failures);
+		return 1;
+	}
+	printf("%s: %d planes match the per-module scorer\n", argv[0], checked);
+
+	return 0;
+}
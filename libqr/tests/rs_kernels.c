@@ -0,0 +1,115 @@
+/*
+ * QR Code Generator Library: Reed-Solomon Kernel Test
+ *
+ * すべての型番・誤り訂正レベルのRSブロックについて、
+ * SIMDでまとめて計算した誤り訂正コード語が1ブロックずつ
+ * 計算したもの(qrComputeRSBlock())と一致することを確かめる
+ * CPUが対応しているベクトルの要素数をすべて試す
+ * (静的関数を呼ぶためにqr.cを取り込む)
+ *
+ * @package     libqr
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2013 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+#include "../qr.c"
+#include <stdio.h>
+
+#define RS_TEST_LANES 32
+
+static unsigned int rs_state = 1U;
+
+static qr_byte_t
+rsRand(void)
+{
+	rs_state = rs_state * 1103515245U + 12345U;
+	return (qr_byte_t)(rs_state >> 16);
+}
+
+#ifdef QR_RS_SIMD
+/*
+ * 長さdwlenのnum個のブロックをwidth要素のベクトルで計算し、
+ * 1ブロックずつ計算した結果expectと比べる
+ */
+static int
+rsCheckBlocks(const qr_byte_t *dw, int dwlen, int ecwlen, int num, int width,
+		const qr_byte_t *expect)
+{
+	qr_byte_t ecw[QR_RSW_MAX * RS_TEST_LANES];
+
+	memset(ecw, 0xa5, sizeof(ecw));
+	qrComputeRSBlocks(dw, dwlen, ecw, ecwlen, num, width);
+
+	return (memcmp(ecw, expect, (size_t)(num * ecwlen)) == 0);
+}
+#endif
+
+int
+main(int argc, char **argv)
+{
+	qr_byte_t dw[QR_RSD_MAX * RS_TEST_LANES];
+	qr_byte_t expect[QR_RSW_MAX * RS_TEST_LANES];
+	int widths[2], nwidths = 0;
+	int version, eclevel, i, b, k, fill, checked = 0, failures = 0;
+
+	(void)argc;
+
+#ifdef QR_RS_SIMD
+	if (qrCpuHasSsse3()) {
+		widths[nwidths++] = 16;
+	}
+	if (qrCpuHasAvx2()) {
+		widths[nwidths++] = 32;
+	}
+#endif
+	if (nwidths == 0) {
+		printf("%s: no SIMD kernel is available on this CPU\n", argv[0]);
+		return 0;
+	}
+
+	for (version = 1; version <= QR_VER_MAX; version++) {
+		for (eclevel = 0; eclevel < QR_ECL_COUNT; eclevel++) {
+			const qr_eclevel_t *ecl = &(qr_vertable[version].ecl[eclevel]);
+			for (i = 0; i < ecl->nrsb; i++) {
+				int dwlen = ecl->rsb[i].datawords;
+				int ecwlen = ecl->rsb[i].totalwords - ecl->rsb[i].datawords;
+
+				/*
+				 * 乱数のほか、すべて0・すべて0xffのデータも試す
+				 */
+				for (fill = 0; fill < 3; fill++) {
+					for (k = 0; k < dwlen * RS_TEST_LANES; k++) {
+						dw[k] = (fill == 0) ? rsRand() : (fill == 1) ? 0x00 : 0xff;
+					}
+					for (b = 0; b < RS_TEST_LANES; b++) {
+						qrComputeRSBlock(&(dw[b * dwlen]), dwlen, &(expect[b * ecwlen]), ecwlen);
+					}
+#ifdef QR_RS_SIMD
+					{
+						int w, num;
+						for (w = 0; w < nwidths; w++) {
+							for (num = 1; num <= widths[w]; num++) {
+								if (!rsCheckBlocks(dw, dwlen, ecwlen, num, widths[w], expect)) {
+									fprintf(stderr, "%s: version %d, eclevel %d, %d blocks of %d+%d, width %d differ\n",
+											argv[0], version, eclevel, num, dwlen, ecwlen, widths[w]);
+									failures++;
+								}
+								checked++;
+							}
+						}
+					}
+#endif
+				}
+			}
+		}
+	}
+
+	if (failures > 0) {
+		fprintf(stderr, "%s: %d failures\n", argv[0], failures);
+		return 1;
+	}
+	printf("%s: %d block groups match the scalar kernel\n", argv[0], checked);
+
+	return 0;
+}
@@ -0,0 +1,363 @@
+/*
+ * QR Code Generator Library: Multi-thread Stress Test
+ *
+ * 複数のスレッドから同時にライブラリを使い、すべての出力が
+ * 単一スレッドで生成したものと一致することを確かめる
+ * ThreadSanitizerで検査するときは QR_SANITIZE_THREAD=ON でビルドする
+ *
+ * @package     libqr
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2013 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+#include "../qr.h"
+#include "../qr_util.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRESS_THREADS 8
+#define STRESS_ITERATIONS 40
+#define STRESS_MAXDATA 600
+
+/*
+ * 実行器に投入した処理の期待値
+ * (完了リストから回収したスレッドが照合して開放する)
+ */
+typedef struct stress_job_t {
+	QRCode *qr;
+	qr_byte_t *expect;
+	int expsize;
+} stress_job_t;
+
+static QRPool *pool;
+static QRCache *cache;
+static QRExecutor *executor;
+static QRCode *master;
+static qr_byte_t *master_symbol;
+static int master_size;
+static int failures;
+static int reaped;
+
+static const int formats[] = {
+	QR_FMT_PNG, QR_FMT_BMP, QR_FMT_TIFF, QR_FMT_PBM,
+	QR_FMT_SVG, QR_FMT_JSON, QR_FMT_DIGIT, QR_FMT_ASCII
+};
+
+/* {{{ utilities */
+
+static void
+stressFail(const char *what, long id, int iter)
+{
+	__sync_fetch_and_add(&failures, 1);
+	fprintf(stderr, "thread %ld, iteration %d: %s\n", id, iter, what);
+}
+
+static unsigned int
+stressRand(unsigned int *state)
+{
+	*state = *state * 1103515245U + 12345U;
+	return (*state >> 16) & 0x7fff;
+}
+
+/*
+ * 数字・英数字・8ビット・漢字が混ざった入力データを作る
+ */
+static int
+stressMakeData(qr_byte_t *buf, unsigned int *state)
+{
+	int size = (int)(stressRand(state) % (STRESS_MAXDATA - 2)) + 1;
+	int i = 0;
+
+	while (i < size) {
+		int run = (int)(stressRand(state) % 24) + 1;
+		int kind = (int)(stressRand(state) % 4);
+		while (run-- > 0 && i < size) {
+			switch (kind) {
+			case 0:
+				buf[i++] = (qr_byte_t)('0' + stressRand(state) % 10);
+				break;
+			case 1:
+				buf[i++] = (qr_byte_t)('A' + stressRand(state) % 26);
+				break;
+			case 2:
+				buf[i++] = (qr_byte_t)(stressRand(state) & 0xff);
+				break;
+			default:
+				buf[i++] = 0x88;
+				buf[i++] = (qr_byte_t)(0x9f + stressRand(state) % 0x5e);
+				break;
+			}
+		}
+	}
+	return i;
+}
+
+/*
+ * 単一のQRコードオブジェクトでシンボルを生成する
+ */
+static qr_byte_t *
+stressRender(const qr_byte_t *data, int size, const qr_param_t *param,
+		int fmt, int *outsize)
+{
+	QRCode *qr;
+	qr_byte_t *symbol = NULL;
+	int errcode;
+
+	qr = qrInit(param->version, param->mode, param->eclevel, param->masktype, &errcode);
+	if (qr == NULL) {
+		return NULL;
+	}
+	if (qrAddData(qr, data, size) && qrFinalize(qr)) {
+		symbol = qrGetSymbol(qr, fmt, 0, 2, outsize);
+	}
+	qrDestroy(qr);
+
+	return symbol;
+}
+
+static int
+stressSame(const qr_byte_t *a, int asize, const qr_byte_t *b, int bsize)
+{
+	return (a != NULL && b != NULL && asize == bsize && memcmp(a, b, (size_t)asize) == 0);
+}
+
+/*
+ * 完了リストにある処理をすべて回収し、期待値と照合する
+ * (どのスレッドが投入した処理でも回収する)
+ */
+static void
+stressReap(long id, int iter)
+{
+	QRTask *task;
+
+	while ((task = qrExecutorReap(executor)) != NULL) {
+		stress_job_t *job = (stress_job_t *)qrTaskGetArg(task);
+		qr_byte_t *symbol;
+		int size = 0;
+
+		symbol = qrTaskGetSymbol(task, &size);
+		if (qrTaskGetError(task) != QR_ERR_NONE
+			|| !stressSame(symbol, size, job->expect, job->expsize))
+		{
+			stressFail("executor result differs", id, iter);
+		}
+		free(symbol);
+		qrTaskFree(task);
+		qrDestroy(job->qr);
+		free(job->expect);
+		free(job);
+		__sync_fetch_and_add(&reaped, 1);
+	}
+}
+
+/* }}} utilities */
+/* {{{ stressRun() */
+
+static void *
+stressRun(void *arg)
+{
+	long id = (long)arg;
+	unsigned int state = (unsigned int)id * 2654435761U + 1U;
+	qr_byte_t data[STRESS_MAXDATA];
+	char name[32];
+	int iter;
+
+	snprintf(name, sizeof(name), "stress%ld()", id);
+	qrSetCurrentFunctionName(name);
+
+	for (iter = 0; iter < STRESS_ITERATIONS; iter++) {
+		qr_param_t param;
+		qr_byte_t *expect, *symbol;
+		int size, expsize = 0, outsize = 0, errcode = 0, fmt;
+		QRCode *qr;
+
+		size = stressMakeData(data, &state);
+		param.version = -1;
+		param.mode = QR_EM_AUTO;
+		param.eclevel = (int)(stressRand(&state) % 4);
+		param.masktype = (stressRand(&state) % 3 == 0) ? (int)(stressRand(&state) % 8) : -1;
+		fmt = formats[stressRand(&state) % (sizeof(formats) / sizeof(formats[0]))];
+
+		expect = stressRender(data, size, &param, fmt, &expsize);
+		if (expect == NULL) {
+			stressFail("reference rendering failed", id, iter);
+			continue;
+		}
+
+		/*
+		 * プールから取り出したオブジェクト
+		 */
+		qr = qrPoolAcquire(pool, param.version, param.mode, param.eclevel, param.masktype, &errcode);
+		if (qr == NULL) {
+			stressFail("qrPoolAcquire() failed", id, iter);
+		} else {
+			symbol = NULL;
+			if (qrAddData(qr, data, size) && qrFinalize(qr)) {
+				symbol = qrGetSymbol(qr, fmt, 0, 2, &outsize);
+			}
+			if (!stressSame(symbol, outsize, expect, expsize)) {
+				stressFail("pooled object differs", id, iter);
+			}
+			free(symbol);
+			qrPoolRelease(pool, qr);
+		}
+
+		/*
+		 * 全スレッドで共有する確定済みオブジェクトの複製
+		 */
+		qr = qrClone(master, &errcode);
+		if (qr == NULL) {
+			stressFail("qrClone() failed", id, iter);
+		} else {
+			symbol = qrGetSymbol(qr, QR_FMT_PNG, 0, 2, &outsize);
+			if (!stressSame(symbol, outsize, master_symbol, master_size)) {
+				stressFail("cloned object differs", id, iter);
+			}
+			free(symbol);
+			qrDestroy(qr);
+		}
+
+		/*
+		 * 共有キャッシュ
+		 * (2回目は全スレッドが同じ項目を取り合う)
+		 */
+		symbol = qrCacheGetSymbol(cache, data, size, &param, fmt, 0, 2, &outsize, &errcode);
+		if (!stressSame(symbol, outsize, expect, expsize)) {
+			stressFail("cached symbol differs", id, iter);
+		}
+		free(symbol);
+		symbol = qrCacheGetSymbol(cache, master_symbol, 64, &param, QR_FMT_SVG, 0, 2, &outsize, &errcode);
+		if (symbol == NULL) {
+			stressFail("shared cache entry failed", id, iter);
+		}
+		free(symbol);
+
+		/*
+		 * 実行器(完了リストは全スレッドで回収し合う)
+		 */
+		qr = qrInit(param.version, param.mode, param.eclevel, param.masktype, &errcode);
+		if (qr == NULL || !qrAddData(qr, data, size)) {
+			stressFail("qrInit() failed", id, iter);
+			qrDestroy(qr);
+			free(expect);
+		} else {
+			stress_job_t *job = (stress_job_t *)malloc(sizeof(stress_job_t));
+			job->qr = qr;
+			job->expect = expect;
+			job->expsize = expsize;
+			while (qrGetSymbolAsync(executor, qr, fmt, 0, 2, NULL, job, &errcode) == NULL) {
+				if (errcode != QR_ERR_QUEUE_FULL) {
+					stressFail("qrGetSymbolAsync() failed", id, iter);
+					qrDestroy(qr);
+					free(expect);
+					free(job);
+					break;
+				}
+				stressReap(id, iter);
+				sched_yield();
+			}
+		}
+		stressReap(id, iter);
+
+		/*
+		 * エラー情報の関数名はスレッドごとに記録される
+		 */
+		qr = qrInit(1, QR_EM_NUMERIC, QR_ECL_H, -1, &errcode);
+		if (qr != NULL) {
+			(void)qrAddData(qr, (const qr_byte_t *)"1", 1);
+			(void)qrFinalize(qr);
+			(void)qrAddData(qr, (const qr_byte_t *)"1", 1);
+			if (strstr(qrGetErrorInfo(qr), name) == NULL) {
+				stressFail("error info has another thread's name", id, iter);
+			}
+			qrDestroy(qr);
+		}
+	}
+
+	return NULL;
+}
+
+/* }}} stressRun() */
+/* {{{ main() */
+
+int
+main(int argc, char **argv)
+{
+	pthread_t threads[STRESS_THREADS];
+	qr_byte_t data[STRESS_MAXDATA];
+	unsigned int state = 12345U;
+	long i;
+	int size, errcode = 0;
+
+	(void)argc;
+
+	qrSetMaskThreads(2, 1);
+
+	pool = qrPoolCreate(STRESS_THREADS / 2, &errcode);
+	cache = qrCacheCreate(256 * 1024, 4, &errcode);
+	executor = qrExecutorCreate(3, STRESS_THREADS, &errcode);
+	master = qrInit(-1, QR_EM_AUTO, QR_ECL_Q, -1, &errcode);
+	if (pool == NULL || cache == NULL || executor == NULL || master == NULL) {
+		fprintf(stderr, "%s: initialization failed (%d)\n", argv[0], errcode);
+		return 1;
+	}
+
+	size = stressMakeData(data, &state);
+	if (!qrAddData(master, data, size) || !qrFinalize(master)) {
+		fprintf(stderr, "%s: %s\n", argv[0], qrGetErrorInfo(master));
+		return 1;
+	}
+	master_symbol = qrGetSymbol(master, QR_FMT_PNG, 0, 2, &master_size);
+	if (master_symbol == NULL || master_size < 64) {
+		fprintf(stderr, "%s: %s\n", argv[0], qrGetErrorInfo(master));
+		return 1;
+	}
+
+	for (i = 0; i < STRESS_THREADS; i++) {
+		pthread_create(&threads[i], NULL, stressRun, (void *)i);
+	}
+
+	/*
+	 * 実行中にマスク評価のスレッド数を変更する
+	 */
+	qrSetMaskThreads(4, 5);
+	sched_yield();
+	qrSetMaskThreads(0, 0);
+	sched_yield();
+	qrSetMaskThreads(3, 2);
+
+	for (i = 0; i < STRESS_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/*
+	 * 残りの処理が完了リストに入るのを待って回収する
+	 */
+	while (qrExecutorPending(executor) > 0) {
+		sched_yield();
+	}
+	stressReap(-1, -1);
+
+	qrExecutorDestroy(executor);
+	qrCacheDestroy(cache);
+	qrPoolDestroy(pool);
+	qrDestroy(master);
+	free(master_symbol);
+	qrCleanup();
+
+	if (failures > 0) {
+		fprintf(stderr, "%s: %d failures\n", argv[0], failures);
+		return 1;
+	}
+	printf("%s: %d threads x %d iterations, %d async results\n",
+			argv[0], STRESS_THREADS, STRESS_ITERATIONS, reaped);
+
+	return 0;
+}
+
+/* }}} main() */
+
@@ -0,0 +1,211 @@
+/*
+ * QR Code Generator Library: Shared-Memory Cache Stress Test
+ *
+ * 複数のプロセスが同じ共有メモリのキャッシュを使っている間に、
+ * 親プロセスが子プロセスを不定のタイミングで止めてから強制終了させる
+ * 書き込み途中で止まったプロセスのスロットを奪わないこと、
+ * 強制終了したプロセスのスロットを取り戻せること、
+ * 書き込み途中の出力が読まれないことを確かめる
+ *
+ * @package     libqr
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2013 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+#include "../qr.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STRESS_CHILDREN 4
+#define STRESS_KILLS 150
+#define STRESS_KEYS 256
+#define STRESS_CACHESIZE (2 * 1024 * 1024)
+
+/*
+ * 入力データ・パラメータ
+ * (キーはキャッシュに収まりきらない数があり、出力はスラブの種類に散らばる)
+ */
+typedef struct stress_key_t {
+	qr_byte_t data[280];
+	int size;
+	qr_param_t param;
+	int fmt;
+	int mag;
+} stress_key_t;
+
+static QRShmCache *cache;
+
+/* {{{ utilities */
+
+/*
+ * 番号idのキーを作る
+ */
+static void
+stressMakeKey(stress_key_t *key, int id)
+{
+	static const int formats[] = { QR_FMT_PNG, QR_FMT_SVG, QR_FMT_ASCII, QR_FMT_PBM };
+	int j;
+
+	key->size = 16 + (id * 37) % 240;
+	for (j = 0; j < key->size; j++) {
+		key->data[j] = (qr_byte_t)('A' + (id * 7 + j) % 26);
+	}
+	key->param.version = -1;
+	key->param.mode = QR_EM_AUTO;
+	key->param.eclevel = id % 4;
+	key->param.masktype = -1;
+	key->fmt = formats[id % 4];
+	key->mag = 1 + (id / 4) % 2;
+}
+
+/*
+ * キーの出力をキャッシュから得て、直接生成した出力と照合する
+ */
+static int
+stressCheck(int id)
+{
+	stress_key_t key;
+	QRCode *qr;
+	qr_byte_t *symbol, *expect = NULL;
+	int size = 0, expsize = 0, errcode = 0, same;
+
+	stressMakeKey(&key, id);
+	symbol = qrShmCacheGetSymbol(cache, key.data, key.size, &key.param,
+			key.fmt, 4, key.mag, &size, &errcode);
+
+	qr = qrInit(key.param.version, key.param.mode, key.param.eclevel,
+			key.param.masktype, &errcode);
+	if (qr != NULL) {
+		if (qrAddData(qr, key.data, key.size) && qrFinalize(qr)) {
+			expect = qrGetSymbol(qr, key.fmt, 4, key.mag, &expsize);
+		}
+		qrDestroy(qr);
+	}
+	same = (symbol != NULL && expect != NULL && size == expsize
+			&& memcmp(symbol, expect, (size_t)size) == 0);
+	free(symbol);
+	free(expect);
+
+	return same;
+}
+
+/*
+ * 子プロセスは殺されるまでキャッシュを読み書きし続ける
+ * 照合に失敗したら終了コード1で終わる
+ */
+static pid_t
+stressSpawn(void)
+{
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		unsigned int state = (unsigned int)getpid();
+		for (;;) {
+			state = state * 1103515245U + 12345U;
+			if (!stressCheck((int)((state >> 16) % STRESS_KEYS))) {
+				_exit(1);
+			}
+		}
+	}
+
+	return pid;
+}
+
+/* }}} utilities */
+/* {{{ main() */
+
+int
+main(int argc, char **argv)
+{
+	pid_t children[STRESS_CHILDREN];
+	char name[64];
+	struct timespec pause;
+	qr_cachestat_t stat;
+	int i, k, status, errcode = 0, failures = 0;
+
+	(void)argc;
+
+	snprintf(name, sizeof(name), "/qr-stress-shm.%ld", (long)getpid());
+	cache = qrShmCacheOpen(name, STRESS_CACHESIZE, &errcode);
+	if (cache == NULL) {
+		if (errcode == QR_ERR_NOT_IMPL) {
+			printf("%s: shared memory is not available\n", argv[0]);
+			return 0;
+		}
+		fprintf(stderr, "%s: qrShmCacheOpen() failed (%d)\n", argv[0], errcode);
+		return 1;
+	}
+	(void)qrShmCacheUnlink(name);
+
+	for (i = 0; i < STRESS_CHILDREN; i++) {
+		children[i] = stressSpawn();
+	}
+
+	/*
+	 * 子プロセスを1つずつ止め、他の子プロセスが動いている間待ってから殺す
+	 * (止まった子プロセスは書き込み途中かもしれない)
+	 */
+	srand((unsigned int)getpid());
+	for (k = 0; k < STRESS_KILLS; k++) {
+		i = rand() % STRESS_CHILDREN;
+		pause.tv_sec = 0;
+		pause.tv_nsec = 100000L + (long)(rand() % 2000) * 1000L;
+		nanosleep(&pause, NULL);
+		kill(children[i], SIGSTOP);
+		nanosleep(&pause, NULL);
+		kill(children[i], SIGKILL);
+		waitpid(children[i], &status, 0);
+		if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL) {
+			fprintf(stderr, "%s: child failed (status %d)\n", argv[0], status);
+			failures++;
+		}
+		children[i] = stressSpawn();
+	}
+	for (i = 0; i < STRESS_CHILDREN; i++) {
+		kill(children[i], SIGKILL);
+		waitpid(children[i], &status, 0);
+		if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL) {
+			fprintf(stderr, "%s: child failed (status %d)\n", argv[0], status);
+			failures++;
+		}
+	}
+
+	/*
+	 * 殺されたプロセスが書き込み中にしたスロットも取り戻されるので、
+	 * 書き込む者が他にいなければ、入れた直後の出力は必ず見つかる
+	 */
+	for (k = 0; k < STRESS_KEYS; k++) {
+		unsigned long hits;
+
+		qrShmCacheGetStats(cache, &stat);
+		hits = stat.hits;
+		if (!stressCheck(k) || !stressCheck(k)) {
+			fprintf(stderr, "%s: key %d has a wrong output\n", argv[0], k);
+			failures++;
+		}
+		qrShmCacheGetStats(cache, &stat);
+		if (stat.hits == hits) {
+			fprintf(stderr, "%s: key %d was not stored\n", argv[0], k);
+			failures++;
+		}
+	}
+	qrShmCacheClose(cache);
+
+	if (failures > 0) {
+		fprintf(stderr, "%s: %d failures\n", argv[0], failures);
+		return 1;
+	}
+	printf("%s: %d children killed, %lu hits, %lu misses, %lu evictions\n",
+			argv[0], STRESS_KILLS, stat.hits, stat.misses, stat.evictions);
+
+	return 0;
+}
+
+/* }}} main() */
@@ -9,11 +9,20 @@ PHP_ARG_ENABLE(qr-zlib-dir, [zlib install prefix],
 [  --with-qr-zlib-dir[[=DIR]]  QR: zlib install prefix], yes, no)
 
 if test "$PHP_QR" != "no"; then
-    QR_SOURCES="php_qr.c libqr/qr.c libqr/qrcnv.c"
+    QR_SOURCES="php_qr.c libqr/qr.c libqr/qralloc.c libqr/qrasync.c libqr/qrbatch.c libqr/qrcache.c"
+    QR_SOURCES="$QR_SOURCES libqr/qrcnv.c"
     QR_SOURCES="$QR_SOURCES libqr/qrcnv_bmp.c libqr/qrcnv_png.c"
     QR_SOURCES="$QR_SOURCES libqr/qrcnv_svg.c libqr/qrcnv_tiff.c"
+    QR_SOURCES="$QR_SOURCES libqr/qrshm.c"
     dnl TODO: check for zlib
     PHP_ADD_LIBRARY_WITH_PATH(z, , QR_SHARED_LIBADD)
+    AC_CHECK_LIB(pthread, pthread_create, [
+        PHP_ADD_LIBRARY(pthread, , QR_SHARED_LIBADD)
+        AC_DEFINE(HAVE_PTHREAD, 1, [Define if libqr can use POSIX threads])
+    ])
+    AC_CHECK_LIB(rt, shm_open, [
+        PHP_ADD_LIBRARY(rt, , QR_SHARED_LIBADD)
+    ])
     PHP_SUBST(QR_SHARED_LIBADD)
     AC_DEFINE(HAVE_QR, 1, [ ])
     PHP_NEW_EXTENSION(qr, $QR_SOURCES , $ext_shared)
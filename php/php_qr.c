@@ -33,6 +33,9 @@
 #include "qr_util.h"
 #include <main/php_logos.h>
 #include "qr_logos.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 /* {{{ module globals */
 
@@ -40,6 +43,18 @@ PHP_QR_LOCAL ZEND_DECLARE_MODULE_GLOBALS(qr)
 
 /* }}} */
 
+/* {{{ shared-memory cache */
+
+/*
+ * The cache is opened in MINIT, before FPM or Apache prefork forks its
+ * workers, so every worker inherits the same mapping. Its name contains
+ * the master's pid and is unlinked right after opening so that nothing
+ * is left behind in /dev/shm when the master exits.
+ */
+static QRShmCache *qr_shm_cache = NULL;
+
+/* }}} */
+
 /* {{{ module fuction prototypes */
 
 static PHP_MINIT_FUNCTION(qr);
@@ -389,6 +404,14 @@ qrcode_object_clone(zval *zobject TSRMLS_DC)
 #define php_qr_error_from_object2(intern) \
 	php_qr_error((intern)->errmode, qrsGetErrorCode((intern)->st), qrsGetErrorInfo((intern)->st))
 
+#define qr_free_symbol(intern, symbol) { \
+	if ((intern)->st) { \
+		qrsFreeSymbols((intern)->st, (symbol)); \
+	} else { \
+		qrFreeSymbol((intern)->qr, (symbol)); \
+	} \
+}
+
 #define warn_not_finalized() \
 	php_error_docref(NULL TSRMLS_CC, E_WARNING, "QRCode is not finalized yet")
 
@@ -659,7 +682,7 @@ static ZEND_INI_MH(QrOnUpdateMasktype)
 #endif
 
 	masktype = zend_atoi(new_value, new_value_length);
-	if (masktype == -1 || (masktype >= 0 && masktype < QR_MPT_MAX)) {
+	if (masktype == QR_MPT_AUTO || masktype == QR_MPT_FAST || (masktype >= 0 && masktype < QR_MPT_MAX)) {
 		p = (long *)(base + (size_t)mh_arg1);
 		*p = masktype;
 		return SUCCESS;
@@ -750,6 +773,8 @@ PHP_INI_BEGIN()
 		QrOnUpdateLongGTZero, default_maxnum, zend_qr_globals, qr_globals)
 	STD_PHP_INI_ENTRY("qr.default_order", "0", PHP_INI_ALL,
 		OnUpdateLong, default_order, zend_qr_globals, qr_globals)
+	STD_PHP_INI_ENTRY("qr.shm_cache_size", "0", PHP_INI_SYSTEM,
+		QrOnUpdateLongGEZero, shm_cache_size, zend_qr_globals, qr_globals)
 PHP_INI_END()
 
 /* }}} */
@@ -772,6 +797,8 @@ PHP_MINIT_FUNCTION(qr)
 	QR_REGISTER_CONSTANT(QR_ECL_M);
 	QR_REGISTER_CONSTANT(QR_ECL_Q);
 	QR_REGISTER_CONSTANT(QR_ECL_H);
+	QR_REGISTER_CONSTANT(QR_MPT_AUTO);
+	QR_REGISTER_CONSTANT(QR_MPT_FAST);
 	QR_REGISTER_CONSTANT(QR_FMT_PNG);
 	QR_REGISTER_CONSTANT(QR_FMT_BMP);
 	QR_REGISTER_CONSTANT(QR_FMT_TIFF);
@@ -832,6 +859,8 @@ PHP_MINIT_FUNCTION(qr)
 		QRCODE_DECLARE_CONSTANT(ECL_M);
 		QRCODE_DECLARE_CONSTANT(ECL_Q);
 		QRCODE_DECLARE_CONSTANT(ECL_H);
+		QRCODE_DECLARE_CONSTANT(MPT_AUTO);
+		QRCODE_DECLARE_CONSTANT(MPT_FAST);
 		QRCODE_DECLARE_CONSTANT(FMT_PNG);
 		QRCODE_DECLARE_CONSTANT(FMT_BMP);
 		QRCODE_DECLARE_CONSTANT(FMT_TIFF);
@@ -862,6 +891,21 @@ PHP_MINIT_FUNCTION(qr)
 				ext_ce_RuntimeException, NULL TSRMLS_CC);
 	}
 
+	if (QRG(shm_cache_size) > 0) {
+		char name[64];
+		int errcode = QR_ERR_NONE;
+
+		snprintf(name, sizeof(name), "/php-qr.%ld", (long)getpid());
+		qr_shm_cache = qrShmCacheOpen(name, (size_t)QRG(shm_cache_size), &errcode);
+		if (qr_shm_cache) {
+			qrShmCacheUnlink(name);
+		} else {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"qr.shm_cache_size: the shared-memory cache is disabled: %s",
+					qrStrError(errcode));
+		}
+	}
+
 	return SUCCESS;
 }
 /* }}} */
@@ -872,6 +916,11 @@ PHP_MSHUTDOWN_FUNCTION(qr)
 	UNREGISTER_INI_ENTRIES();
 	php_unregister_info_logo(QR_LOGO_GUID);
 
+	if (qr_shm_cache) {
+		qrShmCacheClose(qr_shm_cache);
+		qr_shm_cache = NULL;
+	}
+
 	return SUCCESS;
 }
 /* }}} */
@@ -907,6 +956,20 @@ PHP_MINFO_FUNCTION(qr)
 	php_info_print_table_start();
 	php_info_print_table_row(2, "Module Version", PHP_QR_MODULE_VERSION);
 	php_info_print_table_row(2, "Library Version", LIBQR_VERSION);
+	if (qr_shm_cache) {
+		qr_cachestat_t stat;
+		char buf[32];
+
+		qrShmCacheGetStats(qr_shm_cache, &stat);
+		snprintf(buf, sizeof(buf), "%lu", stat.hits);
+		php_info_print_table_row(2, "Shared Cache Hits", buf);
+		snprintf(buf, sizeof(buf), "%lu", stat.misses);
+		php_info_print_table_row(2, "Shared Cache Misses", buf);
+		snprintf(buf, sizeof(buf), "%lu", (unsigned long)stat.entries);
+		php_info_print_table_row(2, "Shared Cache Entries", buf);
+	} else {
+		php_info_print_table_row(2, "Shared Cache", "disabled");
+	}
 	php_info_print_table_end();
 
 	DISPLAY_INI_ENTRIES();
@@ -925,6 +988,7 @@ static PHP_GINIT_FUNCTION(qr)
 	qr_globals->default_separator = 4;
 	qr_globals->default_maxnum = 1;
 	qr_globals->default_order = 0;
+	qr_globals->shm_cache_size = 0;
 }
 /* }}} */
 
@@ -983,7 +1047,8 @@ _qr_create_simple(const qr_byte_t *data, int data_len,
 		return NULL;
 	}
 
-	if (!qrAddData2(qr, data, data_len, mode)) {
+	/* data outlives qrFinalize() below, so let libqr borrow it */
+	if (!qrAddDataRef(qr, data, data_len, mode)) {
 		php_error_docref(NULL TSRMLS_CC, E_WARNING, "%s", qrGetErrorInfo(qr));
 		qrDestroy(qr);
 		return NULL;
@@ -1043,6 +1108,22 @@ _qr_get_symbol(const qr_byte_t *data, int data_len,
 	QRCode *qr = NULL;
 	qr_byte_t *symbol = NULL;
 
+	/* the shared-memory cache; on any error fall through to report it */
+	if (qr_shm_cache) {
+		qr_param_t param;
+		int errcode = QR_ERR_NONE;
+
+		param.version = version;
+		param.mode = mode;
+		param.eclevel = eclevel;
+		param.masktype = masktype;
+		symbol = qrShmCacheGetSymbol(qr_shm_cache, data, data_len, &param,
+				format, separator, magnify, symbol_size, &errcode);
+		if (symbol) {
+			return symbol;
+		}
+	}
+
 	qr = _qr_create_simple(data, data_len, version, mode, eclevel, masktype TSRMLS_CC);
 	if (!qr) {
 		return NULL;
@@ -1220,7 +1301,7 @@ static PHP_FUNCTION(qr_get_symbol)
 	}
 
 	ZVAL_STRINGL(return_value, (char *)symbol, symbol_size, 1);
-	free(symbol);
+	qrFreeBuffer(symbol);
 }
 /* }}} qr_get_symbol */
 
@@ -1280,7 +1361,7 @@ static PHP_FUNCTION(qr_output_symbol)
 
 	output = qr_get_output_stream(zoutput);
 	if (!output) {
-		free(symbol);
+		qrFreeBuffer(symbol);
 		RETURN_FALSE;
 	}
 
@@ -1289,7 +1370,7 @@ static PHP_FUNCTION(qr_output_symbol)
 	if (zoutput != NULL && Z_TYPE_P(zoutput) != IS_RESOURCE) {
 		php_stream_close(output);
 	}
-	free(symbol);
+	qrFreeBuffer(symbol);
 
 	if (output_size != (size_t)symbol_size) {
 		php_error_docref(NULL TSRMLS_CC, E_WARNING, "%s", qrStrError(QR_ERR_FWRITE));
@@ -1732,7 +1813,7 @@ static PHP_METHOD(QRCode, getSymbol)
 	}
 
 	ZVAL_STRINGL(return_value, (char *)symbol, symbol_size, 1);
-	free(symbol);
+	qr_free_symbol(intern, symbol);
 }
 /* }}} QRCode::getSymbol */
 
@@ -1778,7 +1859,7 @@ static PHP_METHOD(QRCode, outputSymbol)
 
 	output = qr_get_output_stream(zoutput);
 	if (!output) {
-		free(symbol);
+		qr_free_symbol(intern, symbol);
 		RETURN_FALSE;
 	}
 
@@ -1787,7 +1868,7 @@ static PHP_METHOD(QRCode, outputSymbol)
 	if (zoutput != NULL && Z_TYPE_P(zoutput) != IS_RESOURCE) {
 		php_stream_close(output);
 	}
-	free(symbol);
+	qr_free_symbol(intern, symbol);
 
 	if (output_size != (size_t)symbol_size) {
 		php_qr_error(intern->errmode, QR_ERR_FWRITE, qrStrError(QR_ERR_FWRITE));
@@ -1827,6 +1908,12 @@ static PHP_METHOD(QRCode, getInfo)
 		add_assoc_long(return_value, "mode",        intern->qr->param.mode);
 		add_assoc_long(return_value, "eclevel",     intern->qr->param.eclevel);
 		add_assoc_long(return_value, "masktype",    intern->qr->param.masktype);
+		if (qrIsFinalized(intern->qr)) {
+			const qr_maskinfo_t *mi = qrGetMaskInfo(intern->qr);
+			add_assoc_long(return_value, "mask_policy",    mi->policy);
+			add_assoc_long(return_value, "mask_estimated", mi->estimated);
+			add_assoc_long(return_value, "mask_penalty",   mi->penalty);
+		}
 	}
 	add_assoc_long(return_value, "errmode",   intern->errmode);
 	add_assoc_long(return_value, "format",    intern->format);
@@ -1915,7 +2002,7 @@ static PHP_METHOD(QRCode, current)
 	}
 
 	ZVAL_STRINGL(return_value, (char *)symbol, symbol_size, 1);
-	free(symbol);
+	qrFreeSymbol(intern->qr, symbol);
 }
 /* }}} QRCode::current */
 
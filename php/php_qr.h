@@ -82,6 +82,7 @@ ZEND_BEGIN_MODULE_GLOBALS(qr)
 	long default_separator;
 	long default_maxnum;
 	long default_order;
+	long shm_cache_size;
 ZEND_END_MODULE_GLOBALS(qr)
 
 #ifdef ZTS
@@ -55,7 +55,6 @@ struct _QRCodeObject {
 
 static PyObject *QRCodeError;
 
-static const char *active_func_name;
 static const char * const fn_qrcode         = "qr.qrcode()";
 static const char * const fn_add_data       = "qr.QRCode.add_data()";
 static const char * const fn_copy           = "qr.QRCode.copy()";
@@ -81,7 +80,7 @@ PyDoc_STRVAR(qrcode__doc__,
 "  version:   symbol version (1-40, default: auto)\n"
 "  mode:      encoding mode (MN, MA, M8, MK, default: auto)\n"
 "  eclevel:   error correction level (ECL_{L,M,Q,H}, default: ECL_M)\n"
-"  masktype:  mask pattern (0-7, default: auto)\n"
+"  masktype:  mask pattern (0-7, MPT_FAST, default: auto)\n"
 "  maxnum:    maximum number of symbols (1-16, default: 1)\n"
 "  format:    output format (default: PNG)\n"
 "             Available formats are followings.\n"
@@ -165,7 +164,7 @@ qr_qrcode(PyObject *self, PyObject *args, PyObject *kwds)
     int separator = 4;
     int order = 0;
 
-    active_func_name = fn_qrcode;
+    qrSetCurrentFunctionName(fn_qrcode);
 
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iiiiiiiii:qrcode", kwlist,
                                      &data,
@@ -291,7 +290,7 @@ QRCode_add_data(QRCodeObject *self, PyObject *args, PyObject *kwds)
     int length = 0;
     int mode = PYQR_USE_DEFAULT_MODE;
 
-    active_func_name = fn_add_data;
+    qrSetCurrentFunctionName(fn_add_data);
 
     if (!PyArg_ParseTupleAndKeywords(args, kwds,
                                      "s#|i:QRCode.add_data", kwlist,
@@ -319,7 +318,7 @@ QRCode_copy(QRCodeObject *self, PyObject *unused)
     QRCodeObject *copy;
     PyObject *obj;
 
-    active_func_name = fn_copy;
+    qrSetCurrentFunctionName(fn_copy);
 
     if (self->qr) {
         qr = qrClone(self->qr, &errcode);
@@ -374,7 +373,7 @@ QRCode_get_symbol(QRCodeObject *self, PyObject *args, PyObject *kwds)
     int separator = self->separator;
     int order = self->order;
 
-    active_func_name = fn_get_symbol;
+    qrSetCurrentFunctionName(fn_get_symbol);
 
     if (!PyArg_ParseTupleAndKeywords(args, kwds,
                                      "|iiii:QRCode.get_symbol", kwlist,
@@ -394,7 +393,7 @@ QRCode_get_info(QRCodeObject *self, PyObject *unused)
 {
     PyErr_SetString(PyExc_NotImplementedError, "not yet implemented");
 
-    active_func_name = fn_get_info;
+    qrSetCurrentFunctionName(fn_get_info);
 
     return NULL;
 }
@@ -462,7 +461,7 @@ PyQR_Process(const qr_byte_t *data, int length,
         else {
             result = PyQR_SymbolDataFromStringAndSize(symbol, size, format);
         }
-        free(symbol);
+        qrFreeBuffer(symbol);
     }
 
     qrDestroy(qr);
@@ -491,7 +490,8 @@ PyQR_Create(const qr_byte_t *data, int length,
         return NULL;
     }
 
-    if (!qrAddData2(qr, data, length, mode)) {
+    /* data outlives qrFinalize() below, so let libqr borrow it */
+    if (!qrAddDataRef(qr, data, length, mode)) {
         PyErr_SetString(QRCodeError, qrGetErrorInfo(qr));
         qrDestroy(qr);
         return NULL;
@@ -570,7 +570,7 @@ PyQR_ProcessMulti(const qr_byte_t *data, int length,
         else {
             result = PyQR_SymbolDataFromStringAndSize(symbol, size, format);
         }
-        free(symbol);
+        qrFreeBuffer(symbol);
     }
 
     qrsDestroy(st);
@@ -754,7 +754,7 @@ PyQR_GetSymbol_FromObject(QRCodeObject *obj,
                 result = PyQR_SymbolDataFromStringAndSize(symbol, size, format);
             }
         }
-        free(symbol);
+        qrFreeBuffer(symbol);
     }
 
     return result;
@@ -1019,8 +1019,6 @@ PyQR_InitModule(void)
 #endif
     d = PyModule_GetDict(m);
 
-    qrGetCurrentFunctionName = PyQR_ActiveFuncName;
-
     /* encoding mode (fullname) */
     QR_DECLARE_CONSTANT(EM_AUTO);
     QR_DECLARE_CONSTANT(EM_NUMERIC);
@@ -1040,6 +1038,10 @@ PyQR_InitModule(void)
     QR_DECLARE_CONSTANT(ECL_Q);
     QR_DECLARE_CONSTANT(ECL_H);
 
+    /* mask pattern selection */
+    QR_DECLARE_CONSTANT(MPT_AUTO);
+    QR_DECLARE_CONSTANT(MPT_FAST);
+
     /* output format (fullname) */
     QR_DECLARE_CONSTANT(FMT_IMAGE);
     QR_DECLARE_CONSTANT(FMT_PNG);
@@ -1085,15 +1087,6 @@ PyMODINIT_FUNC initqr(void)
 }
 #endif
 
-/* }}} */
-/* {{{ PyQR_ActiveFuncName() */
-
-static const char *
-PyQR_ActiveFuncName(void)
-{
-    return active_func_name;
-}
-
 /* }}} */
 
 /*
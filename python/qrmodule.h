@@ -116,9 +116,6 @@ PyQR_SetError(int errcode, const char *errmsg);
 static PyTypeObject *
 PyQR_TypeObject(void);
 
-static const char *
-PyQR_ActiveFuncName(void);
-
 /* }}} */
 /* {{{ macros and inline functions for compatibility and utility */
 
@@ -1,14 +1,26 @@
 #!/usr/bin/env python
 
+import os
+import sys
 from distutils.core import setup, Extension
 
+if os.name == 'posix':
+    qr_macros = [('HAVE_PTHREAD', '1')]
+    qr_libraries = ['z', 'pthread']
+    if sys.platform.startswith('linux'):
+        qr_libraries.append('rt')
+else:
+    qr_macros = []
+    qr_libraries = ['z']
+
 module1 = Extension('qr',
         include_dirs = ['./libqr'],
-        libraries = ['z'],
+        define_macros = qr_macros,
+        libraries = qr_libraries,
         library_dirs = [],
-        sources = ['qrmodule.c', 'libqr/qr.c', 'libqr/qrcnv.c',
-                   'libqr/qrcnv_bmp.c', 'libqr/qrcnv_png.c',
-                   'libqr/qrcnv_svg.c', 'libqr/qrcnv_tiff.c'])
+        sources = ['qrmodule.c', 'libqr/qr.c', 'libqr/qralloc.c', 'libqr/qrasync.c', 'libqr/qrbatch.c',
+                   'libqr/qrcache.c', 'libqr/qrcnv.c', 'libqr/qrcnv_bmp.c', 'libqr/qrcnv_png.c',
+                   'libqr/qrcnv_svg.c', 'libqr/qrcnv_tiff.c', 'libqr/qrshm.c'])
 
 setup(name = 'qr',
         version = '0.2.1',